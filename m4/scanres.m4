@@ -11,6 +11,7 @@ AC_TYPE_MODE_T
 
 AC_CHECK_HEADERS([cstring])
 AC_CHECK_HEADERS([string])
+AC_CHECK_HEADERS([cctype])
 AC_CHECK_HEADERS([iostream])
 AC_CHECK_HEADERS([memory])
 AC_CHECK_HEADERS([thread])
@@ -27,9 +28,17 @@ AC_CHECK_HEADERS([sys/syscall.h])
 AC_CHECK_HEADERS([sys/types.h])
 AC_CHECK_HEADERS([fcntl.h])
 AC_CHECK_HEADERS([strings.h])
+AC_CHECK_HEADERS([poll.h])
+AC_CHECK_HEADERS([sys/uio.h])
+AC_CHECK_HEADERS([sys/epoll.h])
+AC_CHECK_HEADERS([sys/eventfd.h])
+AC_CHECK_HEADERS([sys/wait.h])
+AC_CHECK_HEADERS([signal.h])
 
 AC_CHECK_FUNCS([memset])
 AC_CHECK_FUNCS([socket]) 
+AC_CHECK_FUNCS([accept4])
+AC_CHECK_FUNCS([fork])
 AC_CHECK_FUNCS([strerror])
 AC_CHECK_FUNCS([strtol])
 AC_CHECK_FUNCS([strtoul])
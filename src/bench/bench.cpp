@@ -0,0 +1,263 @@
+#include <config.h>
+#ifdef HAVE_IOSTREAM
+#include <iostream>
+#endif
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#include "bench.hxx"
+
+namespace FCGIBench
+{
+
+struct Entry
+{
+  std::string name;
+  uint64_t bytes;
+  Function fn;
+};
+
+// Function local so registration does not depend on initialization order
+static std::vector<Entry> &registry()
+{
+  static std::vector<Entry> benchmarks;
+  return benchmarks;
+}
+
+bool add(const char *name,uint64_t bytes,Function fn)
+{
+  Entry e;
+  e.name = name;
+  e.bytes = bytes;
+  e.fn = fn;
+  registry().push_back(e);
+  return true;
+}
+
+static double run_once(Function &fn,size_t iterations)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  fn(iterations);
+  return std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief measure runs one benchmark, growing the iteration count until
+ * a run takes the minimum time, then repeating it
+ * @param e the benchmark
+ * @param minTime the minimum time of one run, in nanoseconds
+ * @param repetitions how many runs to take the median of
+ */
+static Result measure(Entry &e,double minTime,int repetitions)
+{
+  size_t iterations = 1;
+  double elapsed = run_once(e.fn,iterations);
+  while (elapsed < minTime)
+  {
+    // Aim a bit over the minimum so the next run is likely the last one
+    double scale = (elapsed > 0) ? (minTime * 1.4 / elapsed) : 100;
+    scale = std::max(2.0,std::min(scale,100.0));
+    iterations = (size_t)(iterations * scale);
+    elapsed = run_once(e.fn,iterations);
+  }
+
+  std::vector<double> perOp;
+  perOp.push_back(elapsed / iterations);
+  for (int i = 1; i < repetitions; i++)
+    perOp.push_back(run_once(e.fn,iterations) / iterations);
+  std::sort(perOp.begin(),perOp.end());
+
+  Result r;
+  r.name = e.name;
+  r.iterations = iterations;
+  r.nsPerOp = perOp[perOp.size() / 2];
+  r.minNsPerOp = perOp.front();
+  r.bytesPerOp = e.bytes;
+  return r;
+}
+
+static void usage(const char *prog)
+{
+  std::cerr << "Usage: " << prog << " [options] [filter...]\n"
+            << "  filter            run the benchmarks whose name contains one of these\n"
+            << "  --list            list the benchmarks and exit\n"
+            << "  --min-time=MS     minimum time of one run, default 200\n"
+            << "  --repetitions=N   runs to take the median of, default 5\n"
+            << "  --csv             print comma separated values\n"
+            << "  --save=FILE       save the results as a baseline\n"
+            << "  --compare=FILE    compare with a saved baseline, exit 2 on a regression\n"
+            << "  --threshold=PCT   slowdown counting as a regression, default 10\n";
+}
+
+static bool load_baseline(const std::string &path,std::map<std::string,double> &baseline)
+{
+  std::ifstream in(path);
+  if (!in)
+    return false;
+  std::string line;
+  while (std::getline(in,line))
+  {
+    std::istringstream ls(line);
+    std::string name;
+    double ns;
+    if (ls >> name >> ns)
+      baseline[name] = ns;
+  }
+  return true;
+}
+
+static std::string throughput(const Result &r)
+{
+  if (r.bytesPerOp == 0 || r.nsPerOp <= 0)
+    return "";
+  char buf[32];
+  snprintf(buf,sizeof(buf),"%.1f MB/s",(double)r.bytesPerOp * 1000.0 / r.nsPerOp);
+  return buf;
+}
+
+int run(int argc,char **argv)
+{
+  std::vector<std::string> filters;
+  double minTime = 200;
+  int repetitions = 5;
+  double threshold = 10;
+  bool csv = false, list = false;
+  std::string savePath, comparePath;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string a = argv[i];
+    std::string::size_type eq = a.find('=');
+    std::string opt = a.substr(0,eq);
+    std::string val = (eq == std::string::npos) ? "" : a.substr(eq+1);
+    if (opt == "--list")
+      list = true;
+    else if (opt == "--csv")
+      csv = true;
+    else if (opt == "--min-time")
+      minTime = atof(val.c_str());
+    else if (opt == "--repetitions")
+      repetitions = std::max(1,atoi(val.c_str()));
+    else if (opt == "--threshold")
+      threshold = atof(val.c_str());
+    else if (opt == "--save")
+      savePath = val;
+    else if (opt == "--compare")
+      comparePath = val;
+    else if (a.size() > 1 && a[0] == '-')
+    {
+      usage(argv[0]);
+      return 1;
+    } else
+      filters.push_back(a);
+  }
+
+  std::vector<Entry> &all = registry();
+  std::stable_sort(all.begin(),all.end(),[](const Entry &a,const Entry &b) { return a.name < b.name; });
+  std::vector<Entry *> selected;
+  for (Entry &e: all)
+  {
+    bool match = filters.empty();
+    for (std::string &f: filters)
+    {
+      if (e.name.find(f) != std::string::npos)
+        match = true;
+    }
+    if (match)
+      selected.push_back(&e);
+  }
+  if (list)
+  {
+    for (Entry *e: selected)
+      std::cout << e->name << std::endl;
+    return 0;
+  }
+
+  std::map<std::string,double> baseline;
+  if (!comparePath.empty() && !load_baseline(comparePath,baseline))
+  {
+    std::cerr << comparePath << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  if (csv)
+    std::cout << "name,iterations,ns_per_op,min_ns_per_op,bytes_per_op" << (baseline.empty() ? "" : ",baseline_ns_per_op") << std::endl;
+  else
+    std::cout << std::left << std::setw(40) << "benchmark" << std::right << std::setw(12) << "iterations"
+              << std::setw(14) << "ns/op" << std::setw(14) << "min ns/op" << std::setw(14) << "throughput"
+              << (baseline.empty() ? "" : "     change") << std::endl;
+
+  std::vector<Result> results;
+  int regressions = 0;
+  for (Entry *e: selected)
+  {
+    Result r = measure(*e,minTime * 1e6,repetitions);
+    results.push_back(r);
+    auto bit = baseline.find(r.name);
+    double change = 0;
+    if (bit != baseline.end() && bit->second > 0)
+      change = (r.nsPerOp - bit->second) * 100.0 / bit->second;
+    bool regressed = (bit != baseline.end() && change > threshold);
+    if (regressed)
+      regressions++;
+
+    if (csv)
+    {
+      std::cout << r.name << "," << r.iterations << "," << std::fixed << std::setprecision(1) << r.nsPerOp << ","
+                << r.minNsPerOp << "," << r.bytesPerOp;
+      if (!baseline.empty())
+      {
+        std::cout << ",";
+        if (bit != baseline.end())
+          std::cout << bit->second;
+      }
+      std::cout << std::endl;
+      continue;
+    }
+    std::cout << std::left << std::setw(40) << r.name << std::right << std::setw(12) << r.iterations
+              << std::fixed << std::setprecision(1) << std::setw(14) << r.nsPerOp << std::setw(14) << r.minNsPerOp
+              << std::setw(14) << throughput(r);
+    if (bit != baseline.end())
+      std::cout << std::showpos << std::setw(10) << change << "%" << std::noshowpos << (regressed ? " REGRESSION" : "");
+    std::cout << std::endl;
+  }
+
+  if (!savePath.empty())
+  {
+    std::ofstream out(savePath);
+    for (Result &r: results)
+      out << r.name << " " << std::fixed << std::setprecision(1) << r.nsPerOp << "\n";
+    if (!out)
+    {
+      std::cerr << savePath << ": could not write baseline" << std::endl;
+      return 1;
+    }
+  }
+  if (regressions > 0)
+  {
+    std::cerr << regressions << " benchmark(s) more than " << threshold << "% slower than the baseline" << std::endl;
+    return 2;
+  }
+  return 0;
+}
+
+}
+
+int main(int argc,char **argv)
+{
+  return FCGIBench::run(argc,argv);
+}
@@ -0,0 +1,125 @@
+#ifndef FCGI_BENCH_HXX
+#define FCGI_BENCH_HXX
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+/**
+ * A small self contained benchmark harness, so measuring the library
+ * needs nothing beyond what building it does.  A benchmark is a function
+ * running its body a given number of times, the harness picks the count
+ * so one run takes at least the minimum time, repeats that and reports
+ * the median.
+ */
+namespace FCGIBench
+{
+
+/**
+ * @brief Function runs the measured body iterations times
+ */
+typedef std::function<void(size_t iterations)> Function;
+
+/**
+ * @brief Result of one benchmark, nanoseconds and bytes per iteration
+ */
+struct Result
+{
+  std::string name;
+  size_t iterations;
+  double nsPerOp;
+  double minNsPerOp;
+  uint64_t bytesPerOp;
+};
+
+/**
+ * @brief add registers a benchmark, normally through FCGI_BENCHMARK
+ * @param name the name to report and filter by
+ * @param bytes the bytes one iteration processes, 0 to not report a
+ * throughput
+ * @param fn the benchmark
+ * @return always true, so it can initialize a static
+ */
+bool add(const char *name,uint64_t bytes,Function fn);
+
+/**
+ * @brief escape keeps the compiler from optimizing away a value
+ * which is computed but not used
+ */
+template <typename T>
+inline void escape(T &&value)
+{
+#if defined(__GNUC__)
+  asm volatile("" : : "g"(&value) : "memory");
+#else
+  static volatile const void *sink;
+  sink = &value;
+#endif
+}
+
+/**
+ * @brief run runs the registered benchmarks as the command line says,
+ * see the usage for the options
+ * @return the exit code for main()
+ */
+int run(int argc,char **argv);
+
+/**
+ * @brief Corpus builds the realistic inputs benchmarks work on. It is
+ * deterministic, so numbers from two runs compare
+ */
+class Corpus
+{
+public:
+  explicit Corpus(uint32_t seed = 0x5eed);
+  /**
+   * @brief query_string a form style query string
+   * @param fields the number of name=value pairs
+   * @param encodedPct percent of values needing percent encoding
+   */
+  std::string query_string(size_t fields,int encodedPct);
+  /**
+   * @brief cookie_jar a Cookie: header value as browsers send them
+   * @param cookies the number of cookies
+   */
+  std::string cookie_jar(size_t cookies);
+  /**
+   * @brief text printable text with spaces
+   */
+  std::string text(size_t bytes);
+  /**
+   * @brief binary random bytes
+   */
+  std::string binary(size_t bytes);
+  /**
+   * @brief multipart a multipart/form-data body with a few fields and
+   * one file upload
+   * @param boundary the boundary, without the leading dashes
+   * @param fileBytes the size of the uploaded file
+   */
+  std::string multipart(const std::string &boundary,size_t fileBytes);
+  /**
+   * @brief json an API style JSON body, an array of user records with
+   * nested objects, arrays, numbers and some escaped strings
+   * @param records the number of records
+   */
+  std::string json(size_t records);
+
+private:
+  uint32_t next();
+  std::string token(size_t minLen,size_t maxLen);
+  uint32_t p_state;
+};
+
+}
+
+#define FCGI_BENCH_CONCAT2(a,b) a##b
+#define FCGI_BENCH_CONCAT(a,b) FCGI_BENCH_CONCAT2(a,b)
+/**
+ * @brief FCGI_BENCHMARK registers a benchmark at static initialization
+ */
+#define FCGI_BENCHMARK(name,bytes,fn) \
+  static bool FCGI_BENCH_CONCAT(fcgi_bench_,__LINE__) = FCGIBench::add(name,bytes,fn)
+
+#endif // FCGI_BENCH_HXX
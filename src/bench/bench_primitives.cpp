@@ -0,0 +1,403 @@
+#include <config.h>
+#include <sstream>
+#include <fcgi_request_cpp.hxx>
+
+#include "bench.hxx"
+
+/**
+ * Benchmarks of the string and data primitives requests are parsed
+ * and responses encoded with.  The inputs are sized like real traffic,
+ * a search form query string, the cookie jar of a site with analytics
+ * and a photo upload.
+ */
+
+using FCGIBench::escape;
+
+namespace
+{
+
+FCGIBench::Corpus corpus;
+
+// parseMultipart() is for the parser only, this opens it up
+class MultipartParser: public FCGIRequest
+{
+public:
+  MultipartParser(): FCGIRequest(std::shared_ptr<FCGX_Request>()) {}
+  using FCGIRequest::parseMultipart;
+};
+
+const std::string shortQuery = corpus.query_string(8,25);
+const std::string longQuery = corpus.query_string(200,25);
+const std::string cookieJar = corpus.cookie_jar(40);
+const std::string plainText = corpus.text(4096);
+const std::string binary64k = corpus.binary(65536);
+const std::string encodedQuery = corpus.query_string(1600,100);
+const std::string csvLine = corpus.query_string(64,0);
+const std::string padded = "   \t " + corpus.text(200) + " \r\n  ";
+const std::string binary1m = corpus.binary(1 << 20);
+const std::string boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+const std::string upload4m = corpus.multipart(boundary,4 << 20);
+const std::string apiJson = corpus.json(4000);
+// The variables nginx passes with its stock fastcgi_params, and the
+// headers of a browser
+const std::map<std::string,std::string> nginxParams = {
+  { "QUERY_STRING", shortQuery }, { "REQUEST_METHOD", "GET" }, { "CONTENT_TYPE", "" }, { "CONTENT_LENGTH", "" },
+  { "SCRIPT_NAME", "/app/search" }, { "REQUEST_URI", "/app/search?" + shortQuery }, { "DOCUMENT_URI", "/app/search" },
+  { "DOCUMENT_ROOT", "/var/www/html" }, { "SERVER_PROTOCOL", "HTTP/1.1" }, { "REQUEST_SCHEME", "https" }, { "HTTPS", "on" },
+  { "GATEWAY_INTERFACE", "CGI/1.1" }, { "SERVER_SOFTWARE", "nginx/1.22.1" }, { "REMOTE_ADDR", "203.0.113.7" },
+  { "REMOTE_PORT", "51234" }, { "SERVER_ADDR", "198.51.100.2" }, { "SERVER_PORT", "443" }, { "SERVER_NAME", "www.example.com" },
+  { "REDIRECT_STATUS", "200" }, { "HTTP_HOST", "www.example.com" }, { "HTTP_CONNECTION", "keep-alive" },
+  { "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36" },
+  { "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8" },
+  { "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" }, { "HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.9" },
+  { "HTTP_REFERER", "https://www.example.com/app/" }, { "HTTP_COOKIE", cookieJar }, { "HTTP_SEC_FETCH_MODE", "navigate" },
+  { "HTTP_UPGRADE_INSECURE_REQUESTS", "1" }, { "HTTP_CACHE_CONTROL", "max-age=0" }
+};
+const std::vector<std::string> pageRows = FCGI::str_split(longQuery,'&');
+const size_t pageBytes = [] {
+  size_t n = 0;
+  for (const std::string &r: pageRows)
+    n += r.size() + 20;
+  return n;
+}();
+
+// An API of 2000 routes, 100 resources with 20 actions each, and paths
+// spread over all of them
+const size_t ROUTE_RESOURCES = 100;
+const size_t ROUTE_ACTIONS = 20;
+const std::vector<std::string> routePaths = [] {
+  std::vector<std::string> rv;
+  for (size_t i = 0; i < 64; i++)
+  {
+    size_t r = (i * 37) % ROUTE_RESOURCES, a = (i * 11) % ROUTE_ACTIONS;
+    rv.push_back("/api/v1/resource" + std::to_string(r) + "/" + std::to_string(1000 + i) + "/action" + std::to_string(a));
+  }
+  return rv;
+}();
+const std::vector<std::pair<std::string,std::string>> routeParts = [] {
+  std::vector<std::pair<std::string,std::string>> rv;
+  for (size_t i = 0; i < ROUTE_RESOURCES; i++)
+  {
+    for (size_t a = 0; a < ROUTE_ACTIONS; a++)
+      rv.emplace_back("/api/v1/resource" + std::to_string(i) + "/","/action" + std::to_string(a));
+  }
+  return rv;
+}();
+const FCGIRouter &router = [] () -> const FCGIRouter & {
+  static FCGIRouter r;
+  for (const std::pair<std::string,std::string> &p: routeParts)
+    r.add(FCGIRouter::GET,p.first + ":id" + p.second,[](FCGIRequest &,const FCGIRouter::Match &) {});
+  return r;
+}();
+// A site with 10000 signed in users, looked up 64 at a time
+const size_t SESSIONS = 10000;
+const std::vector<std::string> sessionIds = [] {
+  std::vector<std::string> rv;
+  for (size_t i = 0; i < SESSIONS; i++)
+    rv.push_back(FCGISessionStore::new_id());
+  return rv;
+}();
+FCGISessionStore &sessions = [] () -> FCGISessionStore & {
+  static FCGISessionStore st;
+  for (const std::string &id: sessionIds)
+    st.put(id,std::make_shared<FCGIData>(corpus.text(200)));
+  return st;
+}();
+
+template <typename F>
+FCGIBench::Function loop(F body)
+{
+  return [body](size_t iterations) {
+    for (size_t i = 0; i < iterations; i++)
+      body();
+  };
+}
+
+}
+
+FCGI_BENCHMARK("urldecode/text_4k",plainText.size(),loop([]() {
+  std::string rv = FCGI::urldecode(plainText);
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("urldecode/encoded_query",encodedQuery.size(),loop([]() {
+  std::string rv = FCGI::urldecode(encodedQuery);
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("urlencode/text_4k",plainText.size(),loop([]() {
+  std::string rv = FCGI::urlencode(plainText);
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("urlencode/binary_64k",binary64k.size(),loop([]() {
+  std::string rv = FCGI::urlencode(binary64k);
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("query_string_parse/8_fields",shortQuery.size(),loop([]() {
+  std::map<std::string,std::string> rv = FCGI::query_string_parse(shortQuery);
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("query_string_parse/200_fields",longQuery.size(),loop([]() {
+  std::map<std::string,std::string> rv = FCGI::query_string_parse(longQuery);
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("cookie_parse/40_cookies",cookieJar.size(),loop([]() {
+  std::map<std::string,std::string> rv = FCGI::cookie_parse(cookieJar);
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("str_split/64_fields",csvLine.size(),loop([]() {
+  std::vector<std::string> rv = FCGI::str_split(csvLine,'&');
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("string_trim/200",padded.size(),loop([]() {
+  std::string rv = FCGI::string_trim(padded);
+  escape(rv);
+}));
+
+FCGI_BENCHMARK("base64Encode/1m",binary1m.size(),[](size_t iterations) {
+  FCGIData in(binary1m.data(),binary1m.size());
+  for (size_t i = 0; i < iterations; i++)
+  {
+    std::string rv = FCGI::base64Encode(in);
+    escape(rv);
+  }
+});
+
+FCGI_BENCHMARK("base64Decode/1m",binary1m.size(),[](size_t iterations) {
+  FCGIData raw(binary1m.data(),binary1m.size());
+  std::string in = FCGI::base64Encode(raw);
+  for (size_t i = 0; i < iterations; i++)
+  {
+    FCGIData rv = FCGI::base64Decode(in);
+    escape(rv);
+  }
+});
+
+FCGI_BENCHMARK("FCGIData::append/char_64k",65536,loop([]() {
+  FCGIData d;
+  for (int i = 0; i < 65536; i++)
+    d.append((char)i);
+  escape(d);
+}));
+
+FCGI_BENCHMARK("FCGIData::append/string_4k_x256",plainText.size() * 256,loop([]() {
+  // As stdin gets read, in buffer sized pieces
+  FCGIData d;
+  std::string chunk = plainText;
+  for (int i = 0; i < 256; i++)
+    d.append(chunk);
+  escape(d);
+}));
+
+FCGI_BENCHMARK("FCGIData::append/cstring_4k_x256",plainText.size() * 256,loop([]() {
+  FCGIData d;
+  for (int i = 0; i < 256; i++)
+    d.append(plainText.c_str());
+  escape(d);
+}));
+
+FCGI_BENCHMARK("FCGIData::construct/small_x64",64 * 6,loop([]() {
+  // Response bodies like "OK\r\n" and short form fields
+  for (int i = 0; i < 64; i++)
+  {
+    FCGIData d("Pong!\n",6);
+    escape(d);
+  }
+}));
+
+FCGI_BENCHMARK("parseMultipart/upload_4m",upload4m.size(),[](size_t iterations) {
+  MultipartParser p;
+  FCGIData body(upload4m.data(),upload4m.size());
+  for (size_t i = 0; i < iterations; i++)
+  {
+    std::vector<FCGIMultipartItem> rv = p.parseMultipart(boundary,body);
+    escape(rv);
+  }
+});
+
+// An html table the way httpecho used to build it, and as it does now
+FCGI_BENCHMARK("page/stringstream_200_rows",pageBytes,loop([]() {
+  std::stringstream ss;
+  for (const std::string &r: pageRows)
+    ss << "   <tr><td>" << r << "</td></tr>\n";
+  std::string s = ss.str();
+  FCGIData body(s);
+  escape(body);
+}));
+
+FCGI_BENCHMARK("page/rope_200_rows",pageBytes,loop([]() {
+  FCGIRope rope;
+  for (const std::string &r: pageRows)
+  {
+    rope.append_static("   <tr><td>");
+    rope.append(r);
+    rope.append_static("</td></tr>\n");
+  }
+  escape(rope);
+}));
+
+FCGI_BENCHMARK("headerLine/common",0,loop([]() {
+  static const unsigned short codes[] = { 200, 204, 301, 304, 404, 500 };
+  for (unsigned short c: codes)
+  {
+    std::string rv = FCGI::headerLine(c);
+    escape(rv);
+  }
+}));
+
+// The headers of an API response, built up per response and from a template
+const FCGIHeaderTemplate::Headers apiHeaders = {
+  { "Content-Type", "application/json; charset=utf-8" }, { "Cache-Control", "no-store" },
+  { "X-Content-Type-Options", "nosniff" }, { "X-Frame-Options", "DENY" },
+  { "Strict-Transport-Security", "max-age=63072000; includeSubDomains" }, { "Vary", "Accept-Encoding" }
+};
+// Built on first use, it reads the server name which is another static
+const FCGIHeaderTemplate &api_template()
+{
+  static const FCGIHeaderTemplate t(apiHeaders);
+  return t;
+}
+const FCGIBlob apiBody = std::make_shared<const FCGIData>("{\"ok\":true}",11);
+
+FCGI_BENCHMARK("FCGIResponse::serialize/set_header_6",0,loop([]() {
+  FCGIResponse resp(nullptr);
+  for (const std::pair<std::string,std::string> &h: apiHeaders)
+    resp.set_header(h.first,h.second);
+  resp.set_data(apiBody);
+  FCGIData out;
+  resp.serialize(out);
+  escape(out);
+}));
+
+FCGI_BENCHMARK("FCGIResponse::serialize/template_6",0,loop([]() {
+  FCGIResponse resp(nullptr);
+  resp.set_template(&api_template());
+  resp.set_data(apiBody);
+  FCGIData out;
+  resp.serialize(out);
+  escape(out);
+}));
+
+FCGI_BENCHMARK("FCGIResponse::serialize/template_6_override",0,loop([]() {
+  FCGIResponse resp(nullptr);
+  resp.set_template(&api_template());
+  resp.set_header("Cache-Control","max-age=60");
+  resp.set_data(apiBody);
+  FCGIData out;
+  resp.serialize(out);
+  escape(out);
+}));
+
+FCGI_BENCHMARK("router/match_2000_routes",0,loop([]() {
+  for (const std::string &p: routePaths)
+  {
+    FCGIRouter::Match m;
+    const FCGIRouter::Handler *h = router.match(FCGIRouter::GET,p.data(),p.size(),m);
+    escape(h);
+    escape(m);
+  }
+}));
+
+// The chain of prefix compares the router replaces
+FCGI_BENCHMARK("router/linear_2000_routes",0,loop([]() {
+  for (const std::string &p: routePaths)
+  {
+    size_t found = 0;
+    for (size_t i = 0; i < routeParts.size() && !found; i++)
+    {
+      const std::string &prefix = routeParts[i].first, &action = routeParts[i].second;
+      if (p.compare(0,prefix.size(),prefix) == 0 && p.size() > prefix.size() + action.size() &&
+          p.compare(p.size() - action.size(),action.size(),action) == 0)
+        found = i + 1;
+    }
+    escape(found);
+  }
+}));
+
+FCGI_BENCHMARK("json/parse_api_1m",apiJson.size(),[](size_t iterations) {
+  FCGIData body(apiJson.data(),apiJson.size());
+  for (size_t i = 0; i < iterations; i++)
+  {
+    FCGIJson doc;
+    doc.parse(body.get(),body.size());
+    escape(doc);
+  }
+});
+
+// What a handler does with it, parse and read a few fields of every record
+FCGI_BENCHMARK("json/parse_read_api_1m",apiJson.size(),[](size_t iterations) {
+  FCGIData body(apiJson.data(),apiJson.size());
+  for (size_t i = 0; i < iterations; i++)
+  {
+    FCGIJson doc;
+    doc.parse(body.get(),body.size());
+    double score = 0;
+    size_t active = 0;
+    for (FCGIJson::Value r = doc.root().first(); r.valid(); r = r.next())
+    {
+      score += r["score"].as_double();
+      active += r["active"].as_bool();
+      escape(r["address"]["zip"].raw());
+    }
+    escape(score);
+    escape(active);
+  }
+});
+
+// Parsing the CGI variables and reading what a handler usually looks at
+FCGI_BENCHMARK("FCGIRequest::parse/nginx_get",0,loop([]() {
+  FCGIRequest req((std::shared_ptr<FCGX_Request>()));
+  req.parse(nginxParams,FCGIData());
+  escape(req.method());
+  escape(req.getenv("CONTENT_LENGTH"));
+  escape(req.getenv("REMOTE_ADDR"));
+  escape(req.header("HOST"));
+  escape(req.header("USER_AGENT"));
+  escape(req.header("ACCEPT_ENCODING"));
+}));
+
+FCGI_BENCHMARK("FCGISessionStore::get/10k_sessions",0,loop([]() {
+  for (size_t i = 0; i < 64; i++)
+    escape(sessions.get(sessionIds[(i * 157) % SESSIONS]));
+}));
+
+FCGI_BENCHMARK("FCGISessionStore::put/10k_sessions",0,[](size_t iterations) {
+  FCGIBlob value = std::make_shared<FCGIData>(corpus.text(200));
+  for (size_t i = 0; i < iterations; i++)
+  {
+    for (size_t j = 0; j < 64; j++)
+      sessions.put(sessionIds[(i * 64 + j) % SESSIONS],value);
+  }
+});
+
+// Requests arriving and answered in time: each deadline is set, moved on to
+// the next stage and cancelled while the wheel ticks along a millisecond a
+// round, as the event loop does
+FCGI_BENCHMARK("FCGITimerWheel::schedule_cancel/10k_timers",0,[](size_t iterations) {
+  std::vector<FCGITimerWheel::Timer> timers(10000);
+  FCGITimerWheel wheel;
+  std::vector<FCGITimerWheel::Timer *> fired;
+  for (size_t i = 0; i < timers.size(); i++)
+    wheel.schedule(&timers[i],wheel.now() + 1000 + i % 30000);
+  for (size_t i = 0; i < iterations; i++)
+  {
+    for (size_t j = 0; j < 64; j++)
+    {
+      FCGITimerWheel::Timer *t = &timers[(i * 64 + j) % timers.size()];
+      wheel.schedule(t,wheel.now() + 5000);
+      wheel.schedule(t,wheel.now() + 30000);
+      wheel.cancel(t);
+      wheel.schedule(t,wheel.now() + 1000 + j * 400);
+    }
+    wheel.advance(wheel.now() + 1,fired);
+    fired.clear();
+  }
+  for (FCGITimerWheel::Timer &t: timers)
+    wheel.cancel(&t);
+});
@@ -0,0 +1,153 @@
+#include <config.h>
+
+#include "bench.hxx"
+
+namespace FCGIBench
+{
+
+Corpus::Corpus(uint32_t seed)
+{
+  p_state = seed ? seed : 1;
+}
+
+// xorshift32, plenty for making up inputs
+uint32_t Corpus::next()
+{
+  p_state ^= p_state << 13;
+  p_state ^= p_state >> 17;
+  p_state ^= p_state << 5;
+  return p_state;
+}
+
+std::string Corpus::token(size_t minLen,size_t maxLen)
+{
+  static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-";
+  size_t len = minLen + next() % (maxLen - minLen + 1);
+  std::string rv;
+  for (size_t i = 0; i < len; i++)
+    rv.push_back(chars[next() % (sizeof(chars)-1)]);
+  return rv;
+}
+
+std::string Corpus::query_string(size_t fields,int encodedPct)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  std::string rv;
+  for (size_t i = 0; i < fields; i++)
+  {
+    if (i)
+      rv.push_back('&');
+    rv.append(token(3,12));
+    rv.push_back('=');
+    std::string v = token(4,40);
+    if ((int)(next() % 100) < encodedPct)
+    {
+      // Search box style values, spaces and a few escaped bytes
+      std::string enc;
+      for (char c: v)
+      {
+        uint32_t r = next() % 10;
+        if (r == 0)
+          enc.push_back('+');
+        else if (r == 1)
+        {
+          unsigned char b = 0x80 + next() % 0x80;
+          enc.push_back('%');
+          enc.push_back(hex[b >> 4]);
+          enc.push_back(hex[b & 15]);
+        }
+        enc.push_back(c);
+      }
+      v = enc;
+    }
+    rv.append(v);
+  }
+  return rv;
+}
+
+std::string Corpus::cookie_jar(size_t cookies)
+{
+  std::string rv;
+  for (size_t i = 0; i < cookies; i++)
+  {
+    if (i)
+      rv.append("; ");
+    rv.append(token(2,16));
+    rv.push_back('=');
+    // Session ids and tracking blobs are long, preferences short
+    if (next() % 4 == 0)
+      rv.append(token(64,160));
+    else
+      rv.append(token(1,20));
+  }
+  return rv;
+}
+
+std::string Corpus::text(size_t bytes)
+{
+  std::string rv;
+  rv.reserve(bytes);
+  while (rv.size() < bytes)
+  {
+    rv.append(token(1,10));
+    rv.push_back(' ');
+  }
+  rv.resize(bytes);
+  return rv;
+}
+
+std::string Corpus::binary(size_t bytes)
+{
+  std::string rv;
+  rv.resize(bytes);
+  for (size_t i = 0; i < bytes; i++)
+    rv[i] = (char)(next() & 0xff);
+  return rv;
+}
+
+std::string Corpus::multipart(const std::string &boundary,size_t fileBytes)
+{
+  std::string rv;
+  const char *fields[] = { "title", "description", "tags" };
+  for (const char *f: fields)
+  {
+    rv.append("--" + boundary + "\r\n");
+    rv.append("Content-Disposition: form-data; name=\"");
+    rv.append(f);
+    rv.append("\"\r\n\r\n");
+    rv.append(text(20 + next() % 200));
+    rv.append("\r\n");
+  }
+  rv.append("--" + boundary + "\r\n");
+  rv.append("Content-Disposition: form-data; name=\"upload\"; filename=\"photo.jpg\"\r\n");
+  rv.append("Content-Type: image/jpeg\r\n\r\n");
+  rv.append(binary(fileBytes));
+  rv.append("\r\n--" + boundary + "--\r\n");
+  return rv;
+}
+
+std::string Corpus::json(size_t records)
+{
+  std::string rv = "[";
+  for (size_t i = 0; i < records; i++)
+  {
+    if (i)
+      rv.push_back(',');
+    rv.append("\n  {\"id\":" + std::to_string(100000 + i));
+    rv.append(",\"name\":\"" + token(4,12) + " " + token(4,12) + "\"");
+    rv.append(",\"email\":\"" + token(4,12) + "@example.com\"");
+    rv.append(",\"active\":");
+    rv.append((next() % 2) ? "true" : "false");
+    rv.append(",\"score\":" + std::to_string(next() % 1000) + "." + std::to_string(next() % 100));
+    rv.append(",\"tags\":[");
+    for (uint32_t t = 0, n = next() % 5; t < n; t++)
+      rv.append((t ? ",\"" : "\"") + token(3,8) + "\"");
+    rv.append("],\"address\":{\"street\":\"" + text(20) + "\",\"zip\":\"" + std::to_string(10000 + next() % 90000) + "\",\"geo\":null}");
+    // Quotes and line breaks as a text area posts them
+    rv.append(",\"bio\":\"" + text(40) + "\\\"" + token(3,8) + "\\\"\\n" + text(60) + "\"}");
+  }
+  rv.append("\n]\n");
+  return rv;
+}
+
+}
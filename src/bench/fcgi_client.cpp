@@ -0,0 +1,287 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#include <cstdlib>
+#include <algorithm>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+#include <fcgi_request_cpp.hxx>
+#include "fcgi_native.hxx"
+#include "fcgi_client.hxx"
+
+FCGIClient::FCGIClient()
+{
+  p_fd = -1;
+  p_closedEarly = false;
+  // Room for the largest record there can be
+  p_buf.resize(FCGIProto::HEADER_LEN + FCGIProto::MAX_CONTENT + 255);
+  p_start = p_end = 0;
+}
+
+FCGIClient::~FCGIClient()
+{
+  close();
+}
+
+/**
+ * @brief FCGIClient::connect
+ * @param address a unix socket path or TCP address
+ * @return true if connected, false and sets the error string if not
+ */
+bool FCGIClient::connect(const std::string &address)
+{
+  close();
+  p_errorString.clear();
+  if (FCGIListener::is_unix_path(address))
+  {
+    struct sockaddr_un sa;
+    memset(&sa,0,sizeof(sa));
+    if (address.size() >= sizeof(sa.sun_path))
+    {
+      p_errorString = address + ": Path too long";
+      return false;
+    }
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path,address.data(),address.size());
+    p_fd = ::socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+    if (p_fd >= 0 && ::connect(p_fd,(struct sockaddr *)&sa,sizeof(sa)) == 0)
+      return true;
+    p_errorString = address + ": " + strerror(errno);
+    close();
+    return false;
+  }
+
+  std::string::size_type idx = address.rfind(':');
+  std::string host = address.substr(0,idx);
+  std::string port = address.substr(idx+1);
+  if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1,host.size()-2);
+  if (host.empty() || host == "*")
+    host = "localhost";
+  struct addrinfo hints, *res = nullptr;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = ::getaddrinfo(host.c_str(),port.c_str(),&hints,&res);
+  if (rc != 0)
+  {
+    p_errorString = address + ": " + gai_strerror(rc);
+    return false;
+  }
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+  {
+    p_fd = ::socket(ai->ai_family,ai->ai_socktype | SOCK_CLOEXEC,ai->ai_protocol);
+    if (p_fd < 0)
+      continue;
+    if (::connect(p_fd,ai->ai_addr,ai->ai_addrlen) == 0)
+    {
+      int one = 1;
+      ::setsockopt(p_fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+      break;
+    }
+    p_errorString = address + ": " + strerror(errno);
+    close();
+  }
+  ::freeaddrinfo(res);
+  return (p_fd >= 0);
+}
+
+void FCGIClient::close()
+{
+  if (p_fd >= 0)
+    ::close(p_fd);
+  p_fd = -1;
+  p_start = p_end = 0;
+}
+
+// Appends a record header
+static void put_header(std::string &out,int type,uint16_t id,size_t len,size_t pad)
+{
+  unsigned char h[FCGIProto::HEADER_LEN] = { FCGIProto::VERSION_1, (unsigned char)type,
+                                             (unsigned char)(id >> 8), (unsigned char)id,
+                                             (unsigned char)(len >> 8), (unsigned char)len,
+                                             (unsigned char)pad, 0 };
+  out.append((const char *)h,sizeof(h));
+}
+
+// Appends a stream as records of at most MAX_CONTENT bytes, padded to 8,
+// followed by the empty record ending it
+static void put_stream(std::string &out,int type,uint16_t id,const std::string &data)
+{
+  size_t off = 0;
+  while (off < data.size())
+  {
+    size_t len = std::min(data.size() - off,(size_t)FCGIProto::MAX_CONTENT);
+    size_t pad = (8 - (len % 8)) % 8;
+    put_header(out,type,id,len,pad);
+    out.append(data,off,len);
+    out.append(pad,'\0');
+    off += len;
+  }
+  put_header(out,type,id,0,0);
+}
+
+static void put_length(std::string &out,size_t len)
+{
+  if (len < 128)
+  {
+    out.push_back((char)len);
+    return;
+  }
+  out.push_back((char)(0x80 | (len >> 24)));
+  out.push_back((char)(len >> 16));
+  out.push_back((char)(len >> 8));
+  out.push_back((char)len);
+}
+
+void FCGIClient::encode(uint16_t id,const Params &params,const std::string &body,bool keepConn,std::string &out)
+{
+  put_header(out,FCGIProto::BEGIN_REQUEST,id,8,0);
+  unsigned char begin[8] = { 0, FCGIProto::RESPONDER, (unsigned char)(keepConn ? FCGIProto::KEEP_CONN : 0), 0, 0, 0, 0, 0 };
+  out.append((const char *)begin,sizeof(begin));
+
+  std::string nv;
+  for (const std::pair<std::string,std::string> &p: params)
+  {
+    put_length(nv,p.first.size());
+    put_length(nv,p.second.size());
+    nv.append(p.first);
+    nv.append(p.second);
+  }
+  put_stream(out,FCGIProto::PARAMS,id,nv);
+  put_stream(out,FCGIProto::STDIN,id,body);
+}
+
+bool FCGIClient::send(const std::string &encoded)
+{
+  p_closedEarly = false;
+  size_t off = 0;
+  while (off < encoded.size())
+  {
+    ssize_t rc = ::send(p_fd,encoded.data() + off,encoded.size() - off,MSG_NOSIGNAL);
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      // The application closed a connection it did not keep
+      p_closedEarly = (errno == EPIPE || errno == ECONNRESET);
+      p_errorString = std::string("send: ") + strerror(errno);
+      return false;
+    }
+    off += rc;
+  }
+  return true;
+}
+
+// Reads more into the buffer, moving what is left to the front
+bool FCGIClient::fill()
+{
+  if (p_start > 0)
+  {
+    memmove(p_buf.data(),p_buf.data() + p_start,p_end - p_start);
+    p_end -= p_start;
+    p_start = 0;
+  }
+  ssize_t rc;
+  do
+  {
+    rc = ::recv(p_fd,p_buf.data() + p_end,p_buf.size() - p_end,0);
+  } while (rc < 0 && errno == EINTR);
+  if (rc <= 0)
+  {
+    p_errorString = (rc == 0) ? "connection closed" : std::string("recv: ") + strerror(errno);
+    p_closedEarly = (rc == 0 || errno == ECONNRESET);
+    return false;
+  }
+  p_end += rc;
+  return true;
+}
+
+// Status from the first line the application wrote
+int FCGIClient::parse_status(const std::string &head)
+{
+  if (head.compare(0,5,"HTTP/") == 0)
+  {
+    std::string::size_type sp = head.find(' ');
+    if (sp != std::string::npos)
+      return atoi(head.c_str() + sp + 1);
+  }
+  if (head.compare(0,7,"Status:") == 0)
+    return atoi(head.c_str() + 7);
+  return 200;
+}
+
+bool FCGIClient::receive(uint16_t id,Response &rsp,bool keepBody)
+{
+  rsp = Response();
+  std::string head;
+  bool anything = false;
+  for (;;)
+  {
+    while (p_end - p_start < FCGIProto::HEADER_LEN)
+    {
+      if (!fill())
+      {
+        p_closedEarly = p_closedEarly && !anything;
+        return false;
+      }
+    }
+    const unsigned char *h = (const unsigned char *)p_buf.data() + p_start;
+    size_t len = (h[4] << 8) | h[5];
+    size_t total = FCGIProto::HEADER_LEN + len + h[6];
+    while (p_end - p_start < total)
+    {
+      if (!fill())
+      {
+        p_closedEarly = false;
+        return false;
+      }
+      h = (const unsigned char *)p_buf.data() + p_start;
+    }
+    anything = true;
+    int type = h[1];
+    uint16_t rid = (h[2] << 8) | h[3];
+    const char *content = (const char *)h + FCGIProto::HEADER_LEN;
+    p_start += total;
+    if (h[0] != FCGIProto::VERSION_1 || rid != id)
+    {
+      p_errorString = "unexpected record";
+      p_closedEarly = false;
+      return false;
+    }
+    if (type == FCGIProto::STDOUT)
+    {
+      rsp.bytes += len;
+      if (head.size() < 64)
+        head.append(content,std::min(len,64 - head.size()));
+      if (keepBody)
+        rsp.body.append(content,len);
+    } else if (type == FCGIProto::STDERR) {
+      rsp.errBytes += len;
+    } else if (type == FCGIProto::END_REQUEST) {
+      if (len < 8)
+      {
+        p_errorString = "short END_REQUEST";
+        return false;
+      }
+      const unsigned char *b = (const unsigned char *)content;
+      rsp.appStatus = (int)(((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]);
+      rsp.protocolStatus = b[4];
+      rsp.status = (rsp.bytes > 0) ? parse_status(head) : 0;
+      return true;
+    }
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef FCGI_CLIENT_HXX
+#define FCGI_CLIENT_HXX
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+/**
+ * @brief The FCGIClient class plays the web server side of FastCGI over
+ * a unix socket or TCP, so the library can be driven without nginx in
+ * front of it. One request at a time per connection.
+ */
+class FCGIClient
+{
+public:
+  typedef std::vector<std::pair<std::string,std::string>> Params;
+
+  struct Response
+  {
+    // From the END_REQUEST record
+    int protocolStatus = 0;
+    int appStatus = 0;
+    // From the HTTP/1.x or Status: line the application sent, 200 if none
+    int status = 0;
+    // STDOUT and STDERR bytes received
+    size_t bytes = 0;
+    size_t errBytes = 0;
+    // The STDOUT stream, if it was asked for
+    std::string body;
+  };
+
+  FCGIClient();
+  ~FCGIClient();
+  /**
+   * @brief connect connects to a unix socket path or a TCP address in the
+   * form FCGIListener takes, ie "127.0.0.1:9000" or "[::1]:9000"
+   * @return true if connected, false and sets the error string if not
+   */
+  bool connect(const std::string &address);
+  void close();
+  bool connected() { return (p_fd >= 0); }
+  /**
+   * @brief encode appends the records of a complete request to out, so it
+   * can be built once and sent many times
+   * @param id the request id
+   * @param params the CGI variables
+   * @param body the request body, sent as STDIN
+   * @param keepConn asks the application to keep the connection open
+   */
+  static void encode(uint16_t id,const Params &params,const std::string &body,bool keepConn,std::string &out);
+  /**
+   * @brief send writes an encoded request
+   * @return true if all of it was written
+   */
+  bool send(const std::string &encoded);
+  /**
+   * @brief receive reads the response to the request with the given id
+   * @param keepBody whether to keep the STDOUT stream in the response
+   * @return true on END_REQUEST, false on a closed connection or a
+   * protocol error
+   */
+  bool receive(uint16_t id,Response &rsp,bool keepBody);
+  /**
+   * @brief closed_early tells if the last failure was the application
+   * closing the connection before sending anything, as happens on a
+   * connection it did not keep open
+   */
+  bool closed_early() { return p_closedEarly; }
+  const std::string error_string() { return p_errorString; }
+
+private:
+  bool fill();
+  static int parse_status(const std::string &head);
+
+  int p_fd;
+  bool p_closedEarly;
+  std::vector<char> p_buf;
+  size_t p_start;
+  size_t p_end;
+  std::string p_errorString;
+};
+
+#endif // FCGI_CLIENT_HXX
@@ -0,0 +1,454 @@
+#include <config.h>
+#ifdef HAVE_IOSTREAM
+#include <iostream>
+#endif
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+#include <fcgi_request_cpp.hxx>
+#include "bench.hxx"
+#include "fcgi_client.hxx"
+
+/*
+ * A load generator speaking FastCGI straight to an FCGIListener socket.
+ * Each connection runs in a thread of its own and sends requests back to
+ * back, picked from a weighted mix of GETs with query strings, urlencoded
+ * POSTs and multipart uploads. At the end it reports the throughput, the
+ * latency percentiles by kind of request, the statuses seen and, given
+ * the pid of the server, how its resident memory developed.
+ */
+
+namespace
+{
+
+struct Options
+{
+  std::string target;
+  int connections = 16;
+  double duration = 10;
+  double warmup = 1;
+  uint64_t requests = 0;
+  std::string uri = "/ping/";
+  size_t uploadSize = 1 << 20;
+  bool keepConn = false;
+  pid_t pid = 0;
+  int weights[3] = { 100, 0, 0 };
+};
+
+enum Kind
+{
+  GET,
+  POST,
+  UPLOAD,
+  KINDS
+};
+
+const char *kind_names[KINDS] = { "get", "post", "upload" };
+
+struct Counters
+{
+  FCGIHistogram latency[KINDS];
+  uint64_t count[KINDS] = { 0, };
+  uint64_t maxUsec[KINDS] = { 0, };
+  uint64_t bytesOut = 0;
+  uint64_t bytesIn = 0;
+  uint64_t connectErrors = 0;
+  uint64_t ioErrors = 0;
+  uint64_t protocolErrors = 0;
+  uint64_t reconnects = 0;
+  std::map<int,uint64_t> statuses;
+};
+
+struct Memory
+{
+  uint64_t startKb = 0;
+  uint64_t peakKb = 0;
+  uint64_t endKb = 0;
+  uint64_t hwmKb = 0;
+};
+
+std::atomic<bool> stopFlag(false);
+std::atomic<bool> measuring(false);
+std::atomic<uint64_t> budget(0);
+
+void usage(const char *prog)
+{
+  std::cerr << "Usage: " << prog << " [options] <socket path or host:port>\n"
+            << "  -c, --connections=N  concurrent connections, default 16\n"
+            << "  -d, --duration=S     seconds to measure, default 10\n"
+            << "  -n, --requests=N     stop after N measured requests instead\n"
+            << "  --warmup=S           seconds to run before measuring, default 1\n"
+            << "  --mix=get:W,post:W,upload:W  weights of the kinds of requests, default get:100\n"
+            << "  --uri=URI            uri of the requests, default /ping/\n"
+            << "  --upload-size=BYTES  size of the file in an upload, default 1048576\n"
+            << "  --keep-conn          keep connections open between requests\n"
+            << "  --pid=PID            sample the resident memory of the server\n";
+}
+
+bool parse_mix(const std::string &s,int *weights)
+{
+  for (int i = 0; i < KINDS; i++)
+    weights[i] = 0;
+  for (std::string &part: FCGI::str_split(s,','))
+  {
+    std::vector<std::string> kv = FCGI::str_split(part,':');
+    int k = 0;
+    while (k < KINDS && kv[0] != kind_names[k])
+      k++;
+    if (k == KINDS || kv.size() != 2)
+      return false;
+    weights[k] = atoi(kv[1].c_str());
+  }
+  return (weights[GET] + weights[POST] + weights[UPLOAD] > 0);
+}
+
+bool parse_options(int argc,char **argv,Options &o)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    std::string a = argv[i];
+    std::string::size_type eq = a.find('=');
+    std::string opt = a.substr(0,eq);
+    std::string val;
+    if (eq != std::string::npos)
+      val = a.substr(eq+1);
+    else if ((opt == "-c" || opt == "-d" || opt == "-n") && i+1 < argc)
+      val = argv[++i];
+
+    if (opt == "-c" || opt == "--connections")
+      o.connections = std::max(1,atoi(val.c_str()));
+    else if (opt == "-d" || opt == "--duration")
+      o.duration = atof(val.c_str());
+    else if (opt == "-n" || opt == "--requests")
+      o.requests = strtoull(val.c_str(),nullptr,10);
+    else if (opt == "--warmup")
+      o.warmup = atof(val.c_str());
+    else if (opt == "--mix")
+    {
+      if (!parse_mix(val,o.weights))
+        return false;
+    } else if (opt == "--uri")
+      o.uri = val;
+    else if (opt == "--upload-size")
+      o.uploadSize = strtoull(val.c_str(),nullptr,10);
+    else if (opt == "--keep-conn")
+      o.keepConn = true;
+    else if (opt == "--pid")
+      o.pid = atoi(val.c_str());
+    else if (a.size() > 1 && a[0] == '-')
+      return false;
+    else
+      o.target = a;
+  }
+  return !o.target.empty();
+}
+
+// The CGI variables nginx passes with fastcgi_params
+FCGIClient::Params base_params(const std::string &method,const std::string &uri,const std::string &query)
+{
+  FCGIClient::Params p;
+  std::string requestUri = uri;
+  if (!query.empty())
+    requestUri += "?" + query;
+  p.push_back({"QUERY_STRING",query});
+  p.push_back({"REQUEST_METHOD",method});
+  p.push_back({"SCRIPT_NAME",uri});
+  p.push_back({"REQUEST_URI",requestUri});
+  p.push_back({"DOCUMENT_URI",uri});
+  p.push_back({"DOCUMENT_ROOT","/var/www"});
+  p.push_back({"SERVER_PROTOCOL","HTTP/1.1"});
+  p.push_back({"REQUEST_SCHEME","http"});
+  p.push_back({"GATEWAY_INTERFACE","CGI/1.1"});
+  p.push_back({"SERVER_SOFTWARE","fcgiload"});
+  p.push_back({"REMOTE_ADDR","127.0.0.1"});
+  p.push_back({"REMOTE_PORT","40000"});
+  p.push_back({"SERVER_ADDR","127.0.0.1"});
+  p.push_back({"SERVER_PORT","80"});
+  p.push_back({"SERVER_NAME","localhost"});
+  p.push_back({"HTTP_HOST","localhost"});
+  p.push_back({"HTTP_USER_AGENT","Mozilla/5.0 (X11; Linux x86_64) fcgiload"});
+  p.push_back({"HTTP_ACCEPT","text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"});
+  p.push_back({"HTTP_ACCEPT_ENCODING","gzip, deflate"});
+  return p;
+}
+
+// Builds the encoded request of every kind once, they are sent as is
+void build_requests(const Options &o,std::string *encoded)
+{
+  FCGIBench::Corpus corpus;
+  std::string cookies = corpus.cookie_jar(12);
+
+  FCGIClient::Params p = base_params("GET",o.uri,corpus.query_string(12,25));
+  p.push_back({"HTTP_COOKIE",cookies});
+  p.push_back({"CONTENT_TYPE",""});
+  p.push_back({"CONTENT_LENGTH",""});
+  FCGIClient::encode(1,p,"",o.keepConn,encoded[GET]);
+
+  std::string form = corpus.query_string(20,25);
+  p = base_params("POST",o.uri,"");
+  p.push_back({"HTTP_COOKIE",cookies});
+  p.push_back({"CONTENT_TYPE","application/x-www-form-urlencoded"});
+  p.push_back({"CONTENT_LENGTH",std::to_string(form.size())});
+  FCGIClient::encode(1,p,form,o.keepConn,encoded[POST]);
+
+  std::string boundary = "----fcgiloadBoundaryq1w2e3r4t5y6";
+  std::string upload = corpus.multipart(boundary,o.uploadSize);
+  p = base_params("POST",o.uri,"");
+  p.push_back({"HTTP_COOKIE",cookies});
+  p.push_back({"CONTENT_TYPE","multipart/form-data; boundary=" + boundary});
+  p.push_back({"CONTENT_LENGTH",std::to_string(upload.size())});
+  FCGIClient::encode(1,p,upload,o.keepConn,encoded[UPLOAD]);
+}
+
+// Runs one connection until told to stop
+void run_connection(const Options &o,const std::string *encoded,uint32_t seed,Counters &c)
+{
+  FCGIClient client;
+  FCGIClient::Response rsp;
+  int total = o.weights[GET] + o.weights[POST] + o.weights[UPLOAD];
+  uint32_t rnd = seed ? seed : 1;
+
+  while (!stopFlag)
+  {
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 17;
+    rnd ^= rnd << 5;
+    int pick = rnd % total;
+    int kind = 0;
+    while (pick >= o.weights[kind])
+      pick -= o.weights[kind++];
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool ok = false;
+    // A kept connection the application closed meanwhile is retried once
+    for (int attempt = 0; attempt < 2 && !ok; attempt++)
+    {
+      bool reused = client.connected();
+      if (!reused && !client.connect(o.target))
+      {
+        c.connectErrors++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        break;
+      }
+      if (client.send(encoded[kind]) && client.receive(1,rsp,false))
+      {
+        ok = true;
+        break;
+      }
+      client.close();
+      if (!(reused && client.closed_early()))
+        break;
+      c.reconnects++;
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    if (!o.keepConn)
+      client.close();
+
+    bool counted = measuring;
+    if (counted && o.requests > 0 && budget.fetch_sub(1) <= 1)
+      stopFlag = true;
+    if (!counted)
+      continue;
+    if (!ok)
+    {
+      if (client.error_string().find("unexpected") != std::string::npos)
+        c.protocolErrors++;
+      else
+        c.ioErrors++;
+      continue;
+    }
+    if (rsp.protocolStatus != 0)
+    {
+      c.protocolErrors++;
+      continue;
+    }
+    uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    c.latency[kind].record(usec);
+    c.count[kind]++;
+    c.maxUsec[kind] = std::max(c.maxUsec[kind],usec);
+    c.bytesOut += encoded[kind].size();
+    c.bytesIn += rsp.bytes;
+    c.statuses[rsp.status]++;
+  }
+}
+
+// VmRSS and VmHWM of a process in kB, false if it is gone
+bool read_memory(pid_t pid,uint64_t &rss,uint64_t &hwm)
+{
+  std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+  if (!in)
+    return false;
+  std::string line;
+  while (std::getline(in,line))
+  {
+    if (line.compare(0,6,"VmRSS:") == 0)
+      rss = strtoull(line.c_str() + 6,nullptr,10);
+    else if (line.compare(0,6,"VmHWM:") == 0)
+      hwm = strtoull(line.c_str() + 6,nullptr,10);
+  }
+  return true;
+}
+
+void sample_memory(pid_t pid,Memory &m)
+{
+  uint64_t rss = 0, hwm = 0;
+  while (!stopFlag)
+  {
+    if (measuring && read_memory(pid,rss,hwm))
+    {
+      if (m.startKb == 0)
+        m.startKb = rss;
+      m.peakKb = std::max(m.peakKb,rss);
+      m.endKb = rss;
+      m.hwmKb = hwm;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+std::string mb(double bytes)
+{
+  char buf[32];
+  snprintf(buf,sizeof(buf),"%.1f MB",bytes / (1024.0 * 1024.0));
+  return buf;
+}
+
+void report_latency(const char *name,const std::vector<uint64_t> &buckets,uint64_t count,uint64_t maxUsec)
+{
+  std::cout << "  " << std::left << std::setw(8) << name << std::right << std::setw(10) << count;
+  // Buckets are reported by their upper bound, which may be over the max
+  for (double pct: { 50.0, 90.0, 99.0, 99.9 })
+    std::cout << std::setw(10) << std::min(FCGIHistogram::percentile(buckets,pct),maxUsec);
+  std::cout << std::setw(10) << maxUsec << std::endl;
+}
+
+}
+
+int main(int argc,char **argv)
+{
+  Options o;
+  if (!parse_options(argc,argv,o))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Fail early if there is nobody there
+  FCGIClient probe;
+  if (!probe.connect(o.target))
+  {
+    std::cerr << probe.error_string() << std::endl;
+    return 1;
+  }
+  probe.close();
+
+  std::string encoded[KINDS];
+  build_requests(o,encoded);
+  budget = o.requests;
+
+  std::vector<std::unique_ptr<Counters>> counters;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < o.connections; i++)
+  {
+    counters.emplace_back(new Counters());
+    Counters *c = counters.back().get();
+    threads.emplace_back([&o,&encoded,i,c]() { run_connection(o,encoded,0x9e3779b9u * (i+1),*c); });
+  }
+  Memory mem;
+  std::thread sampler;
+  if (o.pid > 0)
+    sampler = std::thread([&o,&mem]() { sample_memory(o.pid,mem); });
+
+  if (o.warmup > 0)
+    std::this_thread::sleep_for(std::chrono::duration<double>(o.warmup));
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  measuring = true;
+  if (o.requests > 0)
+  {
+    while (!stopFlag)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  } else {
+    std::this_thread::sleep_for(std::chrono::duration<double>(o.duration));
+    stopFlag = true;
+  }
+  measuring = false;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (std::thread &t: threads)
+    t.join();
+  if (sampler.joinable())
+    sampler.join();
+
+  Counters sum;
+  std::vector<uint64_t> all(FCGIHistogram::BUCKETS,0);
+  std::vector<uint64_t> byKind[KINDS];
+  uint64_t maxAll = 0;
+  for (int k = 0; k < KINDS; k++)
+    byKind[k].assign(FCGIHistogram::BUCKETS,0);
+  for (std::unique_ptr<Counters> &c: counters)
+  {
+    for (int k = 0; k < KINDS; k++)
+    {
+      c->latency[k].add_to(byKind[k]);
+      c->latency[k].add_to(all);
+      sum.count[k] += c->count[k];
+      sum.maxUsec[k] = std::max(sum.maxUsec[k],c->maxUsec[k]);
+      maxAll = std::max(maxAll,c->maxUsec[k]);
+    }
+    sum.bytesOut += c->bytesOut;
+    sum.bytesIn += c->bytesIn;
+    sum.connectErrors += c->connectErrors;
+    sum.ioErrors += c->ioErrors;
+    sum.protocolErrors += c->protocolErrors;
+    sum.reconnects += c->reconnects;
+    for (std::pair<const int,uint64_t> &s: c->statuses)
+      sum.statuses[s.first] += s.second;
+  }
+  uint64_t requests = sum.count[GET] + sum.count[POST] + sum.count[UPLOAD];
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "target        " << o.target << (o.keepConn ? " (kept connections)" : "") << std::endl;
+  std::cout << "connections   " << o.connections << std::endl;
+  std::cout << "duration      " << seconds << " s" << std::endl;
+  std::cout << "requests      " << requests << std::endl;
+  std::cout << "throughput    " << requests / seconds << " req/s, sent " << mb(sum.bytesOut / seconds)
+            << "/s, received " << mb(sum.bytesIn / seconds) << "/s" << std::endl;
+  std::cout << "latency us    " << std::setw(8) << "count" << std::setw(10) << "p50" << std::setw(10) << "p90"
+            << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(10) << "max" << std::endl;
+  report_latency("all",all,requests,maxAll);
+  for (int k = 0; k < KINDS; k++)
+  {
+    if (o.weights[k] > 0)
+      report_latency(kind_names[k],byKind[k],sum.count[k],sum.maxUsec[k]);
+  }
+  std::cout << "statuses     ";
+  for (std::pair<const int,uint64_t> &s: sum.statuses)
+    std::cout << " " << s.first << "=" << s.second;
+  std::cout << std::endl;
+  std::cout << "errors        connect=" << sum.connectErrors << " io=" << sum.ioErrors
+            << " protocol=" << sum.protocolErrors << " reconnects=" << sum.reconnects << std::endl;
+  if (o.pid > 0)
+  {
+    if (mem.startKb == 0)
+      std::cout << "server rss    process " << o.pid << " not found" << std::endl;
+    else
+      std::cout << "server rss    start " << mb(mem.startKb * 1024.0) << ", peak " << mb(mem.peakKb * 1024.0)
+                << ", end " << mb(mem.endKb * 1024.0) << ", high water " << mb(mem.hwmKb * 1024.0) << std::endl;
+  }
+  return (sum.connectErrors + sum.ioErrors + sum.protocolErrors > 0) ? 2 : 0;
+}
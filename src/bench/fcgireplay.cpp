@@ -0,0 +1,164 @@
+#include <config.h>
+#ifdef HAVE_IOSTREAM
+#include <iostream>
+#endif
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+
+#include <fcgi_request_cpp.hxx>
+
+/*
+ * Feeds requests recorded by FCGICapture back through the parser, without
+ * a web server or even a socket, so parse() can be profiled on real
+ * traffic. Every thread parses all of the records the given number of
+ * times. It also lists the records, and splits them into a file each to
+ * seed the fuzz targets in src/fuzz.
+ */
+
+static void usage(const char *prog)
+{
+  std::cerr << "Usage: " << prog << " [options] <capture file>...\n"
+            << "  --threads=N     threads parsing at once, default 1\n"
+            << "  --iterations=N  times each thread parses every record, default 100\n"
+            << "  --list          list the records and whether they parse, then exit\n"
+            << "  --split=DIR     write every record to a file of its own in DIR, then exit\n";
+}
+
+static std::string param(const FCGICapture::Record &r,const char *name)
+{
+  auto it = r.params.find(name);
+  return (it == r.params.end()) ? std::string() : it->second;
+}
+
+static bool parse(const FCGICapture::Record &r)
+{
+  FCGIRequest req((std::shared_ptr<FCGX_Request>()));
+  return req.parse(r.params,r.body);
+}
+
+int main(int argc,char **argv)
+{
+  int threads = 1;
+  long iterations = 100;
+  bool list = false;
+  std::string splitDir;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string a = argv[i];
+    if (a.compare(0,10,"--threads=") == 0)
+      threads = std::max(1,atoi(a.c_str() + 10));
+    else if (a.compare(0,13,"--iterations=") == 0)
+      iterations = std::max(1L,atol(a.c_str() + 13));
+    else if (a == "--list")
+      list = true;
+    else if (a.compare(0,8,"--split=") == 0)
+      splitDir = a.substr(8);
+    else if (a.size() > 1 && a[0] == '-')
+    {
+      usage(argv[0]);
+      return 1;
+    } else
+      files.push_back(a);
+  }
+  if (files.empty())
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<FCGICapture::Record> records;
+  for (std::string &f: files)
+  {
+    std::string error;
+    if (!FCGICapture::read_file(f,records,error))
+    {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+  size_t bytes = 0;
+  for (FCGICapture::Record &r: records)
+    bytes += r.body.size();
+
+  if (list)
+  {
+    size_t n = 0;
+    for (FCGICapture::Record &r: records)
+    {
+      std::cout << std::setw(6) << ++n << " " << std::left << std::setw(7) << param(r,"REQUEST_METHOD") << std::right
+                << " " << param(r,"REQUEST_URI") << " params=" << r.params.size() << " body=" << r.body.size()
+                << (parse(r) ? "" : " PARSE FAILED") << std::endl;
+    }
+    return 0;
+  }
+
+  if (!splitDir.empty())
+  {
+    size_t n = 0;
+    for (FCGICapture::Record &r: records)
+    {
+      std::string rec;
+      FCGICapture::encode(r.params,r.body.get(),r.body.size(),rec);
+      char name[32];
+      snprintf(name,sizeof(name),"/capture-%06zu",++n);
+      std::ofstream out(splitDir + name,std::ios::binary);
+      // The fuzz targets take a record without its length prefix
+      out.write(rec.data() + 4,rec.size() - 4);
+      if (!out)
+      {
+        std::cerr << splitDir << name << ": " << strerror(errno) << std::endl;
+        return 1;
+      }
+    }
+    std::cout << n << " records written to " << splitDir << std::endl;
+    return 0;
+  }
+
+  std::atomic<uint64_t> failed(0);
+  std::vector<std::thread> workers;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; t++)
+  {
+    workers.emplace_back([&records,&failed,iterations]() {
+      uint64_t f = 0;
+      for (long i = 0; i < iterations; i++)
+      {
+        for (FCGICapture::Record &r: records)
+        {
+          if (!parse(r))
+            f++;
+        }
+      }
+      failed += f;
+    });
+  }
+  for (std::thread &t: workers)
+    t.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  double parses = (double)records.size() * iterations * threads;
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "records       " << records.size() << ", " << bytes << " body bytes" << std::endl;
+  std::cout << "threads       " << threads << " x " << iterations << " iterations" << std::endl;
+  std::cout << "time          " << seconds << " s" << std::endl;
+  std::cout << "throughput    " << parses / seconds << " parses/s, "
+            << (double)bytes * iterations * threads / seconds / (1024.0 * 1024.0) << " MB/s of body" << std::endl;
+  std::cout << "per parse     " << seconds * 1e9 * threads / parses << " ns per thread" << std::endl;
+  std::cout << "failed        " << failed / (uint64_t)(iterations * threads) << " of " << records.size() << " records" << std::endl;
+  return 0;
+}
@@ -0,0 +1,83 @@
+#include <config.h>
+#include <iostream>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <fcgi_request_cpp.hxx>
+
+/*
+ * Handlers as coroutines on FCGIExecutor. /wait?ms=N stands in for a
+ * backend taking N milliseconds, 50 by default, during which the thread
+ * goes on with other requests, so a single thread keeps thousands of
+ * them in flight. /stop stops it.
+ *   coroutines [--event-loop] [--threads=N] [socket]
+ * Needs a C++20 compiler, ie CXXFLAGS=-std=c++20
+ */
+#ifdef FCGI_HAVE_COROUTINES
+static FCGIListener *listener = nullptr;
+
+static FCGITask<> handle(FCGIRequest &req,FCGIResponse &resp)
+{
+    resp.set_header("Content-Type","text/plain");
+    if (req.path() == "/stop")
+    {
+        resp.set_c_string("OK\r\n");
+        listener->stop();
+        co_return;
+    }
+    if (req.path() == "/wait")
+    {
+        int ms = req.hasQueryField("ms") ? atoi(req.queryField("ms").c_str()) : 50;
+        co_await FCGIExecutor::sleep_for(std::chrono::milliseconds(ms));
+        resp.set_string("Waited " + std::to_string(ms) + " ms\r\n");
+        co_return;
+    }
+    resp.set_status_code(404);
+    resp.set_c_string("Not Found\r\n");
+}
+
+int main(int argc,char **argv)
+{
+    std::string path = "/tmp/simple-coroutines.sock";
+    bool eventLoop = false;
+    int threads = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        if (a == "--event-loop")
+            eventLoop = true;
+        else if (a.compare(0,10,"--threads=") == 0)
+            threads = std::max(1,atoi(a.c_str() + 10));
+        else
+            path = a;
+    }
+
+    FCGIListener l(path);
+    listener = &l;
+    if (!l.open())
+    {
+        std::cerr << l.error_string() << std::endl;
+        return 1;
+    }
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+    ::chmod(l.listener_path().c_str(),mode);
+    l.set_event_loop(eventLoop);
+    if (!l.start())
+    {
+        std::cerr << l.error_string() << std::endl;
+        return 1;
+    }
+    FCGIExecutor exec(l,threads);
+    if (!exec.serve(handle))
+    {
+        std::cerr << exec.error_string() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+#else
+int main()
+{
+    std::cerr << "coroutines needs a C++20 compiler, ie CXXFLAGS=-std=c++20" << std::endl;
+    return 1;
+}
+#endif
@@ -0,0 +1,139 @@
+#include <config.h>
+#include <iostream>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <fcgi_request_cpp.hxx>
+
+/*
+ * Long polling and server-sent events with FCGIDeferred. The handler parks
+ * the request and returns, a ticker thread answers all of them at once:
+ *   /poll    answered with the next tick
+ *   /events  a text/event-stream getting every tick as an event
+ *   /stop    stops it
+ *   events [--event-loop] [--interval=ms] [socket]
+ * A single worker thread holds any number of clients this way.
+ */
+static std::mutex parkedMutex;
+static std::vector<FCGIDeferred> polls;
+static std::vector<FCGIDeferred> streams;
+// Set by /stop, the streams are ended so the listener can drain
+static std::atomic<bool> stopping(false);
+
+static void serve(FCGIListener &l)
+{
+    while (1)
+    {
+        FCGIRequest req = l.nextRequest();
+        if (!req.valid())
+            break;
+        if (req.path() == "/poll")
+        {
+            std::lock_guard<std::mutex> g(parkedMutex);
+            polls.emplace_back(req);
+            continue;
+        }
+        if (req.path() == "/events")
+        {
+            FCGIDeferred d(req);
+            FCGIResponse resp(d.FCGXHandle());
+            resp.set_header("Content-Type","text/event-stream");
+            resp.set_header("Cache-Control","no-cache");
+            resp.set_header("X-Accel-Buffering","no");
+            if (d.begin(resp))
+            {
+                std::lock_guard<std::mutex> g(parkedMutex);
+                streams.push_back(d);
+            }
+            continue;
+        }
+        FCGIResponse resp(req.FCGXHandle());
+        resp.set_header("Content-Type","text/plain");
+        resp.set_c_string("OK\r\n");
+        resp.send();
+        if (req.path() == "/stop")
+        {
+            stopping = true;
+            l.stop();
+        }
+    }
+}
+
+static void tick(unsigned long n)
+{
+    std::vector<FCGIDeferred> p, s;
+    {
+        std::lock_guard<std::mutex> g(parkedMutex);
+        p.swap(polls);
+        s.swap(streams);
+    }
+    std::string text = "tick " + std::to_string(n);
+    for (FCGIDeferred &d: p)
+    {
+        FCGIResponse resp(d.FCGXHandle());
+        resp.set_header("Content-Type","text/plain");
+        resp.set_string(text + "\r\n");
+        d.complete(resp);
+    }
+    std::vector<FCGIDeferred> keep;
+    for (FCGIDeferred &d: s)
+    {
+        // Clients which went away are dropped
+        if (!d.aborted() && d.write_event(text,"tick",std::to_string(n)) && !stopping)
+            keep.push_back(d);
+        else
+            d.finish();
+    }
+    std::lock_guard<std::mutex> g(parkedMutex);
+    streams.insert(streams.end(),keep.begin(),keep.end());
+}
+
+int main(int argc,char **argv)
+{
+    std::string path = "/tmp/simple-events.sock";
+    bool eventLoop = false;
+    int interval = 1000;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        if (a == "--event-loop")
+            eventLoop = true;
+        else if (a.compare(0,11,"--interval=") == 0)
+            interval = std::max(1,atoi(a.c_str() + 11));
+        else
+            path = a;
+    }
+
+    FCGIListener l(path);
+    if (!l.open())
+    {
+        std::cerr << l.error_string() << std::endl;
+        return 1;
+    }
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+    ::chmod(l.listener_path().c_str(),mode);
+    l.set_event_loop(eventLoop);
+    if (!l.start())
+    {
+        std::cerr << l.error_string() << std::endl;
+        return 1;
+    }
+    FCGI::setServerName("events/1.0");
+
+    std::atomic<bool> running(true);
+    // Ticks until the last parked request is answered, nextRequest()
+    // returning an invalid request only after that
+    std::thread ticker([&running,interval]() {
+        unsigned long n = 0;
+        while (running)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+            tick(++n);
+        }
+    });
+    serve(l);
+    running = false;
+    ticker.join();
+    return 0;
+}
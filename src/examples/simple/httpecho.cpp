@@ -1,22 +1,72 @@
 #include <config.h>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
 #include <sys/stat.h>
 #include <fcgi_request_cpp.hxx>
 
-// Forward declaration for readability
-std::string htmlEchoRequest(FCGIRequest *);
+// Forward declarations for readability
+void htmlEchoRequest(FCGIRequest *,FCGIRope *);
+void serve(FCGIListener &);
 
 /**
  * This program echoes the request sent to the browser in a very
  * aesthetically pleasing table format. Although it only shows
  * a few parameters and the envp array, it does demonstrate
  * how to access and iterate over the values stored.
+ *
+ * Options select the threading and queue mode, so fcgiload can compare
+ * them against the same program:
+ *   httpecho [--event-loop] [--acceptors=N] [--threads=N]
+ *            [--max-body=N] [--max-header-bytes=N] [--rate=R] [--burst=N]
+ *            [--header-timeout=ms] [--body-timeout=ms] [--queue-timeout=ms]
+ *            [--total-timeout=ms] [socket]
+ * The limits are answered 413 and 431 by the listener, see FCGILimits,
+ * and clients over R requests a second 429, see FCGIRateLimiter. Requests
+ * arriving too slowly are answered 408, those waiting too long in the queue
+ * 503 or 504, see FCGIListener::Deadlines.
  */
-int main()
+int main(int argc,char **argv)
 {
+  std::string path = "/tmp/simple-echo.sock";
+  bool eventLoop = false;
+  int acceptors = 1, threads = 1;
+  FCGILimits::Limits limits;
+  double rate = 0, burst = 10;
+  FCGIListener::Deadlines deadlines;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string a = argv[i];
+    if (a == "--event-loop")
+      eventLoop = true;
+    else if (a.compare(0,12,"--acceptors=") == 0)
+      acceptors = atoi(a.c_str() + 12);
+    else if (a.compare(0,10,"--threads=") == 0)
+      threads = std::max(1,atoi(a.c_str() + 10));
+    else if (a.compare(0,11,"--max-body=") == 0)
+      limits.maxBody = strtoull(a.c_str() + 11,nullptr,10);
+    else if (a.compare(0,19,"--max-header-bytes=") == 0)
+      limits.maxHeaderBytes = strtoull(a.c_str() + 19,nullptr,10);
+    else if (a.compare(0,7,"--rate=") == 0)
+      rate = atof(a.c_str() + 7);
+    else if (a.compare(0,8,"--burst=") == 0)
+      burst = atof(a.c_str() + 8);
+    else if (a.compare(0,17,"--header-timeout=") == 0)
+      deadlines.header = std::chrono::milliseconds(atoi(a.c_str() + 17));
+    else if (a.compare(0,15,"--body-timeout=") == 0)
+      deadlines.body = std::chrono::milliseconds(atoi(a.c_str() + 15));
+    else if (a.compare(0,16,"--queue-timeout=") == 0)
+      deadlines.queue = std::chrono::milliseconds(atoi(a.c_str() + 16));
+    else if (a.compare(0,16,"--total-timeout=") == 0)
+      deadlines.total = std::chrono::milliseconds(atoi(a.c_str() + 16));
+    else
+      path = a;
+  }
+
   // Constructor can take the location of the listening socket
-  FCGIListener l("/tmp/simple-echo.sock");
+  FCGIListener l(path);
   // Always check for errors
   if (!l.open())
   {
@@ -28,6 +78,20 @@ int main()
   mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
   ::chmod(l.listener_path().c_str(),mode);
 
+  // Read many connections at once with epoll, and the number of threads
+  // accepting them
+  l.set_event_loop(eventLoop);
+  l.set_acceptors(acceptors);
+
+  // Requests over the limits never reach the queue
+  std::shared_ptr<FCGILimits> requestLimits = std::make_shared<FCGILimits>();
+  requestLimits->set(limits);
+  l.set_limits(requestLimits);
+  if (rate > 0)
+    l.set_rate_limiter(std::make_shared<FCGIRateLimiter>(rate,burst));
+  // Slow clients and requests nginx gave up on never hold a worker
+  l.set_deadlines(deadlines);
+
   // This actually starts in a seperate thread and parses requests as
   // they come in, adding them to a queue.  It is left up to the caller
   // as to the processing model, ie single thread, thread per, or
@@ -38,20 +102,31 @@ int main()
     return 1;
   }
 
-  // Since this is an example program, we only use single threaded
-  // processing
+  // Single threaded processing unless asked for more threads, all
+  // taking requests off the same queue
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; i++)
+    workers.emplace_back(serve,std::ref(l));
+  serve(l);
+  for (std::thread &t: workers)
+    t.join();
+}
+
+void serve(FCGIListener &l)
+{
   while (1)
   {
     // Mutex protected queue
     FCGIRequest req = l.nextRequest();
-    // Process the request and return a string
-    std::string rv = htmlEchoRequest(&req);
+    // Only after stop(), once the queue ran empty
+    if (!req.valid())
+      break;
     // Pair a response object with the request
     FCGIResponse resp(req.FCGXHandle());
     // Content type, important for specifying what will be shown
     resp.set_header("Content-Type","text/html");
-    // Set return data
-    resp.set_string(rv);
+    // Process the request, writing the page straight to the response
+    htmlEchoRequest(&req,resp.rope());
     // And ship it off
     resp.send();
 
@@ -66,29 +141,38 @@ int main()
   }
 }
 
-std::string htmlEchoRequest(FCGIRequest *req)
+// The page is put together in the rope of the response: the markup is
+// referenced where it is, only the values from the request are copied
+void htmlEchoRequest(FCGIRequest *req,FCGIRope *out)
 {
-  std::string rv;
-  std::stringstream ss;
-  ss << "<html>\n <head>\n  <title>Request " << req << "</title>\n </head>\n <body>";
-  ss << "  <table align='center'>\n";
-  ss << "   <tr><th colspan=2>Request Parameters</th></tr>\n";
-  ss << "   <tr><th>URI</th><td>" << req->uri() << "</td></tr>\n";
-  ss << "   <tr><th>Query String</th><td>" << req->query_string() << "</td></tr>\n";
-  ss << "   <tr><th>Method</th><td>" << req->method() << "</td></tr>\n";
-  ss << "  </table>\n";
+  std::stringstream title;
+  title << req;
+  out->append_static("<html>\n <head>\n  <title>Request ");
+  out->append(title.str());
+  out->append_static("</title>\n </head>\n <body>");
+  out->append_static("  <table align='center'>\n");
+  out->append_static("   <tr><th colspan=2>Request Parameters</th></tr>\n");
+  out->append_static("   <tr><th>URI</th><td>");
+  out->append(req->uri());
+  out->append_static("</td></tr>\n   <tr><th>Query String</th><td>");
+  out->append(req->query_string());
+  out->append_static("</td></tr>\n   <tr><th>Method</th><td>");
+  out->append(req->method());
+  out->append_static("</td></tr>\n  </table>\n");
 
-  ss << "  <table align='center' border=1>\n";
-  ss << "   <tr><th colspan=2>Environment</th></tr>\n";
+  out->append_static("  <table align='center' border=1>\n");
+  out->append_static("   <tr><th colspan=2>Environment</th></tr>\n");
   // Example of how to iterate over decoded parts of the request
   std::map<std::string,std::string> *envp = const_cast<std::map<std::string,std::string> *>(req->allEnviron());
   for (std::map<std::string,std::string>::iterator it = envp->begin(); it != envp->end(); it++)
   {
-    ss << "   <tr><th>" << it->first << "</th><td>" << it->second << "</td></tr>\n";
+    out->append_static("   <tr><th>");
+    out->append(it->first);
+    out->append_static("</th><td>");
+    out->append(it->second);
+    out->append_static("</td></tr>\n");
   }
-  ss << "  </table>\n";
+  out->append_static("  </table>\n");
 
-  ss << " </body>\n</html>" << std::endl;
-  rv = ss.str();
-  return rv;
+  out->append_static(" </body>\n</html>\n");
 }
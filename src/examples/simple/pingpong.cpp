@@ -1,17 +1,67 @@
 #include <config.h>
 #include <iostream>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
 #include <sys/stat.h>
 #include <fcgi_request_cpp.hxx>
 
 /*
  * This was a program first written to test the library
- * It really just returns OK or Ping based on the
+ * It really just returns OK or Pong based on the
  * URL passed in, but provides good breakpoints to examine
- * the data in the classes.
+ * the data in the classes. /stop stops it.
  */
-int main()
+// The bodies are built once and shared by every response, on any thread
+static const FCGIBlob okBody = std::make_shared<const FCGIData>("OK\r\n",4);
+static const FCGIBlob pongBody = std::make_shared<const FCGIData>("Pong!\r\n",7);
+// And so are their headers, rendered once the server name is set
+static std::unique_ptr<const FCGIHeaderTemplate> plainHeaders;
+
+static void reply(FCGIRequest &req,const FCGIBlob &body)
+{
+    FCGIResponse resp(req.FCGXHandle());
+    resp.set_template(plainHeaders.get());
+    resp.set_data(body);
+    resp.send();
+}
+
+static void serve(FCGIListener &l,const FCGIRouter &router)
+{
+    while (1)
+    {
+        FCGIRequest req = l.nextRequest();
+        // Only after stop(), once the queue ran empty
+        if (!req.valid())
+            break;
+        router.dispatch(req);
+    }
+}
+
+/*
+ * Options select the threading and queue mode, so fcgiload can compare
+ * them against the same program:
+ *   pingpong [--event-loop] [--acceptors=N] [--threads=N] [socket]
+ */
+int main(int argc,char **argv)
 {
-    FCGIListener l("/tmp/simple-pingpong.sock");
+    std::string path = "/tmp/simple-pingpong.sock";
+    bool eventLoop = false;
+    int acceptors = 1, threads = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        if (a == "--event-loop")
+            eventLoop = true;
+        else if (a.compare(0,12,"--acceptors=") == 0)
+            acceptors = atoi(a.c_str() + 12);
+        else if (a.compare(0,10,"--threads=") == 0)
+            threads = std::max(1,atoi(a.c_str() + 10));
+        else
+            path = a;
+    }
+
+    FCGIListener l(path);
     if (!l.open())
     {
         std::cerr << l.error_string() << std::endl;
@@ -19,32 +69,35 @@ int main()
     }
     mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     ::chmod(l.listener_path().c_str(),mode);
+    l.set_event_loop(eventLoop);
+    l.set_acceptors(acceptors);
     if (!l.start())
     {
         std::cerr << l.error_string() << std::endl;
         return 1;
     }
     FCGI::setServerName("pingpong/1.0");
-    while (1)
-    {
-        FCGIRequest req = l.nextRequest();
-        FCGIResponse resp(req.FCGXHandle());
+    plainHeaders.reset(new FCGIHeaderTemplate({
+        { "Content-Type", "text/plain" },
+        { "X-Content-Type-Options", "nosniff" }
+    }));
 
-        std::string::size_type stopidx = req.uri().find("stop");
-        std::string::size_type pingidx = req.uri().find("/ping/");
-        resp.set_header("Content-Type","text/plain");
-        if (pingidx == std::string::npos)
-        {
-          resp.set_c_string("OK\r\n");
-        } else {
-          resp.set_c_string("Pong!\r\n");
-        }
-        resp.send();
+    FCGIRouter router;
+    router.add(FCGIRouter::ANY,"/ping/*rest",[](FCGIRequest &req,const FCGIRouter::Match &) {
+        reply(req,pongBody);
+    });
+    router.add(FCGIRouter::ANY,"/stop",[&l](FCGIRequest &req,const FCGIRouter::Match &) {
+        reply(req,okBody);
+        l.stop();
+    });
+    router.set_not_found([](FCGIRequest &req,const FCGIRouter::Match &) {
+        reply(req,okBody);
+    });
 
-        if (stopidx != std::string::npos)
-        {
-            l.stop();
-            break;
-        }
-    }
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++)
+        workers.emplace_back(serve,std::ref(l),std::cref(router));
+    serve(l,router);
+    for (std::thread &t: workers)
+        t.join();
 }
@@ -0,0 +1,44 @@
+#include <config.h>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcgi_request_cpp.hxx>
+
+/*
+ * The pingpong server run as four worker processes. Send the master
+ * SIGHUP to replace the workers without dropping a request (for example
+ * after installing a new binary), and SIGTERM to drain and exit.
+ */
+int main()
+{
+    FCGIListener l("/tmp/simple-prefork.sock");
+    if (!l.open())
+    {
+        std::cerr << l.error_string() << std::endl;
+        return 1;
+    }
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+    ::chmod(l.listener_path().c_str(),mode);
+    FCGI::setServerName("prefork/1.0");
+
+    FCGIPrefork pf(l,4);
+    int rc = pf.run([](FCGIListener &listener) {
+        while (1)
+        {
+            // Invalid once this worker was told to drain and is done
+            FCGIRequest req = listener.nextRequest();
+            if (!req.valid())
+                break;
+            FCGIResponse resp(req.FCGXHandle());
+            std::string body = "Pong from " + std::to_string(getpid()) + "\r\n";
+            resp.set_header("Content-Type","text/plain");
+            resp.set_string(body);
+            resp.send();
+        }
+        return 0;
+    });
+    if (rc != 0)
+        std::cerr << pf.error_string() << std::endl;
+    return rc;
+}
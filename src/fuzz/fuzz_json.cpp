@@ -0,0 +1,31 @@
+#include <config.h>
+#include <fcgi_request_cpp.hxx>
+
+/*
+ * libFuzzer target for FCGIJson. The input is the document, every value
+ * of it is read back if it parses.
+ */
+namespace
+{
+size_t walk(FCGIJson::Value v)
+{
+  size_t n = v.raw_size() + v.as_string().size() + (size_t)v.as_int64() + (v.as_double() > 0) + v.as_bool();
+  for (FCGIJson::Value c = v.first(); c.valid(); c = c.next())
+  {
+    n += walk(c) + c.name().size();
+    if (v.is_object())
+      n += v[c.name()].valid();
+  }
+  return n;
+}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data,size_t size)
+{
+  // A copy of just the input, so reading past it is caught
+  FCGIData text(reinterpret_cast<const char *>(data),size);
+  FCGIJson doc;
+  if (doc.parse(text.get(),text.size()))
+    walk(doc.root());
+  return 0;
+}
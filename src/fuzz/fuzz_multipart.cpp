@@ -0,0 +1,34 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#include <fcgi_request_cpp.hxx>
+
+/*
+ * libFuzzer target for FCGIRequest::parseMultipart(). The first line of
+ * the input is the boundary, the rest is the body.
+ */
+namespace
+{
+// parseMultipart() is for the parser only, this opens it up
+class MultipartParser: public FCGIRequest
+{
+public:
+  MultipartParser(): FCGIRequest(std::shared_ptr<FCGX_Request>()) {}
+  using FCGIRequest::parseMultipart;
+};
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data,size_t size)
+{
+  const char *p = reinterpret_cast<const char *>(data);
+  const char *nl = static_cast<const char *>(memchr(p,'\n',size));
+  // RFC 2046 boundaries are 1 to 70 characters
+  if (!nl || nl == p || nl - p > 70)
+    return 0;
+  std::string boundary(p,nl - p);
+  FCGIData body(nl + 1,size - (nl + 1 - p));
+  MultipartParser parser;
+  parser.parseMultipart(boundary,body);
+  return 0;
+}
@@ -0,0 +1,18 @@
+#include <config.h>
+#include <fcgi_request_cpp.hxx>
+
+/*
+ * libFuzzer target for FCGIRequest::parse(). The input is a record as
+ * FCGICapture writes it, without the length prefix, so captured traffic
+ * split up by "fcgireplay --split" seeds it.
+ */
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data,size_t size)
+{
+  FCGICapture::Record rec;
+  if (!FCGICapture::decode(reinterpret_cast<const char *>(data),size,rec))
+    return 0;
+  FCGIRequest req((std::shared_ptr<FCGX_Request>()));
+  if (req.parse(rec.params,rec.body))
+    req.json();
+  return 0;
+}
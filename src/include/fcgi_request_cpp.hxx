@@ -31,20 +31,53 @@
 
 #include <fcgiapp.h>
 #include <string>
+#include <cstring>
 #include <memory>
 #include <map>
 #include <vector>
 #include <mutex>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <deque>
+#include <condition_variable>
+#include <thread>
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#define FCGI_HAVE_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
 
 /**
  * @brief The FCGIData class represents a chunk of raw data
  * a std::string would suffice, but this allows seperation and
- * clear idnetification of binary data.  It is implemented as
- * a vector of chars with common operations stubbed out
+ * clear idnetification of binary data. It is a growable byte
+ * buffer: payloads up to INLINE_SIZE bytes are kept inside the
+ * object itself, larger ones on the heap, which grows geometrically.
+ * Resizing does not zero the new bytes, as they are nearly always
+ * about to be overwritten by a read or memcpy.
  */
 class FCGIData
 {
 public:
+  /**
+   * @brief INLINE_SIZE is the number of bytes held without a heap
+   * allocation, chosen to make the whole object 64 bytes
+   */
+  static const size_t INLINE_SIZE = 64 - 2 * sizeof(size_t) - sizeof(char *);
   /**
    * @brief FCGIData default constructor, called by all other
    * flavors of constructors which initializes all the data
@@ -57,7 +90,7 @@ public:
    * string passed in to the data vector internally
    * @param data - a reference to a std::string to copy
    */
-  FCGIData(std::string &data);
+  FCGIData(const std::string &data);
   /**
    * @brief FCGIData c-tor which copies sz bytes of the
    * passed in pointer into the internal data
@@ -65,6 +98,16 @@ public:
    * @param data the pointer to the data to copy in
    */
   FCGIData(const char *data,size_t sz);
+  FCGIData(const FCGIData &);
+  /**
+   * @brief FCGIData move c-tor takes over the heap buffer of the
+   * other object, which is left empty. Inline data is copied.
+   */
+  FCGIData(FCGIData &&) noexcept;
+  ~FCGIData();
+  FCGIData &operator=(const FCGIData &);
+  FCGIData &operator=(FCGIData &&) noexcept;
+  void swap(FCGIData &) noexcept;
   /**
    * @brief append adds the data contianed in the passed
    * in string into the internal data.  This is done in
@@ -72,7 +115,7 @@ public:
    * passed to memcpy()
    * @return true if successfull, false if not
    */
-  bool append(std::string &);
+  bool append(const std::string &);
   /**
    * @brief append adds the data contianed in the passed
    * in c string into the internal data.  This is not
@@ -80,30 +123,53 @@ public:
    * @return true if successfull, false if not
    */
   bool append(const char *);
+  /**
+   * @brief append adds sz bytes of the passed in pointer, binary safe
+   * @return true if successfull, false if not
+   */
+  bool append(const char *,size_t);
+  bool append(const FCGIData &);
   /**
    * @brief append adds a single character to the data
    * @return true if successfull, false if not
    */
-  bool append(char);
+  bool append(char c)
+  {
+    if (p_size == p_capacity && !grow(p_size + 1))
+      return false;
+    p_ptr[p_size++] = c;
+    return true;
+  }
   /**
    * @brief get_for_modify returns a non-const pointer
    * to the internal data
    * @return the internal pointer to the data
    */
-  char *get_for_modify() { return p_data.data(); }
+  char *get_for_modify() { return p_ptr; }
   /**
    * @brief get_for_modify returns a const pointer
    * to the internal data, should be ususal one called
    * to directly access the data
    * @return the internal pointer to the data
    */
-  const char *get() { return p_data.data(); }
+  const char *get() const { return p_ptr; }
   /**
    * @brief size returns the size of the internal data
    * structure.
    * @return the size of the data
    */
-  size_t size() { return p_data.size(); }
+  size_t size() const { return p_size; }
+  /**
+   * @brief capacity the number of bytes the data can grow to
+   * without reallocating
+   */
+  size_t capacity() const { return p_capacity; }
+  /**
+   * @brief reserve makes room for at least sz bytes, so appending up
+   * to that size does not reallocate
+   * @return true if successfull, false if out of memory
+   */
+  bool reserve(size_t sz);
   /**
    * @brief resizeTo resizes the internal data to
    * the passed in size. The data will be in an
@@ -116,28 +182,55 @@ public:
    * @brief at
    * @return returns the single byte at the position indicated
    */
-  char at(const size_t);
+  char at(const size_t) const;
   /**
    * @brief toStdString creates a std::String object with the
    * internal data copied to it and returns it. Binary safe
    * @return a std::string containing the data from this object
    */
-  std::string toStdString();
+  std::string toStdString() const;
   /**
    * @brief clear clears the internal data structure also setting
-   * the size to zero.
+   * the size to zero. The memory is kept for reuse, see release()
+   */
+  void clear() { p_size = 0; }
+  /**
+   * @brief release clears the data and frees its heap buffer
    */
-  void clear() { p_data.clear(); }
+  void release();
   /**
    * @brief empty checks if the size of the internal data is zero
    * @return true if empty, false if not
    */
-  bool empty() { return p_data.size() == 0; }
+  bool empty() const { return p_size == 0; }
+#if __cplusplus >= 201703L
+  /**
+   * @brief view the data as a string_view, valid until the data is
+   * next changed
+   */
+  std::string_view view() const { return std::string_view(p_ptr,p_size); }
+#endif
+#if __cplusplus >= 202002L
+  std::span<const char> span() const { return std::span<const char>(p_ptr,p_size); }
+  std::span<char> span() { return std::span<char>(p_ptr,p_size); }
+#endif
 
 private:
-  std::vector<char> p_data;
+  bool grow(size_t);
+  bool on_heap() const { return p_ptr != p_inline; }
+
+  char *p_ptr;
+  size_t p_size;
+  size_t p_capacity;
+  char p_inline[INLINE_SIZE];
 };
 
+/**
+ * @brief FCGIBlob is an immutable, reference counted FCGIData, for
+ * payloads built once and sent by many responses on any thread
+ */
+typedef std::shared_ptr<const FCGIData> FCGIBlob;
+
 /**
  * @brief The FCGIMultipartItem struct represents an item of
  * a multipart message. If it has an indicator of being
@@ -235,7 +328,7 @@ void setServerName(std::string);
  * setServerName, or else a blank string
  * @return
  */
-std::string serverName();
+const std::string &serverName();
 /**
  * @brief headerLine returns a line suitable for a reply
  * to a webserver indicating the status code
@@ -260,6 +353,122 @@ FCGIData base64Decode(std::string &);
 std::string base64Encode(FCGIData &);
 };
 
+/**
+ * @brief The FCGIRope class is a response body put together from
+ * segments which are written out as a gather list, so a page built
+ * from many fragments is not copied into one buffer first. Short
+ * fragments are copied into chunks the rope owns. Strings and data
+ * moved in, string literals and shared immutable blobs are referenced
+ * where they are.
+ */
+class FCGIRope
+{
+public:
+  /**
+   * @brief CHUNK_SIZE is the size of the chunks short fragments are
+   * copied into, longer ones get a chunk of their own
+   */
+  static const size_t CHUNK_SIZE = 4096;
+
+  enum Kind { OWNED, BORROWED, SHARED };
+  struct Segment
+  {
+    const char *data;
+    size_t len;
+    Kind kind;
+  };
+
+  FCGIRope();
+  FCGIRope(const FCGIRope &);
+  FCGIRope(FCGIRope &&) noexcept;
+  FCGIRope &operator=(const FCGIRope &);
+  FCGIRope &operator=(FCGIRope &&) noexcept;
+  /**
+   * @brief append copies the bytes into the rope
+   */
+  void append(const char *,size_t);
+  void append(const std::string &s) { append(s.data(),s.size()); }
+  /**
+   * @brief append takes over the string, which is not copied unless it
+   * is short
+   */
+  void append(std::string &&);
+  void append(FCGIData &&);
+  /**
+   * @brief append references a blob which is shared, ie among responses
+   * or with a cache. It must not be changed while the rope is alive.
+   */
+  void append(FCGIBlob);
+  /**
+   * @brief append_static references bytes without copying them, they
+   * must outlive the rope, as string literals do
+   */
+  void append_static(const char *,size_t);
+  void append_static(const char *s) { append_static(s,strlen(s)); }
+  /**
+   * @brief size the total number of bytes in the rope
+   */
+  size_t size() const { return p_size; }
+  bool empty() const { return p_size == 0; }
+  void clear();
+  const std::vector<Segment> &segments() const { return p_segments; }
+  /**
+   * @brief copy_to appends all of the bytes to out, ie for a cache
+   */
+  void copy_to(FCGIData &out) const;
+
+private:
+  void add_segment(const char *,size_t,Kind);
+
+  std::vector<Segment> p_segments;
+  // Owners of the OWNED segments, a deque so the data never moves
+  std::deque<FCGIData> p_chunks;
+  std::deque<std::string> p_strings;
+  std::vector<FCGIBlob> p_blobs;
+  // The chunk short fragments go to, npos if there is none
+  size_t p_tail;
+  size_t p_size;
+};
+
+/**
+ * @brief The FCGIHeaderTemplate class is a set of response headers
+ * rendered once, ie at startup for each kind of endpoint, together
+ * with the server name set at the time. A response it is attached to
+ * copies the rendered block as a whole, only the headers set on the
+ * response itself are rendered per response, replacing those of the
+ * same name in the template. It is immutable once built, so any
+ * number of threads may use it at once.
+ */
+class FCGIHeaderTemplate
+{
+public:
+  typedef std::vector<std::pair<std::string,std::string>> Headers;
+  /**
+   * @brief FCGIHeaderTemplate renders the headers, a later one of the
+   * same name replaces an earlier one. A Server header among them
+   * replaces the server name.
+   */
+  FCGIHeaderTemplate(const Headers &headers);
+  /**
+   * @brief block
+   * @return the rendered "Name: value\r\n" lines
+   */
+  const std::string &block() const { return p_block; }
+  bool has(const std::string &name) const;
+  void append_to(std::string &out,const std::map<std::string,std::string> &overrides) const;
+
+private:
+  // Where each line is in the block, and the length of its name
+  struct Line
+  {
+    size_t offset;
+    size_t len;
+    size_t nameLen;
+  };
+  std::string p_block;
+  std::vector<Line> p_lines;
+};
+
 /**
  * @brief The FCGIResponse class is the object responsible
  * for sending the response to the browser. It is tied
@@ -270,24 +479,650 @@ class FCGIResponse
 public:
   FCGIResponse(const FCGX_Request *);
   bool send();
+  /**
+   * @brief send_head writes the status line and headers without a
+   * Content-Length, followed by any data set so far, and flushes them
+   * without finishing the request. The rest of a streamed body is
+   * written through FCGIDeferred.
+   * @return true if written
+   */
+  bool send_head();
+  void serialize(FCGIData &);
+  static bool send_serialized(const FCGX_Request *,FCGIData &);
   void set_cookie(std::string name,std::string value);
   void set_header(std::string name,std::string value);
+  /**
+   * @brief set_template sends the headers of a template, the ones set
+   * with set_header() replace those of the same name in it. The
+   * template is not copied, it must outlive the response.
+   */
+  void set_template(const FCGIHeaderTemplate *t) { p_template = t; }
   FCGIData *dataPtr() { return &p_data; }
+  /**
+   * @brief rope the segmented body, which is sent after the data, for
+   * pages put together from many fragments without copying them
+   */
+  FCGIRope *rope() { return &p_rope; }
   int status() { return p_httpCode; }
   void set_status_code(int code) { p_httpCode = code; }
   void set_string(std::string &);
+  void set_string(std::string &&);
   void set_data(void *,size_t);
+  /**
+   * @brief set_data sets the response data to a shared blob, which is
+   * sent from where it is, with no copy or allocation per response
+   */
+  void set_data(FCGIBlob);
   void set_c_string(const char *);
   void read_local_file(std::string);
 
 private:
+  void header_block(std::string &out,bool length = true);
+  bool put_body(const std::string &header);
+  size_t body_size();
+  void clear_body();
+
   int p_httpCode;
   std::map<std::string,std::string> p_headers;
   std::map<std::string,std::string> p_cookies;
   FCGIData p_data;
+  FCGIBlob p_blob;
+  FCGIRope p_rope;
+  const FCGIHeaderTemplate *p_template;
   const FCGX_Request *p_fcgiHandle;
 };
 
+/**
+ * @brief The FCGIRequestTimes struct holds monotonic timestamps of
+ * the stages a request goes through. Stages not reached are left at
+ * the epoch of the clock.
+ */
+struct FCGIRequestTimes
+{
+  typedef std::chrono::steady_clock::time_point Time;
+  // The web server began the request (libfcgi mode: it was accepted)
+  Time begin;
+  // The request was read in full
+  Time received;
+  // parse() is done and the request went to the queue
+  Time parsed;
+  // nextRequest() handed it out
+  Time dequeued;
+  // The response started to be sent
+  Time responded;
+  // The response was sent and the request finished
+  Time finished;
+  size_t bytesIn = 0;
+  size_t bytesOut = 0;
+  int status = 0;
+};
+
+/**
+ * @brief The FCGIHistogram class counts latencies in microseconds
+ * into log linear buckets, eight per power of two so values are kept
+ * within 12.5%, in the manner of HdrHistogram. One thread records
+ * while others may read it, without locks.
+ */
+class FCGIHistogram
+{
+public:
+  enum {
+    SUB_BUCKETS = 8,
+    BUCKETS = 8 + 61 * 8
+  };
+  FCGIHistogram();
+  void record(uint64_t usec);
+  void add_to(std::vector<uint64_t> &counts) const;
+  static size_t bucket(uint64_t usec);
+  static uint64_t bucket_value(size_t idx);
+  static uint64_t percentile(const std::vector<uint64_t> &counts,double pct);
+
+private:
+  std::atomic<uint64_t> p_counts[BUCKETS];
+};
+
+/**
+ * @brief The FCGIStats class aggregates the stage timings and byte
+ * counts of finished requests. Every recording thread gets histograms
+ * of its own, so recording takes no locks, and snapshot() merges them.
+ */
+class FCGIStats
+{
+public:
+  enum Stage {
+    RECEIVE,
+    PARSE,
+    QUEUE,
+    HANDLER,
+    SEND,
+    TOTAL,
+    STAGES
+  };
+  // Latencies are in microseconds
+  struct StageSnapshot
+  {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+    double mean;
+    std::vector<uint64_t> buckets;
+  };
+  struct Snapshot
+  {
+    StageSnapshot stages[STAGES];
+    uint64_t requests;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t parseErrors;
+    // Responses by status code, codes never sent are left out
+    std::map<int,uint64_t> statuses;
+    // Since the statistics were started, and requests per second over it
+    double seconds;
+    double throughput;
+  };
+
+  FCGIStats();
+  void record(const FCGIRequestTimes &);
+  void record_parse_error();
+  Snapshot snapshot();
+  static const char *stage_name(Stage);
+  static bool stage_usec(const FCGIRequestTimes &,Stage,uint64_t &usec);
+
+private:
+  struct Shard
+  {
+    FCGIHistogram hist[STAGES];
+    std::atomic<uint64_t> sum[STAGES];
+    std::atomic<uint64_t> max[STAGES];
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> parseErrors;
+    std::atomic<uint64_t> statuses[600];
+  };
+  Shard *local();
+
+  uint64_t p_id;
+  std::chrono::steady_clock::time_point p_started;
+  // Only taken to add a shard and to take a snapshot
+  std::mutex p_mutex;
+  std::vector<std::unique_ptr<Shard>> p_shards;
+};
+
+/**
+ * @brief The FCGIAccessLog class writes an access log line per request
+ * without ever blocking the thread answering it. Each thread logging
+ * gets a fixed size ring of its own, which a background thread empties
+ * in batches with writev(). Entries finding their ring full are dropped
+ * and counted, and sampling keeps only one in every n requests.
+ */
+class FCGIAccessLog
+{
+public:
+  /**
+   * @brief The Entry struct is one log line, fixed size so the rings
+   * never allocate. Longer uris are cut short.
+   */
+  struct Entry
+  {
+    // Microseconds since the Unix epoch
+    int64_t time;
+    char method[8];
+    char uri[256];
+    int status;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    // Stage latencies in microseconds, see FCGIStats::Stage
+    uint32_t usec[FCGIStats::STAGES];
+  };
+
+  FCGIAccessLog(std::string path);
+  FCGIAccessLog(int fd);
+  ~FCGIAccessLog();
+  bool start();
+  void stop();
+  /**
+   * @brief set_json writes JSON lines instead of space separated text
+   */
+  void set_json(bool b) { p_json = b; }
+  /**
+   * @brief set_sample_rate logs one in every n requests of each thread,
+   * the default of 1 logs them all
+   */
+  void set_sample_rate(unsigned n) { p_sampleRate = n ? n : 1; }
+  /**
+   * @brief set_ring_size sets the entries buffered per thread, rounded up
+   * to a power of two. Only rings created afterwards are affected.
+   */
+  void set_ring_size(size_t n) { p_ringSize = n; }
+  void set_flush_interval(std::chrono::milliseconds t) { p_flushInterval = t; }
+  /**
+   * @brief reopen has the writer reopen the log file before its next
+   * batch, for log rotation. It is safe to call from a signal handler.
+   */
+  void reopen() { p_reopen = true; }
+  bool log(const Entry &);
+  bool log(const FCGIRequestTimes &,const std::string &method,const std::string &uri);
+  uint64_t written() { return p_written; }
+  uint64_t dropped();
+  /**
+   * @brief write_failed
+   * @return the entries taken from the rings which could not be written
+   */
+  uint64_t write_failed() { return p_writeFailed; }
+  uint64_t sampled_out();
+  bool has_error();
+  const std::string error_string();
+
+private:
+  struct Ring
+  {
+    std::vector<Entry> slots;
+    size_t mask = 0;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> sampledOut;
+    // Only touched by the owning thread
+    unsigned sampleCount = 0;
+  };
+  Ring *local();
+  bool open_file();
+  void thr_writer();
+  size_t flush();
+  void format(const Entry &,std::string &);
+  void set_error(const std::string &);
+
+  uint64_t p_id;
+  std::string p_path;
+  int p_fd;
+  bool p_ownFd;
+  bool p_json;
+  unsigned p_sampleRate;
+  size_t p_ringSize;
+  std::chrono::milliseconds p_flushInterval;
+  std::atomic<bool> p_reopen;
+  std::atomic<bool> p_stopFlag;
+  std::atomic<uint64_t> p_written;
+  std::atomic<uint64_t> p_writeFailed;
+  // Set by the writer, guarded by p_mutex
+  std::string p_errorString;
+  std::thread p_writer;
+  // Taken to add a ring, by the writer, to wake the writer and for the error
+  std::mutex p_mutex;
+  std::condition_variable p_cond;
+  std::vector<std::unique_ptr<Ring>> p_rings;
+};
+
+class FCGIRequest;
+
+/**
+ * @brief The FCGIRouter class dispatches requests to handlers by method
+ * and path. Routes are compiled into a radix tree as they are added, and
+ * a path is matched against it in a single pass without allocating. A
+ * route is made of static text, ":name" segments capturing up to the
+ * next "/" and a final "*name" segment capturing the rest of the path,
+ * ie "/users/:id" or "/static/" followed by "*file". Static text is
+ * preferred over a capture, and a capture over the rest of the path.
+ * HEAD is served by the GET handler unless it has one of its own.
+ */
+class FCGIRouter
+{
+public:
+  enum Method { GET, HEAD, POST, PUT, DELETE, PATCH, OPTIONS, ANY, METHOD_COUNT };
+  /**
+   * @brief MAX_PARAMS is the most captures a route may have
+   */
+  static const size_t MAX_PARAMS = 8;
+
+  /**
+   * @brief The Match struct is what a path matched, the captures point
+   * into the route and the path, which must outlive it
+   */
+  struct Match
+  {
+    struct Param
+    {
+      const char *name;
+      size_t nameLen;
+      const char *value;
+      size_t len;
+    };
+    Param params[MAX_PARAMS];
+    size_t count = 0;
+    // Methods with a handler, when only the method did not match
+    unsigned allowed = 0;
+    /**
+     * @brief param copies out a capture
+     * @return the captured value, empty if there is no such capture
+     */
+    std::string param(const std::string &name) const;
+#if __cplusplus >= 201703L
+    std::string_view view(std::string_view name) const;
+#endif
+  };
+
+  typedef std::function<void(FCGIRequest &,const Match &)> Handler;
+
+  FCGIRouter();
+  ~FCGIRouter();
+  /**
+   * @brief add registers a handler for a method and route. ANY serves
+   * methods without a handler of their own.
+   * @return true if added, false and sets the error string if the route
+   * is malformed or its captures clash with an existing route
+   */
+  bool add(Method,const std::string &route,Handler);
+  /**
+   * @brief match looks up the handler for a method and path
+   * @param m receives the captures
+   * @return the handler, nullptr if none matched
+   */
+  const Handler *match(Method,const char *path,size_t len,Match &m) const;
+  /**
+   * @brief dispatch runs the handler matching the request. With no match
+   * the not found handler runs if there is one, otherwise the request is
+   * answered 404, or 405 when the path has handlers for other methods.
+   * @return true if a route matched
+   */
+  bool dispatch(FCGIRequest &) const;
+  void set_not_found(Handler h) { p_notFound = h; }
+  static Method method_from(const std::string &);
+  static const char *method_name(Method);
+  size_t routes() { return p_routes; }
+  bool has_error() { return (p_errorString.length() > 0); }
+  const std::string error_string() { return p_errorString; }
+
+private:
+  struct Node;
+  static const Handler *pick(const Node *,Method);
+  static const Handler *match_node(const Node *,const char *p,const char *ep,Method,Match &);
+
+  std::unique_ptr<Node> p_root;
+  Handler p_notFound;
+  size_t p_routes;
+  std::string p_errorString;
+};
+
+/**
+ * @brief The FCGIJson class is a parsed JSON document, a read only view
+ * over the text it was parsed from, which it does not copy. Parsing is
+ * done in two stages: the first finds the structural characters of 64
+ * bytes at a time with bit masks, SSE2 where available, keeping track of
+ * escapes and strings without looking at every character on its own. The
+ * second walks only those positions and builds a flat tape of nodes, a
+ * container node knowing where the node after it is, so lookups skip
+ * whole subtrees. Strings are only unescaped when asked for.
+ * The text must outlive the document and its values.
+ */
+class FCGIJson
+{
+public:
+  enum Type
+  {
+    NUL,
+    BOOL,
+    NUMBER,
+    STRING,
+    ARRAY,
+    OBJECT
+  };
+  /**
+   * @brief MAX_DEPTH is the deepest nesting of arrays and objects parsed
+   */
+  static const size_t MAX_DEPTH = 1024;
+
+  /**
+   * @brief The Value class is a node of the document, cheap to copy. A
+   * missing member or element is an invalid value, whose accessors return
+   * their defaults, so lookups can be chained.
+   */
+  class Value
+  {
+  public:
+    Value(): p_doc(nullptr), p_node(0), p_end(0) {}
+    bool valid() const { return p_doc != nullptr; }
+    Type type() const;
+    bool is_null() const { return valid() && type() == NUL; }
+    bool is_bool() const { return valid() && type() == BOOL; }
+    bool is_number() const { return valid() && type() == NUMBER; }
+    bool is_string() const { return valid() && type() == STRING; }
+    bool is_array() const { return valid() && type() == ARRAY; }
+    bool is_object() const { return valid() && type() == OBJECT; }
+    /**
+     * @brief size
+     * @return the number of elements of an array or members of an object,
+     * 0 for anything else
+     */
+    size_t size() const;
+    /**
+     * @brief operator [] looks up a member of an object, the first one if
+     * the name is used more than once
+     */
+    Value operator[](const char *name) const { return member(name,strlen(name)); }
+    Value operator[](const std::string &name) const { return member(name.data(),name.size()); }
+    Value member(const char *name,size_t len) const;
+    /**
+     * @brief operator [] gets an element of an array, or the value of a
+     * member of an object by its position
+     */
+    Value operator[](size_t i) const;
+    Value operator[](int i) const { return (i < 0) ? Value() : (*this)[(size_t)i]; }
+    /**
+     * @brief first the first element or member value, with next() to go
+     * through them all
+     */
+    Value first() const;
+    Value next() const;
+    /**
+     * @brief name the name of an object member, when the value was got
+     * from first() or next() on an object
+     */
+    std::string name() const;
+    bool as_bool(bool def = false) const;
+    int64_t as_int64(int64_t def = 0) const;
+    double as_double(double def = 0) const;
+    /**
+     * @brief as_string the unescaped string, or the text of a number
+     */
+    std::string as_string(const std::string &def = std::string()) const;
+    /**
+     * @brief raw points at the text of the value in the document, a
+     * string without its quotes and still escaped
+     */
+    const char *raw() const;
+    size_t raw_size() const;
+#if __cplusplus >= 201703L
+    std::string_view raw_view() const { return std::string_view(raw(),raw_size()); }
+#endif
+
+  private:
+    friend class FCGIJson;
+    Value(const FCGIJson *doc,uint32_t node,uint32_t end): p_doc(doc), p_node(node), p_end(end) {}
+
+    const FCGIJson *p_doc;
+    uint32_t p_node;
+    // The end of the array or object the value is in
+    uint32_t p_end;
+  };
+
+  FCGIJson();
+  /**
+   * @brief parse parses the text, which has to stay as it is for as long as
+   * the document is used
+   * @return true if it is valid JSON, false and sets the error string if not
+   */
+  bool parse(const char *text,size_t len);
+  /**
+   * @brief root
+   * @return the top level value, invalid if the text did not parse
+   */
+  Value root() const { return p_nodes.empty() ? Value() : Value(this,0,p_nodes.size()); }
+  Value operator[](const char *name) const { return root()[name]; }
+  Value operator[](const std::string &name) const { return root()[name]; }
+  /**
+   * @brief text
+   * @return the text the document was parsed from
+   */
+  const char *text() const { return p_text; }
+  bool has_error() const { return (p_errorString.length() > 0); }
+  const std::string error_string() const { return p_errorString; }
+
+private:
+  friend class FCGIRequest;
+  struct Node
+  {
+    uint8_t type;
+    // Where the text of the value starts and its length, brackets and
+    // all for a container
+    uint32_t offset;
+    uint32_t length;
+    // The node after this one and all nodes inside it
+    uint32_t next;
+    // The number of elements or members of a container
+    uint32_t count;
+  };
+  bool index();
+  bool build();
+  bool fail(size_t offset,const char *what);
+
+  const char *p_text;
+  size_t p_size;
+  // The offsets of the structural characters, of the start of scalars and
+  // of both quotes of strings, found by the first stage
+  std::vector<uint32_t> p_index;
+  std::vector<Node> p_nodes;
+  std::string p_errorString;
+};
+
+/**
+ * @brief The FCGILimits class bounds what a single request may send. The
+ * listener checks them while the CGI variables arrive and before any of the
+ * body is buffered, and answers a request over them 431 (too many or too
+ * large variables) or 413 (body, multipart parts or an uploaded file too
+ * large) itself, so it never reaches the queue. Limits set for a path prefix
+ * replace the default ones for the requests under it, the longest matching
+ * prefix wins. Zero turns a limit off. Set them all up before the listener
+ * is started, they are not locked.
+ */
+class FCGILimits
+{
+public:
+  struct Limits
+  {
+    Limits();
+    // Bytes of body, by CONTENT_LENGTH as well as by what arrives
+    uint64_t maxBody;
+    // CGI variables, the HTTP_ headers among them
+    size_t maxParams;
+    // Bytes of all CGI variables, names and values
+    size_t maxHeaderBytes;
+    // Parts of a multipart body
+    size_t maxParts;
+    // Bytes of a single uploaded file of a multipart body
+    uint64_t maxFileSize;
+  };
+
+  FCGILimits() {}
+  /**
+   * @brief set sets the default limits
+   */
+  void set(const Limits &l);
+  /**
+   * @brief set sets the limits of the requests whose SCRIPT_NAME followed by
+   * PATH_INFO starts with the prefix, ie "/upload/"
+   */
+  void set(const std::string &prefix,const Limits &l);
+  const Limits &defaults() const { return p_default; }
+  /**
+   * @brief loosest is the largest of each limit over all the prefixes and the
+   * default, what a request is held to before its path is known
+   */
+  const Limits &loosest() const { return p_loosest; }
+  const Limits &lookup(const char *script,size_t scriptLen,const char *pathInfo,size_t pathInfoLen) const;
+  /**
+   * @brief check_params checks the CGI variables of a request
+   * @return 0 if within the limits, else the status to answer it with
+   */
+  static int check_params(const Limits &,size_t count,size_t bytes);
+
+private:
+  void update_loosest();
+
+  Limits p_default;
+  Limits p_loosest;
+  // Longest first, so the first match is the one
+  std::vector<std::pair<std::string,Limits>> p_prefixes;
+};
+
+/**
+ * @brief The FCGIRateLimiter class is a token bucket per client, the client
+ * told apart by REMOTE_ADDR, a header or a cookie. The listener asks it once
+ * the CGI variables of a request are in, before its body is read, and
+ * answers a client out of tokens 429 with Retry-After itself. Buckets are
+ * refilled by arithmetic on the time passed when they are looked at, there
+ * are no timers. The table is a fixed array of slots in groups of a cache
+ * line, updated with compare and swap only. A bucket left alone long enough
+ * to be full again is as good as new, so its slot is taken over by another
+ * client; a client finding its group full of busy buckets is let through
+ * untracked.
+ */
+class FCGIRateLimiter
+{
+public:
+  enum Key { REMOTE_ADDR, HEADER, COOKIE };
+  struct Stats
+  {
+    uint64_t allowed;
+    uint64_t limited;
+    uint64_t untracked;
+  };
+
+  /**
+   * @brief FCGIRateLimiter
+   * @param rate the tokens a client gets back per second, one per request
+   * @param burst the most tokens a client holds, up to 65535
+   * @param slots the clients tracked at most, rounded up to a power of two
+   */
+  FCGIRateLimiter(double rate,double burst,size_t slots = 65536);
+  /**
+   * @brief set_key selects what a client is told apart by, REMOTE_ADDR by
+   * default. A header is named as sent, ie "X-Api-Key", or as its CGI
+   * variable. Requests without it are not limited. Set it up before the
+   * listener is started.
+   */
+  void set_key(Key k,std::string name = std::string());
+  bool admit(const char *key,size_t len,uint32_t &retryAfter);
+  bool admit(const char *const *envp,uint32_t &retryAfter);
+  Stats stats() const;
+
+private:
+  struct Slot
+  {
+    std::atomic<uint64_t> tag;
+    // Milliseconds since the limiter started in the top 40 bits, tokens in
+    // 1/256ths in the low 24
+    std::atomic<uint64_t> state;
+  };
+  uint64_t now_ms() const;
+
+  std::unique_ptr<Slot[]> p_slots;
+  size_t p_groupMask;
+  double p_rate;
+  uint64_t p_burst;
+  // The refill of a millisecond, in 1/256ths of a token
+  double p_perMs;
+  // NAME= of the variable the key is in, and the cookie in it if any
+  std::string p_var;
+  std::string p_cookie;
+  std::chrono::steady_clock::time_point p_started;
+  std::atomic<uint64_t> p_allowed;
+  std::atomic<uint64_t> p_limited;
+  std::atomic<uint64_t> p_untracked;
+};
+
 /**
  * @brief The FCGIRequest class is the heart of
  * this project. The FCGIListener class creates
@@ -297,6 +1132,26 @@ private:
 class FCGIRequest
 {
 public:
+  /**
+   * @brief The Var enum names the CGI variables and request headers
+   * which get a slot of their own as the request is parsed, so reading
+   * them is an array access rather than a lookup by name
+   */
+  enum Var
+  {
+    SCRIPT_NAME, PATH_INFO, QUERY_STRING, REQUEST_METHOD, REQUEST_URI,
+    CONTENT_LENGTH, CONTENT_TYPE, SERVER_PROTOCOL, REMOTE_ADDR, REMOTE_PORT,
+    REMOTE_USER, SERVER_NAME, SERVER_PORT, SERVER_ADDR, SERVER_SOFTWARE,
+    GATEWAY_INTERFACE, DOCUMENT_ROOT, DOCUMENT_URI, SCRIPT_FILENAME,
+    PATH_TRANSLATED, REQUEST_SCHEME, HTTPS, AUTH_TYPE, HTTP_HOST, HTTP_COOKIE,
+    HTTP_USER_AGENT, HTTP_ACCEPT, HTTP_ACCEPT_ENCODING, HTTP_ACCEPT_LANGUAGE,
+    HTTP_AUTHORIZATION, HTTP_CONNECTION, HTTP_CACHE_CONTROL, HTTP_REFERER,
+    HTTP_ORIGIN, HTTP_IF_NONE_MATCH, HTTP_IF_MODIFIED_SINCE,
+    HTTP_X_FORWARDED_FOR, HTTP_X_FORWARDED_PROTO, HTTP_X_REAL_IP,
+    HTTP_X_REQUEST_ID, HTTP_CONTENT_TYPE, HTTP_CONTENT_LENGTH, HTTP_UPGRADE,
+    HTTP_RANGE, VAR_COUNT
+  };
+
   /**
    *@brief Default c-tor, with the copyable object type
    * std::shared_ptr which allows usage in a STL object
@@ -315,10 +1170,25 @@ public:
   /**
    * @brief parse Parses the request and fills all of the
    * appropriate data structures with the data retrieved.
+   * @param limits the limits to hold it to, checked before the body is
+   * read, or nullptr for none
    * @return true if parsing was successfull, flase if not
-   * and not added to the request queue
+   * and not added to the request queue, see rejected()
+   */
+  bool parse(const FCGILimits *limits = nullptr);
+  /**
+   * @brief parse parses a request from its CGI variables and body instead
+   * of the FastCGI connection, ie to replay one recorded by FCGICapture
+   * @param params the CGI variables
+   * @param body the request body, at least CONTENT_LENGTH bytes
+   * @return true if parsing was successfull, false if the body is short
+   */
+  bool parse(const std::map<std::string,std::string> &params,FCGIData body);
+  /**
+   * @brief rejected tells why parse() refused a request over its limits
+   * @return the status to answer it with, 400, 413 or 431, 0 if it was not
    */
-  bool parse();
+  int rejected() const { return p_rejected; }
   /**
    * @brief debug_dump for debugging of the library, shows
    * the data contained in the request after parsing.
@@ -332,11 +1202,45 @@ public:
    * invalid on this objects destruction.
    */
   const FCGX_Request *FCGXHandle() { return p_fcgiHandle.get(); }
+  /**
+   * @brief valid
+   * @return false for the empty request FCGIListener::nextRequest()
+   * returns once the listener was stopped and its queue ran dry
+   */
+  bool valid() { return (p_fcgiHandle != nullptr); }
+  /**
+   * @brief attach keeps an object alive for as long as any copy of the
+   * request exists, FCGIListener uses it to learn when a request is done
+   */
+  void attach(std::shared_ptr<void> o) { p_attached = o; }
+  /**
+   * @brief deferred tells if an FCGIDeferred took over answering the
+   * request
+   */
+  bool deferred() { return p_deferred; }
+  /**
+   * @brief times
+   * @return the timestamps of the stages the request went through so
+   * far, all unset for requests not received by an FCGIListener
+   */
+  FCGIRequestTimes times();
+  /**
+   * @brief deadline
+   * @return when the request has to be answered by, set by the total
+   * deadline of the listener, unset (the epoch of the clock) without one
+   */
+  FCGIRequestTimes::Time deadline();
   /**
    * @brief uri
    * @return The url string of the request, ie /myapp/x/y/z
    */
   const std::string uri() { return p_uri; }
+  /**
+   * @brief path
+   * @return SCRIPT_NAME followed by PATH_INFO, the path FCGIRouter
+   * matches, by reference so it is not copied
+   */
+  const std::string &path() const { return p_path; }
   /**
    * @brief query_string
    * @return The part of the URL that comes after the "?"
@@ -349,6 +1253,36 @@ public:
    * @return The method used, ie GET POST DELETE etc..
    */
   const std::string method() { return p_method; }
+  /**
+   * @brief method_id
+   * @return the method, FCGIRouter::METHOD_COUNT for one the router does
+   * not know
+   */
+  FCGIRouter::Method method_id() const { return p_methodId; }
+  /**
+   * @brief content_length
+   * @return CONTENT_LENGTH as a number, 0 if it was not passed
+   */
+  uint64_t content_length() const { return p_contentLength; }
+  /**
+   * @brief var gets a well known CGI variable or header from its slot
+   * @return the value, an empty string if the web server did not pass it
+   */
+  const std::string &var(Var v) const;
+  bool hasVar(Var v) const { return ((unsigned)v < VAR_COUNT && p_varIndex[v] != 0); }
+  /**
+   * @brief var_from finds the slot of a variable name with a perfect hash
+   * @return the slot, VAR_COUNT if the name has none
+   */
+  static Var var_from(const char *name,size_t len);
+  static const char *var_name(Var v);
+  /**
+   * @brief aborted checks if the web server aborted the request, ie the
+   * client went away. Only known in event loop mode, a handler doing a lot
+   * of work may check it to stop early
+   * @return true if aborted, false if not or unknown
+   */
+  bool aborted();
 
   /**
    * @brief hasEnv checks if "name" exists in the environment
@@ -390,12 +1324,38 @@ public:
   FCGIMultipartItem file(std::string);
   const std::map<std::string,FCGIMultipartItem> *allFiles();
   FCGIData *postData();
+  /**
+   * @brief isJson tells if the body is JSON by its CONTENT_TYPE, ie
+   * application/json or a type ending in +json
+   */
+  bool isJson();
+  /**
+   * @brief json parses the body as JSON the first time it is called, in
+   * place in postData() without copying it. The document is only valid as
+   * long as the request, ask has_error() if the body was not valid JSON,
+   * or not JSON at all by its CONTENT_TYPE.
+   * @return the parsed body
+   */
+  const FCGIJson &json();
 
 protected:
-  std::vector<struct FCGIMultipartItem> parseMultipart(std::string boundary,FCGIData data);
+  std::vector<struct FCGIMultipartItem> parseMultipart(std::string boundary,const FCGIData &data,const FCGILimits::Limits *limits = nullptr);
+  void add_param(const char *key,size_t keyLen,const char *val,size_t valLen);
+  void index_params();
+  void decode(const FCGILimits::Limits *limits = nullptr);
 
 private:
+  friend class FCGIDeferred;
+
   std::shared_ptr<FCGX_Request> p_fcgiHandle;
+  std::shared_ptr<void> p_attached;
+  // The CGI variables in the order they came, the maps of them are only
+  // built when asked for
+  std::vector<std::pair<std::string,std::string>> p_params;
+  // One past the index in p_params of each well known variable, 0 if it
+  // was not passed
+  uint32_t p_varIndex[VAR_COUNT];
+  bool p_indexed;
   std::map<std::string,std::string> p_envp;
   std::map<std::string,std::string> p_headers;
   std::map<std::string,std::string> p_cookies;
@@ -403,23 +1363,370 @@ private:
   std::map<std::string,std::string> p_queryfields;
   std::map<std::string,FCGIMultipartItem> p_files;
   FCGIData p_postdata;
+  // Parsed by json() on first use, a copy of the request has a body of its
+  // own and parses it again
+  std::shared_ptr<FCGIJson> p_json;
   std::string p_uri;
+  std::string p_path;
   std::string p_query_string;
   std::string p_method;
+  FCGIRouter::Method p_methodId;
+  uint64_t p_contentLength;
+  int p_rejected;
+  bool p_deferred;
 };
 
 /**
- * @brief The FCGIListener class
- * This class should be application global and provides
- * the FastCGI listening, initialization, and an event loop
- * which then creates FCGIRequest objects to hand off from
- * an internal queue for processing.
+ * @brief The FCGIDeferred class is a handle on a request which is answered
+ * later, ie a long poll completed when there is news, or server-sent events
+ * streamed as they happen. The handler takes one and returns, the request
+ * is parked until it is completed or finished from any thread. A parked
+ * request only holds on to its connection and a small struct, its input
+ * and buffers are freed. Copies share the request. When the last one goes
+ * away unanswered the request is ended with what was written.
  */
-class FCGIListener
+class FCGIDeferred
 {
 public:
-  FCGIListener();
-  FCGIListener(std::string listenerPath);
+  FCGIDeferred() {}
+  explicit FCGIDeferred(FCGIRequest &);
+  bool valid() const { return (bool)p_state; }
+  /**
+   * @brief FCGXHandle the handle for a response to complete() with
+   */
+  const FCGX_Request *FCGXHandle();
+  /**
+   * @brief complete sends the response and finishes the request
+   * @param resp a response made with FCGXHandle()
+   * @return true if sent, false if the request was already answered or
+   * the connection failed
+   */
+  bool complete(FCGIResponse &resp);
+  /**
+   * @brief begin starts a streamed response with FCGIResponse::send_head(),
+   * its body is written with write() and ended with finish(). For events
+   * set "Content-Type: text/event-stream", and "X-Accel-Buffering: no"
+   * behind nginx.
+   */
+  bool begin(FCGIResponse &resp);
+  /**
+   * @brief write writes and flushes a piece of a streamed body
+   * @return true if written, false if not streaming or the connection failed
+   */
+  bool write(const char *,size_t);
+  bool write(const std::string &s) { return write(s.data(),s.size()); }
+  /**
+   * @brief write_event writes a server-sent event, each line of the data
+   * as a "data:" field
+   * @param data the data
+   * @param event the event type, none if empty
+   * @param id the event id, none if empty
+   */
+  bool write_event(const std::string &data,const std::string &event = std::string(),const std::string &id = std::string());
+  /**
+   * @brief finish ends a streamed response
+   * @return true if ended, false if already done or the connection failed
+   */
+  bool finish();
+  /**
+   * @brief done tells if the request was answered
+   */
+  bool done();
+  /**
+   * @brief aborted tells if the web server gave up on the request, ie as
+   * the client went away, there is no point writing any more
+   */
+  bool aborted();
+
+private:
+  struct State;
+  std::shared_ptr<State> p_state;
+};
+
+/**
+ * @brief The FCGICapture class records the CGI variables and body of
+ * sampled requests to a file, to be replayed through the parser offline
+ * with FCGIRequest::parse(params,body) for profiling, or used as a fuzz
+ * corpus. The file starts with the 8 byte magic "FCGICAP1", followed by
+ * a record per request: its length as 4 bytes big endian, the length of
+ * the variables the same way, the variables in FastCGI name-value pair
+ * encoding, and the body up to the end of the record.
+ */
+class FCGICapture
+{
+public:
+  struct Record
+  {
+    std::map<std::string,std::string> params;
+    FCGIData body;
+  };
+
+  FCGICapture(std::string path);
+  ~FCGICapture();
+  bool open();
+  void close();
+  /**
+   * @brief set_sample_rate records one in every n requests, the default
+   * of 1 records them all
+   */
+  void set_sample_rate(unsigned n) { p_sampleRate = n ? n : 1; }
+  /**
+   * @brief set_max_records stops recording after n requests, 0 (the
+   * default) records on until close()
+   */
+  void set_max_records(uint64_t n) { p_maxRecords = n; }
+  /**
+   * @brief set_max_body leaves out requests with a larger body, so a few
+   * uploads do not fill the disk. The default is 16 MB.
+   */
+  void set_max_body(size_t n) { p_maxBody = n; }
+  bool capture(FCGIRequest &);
+  uint64_t captured() { return p_captured; }
+  static void encode(const std::map<std::string,std::string> &params,const char *body,size_t len,std::string &out);
+  static bool decode(const char *data,size_t len,Record &rec);
+  static bool read_file(const std::string &path,std::vector<Record> &records,std::string &error);
+  bool has_error() { return (p_errorString.length() > 0); }
+  const std::string error_string() { return p_errorString; }
+
+private:
+  std::string p_path;
+  int p_fd;
+  unsigned p_sampleRate;
+  uint64_t p_maxRecords;
+  size_t p_maxBody;
+  std::atomic<uint64_t> p_seen;
+  std::atomic<uint64_t> p_captured;
+  std::mutex p_mutex;
+  std::string p_errorString;
+};
+
+/**
+ * @brief The FCGICoalescer class collapses identical concurrent
+ * requests into a single run of a handler ("single flight"). The
+ * first request for a key runs the handler, requests for the same
+ * key arriving meanwhile are parked without holding a thread, and
+ * the rendered response is written to all of them once it is ready.
+ * With a time to live the rendered response is also cached, and with
+ * a stale window an expired copy keeps being served while a single
+ * request revalidates it.
+ */
+class FCGICoalescer
+{
+public:
+  /**
+   * @brief Handler fills in the response for a request, it must not
+   * call FCGIResponse::send() itself, the coalescer does that
+   */
+  typedef std::function<void(FCGIRequest &,FCGIResponse &)> Handler;
+  /**
+   * @brief KeyFunction computes the cache key of a request, an empty
+   * key means the request is not coalesced and always runs the handler
+   */
+  typedef std::function<std::string(FCGIRequest &)> KeyFunction;
+
+  FCGICoalescer(Handler);
+  bool dispatch(FCGIRequest &);
+  void set_key_function(KeyFunction f) { p_keyFunc = f; }
+  void set_ttl(std::chrono::milliseconds t) { p_ttl = t; }
+  void set_stale_while_revalidate(std::chrono::milliseconds t) { p_staleWindow = t; }
+  void set_max_entries(size_t n) { p_maxEntries = n; }
+  void invalidate(std::string key);
+  void clear();
+  size_t handler_calls() const { return p_handlerCalls.load(std::memory_order_relaxed); }
+  size_t coalesced_calls() const { return p_coalescedCalls.load(std::memory_order_relaxed); }
+  size_t cache_hits() const { return p_cacheHits.load(std::memory_order_relaxed); }
+  static std::string default_key(FCGIRequest &);
+
+private:
+  struct Entry
+  {
+    bool inFlight = false;
+    std::vector<FCGIRequest> waiters;
+    std::shared_ptr<FCGIData> response;
+    std::chrono::steady_clock::time_point expires;
+  };
+  void prune(std::chrono::steady_clock::time_point now);
+
+  Handler p_handler;
+  KeyFunction p_keyFunc;
+  std::chrono::milliseconds p_ttl;
+  std::chrono::milliseconds p_staleWindow;
+  size_t p_maxEntries;
+  std::atomic<size_t> p_handlerCalls;
+  std::atomic<size_t> p_coalescedCalls;
+  std::atomic<size_t> p_cacheHits;
+  std::unordered_map<std::string,Entry> p_entries;
+  std::mutex p_mutex;
+};
+
+/**
+ * @brief The FCGITimerWheel class is a hierarchical timing wheel, four
+ * levels of 64 slots, which keeps any number of timers at a constant
+ * cost to schedule, cancel and fire. Its ticks are whatever the owner
+ * counts in, seconds or milliseconds, and it only moves when advance()
+ * is called. Timers are intrusive, embedded in the objects they belong
+ * to, so the wheel never allocates. It takes no locks of its own.
+ */
+class FCGITimerWheel
+{
+public:
+  enum {
+    SLOT_BITS = 6,
+    SLOTS = 1 << SLOT_BITS,
+    LEVELS = 4
+  };
+  /**
+   * @brief The Timer struct is a node of the wheel. It must be cancelled
+   * before it is destroyed, unless it fired.
+   */
+  struct Timer
+  {
+    // The tick it fires at
+    uint64_t expires = 0;
+    // Left to the owner, ie the object it is embedded in
+    void *data = nullptr;
+    bool scheduled() const { return (slot != nullptr); }
+
+  private:
+    friend class FCGITimerWheel;
+    Timer *prev = nullptr;
+    Timer *next = nullptr;
+    Timer **slot = nullptr;
+    int level = 0;
+  };
+
+  FCGITimerWheel(uint64_t now = 0);
+  FCGITimerWheel(const FCGITimerWheel &) = delete;
+  FCGITimerWheel &operator=(const FCGITimerWheel &) = delete;
+  void schedule(Timer *,uint64_t expires);
+  void cancel(Timer *);
+  void advance(uint64_t to,std::vector<Timer *> &expired);
+  uint64_t next_wakeup() const;
+  void clear();
+  /**
+   * @brief now
+   * @return the tick the wheel was advanced to
+   */
+  uint64_t now() const { return p_now; }
+  size_t size() const { return p_size; }
+
+private:
+  void link(Timer *,uint64_t when);
+  void cascade(int level,size_t idx);
+
+  Timer *p_slots[LEVELS][SLOTS];
+  // Timers in each level, the wheel skips ahead over empty ones
+  size_t p_levelCount[LEVELS];
+  size_t p_size;
+  uint64_t p_now;
+};
+
+/**
+ * @brief The FCGISessionStore class is an in process session cache keyed
+ * by a session cookie. It is split into shards, each a hash map behind a
+ * lock of its own, so lookups from many threads rarely meet. Values are
+ * shared immutable blobs handed out without copying. Sessions expire after
+ * a time to live, pushed out again by every read unless sliding is off,
+ * kept track of by an FCGITimerWheel per shard which is turned as the
+ * shard is used, in steps of a second. Over the memory cap the
+ * least recently used sessions of a shard are evicted. A snapshot file
+ * keeps the sessions over a restart.
+ */
+class FCGISessionStore
+{
+public:
+  struct Stats
+  {
+    size_t sessions;
+    // The sessions, their ids and a fixed overhead for each
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expired;
+    uint64_t evicted;
+  };
+
+  /**
+   * @brief FCGISessionStore
+   * @param cookieName the cookie holding the session id
+   * @param shards the number of shards, rounded up to a power of two
+   */
+  FCGISessionStore(std::string cookieName = "SESSIONID",size_t shards = 16);
+  /**
+   * @brief ~FCGISessionStore saves a snapshot if a snapshot path was set
+   */
+  ~FCGISessionStore();
+  /**
+   * @brief set_ttl sets how long a session lives unless given a time of
+   * its own, 30 minutes by default. At least a second.
+   */
+  void set_ttl(std::chrono::seconds t) { p_ttl = t; }
+  /**
+   * @brief set_sliding makes a read push the expiry of the session out to
+   * its time to live again, the default
+   */
+  void set_sliding(bool b) { p_sliding = b; }
+  /**
+   * @brief set_max_bytes caps the memory held, split evenly among the
+   * shards. Zero, the default, is no cap.
+   */
+  void set_max_bytes(size_t n) { p_maxBytes = n; }
+  /**
+   * @brief set_snapshot_path makes the destructor save() the sessions to
+   * the file, load() reads them back on start up
+   */
+  void set_snapshot_path(std::string p) { p_snapshotPath = p; }
+  const std::string &cookie_name() const { return p_cookieName; }
+  std::string session_id(FCGIRequest &);
+  FCGIBlob get(const std::string &id);
+  /**
+   * @brief get looks up the session of a request by its cookie
+   * @return the value, nullptr if it has none or it expired
+   */
+  FCGIBlob get(FCGIRequest &req) { return get(session_id(req)); }
+  bool put(const std::string &id,FCGIBlob value);
+  bool put(const std::string &id,FCGIBlob value,std::chrono::seconds ttl);
+  bool erase(const std::string &id);
+  void clear();
+  size_t expire();
+  Stats stats();
+  static std::string new_id();
+  bool save(const std::string &path);
+  bool load(const std::string &path);
+  bool has_error() { return (p_errorString.length() > 0); }
+  const std::string error_string() { return p_errorString; }
+
+private:
+  struct Entry;
+  struct Shard;
+  Shard &shard_of(const std::string &id);
+  uint64_t tick();
+
+  std::vector<std::unique_ptr<Shard>> p_shards;
+  unsigned p_shardBits;
+  std::string p_cookieName;
+  std::chrono::seconds p_ttl;
+  bool p_sliding;
+  size_t p_maxBytes;
+  std::string p_snapshotPath;
+  std::chrono::steady_clock::time_point p_started;
+  // Only set by save() and load(), which take this
+  std::mutex p_fileMutex;
+  std::string p_errorString;
+};
+
+/**
+ * @brief The FCGIListener class
+ * This class should be application global and provides
+ * the FastCGI listening, initialization, and an event loop
+ * which then creates FCGIRequest objects to hand off from
+ * an internal queue for processing.
+ */
+class FCGIListener
+{
+public:
+  FCGIListener();
+  FCGIListener(std::string listenerPath);
   ~FCGIListener();
   bool open();
   bool start();
@@ -432,26 +1739,667 @@ public:
     STOPPED
   };
 
+  /**
+   * @brief The DrainStats struct is what drain() reports
+   */
+  struct DrainStats
+  {
+    // Requests the application finished during the drain
+    size_t completed;
+    // Requests still queued or being received at the deadline, answered 503
+    size_t dropped;
+    // Requests the application still held at the deadline
+    size_t unfinished;
+  };
+  DrainStats drain(std::chrono::milliseconds timeout);
+
+  /**
+   * @brief The Deadlines struct limits how long a request may take at each
+   * stage, zero for no limit
+   */
+  struct Deadlines
+  {
+    Deadlines();
+    // From the start of the request until its variables are in, answered
+    // 408 (event loop mode only, libfcgi reads them inside FCGX_Accept_r)
+    std::chrono::milliseconds header;
+    // From then until the body is in, answered 408
+    std::chrono::milliseconds body;
+    // In the queue, dropped and answered 503 instead of being handed out
+    std::chrono::milliseconds queue;
+    // From the start of the request until it is answered, the tighter of
+    // the above and dropped from the queue with 504 past it
+    std::chrono::milliseconds total;
+  };
+  /**
+   * @brief set_deadlines aborts requests which take too long to arrive or
+   * wait too long in the queue, see Deadlines. Must be set before start().
+   */
+  void set_deadlines(const Deadlines &d) { p_deadlines = d; }
+
   void set_listener_path(std::string p) { p_listenerSocketPath = p; }
+  /**
+   * @brief add_listener_path adds another unix socket path or TCP address
+   * to listen on, all of them feed the same queue. Must be called before open()
+   */
+  void add_listener_path(std::string p) { p_extraListenerPaths.push_back(p); }
+  std::vector<std::string> listener_paths();
+  static bool is_unix_path(const std::string &);
+  /**
+   * @brief set_backlog sets the listen backlog of the sockets, the default
+   * is SOMAXCONN
+   */
+  void set_backlog(int n) { p_backlog = n; }
+  /**
+   * @brief set_acceptors sets the number of accept threads (or event loops),
+   * the default is one. They share a socket unless port reuse is on.
+   */
+  void set_acceptors(int n) { p_acceptors = n; }
+  /**
+   * @brief set_reuse_port sets SO_REUSEPORT on TCP sockets and opens one per
+   * acceptor, so each gets its own accept queue balanced by the kernel. Other
+   * processes may also bind the same port this way.
+   */
+  void set_reuse_port(bool b) { p_reusePort = b; }
+  /**
+   * @brief set_tcp_nodelay turns Nagle's algorithm on or off for TCP
+   * connections, it is off (nodelay) by default
+   */
+  void set_tcp_nodelay(bool b) { p_tcpNoDelay = b; }
+  /**
+   * @brief set_defer_accept only wakes the acceptor once data arrived on a
+   * TCP connection, waiting at most the given seconds (Linux only)
+   */
+  void set_defer_accept(int seconds) { p_deferAccept = seconds; }
+  /**
+   * @brief set_event_loop selects the epoll based event loop, which reads
+   * many connections at once with the built in protocol engine instead of
+   * accepting and reading one request at a time through libfcgi. Must be
+   * set before start(), only available on Linux.
+   */
+  void set_event_loop(bool b) { p_eventLoop = b; }
+  bool event_loop() { return p_eventLoop; }
+  /**
+   * @brief set_multiplexing allows the web server to run several requests
+   * over one connection at once (FCGI_MPXS_CONNS), event loop mode only
+   */
+  void set_multiplexing(bool b) { p_multiplex = b; }
+  /**
+   * @brief set_max_connections limits the connections served at once in
+   * event loop mode, further ones wait in the listen backlog
+   */
+  void set_max_connections(int n) { p_maxConns = n; }
+  /**
+   * @brief set_max_requests limits the requests multiplexed over a single
+   * connection in event loop mode, more are answered FCGI_OVERLOADED
+   */
+  void set_max_requests(int n) { p_maxReqs = n; }
+  /**
+   * @brief set_shared_sockets marks the sockets as shared with other
+   * processes, as FCGIPrefork does for its workers. stop() then only stops
+   * this process accepting on them instead of shutting them down.
+   */
+  void set_shared_sockets(bool b) { p_sharedSockets = b; }
   const std::string listener_path() { return p_listenerSocketPath; }
   int socket() { return p_fcgiHandle; }
   bool has_error() { return (p_errorString.length() > 0); }
   const std::string error_string() { return p_errorString; }
   State state() { return p_state; }
   FCGIRequest nextRequest();
+  /**
+   * @brief try_next_request takes the next request off the queue without
+   * waiting for one
+   * @return true if there was one, false if the queue is empty
+   */
+  bool try_next_request(FCGIRequest &);
+  /**
+   * @brief finished tells if the listener was stopped and its queue ran
+   * dry, when nextRequest() returns an invalid request
+   */
+  bool finished();
+  /**
+   * @brief set_queue_notify sets a function called from the accept threads
+   * whenever a request is queued or the listener stops, so an event loop
+   * of the application can take requests with try_next_request() instead
+   * of blocking in nextRequest(). Must be set before start().
+   */
+  void set_queue_notify(std::function<void()> f) { p_queueNotify = f; }
+  /**
+   * @brief stats
+   * @return the stage latencies, throughput and byte counts of the requests
+   * answered since the listener was created
+   */
+  FCGIStats::Snapshot stats() { return p_stats->snapshot(); }
+  /**
+   * @brief set_metrics_uri makes the listener answer requests for the uri,
+   * ie "/__metrics", itself with metrics_text() instead of queueing them.
+   * Empty, the default, turns it off.
+   */
+  void set_metrics_uri(std::string u) { p_metricsUri = u; }
+  std::string metrics_text();
+  /**
+   * @brief set_access_log logs every request answered from the queue to
+   * the log, which must be start()ed by the caller
+   */
+  void set_access_log(std::shared_ptr<FCGIAccessLog> l) { p_accessLog = l; }
+  /**
+   * @brief set_capture records the requests the listener parses, those
+   * the parser rejects included, to the capture, which must be open()
+   */
+  void set_capture(std::shared_ptr<FCGICapture> c) { p_capture = c; }
+  /**
+   * @brief set_limits holds every request to the limits, answering those
+   * over them 413 or 431 before their body is read. Must be set before
+   * start(), and not changed while running.
+   */
+  void set_limits(std::shared_ptr<const FCGILimits> l) { p_limits = l; }
+  /**
+   * @brief set_rate_limiter holds every client to the rate, answering
+   * requests over it 429 before their body is read. Must be set before
+   * start().
+   */
+  void set_rate_limiter(std::shared_ptr<FCGIRateLimiter> r) { p_rateLimiter = r; }
 
 protected:
-  void thr_listen();
+  void thr_listen(int);
+  void thr_event_loop(std::vector<int>);
+  void thread_exited();
+  void drop(FCGIRequest &);
+  void enqueue(FCGIRequest &);
+  void reject(FCGIRequest &,int status,uint32_t retryAfter);
+  bool expired(FCGIRequest &);
+  int open_socket(const std::string &);
+  void close_sockets();
+  void join_threads(std::chrono::steady_clock::time_point until = std::chrono::steady_clock::time_point::max());
 
 private:
-  std::vector<FCGIRequest> p_reqQueue;
+  struct ListenSocket
+  {
+    int fd;
+    int shard;
+  };
+  // Counts the requests handed to the queue which still have copies around,
+  // shared with their tokens so it outlives the listener if need be
+  struct Tracker
+  {
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t outstanding = 0;
+    size_t released = 0;
+    // Requests whose body was still being read when drain() gave up,
+    // answered 503 instead of being queued
+    size_t dropped = 0;
+  };
+  // Cuts short the body reads of the libfcgi acceptors
+  struct Watchdog;
+
+  std::deque<FCGIRequest> p_reqQueue;
   std::mutex p_mutex;
-  std::mutex p_emptyMutex;
+  std::condition_variable p_queueCond;
   std::string p_listenerSocketPath;
+  std::vector<std::string> p_extraListenerPaths;
+  std::vector<ListenSocket> p_sockets;
   std::string p_errorString;
   int p_fcgiHandle;
-  bool p_stopFlag;
+  int p_wakePipe[2];
+  std::atomic<bool> p_stopFlag;
+  std::atomic<bool> p_forceClose;
+  bool p_sharedSockets;
+  bool p_eventLoop;
+  bool p_multiplex;
+  int p_maxConns;
+  int p_maxReqs;
+  int p_backlog;
+  int p_acceptors;
+  bool p_reusePort;
+  bool p_tcpNoDelay;
+  int p_deferAccept;
+  std::atomic<int> p_running;
+  std::vector<std::thread> p_threads;
+  std::shared_ptr<Tracker> p_tracker;
+  std::shared_ptr<FCGIStats> p_stats;
+  std::string p_metricsUri;
+  std::shared_ptr<FCGIAccessLog> p_accessLog;
+  std::shared_ptr<FCGICapture> p_capture;
+  std::shared_ptr<const FCGILimits> p_limits;
+  std::shared_ptr<FCGIRateLimiter> p_rateLimiter;
+  Deadlines p_deadlines;
+  std::unique_ptr<Watchdog> p_watchdog;
+  std::function<void()> p_queueNotify;
   State p_state;
 };
 
+/**
+ * @brief The FCGIPrefork class runs an application as a set of
+ * worker processes sharing the listener sockets. The master opens
+ * the sockets once and forks the workers, each of which starts the
+ * listener and runs the worker function. Workers which die are
+ * replaced. On SIGHUP a new set of workers is started and the old
+ * ones are asked to drain: they stop accepting, answer what they
+ * already queued and exit, so no connection is refused during a
+ * reload. SIGTERM or SIGINT drain all workers and return from run().
+ */
+class FCGIPrefork
+{
+public:
+  /**
+   * @brief WorkerMain runs in each worker after the listener started,
+   * it should serve nextRequest() until it returns an invalid request.
+   * Its return value is the exit code of the worker.
+   */
+  typedef std::function<int(FCGIListener &)> WorkerMain;
+
+  FCGIPrefork(FCGIListener &,int workers);
+  int run(WorkerMain);
+  void set_workers(int n) { p_workers = n; }
+  /**
+   * @brief set_drain_timeout sets how long a draining worker may take to
+   * finish its requests, see FCGIListener::drain(). Zero waits forever.
+   * The default is 30 seconds.
+   */
+  void set_drain_timeout(std::chrono::seconds t) { p_drainTimeout = t; }
+  /**
+   * @brief set_restart_delay sets the pause before replacing a worker
+   * which died shortly after it was started, so a worker failing on
+   * startup does not fork in a tight loop. The default is one second.
+   */
+  void set_restart_delay(std::chrono::milliseconds t) { p_restartDelay = t; }
+  int generation() { return p_generation; }
+  size_t restarts() { return p_restarts; }
+  bool has_error() { return (p_errorString.length() > 0); }
+  const std::string error_string() { return p_errorString; }
+
+protected:
+  pid_t spawn(WorkerMain &);
+  void drain(pid_t);
+  void reap();
+
+private:
+  struct Worker
+  {
+    int generation;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point drainDeadline;
+    bool draining;
+  };
+
+  FCGIListener &p_listener;
+  int p_workers;
+  int p_generation;
+  size_t p_restarts;
+  bool p_shutdown;
+  bool p_lastEarlyExit;
+  std::chrono::seconds p_drainTimeout;
+  std::chrono::milliseconds p_restartDelay;
+  std::map<pid_t,Worker> p_children;
+  std::string p_errorString;
+};
+
+#ifdef FCGI_HAVE_COROUTINES
+template <typename T = void> class FCGITask;
+#endif
+
+/**
+ * @brief The FCGIExecutor class runs requests on a few event loop threads
+ * instead of a thread each, so requests waiting on a backend do not pin a
+ * thread. Every loop takes requests off the listener queue as long as it
+ * has fewer than max_in_flight() of them going, and wakes the waiters of
+ * the sockets and timers of its requests. Work started on a loop stays on
+ * it, nothing needs locking against the other loops. With C++20 handlers
+ * are coroutines, see serve(), otherwise run() hands out the requests and
+ * the application calls task_done() for each.
+ */
+class FCGIExecutor
+{
+public:
+  /**
+   * @brief The Waiter struct is what waits for a socket or a timer, fire
+   * is called on the loop once it is ready. It is not copied, so it must
+   * stay put until then, as it does in a coroutine frame.
+   */
+  struct Waiter
+  {
+    void (*fire)(Waiter *) = nullptr;
+    // The epoll events of the socket, or -errno
+    int result = 0;
+  };
+  /**
+   * @brief Spawn starts the work on a request, on the loop of the thread
+   * calling it
+   */
+  typedef std::function<void(FCGIRequest &)> Spawn;
+
+  FCGIExecutor(FCGIListener &,int threads = 1);
+  ~FCGIExecutor();
+  /**
+   * @brief set_max_in_flight limits the requests each loop has going at
+   * once, the rest wait in the listener queue. The default is 1024.
+   */
+  void set_max_in_flight(size_t n) { p_maxInFlight = n; }
+  size_t max_in_flight() { return p_maxInFlight; }
+  /**
+   * @brief run runs the loops, one on the calling thread, until the
+   * listener finished and the last request is done
+   * @return true when done, false and sets the error string if the loops
+   * could not be set up
+   */
+  bool run(Spawn);
+  /**
+   * @brief task_done tells the loop of the calling thread a request it
+   * spawned is done
+   */
+  static void task_done();
+  /**
+   * @brief wait_fd has the loop of the calling thread fire the waiter once
+   * the socket, which should be non blocking, is readable or writable. One
+   * waiter per direction and socket at a time.
+   * @return true if waiting, false and sets errno if not on a loop thread
+   * or the socket can not be waited for
+   */
+  static bool wait_fd(int fd,bool write,Waiter *);
+  /**
+   * @brief wait_until has the loop of the calling thread fire the waiter
+   * at the given time
+   * @return true if waiting, false and sets errno if not on a loop thread
+   */
+  static bool wait_until(std::chrono::steady_clock::time_point,Waiter *);
+  bool has_error() { return (p_errorString.length() > 0); }
+  const std::string error_string() { return p_errorString; }
+
+#ifdef FCGI_HAVE_COROUTINES
+  struct FdAwaiter;
+  struct TimerAwaiter;
+  struct Detached;
+  /**
+   * @brief Handler handles a request as a coroutine, the response is
+   * sent once it completes unless an FCGIDeferred took the request over.
+   * An exception answers 500.
+   */
+  typedef std::function<FCGITask<void>(FCGIRequest &,FCGIResponse &)> Handler;
+  /**
+   * @brief serve runs the loops like run(), with a coroutine per request
+   */
+  bool serve(Handler);
+  /**
+   * @brief readable waits until the socket is readable
+   * @return the epoll events, or -errno
+   */
+  static FdAwaiter readable(int fd);
+  static FdAwaiter writable(int fd);
+  static TimerAwaiter sleep_until(std::chrono::steady_clock::time_point);
+  static TimerAwaiter sleep_for(std::chrono::milliseconds);
+  /**
+   * @brief read reads what is there, waiting until there is something
+   * @return the bytes read, 0 at the end, or -errno
+   */
+  static FCGITask<ssize_t> read(int fd,void *buf,size_t len);
+  /**
+   * @brief write writes all of the buffer, waiting as needed
+   * @return len, or -errno
+   */
+  static FCGITask<ssize_t> write(int fd,const void *buf,size_t len);
+  /**
+   * @brief connect connects a non blocking socket
+   * @return 0, or -errno
+   */
+  static FCGITask<int> connect(int fd,const struct sockaddr *,socklen_t);
+#endif
+
+private:
+  struct Loop;
+  void loop_main(Loop *,const Spawn &);
+  void notify();
+
+  // The loop of the calling thread, if it runs one
+  static thread_local Loop *p_current;
+
+  FCGIListener &p_listener;
+  int p_threads;
+  size_t p_maxInFlight;
+  std::vector<std::unique_ptr<Loop>> p_loops;
+  std::atomic<size_t> p_next;
+  std::atomic<bool> p_finishing;
+  std::string p_errorString;
+};
+
+#ifdef FCGI_HAVE_COROUTINES
+/**
+ * @brief The FCGITask class is a coroutine of an FCGIExecutor handler.
+ * It starts when it is co_awaited and resumes its awaiter when it is
+ * done, passing on its value or exception.
+ */
+template <typename T>
+class FCGITask
+{
+public:
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  struct PromiseBase
+  {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    struct Final
+    {
+      bool await_ready() noexcept { return false; }
+      template <typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+      {
+        std::coroutine_handle<> c = h.promise().continuation;
+        return c ? c : std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    Final final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+  };
+  struct ValuePromise: PromiseBase
+  {
+    std::optional<T> value;
+    template <typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    T result() { return std::move(*value); }
+  };
+  struct VoidPromise: PromiseBase
+  {
+    void return_void() {}
+    void result() {}
+  };
+  struct promise_type: std::conditional<std::is_void<T>::value,VoidPromise,ValuePromise>::type
+  {
+    FCGITask get_return_object() { return FCGITask(Handle::from_promise(*this)); }
+  };
+
+  FCGITask(): p_handle(nullptr) {}
+  explicit FCGITask(Handle h): p_handle(h) {}
+  FCGITask(const FCGITask &) = delete;
+  FCGITask(FCGITask &&o) noexcept: p_handle(o.p_handle) { o.p_handle = nullptr; }
+  FCGITask &operator=(FCGITask &&o) noexcept
+  {
+    std::swap(p_handle,o.p_handle);
+    return *this;
+  }
+  ~FCGITask()
+  {
+    if (p_handle)
+      p_handle.destroy();
+  }
+
+  bool await_ready() { return (!p_handle || p_handle.done()); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+  {
+    p_handle.promise().continuation = awaiter;
+    return p_handle;
+  }
+  T await_resume()
+  {
+    if (p_handle.promise().error)
+      std::rethrow_exception(p_handle.promise().error);
+    return p_handle.promise().result();
+  }
+
+private:
+  Handle p_handle;
+};
+
+struct FCGIExecutor::FdAwaiter: FCGIExecutor::Waiter
+{
+  int fd;
+  bool write;
+  std::coroutine_handle<> handle;
+
+  FdAwaiter(int f,bool w): fd(f), write(w) {}
+  bool await_ready() { return false; }
+  bool await_suspend(std::coroutine_handle<> h)
+  {
+    handle = h;
+    fire = [](Waiter *w) { static_cast<FdAwaiter *>(w)->handle.resume(); };
+    if (wait_fd(fd,write,this))
+      return true;
+    result = -errno;
+    return false;
+  }
+  int await_resume() { return result; }
+};
+
+struct FCGIExecutor::TimerAwaiter: FCGIExecutor::Waiter
+{
+  std::chrono::steady_clock::time_point when;
+  std::coroutine_handle<> handle;
+
+  explicit TimerAwaiter(std::chrono::steady_clock::time_point t): when(t) {}
+  bool await_ready() { return (when <= std::chrono::steady_clock::now()); }
+  bool await_suspend(std::coroutine_handle<> h)
+  {
+    handle = h;
+    fire = [](Waiter *w) { static_cast<TimerAwaiter *>(w)->handle.resume(); };
+    if (wait_until(when,this))
+      return true;
+    result = -errno;
+    return false;
+  }
+  int await_resume() { return result; }
+};
+
+// The coroutine a request runs in, it frees itself when done
+struct FCGIExecutor::Detached
+{
+  struct promise_type
+  {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+inline FCGIExecutor::FdAwaiter FCGIExecutor::readable(int fd)
+{
+  return FdAwaiter(fd,false);
+}
+
+inline FCGIExecutor::FdAwaiter FCGIExecutor::writable(int fd)
+{
+  return FdAwaiter(fd,true);
+}
+
+inline FCGIExecutor::TimerAwaiter FCGIExecutor::sleep_until(std::chrono::steady_clock::time_point t)
+{
+  return TimerAwaiter(t);
+}
+
+inline FCGIExecutor::TimerAwaiter FCGIExecutor::sleep_for(std::chrono::milliseconds d)
+{
+  return TimerAwaiter(std::chrono::steady_clock::now() + d);
+}
+
+inline FCGITask<ssize_t> FCGIExecutor::read(int fd,void *buf,size_t len)
+{
+  for (;;)
+  {
+    ssize_t rc = ::read(fd,buf,len);
+    if (rc >= 0)
+      co_return rc;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      co_return -errno;
+    int ev = co_await readable(fd);
+    if (ev < 0)
+      co_return ev;
+  }
+}
+
+inline FCGITask<ssize_t> FCGIExecutor::write(int fd,const void *buf,size_t len)
+{
+  size_t off = 0;
+  while (off < len)
+  {
+    ssize_t rc = ::send(fd,static_cast<const char *>(buf) + off,len - off,MSG_NOSIGNAL);
+    if (rc < 0 && errno == ENOTSOCK)
+      rc = ::write(fd,static_cast<const char *>(buf) + off,len - off);
+    if (rc >= 0)
+    {
+      off += rc;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      co_return -errno;
+    int ev = co_await writable(fd);
+    if (ev < 0)
+      co_return ev;
+  }
+  co_return (ssize_t)len;
+}
+
+inline FCGITask<int> FCGIExecutor::connect(int fd,const struct sockaddr *addr,socklen_t len)
+{
+  if (::connect(fd,addr,len) == 0)
+    co_return 0;
+  if (errno != EINPROGRESS && errno != EINTR)
+    co_return -errno;
+  int ev = co_await writable(fd);
+  if (ev < 0)
+    co_return ev;
+  int err = 0;
+  socklen_t errLen = sizeof(err);
+  if (::getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&errLen) != 0)
+    co_return -errno;
+  co_return -err;
+}
+
+inline bool FCGIExecutor::serve(Handler h)
+{
+  struct Run
+  {
+    static Detached request(FCGIRequest req,const Handler &h)
+    {
+      FCGIResponse resp(req.FCGXHandle());
+      bool failed = false;
+      try
+      {
+        co_await h(req,resp);
+      } catch (...) {
+        failed = true;
+      }
+      if (failed && !req.deferred())
+      {
+        FCGIResponse err(req.FCGXHandle());
+        err.set_status_code(500);
+        err.send();
+      } else if (!req.deferred()) {
+        resp.send();
+      }
+      task_done();
+    }
+  };
+  return run([&h](FCGIRequest &req) { Run::request(req,h); });
+}
+#endif
+
 #endif // FCGI_REQUEST_CPP_HXX
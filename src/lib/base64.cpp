@@ -39,64 +39,55 @@ namespace FCGI {
 FCGIData base64Decode(std::string &in)
 {
   std::string::size_type i;
-  char dtable[256];
+  signed char dtable[256];
 
-  for(i= 0;i<255;i++){
-    dtable[i]= 0x80;
+  for(i= 0;i<256;i++){
+    dtable[i]= -1;
   }
-  for(i= 'A';i<='I';i++){
-    dtable[i]= 0+(i-'A');
+  for(i= 'A';i<='Z';i++){
+    dtable[i]= i-'A';
   }
-  for(i= 'J';i<='R';i++){
-    dtable[i]= 9+(i-'J');
-  }
-  for(i= 'S';i<='Z';i++){
-    dtable[i]= 18+(i-'S');
-  }
-  for(i= 'a';i<='i';i++){
+  for(i= 'a';i<='z';i++){
     dtable[i]= 26+(i-'a');
   }
-  for(i= 'j';i<='r';i++){
-    dtable[i]= 35+(i-'j');
-  }
-  for(i= 's';i<='z';i++){
-    dtable[i]= 44+(i-'s');
-  }
   for(i= '0';i<='9';i++){
     dtable[i]= 52+(i-'0');
   }
   dtable[size_t('+')]= 62;
   dtable[size_t('/')]= 63;
-  dtable[size_t('=')]= 0;
-  std::string::size_type idx = 0;
+
   const std::string::size_type inLen = in.length();
   FCGIData out;
-  while(idx < inLen){
-    char a[4],b[4],o[3];
-
-    char inbuf[4] = {0,};
-    for(i = 0; i<4; i++) {
-      char ch = inbuf[i] = in.at(i+idx);
-      size_t c = ch;
-      if(i+idx > inLen){
-        return FCGIData();
-      }
-
-      if(dtable[c]&0x80){
-        fprintf(stderr,"Illegal character '%c' in base64 data.\n",ch);
-        return FCGIData();
-      }
-
-      a[i]= c;
-      b[i]= dtable[c];
+  out.reserve(inLen / 4 * 3);
+  unsigned char b[4];
+  int n = 0, pad = 0;
+  for(std::string::size_type idx = 0; idx < inLen; idx++){
+    unsigned char c = in[idx];
+    // MIME bodies wrap their base64 in lines
+    if(c == '\r' || c == '\n' || c == ' ' || c == '\t'){
+      continue;
+    }
+    if(c == '=' && n >= 2){
+      b[n++]= 0;
+      pad++;
+    } else if(dtable[c] < 0 || pad > 0){
+      fprintf(stderr,"Illegal character '%c' in base64 data.\n",c);
+      return FCGIData();
+    } else {
+      b[n++]= dtable[c];
     }
-    o[0]= (b[0]<<2)|(b[1]>>4);
-    o[1]= (b[1]<<4)|(b[2]>>2);
-    o[2]= (b[2]<<6)|b[3];
-    i= a[2]=='='?1:(a[3]=='='?2:3);
-    for (size_t j = 0; j < i; j++)
-      out.append(o[j]);
-    idx += i;
+    if(n == 4){
+      char o[3];
+      o[0]= (b[0]<<2)|(b[1]>>4);
+      o[1]= (b[1]<<4)|(b[2]>>2);
+      o[2]= (b[2]<<6)|b[3];
+      out.append(o,3-pad);
+      n = 0;
+    }
+  }
+  if(n != 0){
+    fprintf(stderr,"Truncated base64 data.\n");
+    return FCGIData();
   }
   return out;
 }
@@ -104,57 +95,28 @@ FCGIData base64Decode(std::string &in)
 
 std::string base64Encode(FCGIData &dat)
 {
-  char dtable[256] = { 0, };
+  static const char dtable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-  for(int i= 0;i<9;i++){
-    dtable[i]= 'A'+i;
-    dtable[i+9]= 'J'+i;
-    dtable[26+i]= 'a'+i;
-    dtable[26+i+9]= 'j'+i;
-  }
-  for(int i= 0;i<8;i++){
-    dtable[i+18]= 'S'+i;
-    dtable[26+i+18]= 's'+i;
-  }
-  for(int i= 0;i<10;i++){
-    dtable[52+i]= '0'+i;
-  }
-  dtable[62]= '+';
-  dtable[63]= '/';
-
-  size_t idx = 0;
   const size_t datSz = dat.size();
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(dat.get());
 
   std::string rv;
-  while(idx <= datSz)
+  rv.reserve((datSz+2)/3*4);
+  size_t idx = 0;
+  for(; idx+3 <= datSz; idx += 3)
   {
-    char igroup[3],ogroup[4];
-    int c,n;
-
-    igroup[0]= igroup[1]= igroup[2]= 0;
-    for(n = 0;n<3;n++)
-    {
-      c = dat.at(idx+n);
-      if(c==0xff){
-        break;
-      }
-      igroup[n]= c;
-    }
-    if(n > 0){
-      ogroup[0]= dtable[igroup[0]>>2];
-      ogroup[1]= dtable[((igroup[0]&3)<<4)|(igroup[1]>>4)];
-      ogroup[2]= dtable[((igroup[1]&0xF)<<2)|(igroup[2]>>6)];
-      ogroup[3]= dtable[igroup[2]&0x3F];
-      if(n<3){
-        ogroup[3]= '=';
-        if(n<2){
-          ogroup[2]= '=';
-        }
-      }
-      for(int i= 0;i<4;i++){
-        rv.append({ogroup[i]});
-      }
-    }
+    rv.push_back(dtable[p[idx]>>2]);
+    rv.push_back(dtable[((p[idx]&3)<<4)|(p[idx+1]>>4)]);
+    rv.push_back(dtable[((p[idx+1]&0xF)<<2)|(p[idx+2]>>6)]);
+    rv.push_back(dtable[p[idx+2]&0x3F]);
+  }
+  if(idx < datSz)
+  {
+    unsigned char igroup[2] = { p[idx], (idx+1 < datSz) ? p[idx+1] : (unsigned char)0 };
+    rv.push_back(dtable[igroup[0]>>2]);
+    rv.push_back(dtable[((igroup[0]&3)<<4)|(igroup[1]>>4)]);
+    rv.push_back((idx+1 < datSz) ? dtable[(igroup[1]&0xF)<<2] : '=');
+    rv.push_back('=');
   }
   return rv;
 }
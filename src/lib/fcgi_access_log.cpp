@@ -0,0 +1,404 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#include <limits.h>
+#include <time.h>
+#include <algorithm>
+
+#include <fcgi_request_cpp.hxx>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * @brief FCGIAccessLog::FCGIAccessLog sets up a log appending to a file,
+ * which is opened by start()
+ * @param path the log file
+ */
+FCGIAccessLog::FCGIAccessLog(std::string path)
+{
+  static std::atomic<uint64_t> ids(0);
+  p_id = ++ids;
+  p_path = path;
+  p_fd = -1;
+  p_ownFd = true;
+  p_json = false;
+  p_sampleRate = 1;
+  p_ringSize = 1024;
+  p_flushInterval = std::chrono::milliseconds(100);
+  p_reopen = false;
+  p_stopFlag = false;
+  p_written = 0;
+  p_writeFailed = 0;
+}
+
+/**
+ * @brief FCGIAccessLog::FCGIAccessLog sets up a log writing to a descriptor
+ * the caller owns, ie 1 for stdout
+ * @param fd the descriptor
+ */
+FCGIAccessLog::FCGIAccessLog(int fd)
+  :FCGIAccessLog(std::string())
+{
+  p_fd = fd;
+  p_ownFd = false;
+}
+
+FCGIAccessLog::~FCGIAccessLog()
+{
+  stop();
+  if (p_ownFd && p_fd >= 0)
+    ::close(p_fd);
+}
+
+// Opens, or reopens, the log file
+bool FCGIAccessLog::open_file()
+{
+  if (!p_ownFd)
+    return true;
+  int fd = ::open(p_path.c_str(),O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,0644);
+  if (fd < 0)
+  {
+    set_error(p_path + ": " + strerror(errno));
+    return false;
+  }
+  if (p_fd >= 0)
+    ::close(p_fd);
+  p_fd = fd;
+  return true;
+}
+
+/**
+ * @brief FCGIAccessLog::start opens the log file and starts the writer
+ * @return true if started, false and sets the error string if the file
+ * could not be opened
+ */
+bool FCGIAccessLog::start()
+{
+  if (p_writer.joinable())
+    return true;
+  set_error(std::string());
+  if (p_fd < 0 && !open_file())
+    return false;
+  p_stopFlag = false;
+  p_writer = std::thread(&FCGIAccessLog::thr_writer,this);
+  return true;
+}
+
+/**
+ * @brief FCGIAccessLog::stop writes out what is buffered and stops the writer
+ */
+void FCGIAccessLog::stop()
+{
+  if (!p_writer.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> l(p_mutex);
+    p_stopFlag = true;
+  }
+  p_cond.notify_all();
+  p_writer.join();
+}
+
+// The ring of the calling thread, created on its first entry
+FCGIAccessLog::Ring *FCGIAccessLog::local()
+{
+  // Keyed by id rather than address, a new log may reuse the address
+  thread_local std::vector<std::pair<uint64_t,Ring *>> rings;
+  for (std::pair<uint64_t,Ring *> &r: rings)
+  {
+    if (r.first == p_id)
+      return r.second;
+  }
+  size_t sz = 16;
+  while (sz < p_ringSize)
+    sz <<= 1;
+  std::unique_ptr<Ring> ring(new Ring());
+  ring->slots.resize(sz);
+  ring->mask = sz - 1;
+  Ring *rv = ring.get();
+  {
+    std::lock_guard<std::mutex> l(p_mutex);
+    p_rings.push_back(std::move(ring));
+  }
+  rings.push_back(std::make_pair(p_id,rv));
+  return rv;
+}
+
+/**
+ * @brief FCGIAccessLog::log queues an entry, never blocking
+ * @param e the entry
+ * @return false if it was sampled out or dropped because the ring was full
+ */
+bool FCGIAccessLog::log(const Entry &e)
+{
+  Ring *r = local();
+  if (p_sampleRate > 1 && (r->sampleCount++ % p_sampleRate) != 0)
+  {
+    r->sampledOut.fetch_add(1,std::memory_order_relaxed);
+    return false;
+  }
+  size_t head = r->head.load(std::memory_order_relaxed);
+  if (head - r->tail.load(std::memory_order_acquire) > r->mask)
+  {
+    r->dropped.fetch_add(1,std::memory_order_relaxed);
+    return false;
+  }
+  r->slots[head & r->mask] = e;
+  r->head.store(head+1,std::memory_order_release);
+  return true;
+}
+
+/**
+ * @brief FCGIAccessLog::log queues an entry for a finished request
+ * @param t the timestamps, status and byte counts of the request
+ * @param method the request method
+ * @param uri the request uri
+ * @return false if it was sampled out or dropped because the ring was full
+ */
+bool FCGIAccessLog::log(const FCGIRequestTimes &t,const std::string &method,const std::string &uri)
+{
+  Entry e;
+  e.time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  size_t n = std::min(method.size(),sizeof(e.method)-1);
+  memcpy(e.method,method.data(),n);
+  e.method[n] = 0;
+  n = std::min(uri.size(),sizeof(e.uri)-1);
+  memcpy(e.uri,uri.data(),n);
+  e.uri[n] = 0;
+  e.status = t.status;
+  e.bytesIn = t.bytesIn;
+  e.bytesOut = t.bytesOut;
+  for (int i = 0; i < FCGIStats::STAGES; i++)
+  {
+    uint64_t usec = 0;
+    FCGIStats::stage_usec(t,(FCGIStats::Stage)i,usec);
+    e.usec[i] = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+  }
+  return log(e);
+}
+
+/**
+ * @brief FCGIAccessLog::dropped
+ * @return the entries dropped because the ring of their thread was full
+ */
+uint64_t FCGIAccessLog::dropped()
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  uint64_t rv = 0;
+  for (std::unique_ptr<Ring> &r: p_rings)
+    rv += r->dropped.load(std::memory_order_relaxed);
+  return rv;
+}
+
+// The error is set by the writer thread and read by any other
+void FCGIAccessLog::set_error(const std::string &e)
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  p_errorString = e;
+}
+
+/**
+ * @brief FCGIAccessLog::has_error
+ * @return true if the file could not be opened or written to
+ */
+bool FCGIAccessLog::has_error()
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  return !p_errorString.empty();
+}
+
+/**
+ * @brief FCGIAccessLog::error_string
+ * @return what went wrong last, empty if nothing did
+ */
+const std::string FCGIAccessLog::error_string()
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  return p_errorString;
+}
+
+/**
+ * @brief FCGIAccessLog::sampled_out
+ * @return the entries left out by sampling
+ */
+uint64_t FCGIAccessLog::sampled_out()
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  uint64_t rv = 0;
+  for (std::unique_ptr<Ring> &r: p_rings)
+    rv += r->sampledOut.load(std::memory_order_relaxed);
+  return rv;
+}
+
+// Appends s to out, escaping what JSON strings can not hold as is
+static void json_escape(const char *s,std::string &out)
+{
+  for (; *s; s++)
+  {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+    {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf,sizeof(buf),"\\u%04x",c);
+      out.append(buf);
+    } else {
+      out.push_back(c);
+    }
+  }
+}
+
+// Renders an entry as a line of text or JSON
+void FCGIAccessLog::format(const Entry &e,std::string &out)
+{
+  time_t secs = e.time / 1000000;
+  struct tm tm;
+  gmtime_r(&secs,&tm);
+  char ts[64];
+  size_t n = strftime(ts,sizeof(ts),"%Y-%m-%dT%H:%M:%S",&tm);
+  snprintf(ts+n,sizeof(ts)-n,".%03dZ",(int)((e.time / 1000) % 1000));
+
+  char buf[256];
+  if (p_json)
+  {
+    out.append("{\"time\":\"");
+    out.append(ts);
+    out.append("\",\"method\":\"");
+    json_escape(e.method,out);
+    out.append("\",\"uri\":\"");
+    json_escape(e.uri,out);
+    snprintf(buf,sizeof(buf),"\",\"status\":%d,\"bytes_in\":%llu,\"bytes_out\":%llu",
+             e.status,(unsigned long long)e.bytesIn,(unsigned long long)e.bytesOut);
+    out.append(buf);
+    for (int i = 0; i < FCGIStats::STAGES; i++)
+    {
+      snprintf(buf,sizeof(buf),",\"%s_us\":%u",FCGIStats::stage_name((FCGIStats::Stage)i),e.usec[i]);
+      out.append(buf);
+    }
+    out.append("}\n");
+    return;
+  }
+  out.append(ts);
+  out.append(" ");
+  out.append(e.method[0] ? e.method : "-");
+  out.append(" ");
+  out.append(e.uri[0] ? e.uri : "-");
+  snprintf(buf,sizeof(buf)," %d %llu %llu",e.status,(unsigned long long)e.bytesIn,(unsigned long long)e.bytesOut);
+  out.append(buf);
+  for (int i = 0; i < FCGIStats::STAGES; i++)
+  {
+    snprintf(buf,sizeof(buf)," %s=%u",FCGIStats::stage_name((FCGIStats::Stage)i),e.usec[i]);
+    out.append(buf);
+  }
+  out.append("\n");
+}
+
+// Writes out everything in the rings, one iovec per ring, returns the entries
+// written
+size_t FCGIAccessLog::flush()
+{
+  std::vector<Ring *> rings;
+  {
+    std::lock_guard<std::mutex> l(p_mutex);
+    for (std::unique_ptr<Ring> &r: p_rings)
+      rings.push_back(r.get());
+  }
+  if (p_reopen.exchange(false))
+    open_file();
+
+  // The text of each ring and how many entries it holds
+  std::vector<std::string> chunks;
+  std::vector<size_t> counts;
+  for (Ring *r: rings)
+  {
+    size_t tail = r->tail.load(std::memory_order_relaxed);
+    size_t head = r->head.load(std::memory_order_acquire);
+    if (tail == head)
+      continue;
+    chunks.emplace_back();
+    std::string &out = chunks.back();
+    for (; tail != head; tail++)
+      format(r->slots[tail & r->mask],out);
+    counts.push_back(head - r->tail.load(std::memory_order_relaxed));
+    r->tail.store(tail,std::memory_order_release);
+  }
+
+  std::vector<struct iovec> iov;
+  for (std::string &c: chunks)
+  {
+    struct iovec v;
+    v.iov_base = &c[0];
+    v.iov_len = c.size();
+    iov.push_back(v);
+  }
+  size_t idx = 0;
+  size_t entries = 0;
+  while (idx < iov.size())
+  {
+    int cnt = std::min(iov.size()-idx,(size_t)IOV_MAX);
+    ssize_t rc = ::writev(p_fd,&iov[idx],cnt);
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      set_error(std::string("writev: ") + strerror(errno));
+      break;
+    }
+    // Skip over what got written, a partial one is picked up where it ended
+    size_t done = rc;
+    while (idx < iov.size() && done >= iov[idx].iov_len)
+    {
+      done -= iov[idx].iov_len;
+      entries += counts[idx++];
+    }
+    if (idx < iov.size())
+    {
+      iov[idx].iov_base = (char *)iov[idx].iov_base + done;
+      iov[idx].iov_len -= done;
+    }
+  }
+  // Those of a ring only partly written count as lost as well
+  size_t failed = 0;
+  for (; idx < counts.size(); idx++)
+    failed += counts[idx];
+  p_written += entries;
+  p_writeFailed += failed;
+  return entries;
+}
+
+// Internal writer thread function
+void FCGIAccessLog::thr_writer()
+{
+  FCGI::SetThreadName("FCGI AccessLog");
+
+  std::unique_lock<std::mutex> l(p_mutex);
+  while (!p_stopFlag)
+  {
+    p_cond.wait_for(l,p_flushInterval);
+    l.unlock();
+    flush();
+    l.lock();
+  }
+  l.unlock();
+  flush();
+}
@@ -0,0 +1,266 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include <fcgi_request_cpp.hxx>
+
+static const char capture_magic[8] = { 'F', 'C', 'G', 'I', 'C', 'A', 'P', '1' };
+
+/**
+ * @brief FCGICapture::FCGICapture sets up a capture to a file, which is
+ * opened by open()
+ * @param path the capture file, it is created or appended to
+ */
+FCGICapture::FCGICapture(std::string path)
+{
+  p_path = path;
+  p_fd = -1;
+  p_sampleRate = 1;
+  p_maxRecords = 0;
+  p_maxBody = 16 << 20;
+  p_seen = 0;
+  p_captured = 0;
+}
+
+FCGICapture::~FCGICapture()
+{
+  close();
+}
+
+/**
+ * @brief FCGICapture::open opens the capture file, writing the magic if it
+ * is new
+ * @return true if open, false and sets the error string if not
+ */
+bool FCGICapture::open()
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  if (p_fd >= 0)
+    return true;
+  p_errorString.clear();
+  p_fd = ::open(p_path.c_str(),O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,0644);
+  if (p_fd < 0)
+  {
+    p_errorString = p_path + ": " + strerror(errno);
+    return false;
+  }
+  if (::lseek(p_fd,0,SEEK_END) == 0 && ::write(p_fd,capture_magic,sizeof(capture_magic)) != sizeof(capture_magic))
+  {
+    p_errorString = p_path + ": " + strerror(errno);
+    ::close(p_fd);
+    p_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void FCGICapture::close()
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  if (p_fd >= 0)
+    ::close(p_fd);
+  p_fd = -1;
+}
+
+static void put_u32(std::string &out,uint32_t v)
+{
+  out.push_back((char)(v >> 24));
+  out.push_back((char)(v >> 16));
+  out.push_back((char)(v >> 8));
+  out.push_back((char)v);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// FastCGI name-value pair lengths, one byte below 128 and four above
+static void put_length(std::string &out,size_t len)
+{
+  if (len < 128)
+    out.push_back((char)len);
+  else
+    put_u32(out,(uint32_t)len | 0x80000000);
+}
+
+static bool get_length(const unsigned char *&p,const unsigned char *ep,size_t &len)
+{
+  if (p >= ep)
+    return false;
+  if (*p < 128)
+  {
+    len = *p++;
+    return true;
+  }
+  if (ep - p < 4)
+    return false;
+  len = get_u32(p) & 0x7fffffff;
+  p += 4;
+  return true;
+}
+
+/**
+ * @brief FCGICapture::encode appends a record
+ * @param params the CGI variables
+ * @param body the request body
+ * @param len the length of the body
+ * @param out receives the record, length prefix included
+ */
+void FCGICapture::encode(const std::map<std::string,std::string> &params,const char *body,size_t len,std::string &out)
+{
+  std::string nv;
+  for (const std::pair<const std::string,std::string> &p: params)
+  {
+    put_length(nv,p.first.size());
+    put_length(nv,p.second.size());
+    nv.append(p.first);
+    nv.append(p.second);
+  }
+  put_u32(out,4 + nv.size() + len);
+  put_u32(out,nv.size());
+  out.append(nv);
+  out.append(body,len);
+}
+
+/**
+ * @brief FCGICapture::decode decodes a record, without its length prefix,
+ * checking every length against the data, so it takes any input
+ * @param data the record
+ * @param len the length of the record
+ * @param rec receives the variables and body
+ * @return true if it is a well formed record, false if not
+ */
+bool FCGICapture::decode(const char *data,size_t len,Record &rec)
+{
+  rec.params.clear();
+  rec.body.clear();
+  if (len < 4)
+    return false;
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+  size_t nvLen = get_u32(p);
+  if (nvLen > len - 4)
+    return false;
+  p += 4;
+  const unsigned char *ep = p + nvLen;
+  while (p < ep)
+  {
+    size_t nlen, vlen;
+    if (!get_length(p,ep,nlen) || !get_length(p,ep,vlen) || nlen > (size_t)(ep - p) || vlen > (size_t)(ep - p) - nlen)
+      return false;
+    rec.params[std::string((const char *)p,nlen)] = std::string((const char *)p + nlen,vlen);
+    p += nlen + vlen;
+  }
+  rec.body.append((const char *)ep,len - 4 - nvLen);
+  return true;
+}
+
+/**
+ * @brief FCGICapture::capture records a parsed request, if it is sampled
+ * and its body is not over the limit. Safe to call from any thread.
+ * @param r the request
+ * @return true if recorded
+ */
+bool FCGICapture::capture(FCGIRequest &r)
+{
+  if ((p_seen++ % p_sampleRate) != 0)
+    return false;
+  if (p_maxRecords > 0 && p_captured >= p_maxRecords)
+    return false;
+  FCGIData *body = r.postData();
+  if (body->size() > p_maxBody)
+    return false;
+
+  std::string rec;
+  encode(*r.allEnviron(),body->get(),body->size(),rec);
+  std::lock_guard<std::mutex> l(p_mutex);
+  if (p_fd < 0)
+    return false;
+  size_t off = 0;
+  while (off < rec.size())
+  {
+    ssize_t rc = ::write(p_fd,rec.data() + off,rec.size() - off);
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      p_errorString = p_path + ": " + strerror(errno);
+      return false;
+    }
+    off += rc;
+  }
+  p_captured++;
+  return true;
+}
+
+/**
+ * @brief FCGICapture::read_file reads all records of a capture file
+ * @param path the capture file
+ * @param records receives the records
+ * @param error receives what is wrong with the file
+ * @return true if read, false if it could not be read or is malformed.
+ * The records before a malformed one are kept.
+ */
+bool FCGICapture::read_file(const std::string &path,std::vector<Record> &records,std::string &error)
+{
+  int fd = ::open(path.c_str(),O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    error = path + ": " + strerror(errno);
+    return false;
+  }
+  std::string data;
+  char buf[65536];
+  ssize_t rc;
+  while ((rc = ::read(fd,buf,sizeof(buf))) != 0)
+  {
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      error = path + ": " + strerror(errno);
+      ::close(fd);
+      return false;
+    }
+    data.append(buf,rc);
+  }
+  ::close(fd);
+
+  if (data.size() < sizeof(capture_magic) || memcmp(data.data(),capture_magic,sizeof(capture_magic)) != 0)
+  {
+    error = path + ": not a capture file";
+    return false;
+  }
+  size_t off = sizeof(capture_magic);
+  while (off < data.size())
+  {
+    if (data.size() - off < 4)
+      break;
+    size_t len = get_u32(reinterpret_cast<const unsigned char *>(data.data()) + off);
+    off += 4;
+    Record rec;
+    if (len > data.size() - off || !decode(data.data() + off,len,rec))
+    {
+      error = path + ": malformed record at offset " + std::to_string(off - 4);
+      return false;
+    }
+    records.push_back(rec);
+    off += len;
+  }
+  if (off != data.size())
+  {
+    error = path + ": truncated record at the end";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,190 @@
+#include <config.h>
+#include <fcgi_request_cpp.hxx>
+
+/**
+ * @brief FCGICoalescer::FCGICoalescer sets up a coalescer around a handler.
+ * By default it only collapses concurrent requests (no caching), and uses
+ * default_key() to decide which requests are identical
+ * @param h the handler which fills in the responses
+ */
+FCGICoalescer::FCGICoalescer(Handler h)
+{
+  p_handler = h;
+  p_keyFunc = FCGICoalescer::default_key;
+  p_ttl = std::chrono::milliseconds(0);
+  p_staleWindow = std::chrono::milliseconds(0);
+  p_maxEntries = 1024;
+  p_handlerCalls = 0;
+  p_coalescedCalls = 0;
+  p_cacheHits = 0;
+}
+
+/**
+ * @brief FCGICoalescer::default_key builds the key from the method, the path
+ * (SCRIPT_NAME followed by PATH_INFO) and the query string. Only GET and HEAD
+ * requests without post data are coalesced, any other method may change
+ * something and always runs the handler. Note that cookies are not part of
+ * the key, so only use the default for responses which are the same for
+ * every user.
+ * @param req the request to compute the key for
+ * @return the key, or an empty string if the request should not be coalesced
+ */
+std::string FCGICoalescer::default_key(FCGIRequest &req)
+{
+  const FCGIRouter::Method m = req.method_id();
+  if ((m != FCGIRouter::GET && m != FCGIRouter::HEAD) || !req.postData()->empty())
+    return std::string();
+  std::string rv = (m == FCGIRouter::GET) ? "GET " : "HEAD ";
+  rv.append(req.path());
+  rv.append(1,'?');
+  rv.append(req.query_string());
+  return rv;
+}
+
+/**
+ * @brief FCGICoalescer::dispatch answers the request, either from the cache,
+ * by parking it behind a handler run already in progress for the same key,
+ * or by running the handler and writing the result to every parked request.
+ * A parked request returns right away, the thread is not blocked on it.
+ * @param req the request to answer
+ * @return true if the request was answered or parked, false if the response
+ * could not be sent or the handler threw
+ */
+bool FCGICoalescer::dispatch(FCGIRequest &req)
+{
+  std::string key = p_keyFunc(req);
+  if (key.empty())
+  {
+    FCGIResponse resp(req.FCGXHandle());
+    p_handlerCalls++;
+    p_handler(req,resp);
+    return resp.send();
+  }
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::shared_ptr<FCGIData> stale;
+  // A cached copy is sent after the lock is let go, a slow client must not
+  // hold up the requests for every other key
+  std::shared_ptr<FCGIData> cached;
+  {
+    std::lock_guard<std::mutex> l(p_mutex);
+    Entry &e = p_entries[key];
+    if (e.response && now < e.expires)
+      cached = e.response;
+    else
+    {
+      if (e.response && now < e.expires + p_staleWindow)
+        stale = e.response;
+      if (e.inFlight)
+      {
+        if (!stale)
+        {
+          e.waiters.push_back(req);
+          p_coalescedCalls++;
+          return true;
+        }
+        cached.swap(stale);
+      } else {
+        e.inFlight = true;
+        p_handlerCalls++;
+      }
+    }
+  }
+  if (cached)
+  {
+    p_cacheHits++;
+    return FCGIResponse::send_serialized(req.FCGXHandle(),*cached);
+  }
+
+  // We are the leader, a stale copy is answered right away and the
+  // handler only refreshes the cache
+  bool rv = true;
+  if (stale)
+    rv = FCGIResponse::send_serialized(req.FCGXHandle(),*stale);
+
+  std::shared_ptr<FCGIData> out = std::make_shared<FCGIData>();
+  FCGIResponse resp(req.FCGXHandle());
+  bool ok = true;
+  try
+  {
+    p_handler(req,resp);
+  } catch (...) {
+    ok = false;
+    resp = FCGIResponse(req.FCGXHandle());
+    resp.set_status_code(500);
+  }
+  resp.serialize(*out);
+
+  std::vector<FCGIRequest> waiters;
+  {
+    std::lock_guard<std::mutex> l(p_mutex);
+    Entry &e = p_entries[key];
+    e.inFlight = false;
+    waiters.swap(e.waiters);
+    if (ok && p_ttl.count() > 0 && resp.status() >= 200 && resp.status() < 300)
+    {
+      e.response = out;
+      e.expires = std::chrono::steady_clock::now() + p_ttl;
+    } else if (!e.response) {
+      p_entries.erase(key);
+    }
+    if (p_entries.size() > p_maxEntries)
+      prune(now);
+  }
+
+  if (!stale)
+    rv = FCGIResponse::send_serialized(req.FCGXHandle(),*out);
+  for (FCGIRequest &w: waiters)
+  {
+    FCGIResponse::send_serialized(w.FCGXHandle(),*out);
+  }
+  return rv && ok;
+}
+
+/**
+ * @brief FCGICoalescer::invalidate drops the cached response for a key, the
+ * next request for it runs the handler again
+ * @param key the key as returned by the key function
+ */
+void FCGICoalescer::invalidate(std::string key)
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  auto it = p_entries.find(key);
+  if (it == p_entries.end())
+    return;
+  if (it->second.inFlight)
+    it->second.response.reset();
+  else
+    p_entries.erase(it);
+}
+
+/**
+ * @brief FCGICoalescer::clear drops every cached response. Handler runs in
+ * progress are left alone so their parked requests are still answered
+ */
+void FCGICoalescer::clear()
+{
+  std::lock_guard<std::mutex> l(p_mutex);
+  for (auto it = p_entries.begin(); it != p_entries.end(); )
+  {
+    if (it->second.inFlight)
+    {
+      it->second.response.reset();
+      it++;
+    } else {
+      it = p_entries.erase(it);
+    }
+  }
+}
+
+// Removes entries which are past their stale window, called with the lock held
+void FCGICoalescer::prune(std::chrono::steady_clock::time_point now)
+{
+  for (auto it = p_entries.begin(); it != p_entries.end(); )
+  {
+    if (!it->second.inFlight && it->second.expires + p_staleWindow <= now)
+      it = p_entries.erase(it);
+    else
+      it++;
+  }
+}
@@ -33,83 +33,183 @@
 #include <cstring>
 #endif
 
+#include <cstdlib>
+
 #include <fcgi_request_cpp.hxx>
 
 FCGIData::FCGIData()
 {
-  p_data.clear();
+  p_ptr = p_inline;
+  p_size = 0;
+  p_capacity = INLINE_SIZE;
 }
 
-FCGIData::FCGIData(std::string &s)
+FCGIData::FCGIData(const std::string &s)
   :FCGIData()
 {
-  p_data.resize(s.size());
-  memset(p_data.data(),0,s.size());
-  memcpy(p_data.data(),s.data(),s.size());
+  append(s.data(),s.size());
 }
 
 FCGIData::FCGIData(const char *p,size_t sz)
   :FCGIData()
 {
-  p_data.resize(sz);
-  memset(p_data.data(),0,sz);
-  memcpy(p_data.data(),p,sz);
+  append(p,sz);
 }
 
-bool FCGIData::resizeTo(size_t sz)
+FCGIData::FCGIData(const FCGIData &o)
+  :FCGIData()
 {
-  p_data.resize(sz);
-  return (p_data.size() == sz);
+  append(o.p_ptr,o.p_size);
 }
 
-bool FCGIData::append(char c)
+FCGIData::FCGIData(FCGIData &&o) noexcept
+  :FCGIData()
 {
-  size_t sz = p_data.size();
-  p_data.push_back(c);
-  return (p_data.size() == (sz+1));
+  swap(o);
 }
 
-char FCGIData::at(const size_t i)
-{  
-  if (p_data.size() <= i)
-    return 0xff;
-  const char rv = p_data.at(i);
-  return rv;
+FCGIData::~FCGIData()
+{
+  if (on_heap())
+    free(p_ptr);
 }
 
-bool FCGIData::append(const char *s)
+FCGIData &FCGIData::operator=(const FCGIData &o)
+{
+  if (this != &o)
+  {
+    p_size = 0;
+    append(o.p_ptr,o.p_size);
+  }
+  return *this;
+}
+
+FCGIData &FCGIData::operator=(FCGIData &&o) noexcept
 {
-  size_t sz = p_data.size();
-  sz += strlen(s);
-  char *p = const_cast<char *>(s);
-  while (*p)
+  if (this != &o)
   {
-    p_data.push_back(*p);
-    p++;
+    release();
+    swap(o);
   }
-  return (p_data.size() == sz);
+  return *this;
 }
 
-bool FCGIData::append(std::string &s)
+/**
+ * @brief FCGIData::swap exchanges the contents of two objects, heap
+ * buffers change owner and inline bytes are copied
+ */
+void FCGIData::swap(FCGIData &o) noexcept
+{
+  if (on_heap() && o.on_heap())
+  {
+    std::swap(p_ptr,o.p_ptr);
+  } else if (on_heap()) {
+    memcpy(p_inline,o.p_inline,o.p_size);
+    o.p_ptr = p_ptr;
+    p_ptr = p_inline;
+  } else if (o.on_heap()) {
+    memcpy(o.p_inline,p_inline,p_size);
+    p_ptr = o.p_ptr;
+    o.p_ptr = o.p_inline;
+  } else {
+    char tmp[INLINE_SIZE];
+    memcpy(tmp,p_inline,p_size);
+    memcpy(p_inline,o.p_inline,o.p_size);
+    memcpy(o.p_inline,tmp,p_size);
+  }
+  std::swap(p_size,o.p_size);
+  std::swap(p_capacity,o.p_capacity);
+}
+
+void FCGIData::release()
 {
-  size_t sz = p_data.size();
-  sz += s.size();
-  const char *p = s.data();
-  size_t i = 0;
-  const size_t ssz = s.size();
-  while (i < ssz)
+  if (on_heap())
+    free(p_ptr);
+  p_ptr = p_inline;
+  p_size = 0;
+  p_capacity = INLINE_SIZE;
+}
+
+bool FCGIData::reserve(size_t sz)
+{
+  if (sz <= p_capacity)
+    return true;
+  char *p;
+  if (on_heap())
   {
-    p_data.push_back(*p);
-    p++; i++;
+    p = static_cast<char *>(realloc(p_ptr,sz));
+  } else {
+    p = static_cast<char *>(malloc(sz));
+    if (p && p_size > 0)
+      memcpy(p,p_inline,p_size);
   }
-  return (p_data.size() == sz);
+  if (!p)
+    return false;
+  p_ptr = p;
+  p_capacity = sz;
+  return true;
+}
+
+// Grows to at least sz, by half again as much as there is at the least,
+// so a run of appends only reallocates a logarithmic number of times
+bool FCGIData::grow(size_t sz)
+{
+  if (sz <= p_capacity)
+    return true;
+  size_t next = p_capacity + p_capacity / 2;
+  return reserve((next > sz) ? next : sz);
+}
+
+bool FCGIData::resizeTo(size_t sz)
+{
+  if (!grow(sz))
+    return false;
+  p_size = sz;
+  return true;
+}
+
+char FCGIData::at(const size_t i) const
+{
+  if (p_size <= i)
+    return 0xff;
+  return p_ptr[i];
+}
+
+bool FCGIData::append(const char *p,size_t sz)
+{
+  if (sz == 0)
+    return true;
+  if (p_size + sz > p_capacity)
+  {
+    // Appending a part of itself, which growing may move
+    const bool own = (p >= p_ptr && p < p_ptr + p_size);
+    const size_t off = own ? p - p_ptr : 0;
+    if (!grow(p_size + sz))
+      return false;
+    if (own)
+      p = p_ptr + off;
+  }
+  memcpy(p_ptr + p_size,p,sz);
+  p_size += sz;
+  return true;
+}
+
+bool FCGIData::append(const char *s)
+{
+  return append(s,strlen(s));
+}
+
+bool FCGIData::append(const std::string &s)
+{
+  return append(s.data(),s.size());
+}
+
+bool FCGIData::append(const FCGIData &d)
+{
+  return append(d.p_ptr,d.p_size);
 }
 
-std::string FCGIData::toStdString()
+std::string FCGIData::toStdString() const
 {
-  std::string rv;
-  rv.resize(p_data.size());
-  char *dest = const_cast<char *>(rv.data());
-  memcpy(dest,p_data.data(),p_data.size());
-  return rv;
+  return std::string(p_ptr,p_size);
 }
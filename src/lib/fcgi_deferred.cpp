@@ -0,0 +1,204 @@
+#include <config.h>
+
+#include <fcgi_request_cpp.hxx>
+#include "fcgi_native.hxx"
+
+/**
+ * @brief The FCGIDeferred::State struct is the request the handles share,
+ * until it is answered. Calls from several threads are serialized.
+ */
+struct FCGIDeferred::State
+{
+  std::mutex mutex;
+  std::shared_ptr<FCGX_Request> handle;
+  // The token of the listener, so drain() waits for the request
+  std::shared_ptr<void> attached;
+  bool streaming = false;
+  bool done = false;
+  int status = 0;
+  size_t bytes = 0;
+  FCGIRequestTimes::Time responded;
+
+  ~State();
+  void release();
+};
+
+// Lets go of the request, freeing it like FCGIRequest does if this was
+// the last reference
+void FCGIDeferred::State::release()
+{
+  if (handle && handle.use_count() < 2)
+    FCGI::freeRequest(handle.get());
+  handle.reset();
+  attached.reset();
+}
+
+FCGIDeferred::State::~State()
+{
+  if (handle && !done)
+  {
+    // Nobody answered, the web server gets what was written
+    FCGI::finishRequest(handle.get());
+    if (streaming)
+      FCGI::responseFinished(handle.get(),responded,status,bytes);
+  }
+  release();
+}
+
+/**
+ * @brief FCGIDeferred::FCGIDeferred takes over answering the request and
+ * parks it, the handler may return right away
+ * @param req the request, the handle is invalid if it is
+ */
+FCGIDeferred::FCGIDeferred(FCGIRequest &req)
+{
+  if (!req.valid())
+    return;
+  req.p_deferred = true;
+  p_state = std::make_shared<State>();
+  p_state->handle = req.p_fcgiHandle;
+  p_state->attached = req.p_attached;
+  FCGI::parkRequest(p_state->handle.get());
+}
+
+const FCGX_Request *FCGIDeferred::FCGXHandle()
+{
+  if (!p_state)
+    return nullptr;
+  std::lock_guard<std::mutex> l(p_state->mutex);
+  return p_state->handle.get();
+}
+
+/**
+ * @brief FCGIDeferred::complete sends a whole response, the request is then
+ * released
+ * @param resp the response, made with FCGXHandle()
+ * @return true if sent, false if already answered or streaming, or the
+ * connection failed
+ */
+bool FCGIDeferred::complete(FCGIResponse &resp)
+{
+  if (!p_state)
+    return false;
+  std::lock_guard<std::mutex> l(p_state->mutex);
+  if (!p_state->handle || p_state->done || p_state->streaming)
+    return false;
+  bool rv = resp.send();
+  p_state->done = true;
+  p_state->release();
+  return rv;
+}
+
+/**
+ * @brief FCGIDeferred::begin sends the head of a streamed response
+ * @param resp the response, made with FCGXHandle()
+ * @return true if sent, false if already answered or streaming, or the
+ * connection failed
+ */
+bool FCGIDeferred::begin(FCGIResponse &resp)
+{
+  if (!p_state)
+    return false;
+  std::lock_guard<std::mutex> l(p_state->mutex);
+  if (!p_state->handle || p_state->done || p_state->streaming)
+    return false;
+  p_state->responded = std::chrono::steady_clock::now();
+  p_state->status = resp.status();
+  if (!resp.send_head())
+    return false;
+  p_state->streaming = true;
+  FCGI::parkRequest(p_state->handle.get());
+  return true;
+}
+
+/**
+ * @brief FCGIDeferred::write writes a piece of the body and flushes it, so
+ * it reaches the client now
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return true if written
+ */
+bool FCGIDeferred::write(const char *data,size_t len)
+{
+  if (!p_state)
+    return false;
+  std::lock_guard<std::mutex> l(p_state->mutex);
+  if (!p_state->handle || p_state->done || !p_state->streaming)
+    return false;
+  if (len == 0)
+    return true;
+  struct iovec iov = { const_cast<char *>(data), len };
+  if (!FCGI::putGather(p_state->handle.get(),&iov,1) || !FCGI::flushStdout(p_state->handle.get()))
+    return false;
+  p_state->bytes += len;
+  return true;
+}
+
+/**
+ * @brief FCGIDeferred::write_event writes an event in the text/event-stream
+ * format, ending it with a blank line so the client dispatches it
+ * @param data the data, split into a field per line
+ * @param event the event type, none if empty
+ * @param id the event id, none if empty
+ * @return true if written
+ */
+bool FCGIDeferred::write_event(const std::string &data,const std::string &event,const std::string &id)
+{
+  std::string out;
+  out.reserve(data.size() + event.size() + id.size() + 24);
+  if (!event.empty())
+    out.append("event: ").append(event).append("\n");
+  if (!id.empty())
+    out.append("id: ").append(id).append("\n");
+  size_t pos = 0;
+  do
+  {
+    size_t end = data.find('\n',pos);
+    if (end == std::string::npos)
+      end = data.size();
+    size_t len = end - pos;
+    if (len > 0 && data[end-1] == '\r')
+      len--;
+    out.append("data: ").append(data,pos,len).append("\n");
+    pos = end + 1;
+  } while (pos <= data.size());
+  out.append("\n");
+  return write(out);
+}
+
+/**
+ * @brief FCGIDeferred::finish ends a streamed response, the request is
+ * then released
+ * @return true if ended, false if not streaming or already done, or the
+ * connection failed
+ */
+bool FCGIDeferred::finish()
+{
+  if (!p_state)
+    return false;
+  std::lock_guard<std::mutex> l(p_state->mutex);
+  if (!p_state->handle || p_state->done || !p_state->streaming)
+    return false;
+  const bool aborted = FCGI::requestAborted(p_state->handle.get());
+  FCGI::finishRequest(p_state->handle.get());
+  FCGI::responseFinished(p_state->handle.get(),p_state->responded,p_state->status,p_state->bytes);
+  p_state->done = true;
+  p_state->release();
+  return !aborted;
+}
+
+bool FCGIDeferred::done()
+{
+  if (!p_state)
+    return false;
+  std::lock_guard<std::mutex> l(p_state->mutex);
+  return p_state->done;
+}
+
+bool FCGIDeferred::aborted()
+{
+  if (!p_state)
+    return false;
+  std::lock_guard<std::mutex> l(p_state->mutex);
+  return (p_state->handle && FCGI::requestAborted(p_state->handle.get()));
+}
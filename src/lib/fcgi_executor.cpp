@@ -0,0 +1,348 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include <queue>
+
+#include <fcgi_request_cpp.hxx>
+
+/**
+ * @brief The FCGIExecutor::Loop struct is an event loop thread: its epoll
+ * set, the waiters of each socket, the timers as a heap, and an eventfd
+ * the listener wakes it with when requests were queued
+ */
+struct FCGIExecutor::Loop
+{
+  struct Watch
+  {
+    Waiter *rd = nullptr;
+    Waiter *wr = nullptr;
+    // The events the socket is registered for, 0 if it is not
+    uint32_t events = 0;
+  };
+  struct Timer
+  {
+    std::chrono::steady_clock::time_point when;
+    uint64_t seq;
+    Waiter *waiter;
+    bool operator>(const Timer &o) const { return (when > o.when || (when == o.when && seq > o.seq)); }
+  };
+
+  int ep = -1;
+  int wake = -1;
+  std::unordered_map<int,Watch> watches;
+  std::priority_queue<Timer,std::vector<Timer>,std::greater<Timer>> timers;
+  uint64_t timerSeq = 0;
+  // Read by notify() on the accept threads
+  std::atomic<size_t> inFlight;
+  size_t maxInFlight = 0;
+  // Whether to look at the queue, ie once a full loop has room again
+  bool poll = true;
+
+  Loop(): inFlight(0) {}
+  ~Loop()
+  {
+    if (ep >= 0)
+      ::close(ep);
+    if (wake >= 0)
+      ::close(wake);
+  }
+};
+
+thread_local FCGIExecutor::Loop *FCGIExecutor::p_current = nullptr;
+
+/**
+ * @brief FCGIExecutor::FCGIExecutor
+ * @param listener the listener to take the requests from, its queue
+ * notification is taken over by the executor
+ * @param threads the number of event loops
+ */
+FCGIExecutor::FCGIExecutor(FCGIListener &listener,int threads)
+  : p_listener(listener)
+{
+  p_threads = std::max(threads,1);
+  p_maxInFlight = 1024;
+  p_next = 0;
+  p_finishing = false;
+}
+
+FCGIExecutor::~FCGIExecutor()
+{
+}
+
+// Wakes a loop with room for another request, the listener calls it from
+// its accept threads
+void FCGIExecutor::notify()
+{
+  if (p_loops.empty())
+    return;
+  uint64_t one = 1;
+  const size_t n = p_loops.size();
+  const size_t start = p_next++ % n;
+  for (size_t i = 0; i < n; i++)
+  {
+    Loop *l = p_loops[(start + i) % n].get();
+    if (l->inFlight < p_maxInFlight || i == n - 1)
+    {
+      if (::write(l->wake,&one,sizeof(one)) < 0 && errno != EAGAIN)
+        p_errorString = strerror(errno);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief FCGIExecutor::run sets up the loops and runs them, the calling
+ * thread running the first
+ * @param spawn starts the work on a request
+ * @return true once the listener finished and all requests are done,
+ * false and sets the error string if the loops could not be set up
+ */
+bool FCGIExecutor::run(Spawn spawn)
+{
+  p_errorString.clear();
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+  p_loops.clear();
+  p_finishing = false;
+  for (int i = 0; i < p_threads; i++)
+  {
+    std::unique_ptr<Loop> l(new Loop());
+    l->maxInFlight = p_maxInFlight;
+    l->ep = ::epoll_create1(EPOLL_CLOEXEC);
+    l->wake = ::eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+    if (l->ep < 0 || l->wake < 0)
+    {
+      p_errorString = std::string("event loop: ") + strerror(errno);
+      p_loops.clear();
+      return false;
+    }
+    struct epoll_event ev;
+    memset(&ev,0,sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = l->wake;
+    ::epoll_ctl(l->ep,EPOLL_CTL_ADD,l->wake,&ev);
+    p_loops.push_back(std::move(l));
+  }
+  p_listener.set_queue_notify([this]() { notify(); });
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < p_loops.size(); i++)
+    threads.emplace_back(&FCGIExecutor::loop_main,this,p_loops[i].get(),std::cref(spawn));
+  loop_main(p_loops[0].get(),spawn);
+  for (std::thread &t: threads)
+    t.join();
+  p_listener.set_queue_notify(nullptr);
+  p_loops.clear();
+  return true;
+#else
+  (void)spawn;
+  p_errorString = "FCGIExecutor is not supported on this platform";
+  return false;
+#endif
+}
+
+// Runs a loop until the listener finished and its requests are done
+void FCGIExecutor::loop_main(Loop *l,const Spawn &spawn)
+{
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+  FCGI::SetThreadName("FCGI Executor");
+  p_current = l;
+  std::vector<Waiter *> ready;
+  struct epoll_event events[64];
+  // Requests queued before the loop started have no wake up of their own
+  l->poll = true;
+  for (;;)
+  {
+    if (l->poll)
+    {
+      FCGIRequest req(nullptr);
+      while (l->inFlight < p_maxInFlight && p_listener.try_next_request(req))
+      {
+        l->inFlight++;
+        spawn(req);
+      }
+      if (p_listener.finished() && !p_finishing.exchange(true))
+      {
+        // Every loop has to see it, not only the one which was woken
+        uint64_t one = 1;
+        for (std::unique_ptr<Loop> &o: p_loops)
+        {
+          if (::write(o->wake,&one,sizeof(one)) < 0 && errno != EAGAIN)
+            p_errorString = strerror(errno);
+        }
+      }
+      l->poll = false;
+    }
+    if (l->inFlight == 0 && p_finishing)
+      break;
+
+    int timeout = -1;
+    if (!l->timers.empty())
+    {
+      std::chrono::steady_clock::duration d = l->timers.top().when - std::chrono::steady_clock::now();
+      // Rounded up, so the timer is due when the loop wakes
+      timeout = (d.count() <= 0) ? 0 : (int)std::chrono::duration_cast<std::chrono::milliseconds>(d + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count();
+    }
+    int n = ::epoll_wait(l->ep,events,64,timeout);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      p_errorString = std::string("epoll_wait: ") + strerror(errno);
+      break;
+    }
+    for (int i = 0; i < n; i++)
+    {
+      const int fd = events[i].data.fd;
+      if (fd == l->wake)
+      {
+        uint64_t count;
+        if (::read(l->wake,&count,sizeof(count)) < 0 && errno != EAGAIN)
+          p_errorString = strerror(errno);
+        l->poll = true;
+        continue;
+      }
+      auto it = l->watches.find(fd);
+      if (it == l->watches.end())
+        continue;
+      Loop::Watch &w = it->second;
+      const uint32_t got = events[i].events;
+      const bool failed = (got & (EPOLLERR | EPOLLHUP));
+      if (w.rd && (failed || (got & EPOLLIN)))
+      {
+        w.rd->result = (int)got;
+        ready.push_back(w.rd);
+        w.rd = nullptr;
+      }
+      if (w.wr && (failed || (got & EPOLLOUT)))
+      {
+        w.wr->result = (int)got;
+        ready.push_back(w.wr);
+        w.wr = nullptr;
+      }
+      const uint32_t want = (w.rd ? (uint32_t)EPOLLIN : 0) | (w.wr ? (uint32_t)EPOLLOUT : 0);
+      if (want == 0)
+      {
+        ::epoll_ctl(l->ep,EPOLL_CTL_DEL,fd,nullptr);
+        l->watches.erase(it);
+      } else if (want != w.events) {
+        struct epoll_event ev;
+        memset(&ev,0,sizeof(ev));
+        ev.events = want;
+        ev.data.fd = fd;
+        ::epoll_ctl(l->ep,EPOLL_CTL_MOD,fd,&ev);
+        w.events = want;
+      }
+    }
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (!l->timers.empty() && l->timers.top().when <= now)
+    {
+      ready.push_back(l->timers.top().waiter);
+      l->timers.pop();
+    }
+    // Fired only now, the waiters go on to wait for more
+    for (Waiter *w: ready)
+      w->fire(w);
+    ready.clear();
+  }
+  p_current = nullptr;
+#else
+  (void)l;
+  (void)spawn;
+#endif
+}
+
+void FCGIExecutor::task_done()
+{
+  Loop *l = p_current;
+  if (l && l->inFlight > 0)
+  {
+    // A full loop is passed over by notify(), so it looks for itself
+    if (l->inFlight-- >= l->maxInFlight)
+      l->poll = true;
+  }
+}
+
+/**
+ * @brief FCGIExecutor::wait_fd registers the socket with the epoll set of
+ * the loop for the direction waited for, on top of the other if a waiter
+ * waits for that
+ * @param fd the socket
+ * @param write whether to wait for it to be writable rather than readable
+ * @param w the waiter, fired with the events of the socket
+ * @return true if waiting, false and sets errno if not
+ */
+bool FCGIExecutor::wait_fd(int fd,bool write,Waiter *w)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  Loop *l = p_current;
+  if (!l)
+  {
+    errno = EPERM;
+    return false;
+  }
+  Loop::Watch &watch = l->watches[fd];
+  Waiter *&slot = write ? watch.wr : watch.rd;
+  if (slot)
+  {
+    errno = EBUSY;
+    return false;
+  }
+  slot = w;
+  const uint32_t want = (watch.rd ? (uint32_t)EPOLLIN : 0) | (watch.wr ? (uint32_t)EPOLLOUT : 0);
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev));
+  ev.events = want;
+  ev.data.fd = fd;
+  int rc = ::epoll_ctl(l->ep,watch.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,fd,&ev);
+  // A socket closed while it was registered left the set on its own
+  if (rc != 0 && errno == ENOENT)
+    rc = ::epoll_ctl(l->ep,EPOLL_CTL_ADD,fd,&ev);
+  if (rc != 0)
+  {
+    const int err = errno;
+    slot = nullptr;
+    if (!watch.rd && !watch.wr)
+      l->watches.erase(fd);
+    errno = err;
+    return false;
+  }
+  watch.events = want;
+  return true;
+#else
+  (void)fd;
+  (void)write;
+  (void)w;
+  errno = ENOSYS;
+  return false;
+#endif
+}
+
+/**
+ * @brief FCGIExecutor::wait_until adds a timer to the loop
+ * @param when the time to fire the waiter at
+ * @param w the waiter
+ * @return true if waiting, false and sets errno if not on a loop thread
+ */
+bool FCGIExecutor::wait_until(std::chrono::steady_clock::time_point when,Waiter *w)
+{
+  Loop *l = p_current;
+  if (!l)
+  {
+    errno = EPERM;
+    return false;
+  }
+  l->timers.push({ when, l->timerSeq++, w });
+  return true;
+}
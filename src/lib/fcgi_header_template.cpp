@@ -0,0 +1,100 @@
+#include <config.h>
+#ifdef HAVE_STRINGS_H
+#include <strings.h>
+#endif
+
+#include <fcgi_request_cpp.hxx>
+
+namespace
+{
+bool same_name(const char *a,size_t aLen,const std::string &b)
+{
+  return (aLen == b.size() && strncasecmp(a,b.data(),aLen) == 0);
+}
+}
+
+/**
+ * @brief FCGIHeaderTemplate::FCGIHeaderTemplate renders the headers after
+ * the server name, so it is built after FCGI::setServerName()
+ * @param headers the names and values
+ */
+FCGIHeaderTemplate::FCGIHeaderTemplate(const Headers &headers)
+{
+  // Header names are not case sensitive, the last one of a name wins
+  Headers lines;
+  const std::string &server = FCGI::serverName();
+  if (!server.empty())
+    lines.emplace_back("Server",server);
+  for (const std::pair<std::string,std::string> &h: headers)
+  {
+    Headers::iterator it = lines.begin();
+    while (it != lines.end() && !same_name(it->first.data(),it->first.size(),h.first))
+      ++it;
+    if (it != lines.end())
+      *it = h;
+    else
+      lines.push_back(h);
+  }
+  for (const std::pair<std::string,std::string> &h: lines)
+  {
+    Line l;
+    l.offset = p_block.size();
+    l.nameLen = h.first.size();
+    p_block.append(h.first);
+    p_block.append(": ",2);
+    p_block.append(h.second);
+    p_block.append("\r\n",2);
+    l.len = p_block.size() - l.offset;
+    p_lines.push_back(l);
+  }
+}
+
+/**
+ * @brief FCGIHeaderTemplate::has tells if the template sets a header
+ * @param name the header name, in any case
+ * @return true if it is among its headers
+ */
+bool FCGIHeaderTemplate::has(const std::string &name) const
+{
+  for (const Line &l: p_lines)
+  {
+    if (same_name(p_block.data() + l.offset,l.nameLen,name))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief FCGIHeaderTemplate::append_to appends the rendered headers, the
+ * whole block at once unless some of them are overridden
+ * @param out the header block of a response
+ * @param overrides the headers set on the response, the lines of the same
+ * names are left out, the caller renders these itself
+ */
+void FCGIHeaderTemplate::append_to(std::string &out,const std::map<std::string,std::string> &overrides) const
+{
+  if (overrides.empty())
+  {
+    out.append(p_block);
+    return;
+  }
+  // Runs of lines which are kept are copied in one go
+  size_t from = 0;
+  for (const Line &l: p_lines)
+  {
+    bool overridden = false;
+    for (const std::pair<const std::string,std::string> &h: overrides)
+    {
+      if (same_name(p_block.data() + l.offset,l.nameLen,h.first))
+      {
+        overridden = true;
+        break;
+      }
+    }
+    if (!overridden)
+      continue;
+    out.append(p_block,from,l.offset - from);
+    from = l.offset + l.len;
+  }
+  out.append(p_block,from,std::string::npos);
+}
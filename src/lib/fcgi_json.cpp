@@ -0,0 +1,704 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#include <cstdlib>
+#include <limits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <fcgi_request_cpp.hxx>
+
+// The bit set on the type of an object member value, its name is the node
+// before it
+static const uint8_t MEMBER = 0x80;
+
+static inline uint64_t prefix_xor(uint64_t x)
+{
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+// The characters escaped by a backslash, ie those right after a run of an
+// odd number of backslashes, the run may start in the block before
+static inline uint64_t find_escaped(uint64_t bs,uint64_t &prevOdd)
+{
+  const uint64_t evenBits = 0x5555555555555555ULL;
+  const uint64_t oddBits = ~evenBits;
+  uint64_t startEdges = bs & ~(bs << 1);
+  uint64_t evenStartMask = evenBits ^ prevOdd;
+  uint64_t evenStarts = startEdges & evenStartMask;
+  uint64_t oddStarts = startEdges & ~evenStartMask;
+  uint64_t evenCarries = bs + evenStarts;
+  uint64_t oddCarries;
+  bool endsOdd = __builtin_add_overflow(bs,oddStarts,&oddCarries);
+  oddCarries |= prevOdd;
+  prevOdd = endsOdd ? 1 : 0;
+  uint64_t evenCarryEnds = evenCarries & ~bs;
+  uint64_t oddCarryEnds = oddCarries & ~bs;
+  return (evenCarryEnds & oddBits) | (oddCarryEnds & evenBits);
+}
+
+namespace
+{
+// The character classes of a 64 byte block as a bit per byte
+struct Masks
+{
+  uint64_t backslash;
+  uint64_t quote;
+  uint64_t op;
+  uint64_t space;
+  uint64_t control;
+  uint64_t high;
+};
+
+#ifdef __SSE2__
+inline uint64_t movemask(__m128i a,__m128i b,__m128i c,__m128i d)
+{
+  return (uint64_t)(uint16_t)_mm_movemask_epi8(a) | ((uint64_t)(uint16_t)_mm_movemask_epi8(b) << 16) |
+         ((uint64_t)(uint16_t)_mm_movemask_epi8(c) << 32) | ((uint64_t)(uint16_t)_mm_movemask_epi8(d) << 48);
+}
+
+inline void classify(const char *p,Masks &m)
+{
+  __m128i v[4];
+  for (int i = 0; i < 4; i++)
+    v[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+  const __m128i bs = _mm_set1_epi8('\\'), quote = _mm_set1_epi8('"');
+  // [ and ] are { and } with the 0x20 bit clear
+  const __m128i lower = _mm_set1_epi8(0x20), open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+  const __m128i colon = _mm_set1_epi8(':'), comma = _mm_set1_epi8(',');
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+  __m128i r[4];
+#define FCGI_JSON_MASK(expr) \
+  for (int i = 0; i < 4; i++) \
+  { \
+    const __m128i x = v[i]; \
+    r[i] = (expr); \
+  }
+  FCGI_JSON_MASK(_mm_cmpeq_epi8(x,bs));
+  m.backslash = movemask(r[0],r[1],r[2],r[3]);
+  FCGI_JSON_MASK(_mm_cmpeq_epi8(x,quote));
+  m.quote = movemask(r[0],r[1],r[2],r[3]);
+  FCGI_JSON_MASK(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(x,lower),open),_mm_cmpeq_epi8(_mm_or_si128(x,lower),close)),
+                              _mm_or_si128(_mm_cmpeq_epi8(x,colon),_mm_cmpeq_epi8(x,comma))));
+  m.op = movemask(r[0],r[1],r[2],r[3]);
+  FCGI_JSON_MASK(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x,sp),_mm_cmpeq_epi8(x,tab)),
+                              _mm_or_si128(_mm_cmpeq_epi8(x,nl),_mm_cmpeq_epi8(x,cr))));
+  m.space = movemask(r[0],r[1],r[2],r[3]);
+  // Signed, so the bytes of 0x80 and up are below 0x20 as well
+  FCGI_JSON_MASK(_mm_cmplt_epi8(x,lower));
+  m.high = movemask(v[0],v[1],v[2],v[3]);
+  m.control = movemask(r[0],r[1],r[2],r[3]) & ~m.high;
+#undef FCGI_JSON_MASK
+}
+#else
+enum
+{
+  C_BACKSLASH = 1,
+  C_QUOTE = 2,
+  C_OP = 4,
+  C_SPACE = 8,
+  C_CONTROL = 16,
+  C_HIGH = 32
+};
+
+struct ClassTable
+{
+  uint8_t c[256];
+  ClassTable()
+  {
+    for (int i = 0; i < 256; i++)
+      c[i] = (i < 0x20) ? C_CONTROL : (i >= 0x80) ? C_HIGH : 0;
+    c[(uint8_t)'\\'] = C_BACKSLASH;
+    c[(uint8_t)'"'] = C_QUOTE;
+    for (const char *p = "{}[]:,"; *p; p++)
+      c[(uint8_t)*p] = C_OP;
+    // Tabs and line ends are not allowed in strings either
+    for (const char *p = "\t\n\r"; *p; p++)
+      c[(uint8_t)*p] = C_SPACE | C_CONTROL;
+    c[(uint8_t)' '] = C_SPACE;
+  }
+};
+
+const ClassTable classes;
+
+inline void classify(const char *p,Masks &m)
+{
+  memset(&m,0,sizeof(m));
+  for (int i = 0; i < 64; i++)
+  {
+    const uint8_t c = classes.c[(uint8_t)p[i]];
+    const uint64_t bit = (uint64_t)1 << i;
+    if (c & C_BACKSLASH) m.backslash |= bit;
+    if (c & C_QUOTE) m.quote |= bit;
+    if (c & C_OP) m.op |= bit;
+    if (c & C_SPACE) m.space |= bit;
+    if (c & C_CONTROL) m.control |= bit;
+    if (c & C_HIGH) m.high |= bit;
+  }
+}
+#endif
+
+inline bool is_space(char c)
+{
+  return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+}
+
+inline bool is_hex(char c)
+{
+  return ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'));
+}
+
+inline int hex_value(char c)
+{
+  return (c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+bool valid_utf8(const unsigned char *p,size_t len)
+{
+  const unsigned char *ep = p + len;
+  while (p < ep)
+  {
+    unsigned char c = *p++;
+    if (c < 0x80)
+      continue;
+    size_t n;
+    uint32_t cp;
+    if (c >= 0xc2 && c <= 0xdf)
+    {
+      n = 1;
+      cp = c & 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 2;
+      cp = c & 0x0f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 3;
+      cp = c & 0x07;
+    } else
+      return false;
+    if ((size_t)(ep - p) < n)
+      return false;
+    for (size_t i = 0; i < n; i++)
+    {
+      if ((p[i] & 0xc0) != 0x80)
+        return false;
+      cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    p += n;
+    // Overlong forms, surrogates and past the last code point
+    if ((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+      return false;
+  }
+  return true;
+}
+
+// The length of a valid number at the start of p, 0 if there is none
+size_t number_length(const char *p,size_t len)
+{
+  size_t i = 0;
+  if (i < len && p[i] == '-')
+    i++;
+  if (i >= len)
+    return 0;
+  if (p[i] == '0')
+    i++;
+  else if (p[i] >= '1' && p[i] <= '9')
+  {
+    while (i < len && p[i] >= '0' && p[i] <= '9')
+      i++;
+  } else
+    return 0;
+  if (i < len && p[i] == '.')
+  {
+    size_t d = ++i;
+    while (i < len && p[i] >= '0' && p[i] <= '9')
+      i++;
+    if (i == d)
+      return 0;
+  }
+  if (i < len && (p[i] == 'e' || p[i] == 'E'))
+  {
+    i++;
+    if (i < len && (p[i] == '+' || p[i] == '-'))
+      i++;
+    size_t d = i;
+    while (i < len && p[i] >= '0' && p[i] <= '9')
+      i++;
+    if (i == d)
+      return 0;
+  }
+  return i;
+}
+
+void put_utf8(std::string &out,uint32_t cp)
+{
+  if (cp < 0x80)
+    out.push_back((char)cp);
+  else if (cp < 0x800)
+  {
+    out.push_back((char)(0xc0 | (cp >> 6)));
+    out.push_back((char)(0x80 | (cp & 0x3f)));
+  } else if (cp < 0x10000) {
+    out.push_back((char)(0xe0 | (cp >> 12)));
+    out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+    out.push_back((char)(0x80 | (cp & 0x3f)));
+  } else {
+    out.push_back((char)(0xf0 | (cp >> 18)));
+    out.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+    out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+    out.push_back((char)(0x80 | (cp & 0x3f)));
+  }
+}
+
+// Unescapes a string the first stage found well formed
+void unescape(const char *p,size_t len,std::string &out)
+{
+  out.clear();
+  out.reserve(len);
+  const char *ep = p + len;
+  while (p < ep)
+  {
+    const char *bs = static_cast<const char *>(memchr(p,'\\',ep - p));
+    if (!bs)
+    {
+      out.append(p,ep - p);
+      break;
+    }
+    out.append(p,bs - p);
+    p = bs + 2;
+    switch (bs[1])
+    {
+    case 'b': out.push_back('\b'); break;
+    case 'f': out.push_back('\f'); break;
+    case 'n': out.push_back('\n'); break;
+    case 'r': out.push_back('\r'); break;
+    case 't': out.push_back('\t'); break;
+    case 'u':
+    {
+      uint32_t cp = 0;
+      for (int i = 0; i < 4; i++)
+        cp = (cp << 4) | hex_value(p[i]);
+      p += 4;
+      if (cp >= 0xd800 && cp <= 0xdbff && ep - p >= 6 && p[0] == '\\' && p[1] == 'u')
+      {
+        uint32_t lo = 0;
+        for (int i = 0; i < 4; i++)
+          lo = (lo << 4) | hex_value(p[2 + i]);
+        if (lo >= 0xdc00 && lo <= 0xdfff)
+        {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          p += 6;
+        }
+      }
+      // A surrogate without its other half
+      if (cp >= 0xd800 && cp <= 0xdfff)
+        cp = 0xfffd;
+      put_utf8(out,cp);
+      break;
+    }
+    default:
+      out.push_back(bs[1]);
+    }
+  }
+}
+}
+
+FCGIJson::FCGIJson()
+{
+  p_text = nullptr;
+  p_size = 0;
+}
+
+bool FCGIJson::fail(size_t offset,const char *what)
+{
+  p_errorString = std::string(what) + " at offset " + std::to_string(offset);
+  p_nodes.clear();
+  p_index.clear();
+  return false;
+}
+
+/**
+ * @brief FCGIJson::parse parses a document, the text is not copied
+ * @param text the JSON text
+ * @param len its length
+ * @return true if parsed, false and sets the error string if it is not
+ * valid JSON
+ */
+bool FCGIJson::parse(const char *text,size_t len)
+{
+  p_text = text;
+  p_size = len;
+  p_nodes.clear();
+  p_index.clear();
+  p_errorString.clear();
+  // Offsets are 32 bits
+  if (len >= std::numeric_limits<uint32_t>::max() - 64)
+    return fail(0,"document too large");
+  if (!index())
+    return false;
+  bool rv = build();
+  // The index is only needed to build the tape
+  p_index.clear();
+  if (p_index.capacity() > 4096)
+    std::vector<uint32_t>().swap(p_index);
+  return rv;
+}
+
+// The first stage, finds the structural characters and checks the string
+// contents and escapes
+bool FCGIJson::index()
+{
+  uint64_t prevOdd = 0, prevInString = 0, prevScalar = 0, high = 0;
+  size_t n = 0;
+  char tail[64];
+  for (size_t base = 0; base < p_size; base += 64)
+  {
+    const char *block = p_text + base;
+    if (p_size - base < 64)
+    {
+      // Spaces past the end are neither structural nor part of a scalar
+      memset(tail,' ',sizeof(tail));
+      memcpy(tail,block,p_size - base);
+      block = tail;
+    }
+    Masks m;
+    classify(block,m);
+    const uint64_t escaped = m.backslash ? find_escaped(m.backslash,prevOdd) : (prevOdd ? (prevOdd = 0, (uint64_t)1) : 0);
+    const uint64_t quotes = m.quote & ~escaped;
+    // From an opening quote up to the character before the closing one
+    const uint64_t inString = prefix_xor(quotes) ^ prevInString;
+    prevInString = (uint64_t)((int64_t)inString >> 63);
+    if (m.control & inString)
+      return fail(base + __builtin_ctzll(m.control & inString),"control character in string");
+    uint64_t esc = escaped & inString;
+    while (esc)
+    {
+      const size_t pos = base + __builtin_ctzll(esc);
+      esc &= esc - 1;
+      if (pos >= p_size)
+        break;
+      const char c = p_text[pos];
+      if (c == 'u')
+      {
+        if (p_size - pos < 5 || !is_hex(p_text[pos + 1]) || !is_hex(p_text[pos + 2]) || !is_hex(p_text[pos + 3]) || !is_hex(p_text[pos + 4]))
+          return fail(pos - 1,"invalid unicode escape");
+      } else if (!strchr("\"\\/bfnrt",c) || c == 0) {
+        return fail(pos - 1,"invalid escape");
+      }
+    }
+    high |= m.high;
+    const uint64_t scalar = ~(m.op | m.space | quotes | inString);
+    const uint64_t scalarStart = scalar & ~((scalar << 1) | prevScalar);
+    prevScalar = scalar >> 63;
+    uint64_t structural = (m.op & ~inString) | quotes | scalarStart;
+    if (n + 64 > p_index.size())
+      p_index.resize(std::max(p_index.size() * 2,n + 64));
+    uint32_t *out = p_index.data() + n;
+    while (structural)
+    {
+      *out++ = (uint32_t)(base + __builtin_ctzll(structural));
+      structural &= structural - 1;
+    }
+    n = out - p_index.data();
+  }
+  p_index.resize(n);
+  if (prevInString)
+    return fail(p_size,"unterminated string");
+  if (high && !valid_utf8(reinterpret_cast<const unsigned char *>(p_text),p_size))
+    return fail(0,"invalid UTF-8");
+  return true;
+}
+
+// The second stage, builds the tape from the structural characters
+bool FCGIJson::build()
+{
+  enum State
+  {
+    VALUE,
+    VALUE_OR_CLOSE,
+    KEY,
+    KEY_OR_CLOSE,
+    COLON,
+    COMMA_OR_CLOSE
+  };
+  const size_t n = p_index.size();
+  if (n == 0)
+    return fail(p_size,"empty document");
+  p_nodes.reserve(n / 2 + 1);
+  std::vector<uint32_t> stack;
+  State state = VALUE;
+  size_t i = 0;
+  while (i < n)
+  {
+    const size_t pos = p_index[i];
+    const char c = p_text[pos];
+    bool value = false;
+    switch (state)
+    {
+    case VALUE_OR_CLOSE:
+    case KEY_OR_CLOSE:
+      if (c == ((state == KEY_OR_CLOSE) ? '}' : ']'))
+      {
+        i++;
+        const uint32_t node = stack.back();
+        stack.pop_back();
+        p_nodes[node].length = pos + 1 - p_nodes[node].offset;
+        p_nodes[node].next = p_nodes.size();
+        value = true;
+        break;
+      }
+      if (state == VALUE_OR_CLOSE)
+      {
+        state = VALUE;
+        continue;
+      }
+      // fall through
+    case KEY:
+      if (c != '"')
+        return fail(pos,"expected a member name");
+      p_nodes.push_back({ STRING, (uint32_t)pos + 1, p_index[i + 1] - (uint32_t)pos - 1, (uint32_t)p_nodes.size() + 1, 0 });
+      i += 2;
+      state = COLON;
+      break;
+    case COLON:
+      if (c != ':')
+        return fail(pos,"expected a colon");
+      i++;
+      state = VALUE;
+      break;
+    case COMMA_OR_CLOSE:
+    {
+      const uint32_t node = stack.back();
+      const bool object = (p_nodes[node].type & ~MEMBER) == OBJECT;
+      if (c == ',')
+      {
+        i++;
+        state = object ? KEY : VALUE;
+        break;
+      }
+      if (c != (object ? '}' : ']'))
+        return fail(pos,object ? "expected a comma or }" : "expected a comma or ]");
+      i++;
+      stack.pop_back();
+      p_nodes[node].length = pos + 1 - p_nodes[node].offset;
+      p_nodes[node].next = p_nodes.size();
+      value = true;
+      break;
+    }
+    case VALUE:
+    {
+      uint8_t flags = (!stack.empty() && (p_nodes[stack.back()].type & ~MEMBER) == OBJECT) ? MEMBER : 0;
+      if (!stack.empty())
+        p_nodes[stack.back()].count++;
+      if (c == '{' || c == '[')
+      {
+        if (stack.size() >= MAX_DEPTH)
+          return fail(pos,"nesting too deep");
+        stack.push_back(p_nodes.size());
+        p_nodes.push_back({ (uint8_t)((c == '{' ? OBJECT : ARRAY) | flags), (uint32_t)pos, 0, 0, 0 });
+        i++;
+        state = (c == '{') ? KEY_OR_CLOSE : VALUE_OR_CLOSE;
+        break;
+      }
+      if (c == '"')
+      {
+        p_nodes.push_back({ (uint8_t)(STRING | flags), (uint32_t)pos + 1, p_index[i + 1] - (uint32_t)pos - 1, (uint32_t)p_nodes.size() + 1, 0 });
+        i += 2;
+        value = true;
+        break;
+      }
+      if (c == ':' || c == ',' || c == '}' || c == ']')
+        return fail(pos,"expected a value");
+      // A scalar runs up to the next structural character or space
+      size_t end = (i + 1 < n) ? p_index[i + 1] : p_size;
+      while (end > pos && is_space(p_text[end - 1]))
+        end--;
+      const size_t len = end - pos;
+      uint8_t type;
+      if ((len == 4 && memcmp(p_text + pos,"true",4) == 0) || (len == 5 && memcmp(p_text + pos,"false",5) == 0))
+        type = BOOL;
+      else if (len == 4 && memcmp(p_text + pos,"null",4) == 0)
+        type = NUL;
+      else if (number_length(p_text + pos,len) == len)
+        type = NUMBER;
+      else
+        return fail(pos,"invalid value");
+      p_nodes.push_back({ (uint8_t)(type | flags), (uint32_t)pos, (uint32_t)len, (uint32_t)p_nodes.size() + 1, 0 });
+      i++;
+      value = true;
+      break;
+    }
+    }
+    if (value)
+    {
+      if (stack.empty())
+      {
+        if (i < n)
+          return fail(p_index[i],"trailing characters");
+        return true;
+      }
+      state = COMMA_OR_CLOSE;
+    }
+  }
+  return fail(p_size,"unexpected end of document");
+}
+
+FCGIJson::Type FCGIJson::Value::type() const
+{
+  return (Type)(p_doc->p_nodes[p_node].type & ~MEMBER);
+}
+
+size_t FCGIJson::Value::size() const
+{
+  if (!valid())
+    return 0;
+  const Type t = type();
+  return (t == ARRAY || t == OBJECT) ? p_doc->p_nodes[p_node].count : 0;
+}
+
+/**
+ * @brief FCGIJson::Value::member looks up a member of an object by name,
+ * comparing the escaped text first so only names with escapes are
+ * unescaped
+ * @param name the name
+ * @param len its length
+ * @return the value, invalid if there is no such member
+ */
+FCGIJson::Value FCGIJson::Value::member(const char *name,size_t len) const
+{
+  if (!is_object())
+    return Value();
+  const std::vector<Node> &nodes = p_doc->p_nodes;
+  const uint32_t end = nodes[p_node].next;
+  std::string key;
+  for (uint32_t k = p_node + 1; k < end; k = nodes[k + 1].next)
+  {
+    const Node &kn = nodes[k];
+    const char *raw = p_doc->p_text + kn.offset;
+    if (kn.length == len && memcmp(raw,name,len) == 0)
+      return Value(p_doc,k + 1,end);
+    if (kn.length > len && memchr(raw,'\\',kn.length))
+    {
+      unescape(raw,kn.length,key);
+      if (key.size() == len && memcmp(key.data(),name,len) == 0)
+        return Value(p_doc,k + 1,end);
+    }
+  }
+  return Value();
+}
+
+FCGIJson::Value FCGIJson::Value::operator[](size_t i) const
+{
+  Value v = first();
+  for (; v.valid() && i > 0; i--)
+    v = v.next();
+  return v;
+}
+
+FCGIJson::Value FCGIJson::Value::first() const
+{
+  if (size() == 0)
+    return Value();
+  // An object starts with the name of its first member
+  return Value(p_doc,p_node + ((type() == OBJECT) ? 2 : 1),p_doc->p_nodes[p_node].next);
+}
+
+/**
+ * @brief FCGIJson::Value::next
+ * @return the element or member value after this one in its array or
+ * object, invalid after the last
+ */
+FCGIJson::Value FCGIJson::Value::next() const
+{
+  if (!valid())
+    return Value();
+  const Node &node = p_doc->p_nodes[p_node];
+  if (node.next >= p_end)
+    return Value();
+  // Past the name of the next member
+  return Value(p_doc,node.next + ((node.type & MEMBER) ? 1 : 0),p_end);
+}
+
+std::string FCGIJson::Value::name() const
+{
+  if (!valid() || !(p_doc->p_nodes[p_node].type & MEMBER))
+    return std::string();
+  return Value(p_doc,p_node - 1,p_end).as_string();
+}
+
+bool FCGIJson::Value::as_bool(bool def) const
+{
+  if (!is_bool())
+    return def;
+  return p_doc->p_text[p_doc->p_nodes[p_node].offset] == 't';
+}
+
+int64_t FCGIJson::Value::as_int64(int64_t def) const
+{
+  if (!is_number())
+    return def;
+  const char *p = raw(), *ep = p + raw_size();
+  const bool neg = (*p == '-');
+  if (neg)
+    p++;
+  uint64_t v = 0;
+  for (; p < ep && *p >= '0' && *p <= '9'; p++)
+  {
+    if (v > (std::numeric_limits<uint64_t>::max() - 9) / 10)
+      break;
+    v = v * 10 + (*p - '0');
+  }
+  // Fractions, exponents and large numbers go by way of a double
+  if (p < ep || v > (uint64_t)std::numeric_limits<int64_t>::max() + (neg ? 1 : 0))
+  {
+    double d = as_double();
+    if (d >= -9223372036854775808.0 && d < 9223372036854775808.0)
+      return (int64_t)d;
+    return def;
+  }
+  return neg ? (int64_t)(0 - v) : (int64_t)v;
+}
+
+double FCGIJson::Value::as_double(double def) const
+{
+  if (!is_number())
+    return def;
+  // The text is not terminated, strtod() gets a copy of it
+  char buf[64];
+  const size_t len = raw_size();
+  if (len < sizeof(buf))
+  {
+    memcpy(buf,raw(),len);
+    buf[len] = 0;
+    return strtod(buf,nullptr);
+  }
+  return strtod(std::string(raw(),len).c_str(),nullptr);
+}
+
+std::string FCGIJson::Value::as_string(const std::string &def) const
+{
+  if (is_number())
+    return std::string(raw(),raw_size());
+  if (!is_string())
+    return def;
+  std::string rv;
+  unescape(raw(),raw_size(),rv);
+  return rv;
+}
+
+const char *FCGIJson::Value::raw() const
+{
+  return valid() ? p_doc->p_text + p_doc->p_nodes[p_node].offset : nullptr;
+}
+
+size_t FCGIJson::Value::raw_size() const
+{
+  return valid() ? p_doc->p_nodes[p_node].length : 0;
+}
@@ -0,0 +1,101 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#include <algorithm>
+
+#include <fcgi_request_cpp.hxx>
+
+FCGILimits::Limits::Limits()
+{
+  maxBody = 0;
+  maxParams = 0;
+  maxHeaderBytes = 0;
+  maxParts = 0;
+  maxFileSize = 0;
+}
+
+/**
+ * @brief FCGILimits::set sets the default limits, which hold for the requests
+ * under none of the prefixes
+ * @param l the limits
+ */
+void FCGILimits::set(const Limits &l)
+{
+  p_default = l;
+  update_loosest();
+}
+
+/**
+ * @brief FCGILimits::set sets the limits of a path prefix, replacing those set
+ * for it before
+ * @param prefix the start of SCRIPT_NAME followed by PATH_INFO
+ * @param l the limits
+ */
+void FCGILimits::set(const std::string &prefix,const Limits &l)
+{
+  for (std::pair<std::string,Limits> &p: p_prefixes)
+  {
+    if (p.first == prefix)
+    {
+      p.second = l;
+      update_loosest();
+      return;
+    }
+  }
+  p_prefixes.emplace_back(prefix,l);
+  std::stable_sort(p_prefixes.begin(),p_prefixes.end(),[](const std::pair<std::string,Limits> &a,const std::pair<std::string,Limits> &b) {
+    return (a.first.size() > b.first.size());
+  });
+  update_loosest();
+}
+
+// Zero is no limit, so it is the largest of all
+template <typename T> static T loosest_of(T a,T b)
+{
+  return (a == 0 || b == 0) ? 0 : std::max(a,b);
+}
+
+void FCGILimits::update_loosest()
+{
+  p_loosest = p_default;
+  for (const std::pair<std::string,Limits> &p: p_prefixes)
+  {
+    p_loosest.maxBody = loosest_of(p_loosest.maxBody,p.second.maxBody);
+    p_loosest.maxParams = loosest_of(p_loosest.maxParams,p.second.maxParams);
+    p_loosest.maxHeaderBytes = loosest_of(p_loosest.maxHeaderBytes,p.second.maxHeaderBytes);
+    p_loosest.maxParts = loosest_of(p_loosest.maxParts,p.second.maxParts);
+    p_loosest.maxFileSize = loosest_of(p_loosest.maxFileSize,p.second.maxFileSize);
+  }
+}
+
+/**
+ * @brief FCGILimits::lookup finds the limits of a request by its path, given
+ * in two pieces as the web server passes it
+ * @param script SCRIPT_NAME
+ * @param scriptLen its length
+ * @param pathInfo PATH_INFO
+ * @param pathInfoLen its length
+ * @return the limits of the longest prefix the path starts with, the default
+ * ones if none
+ */
+const FCGILimits::Limits &FCGILimits::lookup(const char *script,size_t scriptLen,const char *pathInfo,size_t pathInfoLen) const
+{
+  for (const std::pair<std::string,Limits> &p: p_prefixes)
+  {
+    const size_t len = p.first.size();
+    if (len > scriptLen + pathInfoLen)
+      continue;
+    const size_t head = std::min(len,scriptLen);
+    if ((head == 0 || memcmp(p.first.data(),script,head) == 0) && (len == head || memcmp(p.first.data() + head,pathInfo,len - head) == 0))
+      return p.second;
+  }
+  return p_default;
+}
+
+int FCGILimits::check_params(const Limits &l,size_t count,size_t bytes)
+{
+  if ((l.maxParams && count > l.maxParams) || (l.maxHeaderBytes && bytes > l.maxHeaderBytes))
+    return 431;
+  return 0;
+}
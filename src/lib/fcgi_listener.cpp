@@ -1,16 +1,175 @@
 #include <config.h>
+#include <algorithm>
+#include <climits>
 #include <exception>
 #include <iostream>
 #include <memory>
+#include <set>
 #include <thread>
 #include <errno.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 
 #include <fcgi_request_cpp.hxx>
 #include <fcgiapp.h>
+#include "fcgi_native.hxx"
+
+// How long the accept threads cut short by drain() or the destructor get to
+// answer and leave, before they are left behind
+#define DRAIN_GRACE std::chrono::milliseconds(100)
+
+/**
+ * @brief The FCGIListener::Watchdog struct keeps the deadlines of the bodies
+ * being read by the libfcgi acceptors, which block in FCGX_GetStr() where
+ * nothing else can reach them. Past a deadline it shuts the reading side of
+ * the connection down, so the read returns short and the request can still
+ * be answered. Its wheel counts milliseconds. close_all() does the same to
+ * every body being read, for drain() giving up.
+ */
+struct FCGIListener::Watchdog
+{
+    // A body being read, on the stack of the acceptor reading it
+    struct Armed
+    {
+        FCGITimerWheel::Timer timer;
+        int fd = -1;
+        bool fired = false;
+    };
+
+    Watchdog();
+    ~Watchdog();
+    uint64_t tick(std::chrono::steady_clock::time_point t);
+    void arm(Armed &,int fd,std::chrono::steady_clock::time_point deadline);
+    bool disarm(Armed &);
+    void close_all();
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    FCGITimerWheel wheel;
+    // Every body being read, with a deadline or not
+    std::set<Armed *> reading;
+    std::chrono::steady_clock::time_point epoch;
+    bool stopping;
+    // Set by close_all(), bodies started afterwards are cut short at once
+    bool closing;
+    std::thread thread;
+};
+
+FCGIListener::Watchdog::Watchdog()
+{
+    epoch = std::chrono::steady_clock::now();
+    stopping = false;
+    closing = false;
+    thread = std::thread(&Watchdog::run,this);
+}
+
+FCGIListener::Watchdog::~Watchdog()
+{
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        stopping = true;
+    }
+    cond.notify_one();
+    thread.join();
+}
+
+uint64_t FCGIListener::Watchdog::tick(std::chrono::steady_clock::time_point t)
+{
+    if (t <= epoch)
+        return 0;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t - epoch).count();
+}
+
+// Only wakes the thread when the new deadline comes before the one it
+// waits for
+void FCGIListener::Watchdog::arm(Armed &a,int fd,std::chrono::steady_clock::time_point deadline)
+{
+    a.fd = fd;
+    a.fired = false;
+    a.timer.data = &a;
+    bool sooner = false;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        reading.insert(&a);
+        if (closing)
+        {
+            a.fired = true;
+            ::shutdown(fd,SHUT_RD);
+            return;
+        }
+        if (deadline == std::chrono::steady_clock::time_point::max())
+            return;
+        const uint64_t when = tick(deadline);
+        sooner = (when < wheel.next_wakeup());
+        wheel.schedule(&a.timer,when);
+    }
+    if (sooner)
+        cond.notify_one();
+}
+
+// Takes the deadline off the wheel before the connection may be closed and
+// its descriptor reused, tells if it fired first
+bool FCGIListener::Watchdog::disarm(Armed &a)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    reading.erase(&a);
+    wheel.cancel(&a.timer);
+    return a.fired;
+}
+
+// Cuts short every body being read and any started from now on
+void FCGIListener::Watchdog::close_all()
+{
+    std::lock_guard<std::mutex> l(mutex);
+    closing = true;
+    for (Armed *a: reading)
+    {
+        a->fired = true;
+        ::shutdown(a->fd,SHUT_RD);
+    }
+}
+
+void FCGIListener::Watchdog::run()
+{
+    FCGI::SetThreadName("FCGI Watchdog");
+    std::vector<FCGITimerWheel::Timer *> fired;
+    std::unique_lock<std::mutex> l(mutex);
+    while (!stopping)
+    {
+        wheel.advance(tick(std::chrono::steady_clock::now()),fired);
+        for (FCGITimerWheel::Timer *t: fired)
+        {
+            Armed *a = static_cast<Armed *>(t->data);
+            a->fired = true;
+            ::shutdown(a->fd,SHUT_RD);
+        }
+        fired.clear();
+        const uint64_t next = wheel.next_wakeup();
+        if (next == UINT64_MAX)
+            cond.wait(l);
+        else
+            cond.wait_until(l,epoch + std::chrono::milliseconds(next));
+    }
+}
+
+FCGIListener::Deadlines::Deadlines()
+    : header(0), body(0), queue(0), total(0)
+{
+}
 
 /**
  * @brief FCGIListener::FCGIListener default constructor
@@ -25,6 +184,21 @@ FCGIListener::FCGIListener()
     p_errorString.clear();
     p_stopFlag = false;
     p_state = INVALID;
+    p_eventLoop = false;
+    p_wakePipe[0] = p_wakePipe[1] = -1;
+    p_sharedSockets = false;
+    p_multiplex = true;
+    p_maxConns = 1024;
+    p_maxReqs = 64;
+    p_backlog = SOMAXCONN;
+    p_acceptors = 1;
+    p_reusePort = false;
+    p_tcpNoDelay = true;
+    p_deferAccept = 0;
+    p_running = 0;
+    p_forceClose = false;
+    p_tracker = std::make_shared<Tracker>();
+    p_stats = std::make_shared<FCGIStats>();
 }
 
 /**
@@ -41,15 +215,180 @@ FCGIListener::FCGIListener(std::string listenerPath)
 
 /**
  * @brief FCGIListener::~FCGIListener d-tor for the listening 
- * object. Will also unlink the unix socket.
+ * object. Will also unlink the unix sockets.
  */
 FCGIListener::~FCGIListener()
 {
-    ::unlink(p_listenerSocketPath.c_str());
+    // Whatever is still going on is cut short, drain() first to finish it
+    stop();
+    p_forceClose = true;
+    if (p_watchdog)
+        p_watchdog->close_all();
+    join_threads(std::chrono::steady_clock::now() + DRAIN_GRACE);
+    for (std::string &addr: listener_paths())
+    {
+        if (is_unix_path(addr))
+            ::unlink(addr.c_str());
+    }
+    for (int fd: p_wakePipe)
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+}
+
+/**
+ * @brief FCGIListener::is_unix_path tells unix socket paths from TCP
+ * addresses, anything with a slash in it or without a colon is a path
+ * @param addr the listener path
+ * @return true if it is a unix socket path
+ */
+bool FCGIListener::is_unix_path(const std::string &addr)
+{
+    return (addr.find('/') != std::string::npos || addr.find(':') == std::string::npos);
 }
 
 /**
- * @brief FCGIListener::open Attempts to open and create the UNIX socket.
+ * @brief FCGIListener::listener_paths
+ * @return the primary listener path followed by any added with
+ * add_listener_path()
+ */
+std::vector<std::string> FCGIListener::listener_paths()
+{
+    std::vector<std::string> rv;
+    if (!p_listenerSocketPath.empty())
+        rv.push_back(p_listenerSocketPath);
+    rv.insert(rv.end(),p_extraListenerPaths.begin(),p_extraListenerPaths.end());
+    return rv;
+}
+
+// Sets the error string from errno for a failed call on a listener path
+static void set_socket_error(std::string &err,const std::string &addr,const char *call)
+{
+    err = addr;
+    err.append(" (");
+    err.append(call);
+    err.append("): ");
+    err.append(strerror(errno));
+}
+
+/**
+ * @brief FCGIListener::open_socket creates, binds and listens on a single
+ * listener path. Unix socket paths replace a stale socket file, TCP addresses
+ * are [host]:port, host:port or :port, where no host means every IPv6 and
+ * IPv4 address.
+ * @param addr the listener path
+ * @return the listening socket, or -1 and sets the error string
+ */
+int FCGIListener::open_socket(const std::string &addr)
+{
+    if (is_unix_path(addr))
+    {
+        struct sockaddr_un sa;
+        memset(&sa,0,sizeof(sa));
+        if (addr.size() >= sizeof(sa.sun_path))
+        {
+            p_errorString = addr + ": Path too long";
+            return -1;
+        }
+        if (::unlink(addr.c_str()) != 0 && errno != ENOENT)
+        {
+            set_socket_error(p_errorString,addr,"unlink");
+            return -1;
+        }
+        sa.sun_family = AF_UNIX;
+        memcpy(sa.sun_path,addr.data(),addr.size());
+        int fd = ::socket(AF_UNIX,SOCK_STREAM,0);
+        if (fd < 0)
+        {
+            set_socket_error(p_errorString,addr,"socket");
+            return -1;
+        }
+        if (::bind(fd,(struct sockaddr *)&sa,sizeof(sa)) != 0 || ::listen(fd,p_backlog) != 0)
+        {
+            set_socket_error(p_errorString,addr,"bind");
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    std::string host,port;
+    std::string::size_type idx = addr.rfind(':');
+    host = addr.substr(0,idx);
+    port = addr.substr(idx+1);
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1,host.size()-2);
+    if (host == "*")
+        host.clear();
+    std::vector<std::string> hosts;
+    if (host.empty())
+    {
+        // Dual stack if IPv6 is available, else IPv4 only
+        hosts.push_back("::");
+        hosts.push_back("0.0.0.0");
+    } else {
+        hosts.push_back(host);
+    }
+    for (std::string &h: hosts)
+    {
+        struct addrinfo hints, *res = nullptr;
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int rc = ::getaddrinfo(h.c_str(),port.c_str(),&hints,&res);
+        if (rc != 0)
+        {
+            p_errorString = addr + " (getaddrinfo): " + gai_strerror(rc);
+            continue;
+        }
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+        {
+            int fd = ::socket(ai->ai_family,ai->ai_socktype,ai->ai_protocol);
+            if (fd < 0)
+            {
+                set_socket_error(p_errorString,addr,"socket");
+                continue;
+            }
+            int one = 1, zero = 0;
+            ::setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+            if (ai->ai_family == AF_INET6)
+                ::setsockopt(fd,IPPROTO_IPV6,IPV6_V6ONLY,&zero,sizeof(zero));
+            if (p_reusePort)
+            {
+#if defined(SO_REUSEPORT_LB)
+                ::setsockopt(fd,SOL_SOCKET,SO_REUSEPORT_LB,&one,sizeof(one));
+#elif defined(SO_REUSEPORT)
+                ::setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one));
+#endif
+            }
+            if (p_tcpNoDelay)
+                ::setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+#ifdef TCP_DEFER_ACCEPT
+            if (p_deferAccept > 0)
+                ::setsockopt(fd,IPPROTO_TCP,TCP_DEFER_ACCEPT,&p_deferAccept,sizeof(p_deferAccept));
+#endif
+            if (::bind(fd,ai->ai_addr,ai->ai_addrlen) != 0 || ::listen(fd,p_backlog) != 0)
+            {
+                set_socket_error(p_errorString,addr,"bind");
+                ::close(fd);
+                continue;
+            }
+            ::freeaddrinfo(res);
+            p_errorString.clear();
+            return fd;
+        }
+        ::freeaddrinfo(res);
+    }
+    return -1;
+}
+
+/**
+ * @brief FCGIListener::open Attempts to open and create the listening sockets,
+ * a unix socket or a TCP port for each listener path. With port reuse every
+ * path gets one socket per acceptor, each with its own accept queue which the
+ * kernel balances connections over.
  * If successfull sets the internal status and the socket descriptor, otherwise
  * sets the error flags and message
  * @return true if success, false if not and sets the error string/flags
@@ -57,48 +396,53 @@ FCGIListener::~FCGIListener()
 bool FCGIListener::open()
 {    
     p_errorString.clear();
-    if (p_listenerSocketPath.empty())
+    std::vector<std::string> paths = listener_paths();
+    if (paths.empty())
     {
         p_errorString = "Blank listener path";
         return false;
     }
     FCGX_Init();
-    if (::unlink(p_listenerSocketPath.c_str()) != 0)
+    for (std::string &addr: paths)
     {
-        std::string err = strerror(errno);
-        if (err != "No such file or directory")
+        // A unix socket path can only be bound once, its acceptors share it
+        const bool shard = (p_reusePort && p_acceptors > 1 && !is_unix_path(addr));
+        for (int i = 0; i < (shard ? p_acceptors : 1); i++)
         {
-            p_errorString = p_listenerSocketPath;
-            p_errorString.append(" (unlink): ");
-            p_errorString.append(err);
-            return false;
+            ListenSocket ls;
+            ls.fd = open_socket(addr);
+            ls.shard = shard ? i : -1;
+            if (ls.fd < 0)
+            {
+                for (ListenSocket &s: p_sockets)
+                    ::close(s.fd);
+                p_sockets.clear();
+                p_fcgiHandle = -1;
+                return false;
+            }
+            p_sockets.push_back(ls);
         }
     }
-    FILE *f = fopen(p_listenerSocketPath.c_str(),"w");
-    if (!f)
-    {
-        p_errorString = p_listenerSocketPath;
-        p_errorString.append(": ");
-        p_errorString.append(strerror(errno));
-        return false;
-    }
-    fclose(f);
-    if (::unlink(p_listenerSocketPath.c_str()) != 0)
-    {
-        p_errorString = p_listenerSocketPath;
-        p_errorString.append(" (unlink): ");
-        p_errorString.append(strerror(errno));
-        return false;
-    }
-    p_fcgiHandle = FCGX_OpenSocket(p_listenerSocketPath.c_str(),10);
-    if (p_fcgiHandle >= 0)
-        p_state = ATTACHED;
-    return (p_fcgiHandle != -1);
+    p_fcgiHandle = p_sockets.front().fd;
+    p_state = ATTACHED;
+    return true;
 }
+
+// Closes the listening sockets, not their unix socket files
+void FCGIListener::close_sockets()
+{
+    for (ListenSocket &s: p_sockets)
+        ::close(s.fd);
+    p_sockets.clear();
+    p_fcgiHandle = -1;
+}
+
 /**
- * @brief FCGIListener::start checks that the socket has been open() ed
- * then starts the accept thread in detached mode. The accept thread 
- * will listen for connections and append requests to the queue
+ * @brief FCGIListener::start checks that the sockets have been open() ed
+ * then starts the accept threads in detached mode, one per acceptor. Each
+ * acceptor serves its own sockets when port reuse sharded them, and shares
+ * the others. The accept threads will listen for connections and append
+ * requests to the queue
  * @return true if started, false if there was a problem
  */
 bool FCGIListener::start()
@@ -113,34 +457,291 @@ bool FCGIListener::start()
         p_errorString = "Listener already running";
         return false;
     }
-    p_emptyMutex.lock();
-    std::thread t1(&FCGIListener::thr_listen,this);
-    t1.detach();
+    if (p_wakePipe[0] < 0)
+    {
+        // stop() writes to it to wake the acceptors out of poll or epoll
+        if (::pipe(p_wakePipe) != 0)
+        {
+            p_errorString = "pipe: ";
+            p_errorString.append(strerror(errno));
+            return false;
+        }
+        for (int fd: p_wakePipe)
+        {
+            ::fcntl(fd,F_SETFL,::fcntl(fd,F_GETFL) | O_NONBLOCK);
+            ::fcntl(fd,F_SETFD,FD_CLOEXEC);
+        }
+    }
+    join_threads();
+    // A byte the last stop() left in the pipe would wake the new acceptors
+    // right away, the event loops for good
+    char buf[64];
+    while (::read(p_wakePipe[0],buf,sizeof(buf)) > 0)
+        ;
+    p_forceClose = false;
+    const int acceptors = std::max(p_acceptors,1);
+    std::vector<std::vector<int>> fds(acceptors);
+    for (int i = 0; i < acceptors; i++)
+    {
+        for (ListenSocket &s: p_sockets)
+        {
+            if (s.shard == -1 || s.shard == i)
+                fds[i].push_back(s.fd);
+        }
+    }
+    if (p_eventLoop)
+    {
+#ifdef HAVE_SYS_EPOLL_H
+        p_stopFlag = false;
+        p_state = RUNNING;
+        p_running = acceptors;
+        for (int i = 0; i < acceptors; i++)
+            p_threads.emplace_back(&FCGIListener::thr_event_loop,this,fds[i]);
+        return true;
+#else
+        p_errorString = "Event loop mode is not supported on this platform";
+        return false;
+#endif
+    }
+#ifdef __linux__
+    // Accepted sockets do not inherit O_NONBLOCK here, so an acceptor which
+    // lost a connection to another thread or process gets EAGAIN instead of
+    // blocking in accept() where stop() can not reach it
+    for (ListenSocket &s: p_sockets)
+        ::fcntl(s.fd,F_SETFL,::fcntl(s.fd,F_GETFL) | O_NONBLOCK);
+#endif
+    // Also there for drain() to cut short the bodies still being read
+    p_watchdog.reset(new Watchdog());
+    p_stopFlag = false;
+    p_state = RUNNING;
+    int threads = 0;
+    for (int i = 0; i < acceptors; i++)
+        threads += fds[i].size();
+    p_running = threads;
+    for (int i = 0; i < acceptors; i++)
+    {
+        for (int fd: fds[i])
+            p_threads.emplace_back(&FCGIListener::thr_listen,this,fd);
+    }
     return true;
 }
+
+// Parses a freshly received request and adds it to the queue. Each request
+// carries a token which tells the tracker once its last copy is gone.
+void FCGIListener::enqueue(FCGIRequest &reqst)
+{
+    // Requests of the event loop were let through by the engine already,
+    // those read with libfcgi have their variables but not their body yet
+    uint32_t retryAfter;
+    if (p_rateLimiter && !FCGI::isNativeRequest(reqst.FCGXHandle()) &&
+        !p_rateLimiter->admit(reqst.FCGXHandle()->envp,retryAfter))
+    {
+        reject(reqst,429,retryAfter);
+        return;
+    }
+    FCGIRequestRecord *rec = FCGI::requestRecord(reqst.FCGXHandle());
+    if (rec && p_deadlines.total.count() > 0)
+        rec->deadline = rec->times.begin + p_deadlines.total;
+    // The body of a libfcgi request is read right here, a slow one is cut
+    // short by the watchdog, as is every one when drain() gives up
+    Watchdog::Armed armed;
+    const bool watched = (p_watchdog && rec && !FCGI::isNativeRequest(reqst.FCGXHandle()));
+    if (watched)
+    {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+        if (p_deadlines.body.count() > 0)
+            deadline = std::chrono::steady_clock::now() + p_deadlines.body;
+        if (p_deadlines.total.count() > 0)
+            deadline = std::min(deadline,rec->deadline);
+        p_watchdog->arm(armed,reqst.FCGXHandle()->ipcFd,deadline);
+    }
+    bool parsed = reqst.parse(p_limits.get());
+    const bool timedOut = (watched && p_watchdog->disarm(armed));
+    if (p_forceClose)
+    {
+        drop(reqst);
+        return;
+    }
+    // Requests the parser rejects are recorded as well, they are the ones
+    // most worth replaying
+    if (p_capture)
+        p_capture->capture(reqst);
+    if (!parsed)
+    {
+        if (reqst.rejected())
+            reject(reqst,reqst.rejected(),0);
+        else if (timedOut)
+            reject(reqst,408,0);
+        else
+            p_stats->record_parse_error();
+        return;
+    }
+    if (!p_metricsUri.empty() && reqst.uri() == p_metricsUri)
+    {
+        // Answered here, so scrapes neither wait in the queue nor show up
+        // in the statistics of the application
+        FCGIResponse resp(reqst.FCGXHandle());
+        resp.set_header("Content-Type","text/plain; version=0.0.4");
+        std::string body = metrics_text();
+        resp.set_string(body);
+        resp.send();
+        return;
+    }
+    if (rec)
+    {
+        rec->times.parsed = std::chrono::steady_clock::now();
+        rec->stats = p_stats;
+        if (p_accessLog)
+        {
+            rec->log = p_accessLog;
+            rec->method = reqst.method();
+            rec->uri = reqst.uri();
+        }
+    }
+    std::shared_ptr<Tracker> t = p_tracker;
+    bool queued = false;
+    {
+        // drain() sets p_forceClose before it takes what is left in the
+        // queue under the same lock, so nothing is queued after that
+        std::lock_guard<std::mutex> l(p_mutex);
+        if (!p_forceClose)
+        {
+            {
+                std::lock_guard<std::mutex> tl(t->mutex);
+                t->outstanding++;
+            }
+            reqst.attach(std::shared_ptr<void>(nullptr,[t](void *) {
+                std::lock_guard<std::mutex> l(t->mutex);
+                t->outstanding--;
+                t->released++;
+                t->cond.notify_all();
+            }));
+            p_reqQueue.push_back(reqst);
+            queued = true;
+        }
+    }
+    if (!queued)
+    {
+        drop(reqst);
+        return;
+    }
+    p_queueCond.notify_one();
+    if (p_queueNotify)
+        p_queueNotify();
+}
+
+// Answers a request over its limits or rate, or malformed, without queueing
+// it. It still counts in the statistics by its status.
+void FCGIListener::reject(FCGIRequest &reqst,int status,uint32_t retryAfter)
+{
+    FCGIRequestRecord *rec = FCGI::requestRecord(reqst.FCGXHandle());
+    if (rec)
+    {
+        rec->times.parsed = std::chrono::steady_clock::now();
+        rec->stats = p_stats;
+    }
+    FCGIResponse resp(reqst.FCGXHandle());
+    resp.set_status_code(status);
+    resp.set_header("Content-Type","text/plain");
+    resp.set_header("Connection","close");
+    if (retryAfter)
+        resp.set_header("Retry-After",std::to_string(retryAfter));
+    resp.set_string(std::to_string(status) + "\r\n");
+    resp.send();
+}
+
+// Answers 503 a request which was still being received when drain() gave up
+void FCGIListener::drop(FCGIRequest &reqst)
+{
+    reject(reqst,503,1);
+    std::lock_guard<std::mutex> l(p_tracker->mutex);
+    p_tracker->dropped++;
+}
+
+// Called by every accept thread on its way out, the last one turns out the lights
+void FCGIListener::thread_exited()
+{
+    {
+        // Under the lock stop() closes the sockets with, so only one of
+        // them does
+        std::lock_guard<std::mutex> l(p_mutex);
+        if (--p_running > 0)
+            return;
+        close_sockets();
+        p_state = STOPPED;
+    }
+    // Consumers waiting on an empty queue get their invalid request now
+    p_queueCond.notify_all();
+    if (p_queueNotify)
+        p_queueNotify();
+    std::lock_guard<std::mutex> l(p_tracker->mutex);
+    p_tracker->cond.notify_all();
+}
+
+// Waits for the accept threads, which stop() or an error made leave. Given a
+// time, those still running then are left behind, such as one reading the
+// variables in FCGX_Accept_r() where nothing can reach it.
+void FCGIListener::join_threads(std::chrono::steady_clock::time_point until)
+{
+    bool stuck = false;
+    if (until != std::chrono::steady_clock::time_point::max())
+    {
+        std::shared_ptr<Tracker> t = p_tracker;
+        std::unique_lock<std::mutex> l(t->mutex);
+        stuck = !t->cond.wait_until(l,until,[this] { return (p_running == 0); });
+    }
+    for (std::thread &t: p_threads)
+    {
+        if (!stuck && t.joinable() && t.get_id() != std::this_thread::get_id())
+            t.join();
+        else if (t.joinable())
+            t.detach();
+    }
+    p_threads.clear();
+    // A thread left behind may still be reading a body
+    if (!stuck)
+        p_watchdog.reset();
+}
+
 // Internal accept thread function
-void FCGIListener::thr_listen()
+void FCGIListener::thr_listen(int sock)
 {
-    p_state = RUNNING;
-    p_stopFlag = false;
     FCGI::SetThreadName("FCGI Listen");
 
+    // Wait for a connection in poll() rather than in accept(), so stop() can
+    // wake us without shutting down a socket other processes may share
+    struct pollfd pfd[2];
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = p_wakePipe[0];
+    pfd[1].events = POLLIN;
     while (!p_stopFlag)
     {
-        std::shared_ptr<FCGX_Request> req = std::make_shared<FCGX_Request>();
-        FCGX_InitRequest(req.get(),p_fcgiHandle,0);
-        if (FCGX_Accept_r(req.get()) == 0)
+        pfd[0].revents = pfd[1].revents = 0;
+        if (::poll(pfd,2,-1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            p_errorString = "poll: ";
+            p_errorString.append(strerror(errno));
+            break;
+        }
+        if (p_stopFlag || pfd[1].revents != 0)
+            break;
+        std::shared_ptr<FCGIAcceptedRequest> acc = std::make_shared<FCGIAcceptedRequest>();
+        std::shared_ptr<FCGX_Request> req(acc,&acc->request);
+        FCGX_InitRequest(req.get(),sock,FCGI_TRACKED_REQUEST);
+        int rc = FCGX_Accept_r(req.get());
+        if (rc == 0)
         {
+            acc->record.times.begin = std::chrono::steady_clock::now();
+            acc.reset();
             FCGIRequest reqst(req);
-            if (reqst.parse())
-            {
-                req.reset();
-                {
-                    p_emptyMutex.try_lock();
-                    p_reqQueue.push_back(reqst);
-                    p_emptyMutex.unlock();
-                }
-            }
+            req.reset();
+            enqueue(reqst);
+        } else if (rc == -EAGAIN || rc == -EWOULDBLOCK || rc == -EINTR) {
+            // Somebody else got the connection
+            continue;
         } else {
             char errdesc[1024];
             if (!p_stopFlag)
@@ -148,32 +749,384 @@ void FCGIListener::thr_listen()
             p_stopFlag = true;
         }
     }
-    p_state = STOPPED;
+    thread_exited();
 }
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Internal event loop thread function. Accepts connections without blocking
+ * and reads the records of all of them as they arrive, only requests which
+ * were received in full are handed to the parser and the queue, so a slow
+ * client never holds up the others.
+ */
+void FCGIListener::thr_event_loop(std::vector<int> socks)
+{
+    FCGI::SetThreadName("FCGI Event");
+
+    std::map<int,std::shared_ptr<FCGIConnection>> conns;
+    int ep = ::epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0)
+    {
+        p_errorString = "epoll_create1: ";
+        p_errorString.append(strerror(errno));
+        thread_exited();
+        return;
+    }
+    // Sockets shared with other event loops wake only one of them
+    uint32_t listenEvents = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    if (p_acceptors > 1)
+        listenEvents |= EPOLLEXCLUSIVE;
+#endif
+    struct epoll_event ev;
+    memset(&ev,0,sizeof(ev));
+    for (int sock: socks)
+    {
+        ::fcntl(sock,F_SETFL,::fcntl(sock,F_GETFL) | O_NONBLOCK);
+        ev.events = listenEvents;
+        ev.data.fd = sock;
+        ::epoll_ctl(ep,EPOLL_CTL_ADD,sock,&ev);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = p_wakePipe[0];
+    ::epoll_ctl(ep,EPOLL_CTL_ADD,p_wakePipe[0],&ev);
+
+    FCGINativeLimits limits;
+    limits.multiplex = p_multiplex;
+    limits.maxConns = p_maxConns;
+    limits.maxReqs = p_maxReqs;
+    limits.requests = p_limits;
+    limits.rate = p_rateLimiter;
+    limits.deadlines = p_deadlines;
+    limits.poller = ep;
+    // The header and body deadlines of all its connections, in milliseconds
+    // since the loop started
+    FCGITimerWheel wheel;
+    const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::vector<FCGITimerWheel::Timer *> fired;
+    const bool deadlines = (p_deadlines.header.count() > 0 || p_deadlines.body.count() > 0 || p_deadlines.total.count() > 0);
+    limits.wheel = deadlines ? &wheel : nullptr;
+    bool acceptPaused = false;
+
+    std::vector<char> rdbuf(65536);
+    std::vector<std::shared_ptr<FCGINativeRequest>> done;
+    struct epoll_event events[64];
+    bool draining = false;
+    while (!draining || !conns.empty())
+    {
+        if (p_stopFlag && !draining)
+        {
+            // Stop accepting, and let the connections finish the requests
+            // they started before they are closed
+            if (!acceptPaused)
+            {
+                for (int sock: socks)
+                    ::epoll_ctl(ep,EPOLL_CTL_DEL,sock,nullptr);
+            }
+            ::epoll_ctl(ep,EPOLL_CTL_DEL,p_wakePipe[0],nullptr);
+            for (auto &c: conns)
+                c.second->close_when_idle();
+            draining = true;
+            continue;
+        }
+        if (p_forceClose)
+            break;
+        // While draining look out for drain() giving up every so often
+        int timeout = draining ? 100 : -1;
+        if (wheel.size() > 0)
+        {
+            const uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch).count();
+            const uint64_t next = wheel.next_wakeup();
+            const uint64_t wait = (next > now) ? next - now : 0;
+            if (timeout < 0 || wait < (uint64_t)timeout)
+                timeout = (int)std::min<uint64_t>(wait,INT_MAX);
+        }
+        int n = ::epoll_wait(ep,events,64,timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            p_errorString = "epoll_wait: ";
+            p_errorString.append(strerror(errno));
+            break;
+        }
+        if (deadlines)
+        {
+            // Requests still arriving past their deadline are answered 408,
+            // records coming in for them later are ignored
+            wheel.advance(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch).count(),fired);
+            for (FCGITimerWheel::Timer *t: fired)
+            {
+                FCGINativeRequest *r = static_cast<FCGINativeRequest *>(t->data);
+                r->conn->time_out(r->request.requestId,done);
+            }
+            fired.clear();
+        }
+        for (int i = 0; i < n; i++)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == p_wakePipe[0])
+                continue;
+            if (std::find(socks.begin(),socks.end(),fd) != socks.end())
+            {
+                while ((int)conns.size() < p_maxConns)
+                {
+#ifdef HAVE_ACCEPT4
+                    int cfd = ::accept4(fd,nullptr,nullptr,SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+                    int cfd = ::accept(fd,nullptr,nullptr);
+                    if (cfd >= 0)
+                        ::fcntl(cfd,F_SETFL,::fcntl(cfd,F_GETFL) | O_NONBLOCK);
+#endif
+                    if (cfd < 0)
+                        break;
+                    if (p_tcpNoDelay)
+                    {
+                        int one = 1;
+                        ::setsockopt(cfd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+                    }
+                    struct epoll_event cev;
+                    memset(&cev,0,sizeof(cev));
+                    cev.events = EPOLLIN | EPOLLRDHUP;
+                    cev.data.fd = cfd;
+                    conns[cfd] = std::make_shared<FCGIConnection>(cfd,limits);
+                    ::epoll_ctl(ep,EPOLL_CTL_ADD,cfd,&cev);
+                }
+                if (!acceptPaused && (int)conns.size() >= p_maxConns)
+                {
+                    // Leave further connections in the kernel backlog until
+                    // one of ours goes away
+                    for (int sock: socks)
+                        ::epoll_ctl(ep,EPOLL_CTL_DEL,sock,nullptr);
+                    acceptPaused = true;
+                }
+                continue;
+            }
+            auto it = conns.find(fd);
+            if (it == conns.end())
+                continue;
+            std::shared_ptr<FCGIConnection> conn = it->second;
+            // The socket drained, out goes what was queued on it
+            bool drop = ((events[i].events & EPOLLOUT) && !conn->flush_output());
+            while (!drop && (events[i].events & ~EPOLLOUT))
+            {
+                ssize_t rc = ::read(fd,rdbuf.data(),rdbuf.size());
+                if (rc > 0)
+                {
+                    if (!conn->consume(rdbuf.data(),rc,done))
+                    {
+                        drop = true;
+                        break;
+                    }
+                    continue;
+                }
+                if (rc < 0 && errno == EINTR)
+                    continue;
+                if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                drop = true;
+                break;
+            }
+            if (drop)
+            {
+                ::epoll_ctl(ep,EPOLL_CTL_DEL,fd,nullptr);
+                conn->close_requests();
+                conns.erase(it);
+                if (acceptPaused && !draining)
+                {
+                    for (int sock: socks)
+                    {
+                        ev.events = listenEvents;
+                        ev.data.fd = sock;
+                        ::epoll_ctl(ep,EPOLL_CTL_ADD,sock,&ev);
+                    }
+                    acceptPaused = false;
+                }
+            }
+        }
+        for (std::shared_ptr<FCGINativeRequest> &r: done)
+        {
+            FCGIRequest reqst(std::shared_ptr<FCGX_Request>(r,&r->request));
+            if (r->rejected)
+                reject(reqst,r->rejected,r->retryAfter);
+            else
+                enqueue(reqst);
+        }
+        done.clear();
+    }
+    for (auto &c: conns)
+        c.second->close_requests();
+    conns.clear();
+    ::close(ep);
+    thread_exited();
+}
+#endif
+
 /**
  * @brief FCGIListener::stop
- * Stops the accept thread and closes the unix socket
+ * Stops the accept threads, the last one to go closes the sockets. Requests
+ * already queued are still handed out by nextRequest(). Sockets shared with
+ * other processes are left open for them.
  */
 void FCGIListener::stop()
 {
-    p_stopFlag = true;
-    ::shutdown(p_fcgiHandle,SHUT_RDWR);
-    ::close(p_fcgiHandle);
+    {
+        std::lock_guard<std::mutex> l(p_mutex);
+        p_stopFlag = true;
+    }
+    if (p_wakePipe[1] >= 0)
+    {
+        // Only read again by start(), so it wakes every acceptor for good
+        char c = 0;
+        if (::write(p_wakePipe[1],&c,1) < 0 && errno != EAGAIN)
+            p_errorString = strerror(errno);
+    }
+    {
+        // The last accept thread may be closing the sockets right now, they
+        // are only touched under the lock it does that with
+        std::lock_guard<std::mutex> l(p_mutex);
+        if (!p_sharedSockets)
+        {
+            for (ListenSocket &s: p_sockets)
+                ::shutdown(s.fd,SHUT_RDWR);
+        }
+        if (p_running == 0)
+            close_sockets();
+    }
+    p_queueCond.notify_all();
+    if (p_queueNotify)
+        p_queueNotify();
 }
+
+/**
+ * @brief FCGIListener::drain stops accepting and waits up to the timeout for
+ * the application to finish the queued and in flight requests. Requests still
+ * queued after that are answered 503, as are those whose body is still being
+ * read, connections still open are closed, and the accept threads are joined.
+ * An accept thread which does not come back shortly after is left behind.
+ * @param timeout how long to wait for the requests
+ * @return how many requests were completed, dropped (answered 503) and left
+ * unfinished by the application at the deadline
+ */
+FCGIListener::DrainStats FCGIListener::drain(std::chrono::milliseconds timeout)
+{
+    DrainStats rv;
+    rv.completed = rv.dropped = rv.unfinished = 0;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+    std::shared_ptr<Tracker> t = p_tracker;
+    size_t released, dropped;
+    {
+        std::lock_guard<std::mutex> l(t->mutex);
+        released = t->released;
+        dropped = t->dropped;
+    }
+    stop();
+    {
+        std::unique_lock<std::mutex> l(t->mutex);
+        t->cond.wait_until(l,deadline,[this,t] { return (t->outstanding == 0 && p_running == 0); });
+    }
+
+    p_forceClose = true;
+    std::deque<FCGIRequest> leftovers;
+    {
+        std::lock_guard<std::mutex> l(p_mutex);
+        leftovers.swap(p_reqQueue);
+    }
+    for (FCGIRequest &req: leftovers)
+    {
+        FCGIResponse resp(req.FCGXHandle());
+        resp.set_status_code(503);
+        resp.set_header("Retry-After","1");
+        resp.send();
+        rv.dropped++;
+    }
+    const size_t queued = rv.dropped;
+    leftovers.clear();
+    // The bodies still being read are cut short and answered 503 as well
+    if (p_watchdog)
+        p_watchdog->close_all();
+    join_threads(std::max(deadline,std::chrono::steady_clock::now()) + DRAIN_GRACE);
+    p_queueCond.notify_all();
+    if (p_queueNotify)
+        p_queueNotify();
+
+    std::lock_guard<std::mutex> l(t->mutex);
+    rv.completed = t->released - released - queued;
+    rv.dropped += t->dropped - dropped;
+    rv.unfinished = t->outstanding;
+    return rv;
+}
+
 /**
  * @brief FCGIListener::nextRequest
- * Gets the next request in the queue in a blocking manner
+ * Gets the next request in the queue in a blocking manner. Once the listener
+ * is stopped and the queue ran dry it returns an invalid request, see
+ * FCGIRequest::valid()
  */
 FCGIRequest FCGIListener::nextRequest()
 {
-    std::lock_guard<std::mutex> l(p_mutex);
-    FCGIRequest rv(nullptr);
+    std::unique_lock<std::mutex> l(p_mutex);
+    while (1)
     {
-      std::lock_guard<std::mutex> l2(p_emptyMutex);
-      rv = p_reqQueue.front();
-      p_reqQueue.erase(p_reqQueue.begin());
+        p_queueCond.wait(l,[this] { return (!p_reqQueue.empty() || (p_stopFlag && p_running == 0)); });
+        if (p_reqQueue.empty())
+            return FCGIRequest(nullptr);
+        FCGIRequest rv = p_reqQueue.front();
+        p_reqQueue.pop_front();
+        l.unlock();
+        if (!expired(rv))
+            return rv;
+        l.lock();
     }
-    if (p_reqQueue.empty())
-      p_emptyMutex.try_lock();
-    return rv;
+}
+
+/**
+ * @brief FCGIListener::try_next_request
+ * Takes the next request in the queue if there is one, without waiting
+ * @param req receives the request
+ * @return true if there was a request
+ */
+bool FCGIListener::try_next_request(FCGIRequest &req)
+{
+    do
+    {
+        std::lock_guard<std::mutex> l(p_mutex);
+        if (p_reqQueue.empty())
+            return false;
+        req = p_reqQueue.front();
+        p_reqQueue.pop_front();
+    } while (expired(req));
+    return true;
+}
+
+// Stamps a request taken off the queue, and answers it instead of handing it
+// out if it is past its queue or total deadline, the web server has likely
+// given up on it by now
+bool FCGIListener::expired(FCGIRequest &req)
+{
+    FCGIRequestRecord *rec = FCGI::requestRecord(req.FCGXHandle());
+    if (!rec)
+        return false;
+    rec->times.dequeued = std::chrono::steady_clock::now();
+    int status = 0;
+    if (p_deadlines.total.count() > 0 && rec->times.dequeued >= rec->deadline)
+        status = 504;
+    else if (p_deadlines.queue.count() > 0 && rec->times.dequeued - rec->times.parsed >= p_deadlines.queue)
+        status = 503;
+    if (status == 0)
+        return false;
+    FCGIResponse resp(req.FCGXHandle());
+    resp.set_status_code(status);
+    resp.set_header("Content-Type","text/plain");
+    if (status == 503)
+        resp.set_header("Retry-After","1");
+    resp.set_string(std::to_string(status) + "\r\n");
+    resp.send();
+    req = FCGIRequest(nullptr);
+    return true;
+}
+
+bool FCGIListener::finished()
+{
+    std::lock_guard<std::mutex> l(p_mutex);
+    return (p_reqQueue.empty() && p_stopFlag && p_running == 0);
 }
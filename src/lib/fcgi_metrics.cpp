@@ -0,0 +1,116 @@
+#include <config.h>
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
+#include <fcgi_request_cpp.hxx>
+
+// Bucket bounds of the exported latency histograms, in seconds
+static const double metric_bounds[] = {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+    0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static void metric_header(std::string &out,const char *name,const char *type,const char *help)
+{
+    out.append("# HELP ");
+    out.append(name);
+    out.append(" ");
+    out.append(help);
+    out.append("\n# TYPE ");
+    out.append(name);
+    out.append(" ");
+    out.append(type);
+    out.append("\n");
+}
+
+static void metric_value(std::string &out,const char *name,const char *labels,double value)
+{
+    char buf[128];
+    // Counters print as integers, everything else with enough digits
+    if (value == (double)(uint64_t)value && value < 1e15)
+        snprintf(buf,sizeof(buf),"%.0f",value);
+    else
+        snprintf(buf,sizeof(buf),"%.9g",value);
+    out.append(name);
+    if (labels && *labels)
+    {
+        out.append("{");
+        out.append(labels);
+        out.append("}");
+    }
+    out.append(" ");
+    out.append(buf);
+    out.append("\n");
+}
+
+/**
+ * @brief FCGIListener::metrics_text renders the statistics in the Prometheus
+ * text exposition format: request and byte counters, responses by status code,
+ * parse errors, the queue depth, the requests the application is working on,
+ * and a latency histogram per stage. Recording threads are not held up, only
+ * the merge of their counters is locked.
+ * @return the metrics page
+ */
+std::string FCGIListener::metrics_text()
+{
+    FCGIStats::Snapshot s = p_stats->snapshot();
+    size_t queued, outstanding;
+    {
+        std::lock_guard<std::mutex> l(p_mutex);
+        queued = p_reqQueue.size();
+    }
+    {
+        std::lock_guard<std::mutex> l(p_tracker->mutex);
+        outstanding = p_tracker->outstanding;
+    }
+
+    std::string out;
+    char labels[64];
+    metric_header(out,"fcgi_requests_total","counter","Requests answered");
+    metric_value(out,"fcgi_requests_total",nullptr,s.requests);
+    metric_header(out,"fcgi_request_bytes_total","counter","Request body bytes received");
+    metric_value(out,"fcgi_request_bytes_total",nullptr,s.bytesIn);
+    metric_header(out,"fcgi_response_bytes_total","counter","Response bytes sent");
+    metric_value(out,"fcgi_response_bytes_total",nullptr,s.bytesOut);
+    metric_header(out,"fcgi_responses_total","counter","Responses by status code");
+    for (std::pair<const int,uint64_t> &st: s.statuses)
+    {
+        snprintf(labels,sizeof(labels),"code=\"%d\"",st.first);
+        metric_value(out,"fcgi_responses_total",labels,st.second);
+    }
+    metric_header(out,"fcgi_parse_errors_total","counter","Requests dropped because they could not be parsed");
+    metric_value(out,"fcgi_parse_errors_total",nullptr,s.parseErrors);
+    metric_header(out,"fcgi_queue_depth","gauge","Requests waiting in the queue");
+    metric_value(out,"fcgi_queue_depth",nullptr,queued);
+    metric_header(out,"fcgi_requests_in_progress","gauge","Requests handed to the application and not yet released");
+    metric_value(out,"fcgi_requests_in_progress",nullptr,outstanding > queued ? outstanding - queued : 0);
+    metric_header(out,"fcgi_acceptors_running","gauge","Accept threads or event loops running");
+    metric_value(out,"fcgi_acceptors_running",nullptr,p_running);
+    metric_header(out,"fcgi_uptime_seconds","gauge","Seconds since the statistics were started");
+    metric_value(out,"fcgi_uptime_seconds",nullptr,s.seconds);
+
+    metric_header(out,"fcgi_stage_duration_seconds","histogram","Time spent in each stage of a request");
+    for (int i = 0; i < FCGIStats::STAGES; i++)
+    {
+        FCGIStats::StageSnapshot &st = s.stages[i];
+        const char *stage = FCGIStats::stage_name((FCGIStats::Stage)i);
+        // The fine buckets are folded into the coarse ones they fit in whole
+        size_t b = 0;
+        uint64_t cumulative = 0;
+        for (double bound: metric_bounds)
+        {
+            const uint64_t usec = bound * 1000000;
+            while (b < st.buckets.size() && FCGIHistogram::bucket_value(b) <= usec)
+                cumulative += st.buckets[b++];
+            snprintf(labels,sizeof(labels),"stage=\"%s\",le=\"%g\"",stage,bound);
+            metric_value(out,"fcgi_stage_duration_seconds_bucket",labels,cumulative);
+        }
+        snprintf(labels,sizeof(labels),"stage=\"%s\",le=\"+Inf\"",stage);
+        metric_value(out,"fcgi_stage_duration_seconds_bucket",labels,st.count);
+        snprintf(labels,sizeof(labels),"stage=\"%s\"",stage);
+        metric_value(out,"fcgi_stage_duration_seconds_sum",labels,st.mean * st.count / 1000000.0);
+        metric_value(out,"fcgi_stage_duration_seconds_count",labels,st.count);
+    }
+    return out;
+}
@@ -0,0 +1,1200 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#include <limits.h>
+#include <algorithm>
+
+#include "fcgi_native.hxx"
+
+// Largest content written in a single STDOUT record, a multiple of 8
+#define NATIVE_OUT_BUFSZ 16376
+#define NATIVE_ERR_BUFSZ 1016
+// Pieces of a gathered STDOUT record, and the largest content of one
+#define NATIVE_GATHER_PIECES 64
+#define NATIVE_GATHER_RECORD 65528
+// Entries of a gather list laid out on the stack
+#define NATIVE_GATHER_STACK 64
+// How long a worker waits for the web server to take any of its output, and
+// the most output the event loop queues on a connection, before it is closed
+#define NATIVE_WRITE_TIMEOUT 30000
+#define NATIVE_QUEUE_MAX (1 << 20)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Everything is buffered before the request is handed out, so there is
+// never anything more to read
+static void native_fill(FCGX_Stream *s)
+{
+  s->isClosed = 1;
+}
+
+static void native_empty(FCGX_Stream *s,int doClose)
+{
+  FCGINativeRequest *r = static_cast<FCGINativeRequest *>(s->data);
+  r->flush(s,doClose != 0);
+}
+
+// Reads the two lengths of a name-value pair, false if they are incomplete
+static bool read_nv_lengths(const unsigned char *&p,const unsigned char *ep,size_t *lens)
+{
+  const unsigned char *q = p;
+  for (int i = 0; i < 2; i++)
+  {
+    if (q >= ep)
+      return false;
+    if (*q & 0x80)
+    {
+      if (ep-q < 4)
+        return false;
+      lens[i] = ((size_t)(q[0] & 0x7f) << 24) | ((size_t)q[1] << 16) | ((size_t)q[2] << 8) | q[3];
+      q += 4;
+    } else {
+      lens[i] = *q;
+      q++;
+    }
+  }
+  p = q;
+  return true;
+}
+
+// Appends a name-value pair in the FastCGI encoding
+static void put_nv(std::string &out,const std::string &name,const std::string &value)
+{
+  for (size_t len: { name.size(), value.size() })
+  {
+    if (len < 128)
+    {
+      out.push_back((char)len);
+    } else {
+      out.push_back((char)(((len >> 24) & 0x7f) | 0x80));
+      out.push_back((char)((len >> 16) & 0xff));
+      out.push_back((char)((len >> 8) & 0xff));
+      out.push_back((char)(len & 0xff));
+    }
+  }
+  out.append(name);
+  out.append(value);
+}
+
+static void setup_writer(FCGX_Stream *s,std::vector<char> &buf,size_t sz)
+{
+  buf.resize(FCGIProto::HEADER_LEN+sz);
+  s->wrNext = reinterpret_cast<unsigned char *>(buf.data())+FCGIProto::HEADER_LEN;
+  s->stop = reinterpret_cast<unsigned char *>(buf.data())+buf.size();
+}
+
+namespace FCGI
+{
+
+void putRecordHeader(unsigned char *h,int type,int id,size_t len)
+{
+  h[0] = FCGIProto::VERSION_1;
+  h[1] = type;
+  h[2] = (id >> 8) & 0xff;
+  h[3] = id & 0xff;
+  h[4] = (len >> 8) & 0xff;
+  h[5] = len & 0xff;
+  h[6] = 0;
+  h[7] = 0;
+}
+
+bool isNativeRequest(const FCGX_Request *r)
+{
+  return (r && r->in && r->in->fillBuffProc == native_fill);
+}
+
+bool requestAborted(const FCGX_Request *r)
+{
+  if (isNativeRequest(r))
+    return static_cast<FCGINativeRequest *>(r->in->data)->aborted;
+  return false;
+}
+
+void finishRequest(const FCGX_Request *r)
+{
+  if (isNativeRequest(r))
+  {
+    static_cast<FCGINativeRequest *>(r->in->data)->finish();
+    return;
+  }
+  FCGX_Finish_r(const_cast<FCGX_Request *>(r));
+}
+
+void freeRequest(const FCGX_Request *r)
+{
+  // Native requests are released with the last reference to them
+  if (isNativeRequest(r))
+    return;
+  FCGX_Free(const_cast<FCGX_Request *>(r),1);
+}
+
+FCGIRequestRecord *requestRecord(const FCGX_Request *r)
+{
+  if (isNativeRequest(r))
+    return &static_cast<FCGINativeRequest *>(r->in->data)->record;
+  if (r && (r->flags & FCGI_TRACKED_REQUEST))
+    return &reinterpret_cast<FCGIAcceptedRequest *>(const_cast<FCGX_Request *>(r))->record;
+  return nullptr;
+}
+
+bool putGather(const FCGX_Request *r,const struct iovec *iov,int cnt)
+{
+  if (isNativeRequest(r))
+    return static_cast<FCGINativeRequest *>(r->in->data)->write_stdout(iov,cnt);
+  for (int i = 0; i < cnt; i++)
+  {
+    if (FCGX_PutStr(static_cast<const char *>(iov[i].iov_base),iov[i].iov_len,r->out) == -1)
+      return false;
+  }
+  return true;
+}
+
+bool flushStdout(const FCGX_Request *r)
+{
+  if (isNativeRequest(r))
+  {
+    FCGINativeRequest *nr = static_cast<FCGINativeRequest *>(r->in->data);
+    if (nr->out.isClosed)
+      return false;
+    // A parked request wrote straight to the connection
+    return (nr->outBuf.empty() || nr->flush(&nr->out,false));
+  }
+  return (FCGX_FFlush(r->out) == 0);
+}
+
+void parkRequest(const FCGX_Request *r)
+{
+  if (isNativeRequest(r))
+    static_cast<FCGINativeRequest *>(r->in->data)->park();
+  else
+    FCGX_FFlush(r->out);
+}
+
+void responseFinished(const FCGX_Request *r,FCGIRequestTimes::Time responded,int status,size_t bytes)
+{
+  FCGIRequestRecord *rec = requestRecord(r);
+  if (!rec)
+    return;
+  rec->times.responded = responded;
+  rec->times.finished = std::chrono::steady_clock::now();
+  rec->times.status = status;
+  rec->times.bytesOut = bytes;
+  if (rec->stats)
+    rec->stats->record(rec->times);
+  if (rec->log)
+    rec->log->log(rec->times,rec->method,rec->uri);
+}
+
+} // namespace FCGI
+
+/**
+ * @brief FCGINativeRequest::FCGINativeRequest sets up the embedded FCGX_Request
+ * and its streams for a request which just got its BEGIN_REQUEST record
+ * @param c the connection the request arrived on
+ * @param id the FastCGI request id
+ * @param keepConn true if the web server wants the connection kept open
+ */
+FCGINativeRequest::FCGINativeRequest(std::shared_ptr<FCGIConnection> c,int id,bool keepConn)
+{
+  conn = c;
+  aborted = false;
+  paramsDone = false;
+  finished = false;
+  paramBytes = 0;
+  maxBody = 0;
+  rejected = 0;
+  retryAfter = 0;
+  timer.data = this;
+  began = 0;
+  memset(&request,0,sizeof(request));
+  memset(&in,0,sizeof(in));
+  memset(&out,0,sizeof(out));
+  memset(&err,0,sizeof(err));
+  request.requestId = id;
+  request.role = FCGIProto::RESPONDER;
+  request.in = &in;
+  request.out = &out;
+  request.err = &err;
+  request.ipcFd = conn->fd();
+  request.isBeginProcessed = 1;
+  request.keepConnection = keepConn ? 1 : 0;
+  request.listen_sock = -1;
+  in.isReader = 1;
+  in.fillBuffProc = native_fill;
+  in.data = this;
+  out.emptyBuffProc = native_empty;
+  out.data = this;
+  setup_writer(&out,outBuf,NATIVE_OUT_BUFSZ);
+  // The error stream gets its buffer on first use
+  err.emptyBuffProc = native_empty;
+  err.data = this;
+  envp.push_back(nullptr);
+  request.envp = envp.data();
+  record.times.begin = std::chrono::steady_clock::now();
+}
+
+/**
+ * @brief FCGINativeRequest::~FCGINativeRequest ends the request if nobody
+ * answered it, so the web server is not left waiting on it
+ */
+FCGINativeRequest::~FCGINativeRequest()
+{
+  if (timer.scheduled())
+    conn->disarm(*this);
+  finish();
+}
+
+/**
+ * @brief FCGINativeRequest::add_params decodes the name-value pairs of a PARAMS
+ * record as it arrives, straight into the NAME=VALUE layout libfcgi exposes in
+ * the envp array. Only a pair split across records is kept back.
+ * @param content the record content
+ * @param clen the length of the content
+ */
+void FCGINativeRequest::add_params(const char *content,size_t clen)
+{
+  const bool direct = params.empty();
+  if (!direct)
+  {
+    params.append(content,clen);
+    content = params.data();
+    clen = params.size();
+  }
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(content);
+  const unsigned char *ep = p+clen;
+  while (p < ep)
+  {
+    const unsigned char *q = p;
+    size_t lens[2];
+    if (!read_nv_lengths(q,ep,lens) || (size_t)(ep-q) < lens[0]+lens[1])
+      break;
+    envOffsets.push_back(envArena.size());
+    envArena.append(reinterpret_cast<const char *>(q),lens[0]);
+    envArena.push_back('=');
+    envArena.append(reinterpret_cast<const char *>(q)+lens[0],lens[1]);
+    envArena.push_back(0);
+    paramBytes += lens[0]+lens[1];
+    p = q+lens[0]+lens[1];
+  }
+  const size_t used = p-reinterpret_cast<const unsigned char *>(content);
+  if (direct)
+    params.assign(content+used,clen-used);
+  else
+    params.erase(0,used);
+}
+
+/**
+ * @brief FCGINativeRequest::params_complete builds the envp array once the
+ * empty PARAMS record arrived
+ */
+void FCGINativeRequest::params_complete()
+{
+  paramsDone = true;
+  params.clear();
+  envp.clear();
+  envp.reserve(envOffsets.size()+1);
+  for (size_t off: envOffsets)
+    envp.push_back(&envArena[off]);
+  envp.push_back(nullptr);
+  request.envp = envp.data();
+}
+
+/**
+ * @brief FCGINativeRequest::env looks up a CGI variable
+ * @param name the name of the variable
+ * @param len the length of the name
+ * @param valLen receives the length of the value
+ * @return the 0 terminated value, nullptr if the variable was not passed
+ */
+const char *FCGINativeRequest::env(const char *name,size_t len,size_t &valLen) const
+{
+  for (size_t off: envOffsets)
+  {
+    if (envArena.compare(off,len,name,len) == 0 && envArena[off+len] == '=')
+    {
+      const char *v = envArena.data()+off+len+1;
+      valLen = strlen(v);
+      return v;
+    }
+  }
+  valLen = 0;
+  return nullptr;
+}
+
+/**
+ * @brief FCGINativeRequest::stdin_complete points the input stream at the
+ * buffered request body once the empty STDIN record arrived
+ */
+void FCGINativeRequest::stdin_complete()
+{
+  if (!paramsDone)
+    params_complete();
+  in.rdNext = reinterpret_cast<unsigned char *>(const_cast<char *>(stdinData.data()));
+  in.stopUnget = in.rdNext;
+  in.stop = in.rdNext+stdinData.size();
+  record.times.received = std::chrono::steady_clock::now();
+  record.times.bytesIn = stdinData.size();
+}
+
+/**
+ * @brief FCGINativeRequest::flush writes what is buffered in one of the output
+ * streams as a STDOUT or STDERR record, and the closing empty record if the
+ * stream is being closed. Called by libfcgi when the stream buffer is full.
+ * @param s the stream to flush
+ * @param close true to also end the stream
+ * @return true if written, false if the connection failed
+ */
+bool FCGINativeRequest::flush(FCGX_Stream *s,bool close)
+{
+  std::vector<char> &buf = (s == &out) ? outBuf : errBuf;
+  const int type = (s == &out) ? FCGIProto::STDOUT : FCGIProto::STDERR;
+  if (buf.empty())
+  {
+    // First write to the lazily allocated error stream, or to the output
+    // of a parked request, which gets as small a buffer
+    if (!close)
+      setup_writer(s,buf,NATIVE_ERR_BUFSZ);
+    return true;
+  }
+  unsigned char *start = reinterpret_cast<unsigned char *>(buf.data());
+  size_t len = s->wrNext-(start+FCGIProto::HEADER_LEN);
+  if (aborted)
+  {
+    // Nobody is reading it any more
+    s->wrNext = start+FCGIProto::HEADER_LEN;
+    return true;
+  }
+  unsigned char eof[FCGIProto::HEADER_LEN];
+  struct iovec iov[2];
+  int cnt = 0;
+  if (len > 0)
+  {
+    FCGI::putRecordHeader(start,type,request.requestId,len);
+    iov[cnt].iov_base = start;
+    iov[cnt].iov_len = FCGIProto::HEADER_LEN+len;
+    cnt++;
+  }
+  if (close)
+  {
+    FCGI::putRecordHeader(eof,type,request.requestId,0);
+    iov[cnt].iov_base = eof;
+    iov[cnt].iov_len = sizeof(eof);
+    cnt++;
+  }
+  s->wrNext = start+FCGIProto::HEADER_LEN;
+  if (cnt && !conn->write_all(iov,cnt))
+  {
+    s->isClosed = 1;
+    s->FCGI_errno = errno;
+    return false;
+  }
+  return true;
+}
+
+// Splits a gather list into STDOUT records of at most NATIVE_GATHER_RECORD
+// bytes and NATIVE_GATHER_PIECES pieces. Counts the records and iovec entries
+// only, unless there is a list to fill with the record headers interleaved,
+// recIdx getting the entry each record starts at.
+static void layout_stdout(const struct iovec *iov,int cnt,int id,struct iovec *list,unsigned char *headers,
+                          size_t *recIdx,size_t &records,size_t &entries)
+{
+  records = entries = 0;
+  size_t len = 0;
+  int pieces = 0;
+  for (int i = 0; i < cnt; i++)
+  {
+    size_t off = 0;
+    while (off < iov[i].iov_len)
+    {
+      if (records == 0 || len == NATIVE_GATHER_RECORD || pieces == NATIVE_GATHER_PIECES)
+      {
+        if (list && records > 0)
+          FCGI::putRecordHeader(headers+(records-1)*FCGIProto::HEADER_LEN,FCGIProto::STDOUT,id,len);
+        if (list)
+        {
+          recIdx[records] = entries;
+          list[entries] = { headers+records*FCGIProto::HEADER_LEN, FCGIProto::HEADER_LEN };
+        }
+        records++;
+        entries++;
+        len = 0;
+        pieces = 0;
+      }
+      size_t n = std::min(iov[i].iov_len-off,(size_t)NATIVE_GATHER_RECORD-len);
+      if (list)
+        list[entries] = { static_cast<char *>(iov[i].iov_base)+off, n };
+      entries++;
+      len += n;
+      pieces++;
+      off += n;
+    }
+  }
+  if (list && records > 0)
+    FCGI::putRecordHeader(headers+(records-1)*FCGIProto::HEADER_LEN,FCGIProto::STDOUT,id,len);
+}
+
+/**
+ * @brief FCGINativeRequest::write_stdout writes a gather list to the STDOUT
+ * stream. What fits in the stream buffer is copied there, to go out in one
+ * write with the END_REQUEST. Anything larger is written straight from where
+ * it is, as records whose headers are interleaved with the pieces.
+ * @param iov the gather list
+ * @param cnt the number of entries in the list
+ * @return true if written, false if the connection failed
+ */
+bool FCGINativeRequest::write_stdout(const struct iovec *iov,int cnt)
+{
+  size_t total = 0;
+  for (int i = 0; i < cnt; i++)
+    total += iov[i].iov_len;
+  if (out.isClosed)
+    return false;
+  if (total <= (size_t)(out.stop-out.wrNext))
+  {
+    for (int i = 0; i < cnt; i++)
+    {
+      memcpy(out.wrNext,iov[i].iov_base,iov[i].iov_len);
+      out.wrNext += iov[i].iov_len;
+    }
+    return true;
+  }
+  // What is buffered goes first
+  if (!outBuf.empty() && !flush(&out,false))
+    return false;
+  if (aborted)
+    return true;
+
+  // Laid out on the stack unless it is too long, so a blob is sent with
+  // no allocation
+  size_t records, entries;
+  layout_stdout(iov,cnt,request.requestId,nullptr,nullptr,nullptr,records,entries);
+  struct iovec listBuf[NATIVE_GATHER_STACK];
+  unsigned char headerBuf[NATIVE_GATHER_STACK*FCGIProto::HEADER_LEN];
+  size_t idxBuf[NATIVE_GATHER_STACK];
+  std::vector<struct iovec> listHeap;
+  std::vector<unsigned char> headerHeap;
+  std::vector<size_t> idxHeap;
+  struct iovec *list = listBuf;
+  unsigned char *headers = headerBuf;
+  size_t *recIdx = idxBuf;
+  if (entries > NATIVE_GATHER_STACK)
+  {
+    listHeap.resize(entries);
+    headerHeap.resize(records*FCGIProto::HEADER_LEN);
+    idxHeap.resize(records);
+    list = listHeap.data();
+    headers = headerHeap.data();
+    recIdx = idxHeap.data();
+  }
+  layout_stdout(iov,cnt,request.requestId,list,headers,recIdx,records,entries);
+
+  // Whole records at a time, so other requests on the connection may
+  // write between them
+  size_t k = 0;
+  while (k < records)
+  {
+    size_t end = k+1;
+    while (end < records && recIdx[end]-recIdx[k] <= IOV_MAX-NATIVE_GATHER_PIECES-1)
+      end++;
+    size_t first = recIdx[k];
+    size_t last = (end < records) ? recIdx[end] : entries;
+    if (!conn->write_all(&list[first],last-first))
+    {
+      out.isClosed = 1;
+      out.FCGI_errno = errno;
+      return false;
+    }
+    k = end;
+  }
+  return true;
+}
+
+/**
+ * @brief FCGINativeRequest::park writes out what is buffered and frees the
+ * input and the output buffer, for a request answered later. Anything
+ * written to it afterwards is sent right away.
+ */
+void FCGINativeRequest::park()
+{
+  if (finished)
+    return;
+  if (!outBuf.empty() && !out.isClosed)
+    flush(&out,false);
+  std::vector<char>().swap(outBuf);
+  out.wrNext = out.stop = nullptr;
+  // The request was parsed, the body is not read again
+  in.rdNext = in.stop = in.stopUnget = nullptr;
+  in.isClosed = 1;
+  std::string().swap(stdinData);
+  std::string().swap(params);
+}
+
+/**
+ * @brief FCGINativeRequest::finish ends the output streams and writes the
+ * END_REQUEST record, all in one write, then releases the connection or
+ * closes it if the web server did not ask to keep it open.
+ * @return true if written, false if the connection failed
+ */
+bool FCGINativeRequest::finish()
+{
+  if (finished)
+    return true;
+  finished = true;
+  bool rv = true;
+  if (!errBuf.empty())
+    rv = flush(&err,true);
+  if (aborted)
+    out.isClosed = 1;
+  err.isClosed = err.wasFCloseCalled = 1;
+
+  unsigned char *start = reinterpret_cast<unsigned char *>(outBuf.data());
+  size_t len = (out.isClosed || outBuf.empty()) ? 0 : out.wrNext-(start+FCGIProto::HEADER_LEN);
+  unsigned char tail[FCGIProto::HEADER_LEN*3];
+  FCGI::putRecordHeader(tail,FCGIProto::STDOUT,request.requestId,0);
+  FCGI::putRecordHeader(tail+FCGIProto::HEADER_LEN,FCGIProto::END_REQUEST,request.requestId,8);
+  memset(tail+FCGIProto::HEADER_LEN*2,0,FCGIProto::HEADER_LEN);
+  tail[FCGIProto::HEADER_LEN*2+4] = FCGIProto::REQUEST_COMPLETE;
+  struct iovec iov[2];
+  int cnt = 0;
+  if (len > 0)
+  {
+    FCGI::putRecordHeader(start,FCGIProto::STDOUT,request.requestId,len);
+    iov[cnt].iov_base = start;
+    iov[cnt].iov_len = FCGIProto::HEADER_LEN+len;
+    cnt++;
+  }
+  // An aborted request only gets its END_REQUEST
+  iov[cnt].iov_base = aborted ? tail+FCGIProto::HEADER_LEN : tail;
+  iov[cnt].iov_len = aborted ? sizeof(tail)-FCGIProto::HEADER_LEN : sizeof(tail);
+  cnt++;
+  out.isClosed = out.wasFCloseCalled = 1;
+  if (!outBuf.empty())
+    out.wrNext = out.stop = start+FCGIProto::HEADER_LEN;
+  // The id is released first, the web server may reuse it as soon as it
+  // sees the END_REQUEST
+  conn->request_ending(request.requestId,request.keepConnection != 0);
+  if (!conn->write_all(iov,cnt))
+    rv = false;
+  conn->request_done();
+  return rv;
+}
+
+/**
+ * @brief FCGIConnection::FCGIConnection takes ownership of an accepted, non
+ * blocking socket
+ * @param fd the socket
+ * @param limits the multiplexing limits set on the listener
+ */
+FCGIConnection::FCGIConnection(int fd,const FCGINativeLimits &limits)
+{
+  p_fd = fd;
+  p_limits = limits;
+  p_pending = 0;
+  p_ending = 0;
+  p_closeWhenIdle = false;
+  p_writing = false;
+  p_shutdownPending = false;
+  p_watchingOut = false;
+  p_loop = std::this_thread::get_id();
+}
+
+/**
+ * @brief FCGIConnection::~FCGIConnection closes the socket once the event loop
+ * and every request still referencing the connection are done with it
+ */
+FCGIConnection::~FCGIConnection()
+{
+  ::close(p_fd);
+}
+
+/**
+ * @brief FCGIConnection::consume parses the records in what was just read off
+ * the socket. Partial records are kept until the rest of them arrives.
+ * @param data the bytes read
+ * @param len the number of bytes read
+ * @param done receives the requests which are now fully received
+ * @return true if ok, false on a protocol error and the connection should be
+ * dropped
+ */
+bool FCGIConnection::consume(const char *data,size_t len,std::vector<std::shared_ptr<FCGINativeRequest>> &done)
+{
+  // Parse straight from the read buffer unless a partial record is pending
+  const bool direct = p_inbuf.empty();
+  if (!direct)
+  {
+    p_inbuf.append(data,len);
+    data = p_inbuf.data();
+    len = p_inbuf.size();
+  }
+  size_t off = 0;
+  while (len-off >= FCGIProto::HEADER_LEN)
+  {
+    const unsigned char *h = reinterpret_cast<const unsigned char *>(data+off);
+    if (h[0] != FCGIProto::VERSION_1)
+      return false;
+    const int type = h[1];
+    const int id = (h[2] << 8) | h[3];
+    const size_t clen = (h[4] << 8) | h[5];
+    const size_t plen = h[6];
+    if (len-off < FCGIProto::HEADER_LEN+clen+plen)
+      break;
+    if (!handle_record(type,id,data+off+FCGIProto::HEADER_LEN,clen,done))
+      return false;
+    off += FCGIProto::HEADER_LEN+clen+plen;
+  }
+  if (direct)
+    p_inbuf.assign(data+off,len-off);
+  else
+    p_inbuf.erase(0,off);
+  return true;
+}
+
+// Handles a single complete record
+bool FCGIConnection::handle_record(int type,int id,const char *content,size_t clen,std::vector<std::shared_ptr<FCGINativeRequest>> &done)
+{
+  if (id == 0)
+  {
+    if (type == FCGIProto::GET_VALUES)
+      return write_values(content,clen);
+    unsigned char rec[FCGIProto::HEADER_LEN*2];
+    memset(rec,0,sizeof(rec));
+    FCGI::putRecordHeader(rec,FCGIProto::UNKNOWN_TYPE,0,8);
+    rec[FCGIProto::HEADER_LEN] = type;
+    struct iovec iov = { rec, sizeof(rec) };
+    return write_all(&iov,1);
+  }
+  switch (type)
+  {
+  case FCGIProto::BEGIN_REQUEST: {
+    if (clen < 8)
+      return false;
+    const unsigned char *b = reinterpret_cast<const unsigned char *>(content);
+    const int role = (b[0] << 8) | b[1];
+    if (role != FCGIProto::RESPONDER)
+      return write_end_request(id,0,FCGIProto::UNKNOWN_ROLE);
+    {
+      std::lock_guard<std::mutex> l(p_stateMutex);
+      if (p_receiving.count(id) || p_active.count(id))
+        break; // id still in use, ignore the duplicate
+      if (!p_limits.multiplex && p_pending > 0)
+        return write_end_request(id,0,FCGIProto::CANT_MPX_CONN);
+      if (p_pending >= p_limits.maxReqs)
+        return write_end_request(id,0,FCGIProto::OVERLOADED);
+      p_pending++;
+    }
+    std::shared_ptr<FCGINativeRequest> r = std::make_shared<FCGINativeRequest>(shared_from_this(),id,(b[2] & FCGIProto::KEEP_CONN) != 0);
+    if (p_limits.requests)
+      r->maxBody = p_limits.requests->loosest().maxBody;
+    p_receiving[id] = r;
+    if (p_limits.wheel)
+    {
+      r->began = p_limits.wheel->now();
+      arm(*r,p_limits.deadlines.header);
+    }
+    break;
+  }
+  case FCGIProto::ABORT_REQUEST: {
+    auto it = p_receiving.find(id);
+    if (it != p_receiving.end())
+    {
+      // Aborted before it was handed out, just end it
+      std::shared_ptr<FCGINativeRequest> r = it->second;
+      p_receiving.erase(it);
+      disarm(*r);
+      r->aborted = true;
+      r->finish();
+      break;
+    }
+    std::shared_ptr<FCGINativeRequest> r;
+    {
+      std::lock_guard<std::mutex> l(p_stateMutex);
+      auto ait = p_active.find(id);
+      if (ait != p_active.end())
+        r = ait->second.lock();
+    }
+    // The handler still answers it, but its output is thrown away
+    if (r)
+      r->aborted = true;
+    break;
+  }
+  case FCGIProto::PARAMS: {
+    auto it = p_receiving.find(id);
+    if (it == p_receiving.end())
+      break;
+    FCGINativeRequest &r = *it->second;
+    if (clen == 0)
+      r.params_complete();
+    else
+      r.add_params(content,clen);
+    if (p_limits.requests && (r.rejected = check_limits(r)) != 0)
+      hand_out(id,done);
+    else if (clen == 0 && p_limits.rate && !p_limits.rate->admit(r.request.envp,r.retryAfter))
+    {
+      r.rejected = 429;
+      hand_out(id,done);
+    }
+    else if (clen == 0 && p_limits.wheel)
+      arm(r,p_limits.deadlines.body);
+    break;
+  }
+  case FCGIProto::STDIN: {
+    auto it = p_receiving.find(id);
+    if (it == p_receiving.end())
+      break;
+    FCGINativeRequest &r = *it->second;
+    if (clen == 0)
+    {
+      hand_out(id,done);
+    } else if (r.maxBody && r.stdinData.size()+clen > r.maxBody) {
+      // More than CONTENT_LENGTH let on, or no CONTENT_LENGTH at all
+      r.rejected = 413;
+      hand_out(id,done);
+    } else {
+      r.stdinData.append(content,clen);
+    }
+    break;
+  }
+  default:
+    // DATA is only used by the filter role, anything else is ignored
+    break;
+  }
+  return true;
+}
+
+// Hands a request out to the listener, fully received or rejected. Records
+// still coming for it are ignored from now on.
+void FCGIConnection::hand_out(int id,std::vector<std::shared_ptr<FCGINativeRequest>> &done)
+{
+  auto it = p_receiving.find(id);
+  std::shared_ptr<FCGINativeRequest> r = it->second;
+  p_receiving.erase(it);
+  disarm(*r);
+  if (r->rejected)
+  {
+    r->params.clear();
+    r->stdinData.clear();
+  }
+  r->stdin_complete();
+  {
+    std::lock_guard<std::mutex> l(p_stateMutex);
+    p_active[id] = r;
+  }
+  done.push_back(r);
+}
+
+// Checks a request against the limits as its PARAMS arrive, until they are
+// complete against the loosest ones as its path is not known yet
+int FCGIConnection::check_limits(FCGINativeRequest &r)
+{
+  const FCGILimits &limits = *p_limits.requests;
+  if (!r.paramsDone)
+    return FCGILimits::check_params(limits.loosest(),r.envOffsets.size(),r.paramBytes+r.params.size());
+  size_t scriptLen, infoLen, lenLen;
+  const char *script = r.env("SCRIPT_NAME",11,scriptLen);
+  const char *info = r.env("PATH_INFO",9,infoLen);
+  const FCGILimits::Limits &l = limits.lookup(script,scriptLen,info,infoLen);
+  if (int status = FCGILimits::check_params(l,r.envOffsets.size(),r.paramBytes))
+    return status;
+  uint64_t length;
+  const char *len = r.env("CONTENT_LENGTH",14,lenLen);
+  // A malformed one is answered by the parser
+  if (len && l.maxBody && FCGI::parseLength(len,lenLen,length) && length > l.maxBody)
+    return 413;
+  r.maxBody = l.maxBody;
+  return 0;
+}
+
+// Sets the deadline of a request for the stage it is in, the tighter of the
+// one of the stage and the total one
+void FCGIConnection::arm(FCGINativeRequest &r,std::chrono::milliseconds stage)
+{
+  FCGITimerWheel &wheel = *p_limits.wheel;
+  uint64_t when = UINT64_MAX;
+  if (stage.count() > 0)
+    when = wheel.now() + stage.count();
+  if (p_limits.deadlines.total.count() > 0)
+    when = std::min<uint64_t>(when,r.began + p_limits.deadlines.total.count());
+  if (when == UINT64_MAX)
+    wheel.cancel(&r.timer);
+  else
+    wheel.schedule(&r.timer,when);
+}
+
+/**
+ * @brief FCGIConnection::disarm takes the deadline of a request off the wheel
+ * @param r the request
+ */
+void FCGIConnection::disarm(FCGINativeRequest &r)
+{
+  if (p_limits.wheel)
+    p_limits.wheel->cancel(&r.timer);
+}
+
+/**
+ * @brief FCGIConnection::time_out hands out a request which missed its
+ * deadline while still being received, for the listener to answer 408
+ * @param id the FastCGI request id
+ * @param done receives the request
+ */
+void FCGIConnection::time_out(int id,std::vector<std::shared_ptr<FCGINativeRequest>> &done)
+{
+  auto it = p_receiving.find(id);
+  if (it == p_receiving.end())
+    return;
+  it->second->rejected = 408;
+  hand_out(id,done);
+}
+
+// Answers FCGI_GET_VALUES with the variables we know about
+bool FCGIConnection::write_values(const char *content,size_t clen)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(content);
+  const unsigned char *ep = p+clen;
+  std::string body;
+  while (p < ep)
+  {
+    size_t lens[2];
+    if (!read_nv_lengths(p,ep,lens) || (size_t)(ep-p) < lens[0]+lens[1])
+      break;
+    std::string name(reinterpret_cast<const char *>(p),lens[0]);
+    p += lens[0]+lens[1];
+    if (name == "FCGI_MAX_CONNS")
+      put_nv(body,name,std::to_string(p_limits.maxConns));
+    else if (name == "FCGI_MAX_REQS")
+      put_nv(body,name,std::to_string(p_limits.multiplex ? p_limits.maxConns*p_limits.maxReqs : p_limits.maxConns));
+    else if (name == "FCGI_MPXS_CONNS")
+      put_nv(body,name,p_limits.multiplex ? "1" : "0");
+  }
+  unsigned char hdr[FCGIProto::HEADER_LEN];
+  FCGI::putRecordHeader(hdr,FCGIProto::GET_VALUES_RESULT,0,body.size());
+  struct iovec iov[2] = { { hdr, sizeof(hdr) }, { const_cast<char *>(body.data()), body.size() } };
+  return write_all(iov,2);
+}
+
+/**
+ * @brief FCGIConnection::write_all writes the whole gather list. Writes from
+ * several threads are serialized so records never interleave. A worker waits
+ * for the socket to drain, for up to NATIVE_WRITE_TIMEOUT between progress.
+ * The event loop never waits, neither on the socket nor on a worker writing
+ * to it. What it can not write right away is queued, and sent by the worker
+ * or by flush_output() once the socket drains.
+ * @param iov the gather list, it is modified
+ * @param cnt the number of entries in the list
+ * @return true if written or queued, false if the connection failed
+ */
+bool FCGIConnection::write_all(struct iovec *iov,int cnt)
+{
+  std::unique_lock<std::mutex> l(p_outMutex);
+  if (std::this_thread::get_id() == p_loop)
+  {
+    // Behind whatever is queued or being written
+    if (p_writing || !p_outbuf.empty())
+      return queue_output(iov,cnt);
+    p_writing = true;
+    l.unlock();
+    bool rv = send_all(iov,cnt,false);
+    l.lock();
+    p_writing = false;
+    if (rv && cnt > 0)
+      rv = queue_output(iov,cnt);
+    l.unlock();
+    p_writable.notify_all();
+    return rv;
+  }
+
+  p_writable.wait(l,[this] { return !p_writing; });
+  p_writing = true;
+  // What the event loop queued goes first, and what it queues while we
+  // write goes out before we let go of the socket
+  std::string pending;
+  pending.swap(p_outbuf);
+  l.unlock();
+  bool rv = send_pending(pending) && send_all(iov,cnt,true);
+  l.lock();
+  while (rv && !p_outbuf.empty())
+  {
+    pending.swap(p_outbuf);
+    l.unlock();
+    rv = send_pending(pending);
+    l.lock();
+  }
+  p_writing = false;
+  const bool close = (rv && p_shutdownPending && p_outbuf.empty());
+  l.unlock();
+  p_writable.notify_all();
+  if (close)
+    ::shutdown(p_fd,SHUT_RDWR);
+  return rv;
+}
+
+/**
+ * @brief FCGIConnection::flush_output sends the output queued by the event
+ * loop, called by it when the socket drained
+ * @return true if ok, false if the connection failed and should be dropped
+ */
+bool FCGIConnection::flush_output()
+{
+  std::unique_lock<std::mutex> l(p_outMutex);
+  if (p_writing)
+  {
+    // A worker has the socket, it sends the queue before it lets go
+    watch_output(false);
+    return true;
+  }
+  if (!p_outbuf.empty())
+  {
+    std::string pending;
+    pending.swap(p_outbuf);
+    p_writing = true;
+    l.unlock();
+    struct iovec q = { &pending[0], pending.size() };
+    struct iovec *qp = &q;
+    int qcnt = 1;
+    bool rv = send_all(qp,qcnt,false);
+    l.lock();
+    p_writing = false;
+    // Nothing was queued meanwhile, the event loop is this thread
+    if (rv && qcnt > 0)
+      p_outbuf.assign(static_cast<const char *>(qp->iov_base),qp->iov_len);
+    l.unlock();
+    p_writable.notify_all();
+    if (!rv)
+      return false;
+    l.lock();
+    if (!p_outbuf.empty())
+      return true;
+  }
+  watch_output(false);
+  if (p_shutdownPending)
+    ::shutdown(p_fd,SHUT_RDWR);
+  return true;
+}
+
+// Sends output taken off the queue, by a worker, and empties it
+bool FCGIConnection::send_pending(std::string &pending)
+{
+  if (pending.empty())
+    return true;
+  struct iovec q = { &pending[0], pending.size() };
+  struct iovec *qp = &q;
+  int qcnt = 1;
+  bool rv = send_all(qp,qcnt,true);
+  pending.clear();
+  return rv;
+}
+
+// Writes a gather list, advancing it past what was written. Without waiting
+// it stops when the socket is full and leaves the rest in the list. Only
+// called by the thread which set p_writing, without p_outMutex held.
+bool FCGIConnection::send_all(struct iovec *&iov,int &cnt,bool wait)
+{
+  while (cnt > 0)
+  {
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+#ifdef MSG_NOSIGNAL
+    ssize_t rc = ::sendmsg(p_fd,&msg,MSG_NOSIGNAL);
+#else
+    ssize_t rc = ::sendmsg(p_fd,&msg,0);
+#endif
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (!wait)
+          return true;
+        struct pollfd pfd = { p_fd, POLLOUT, 0 };
+        int prc = ::poll(&pfd,1,NATIVE_WRITE_TIMEOUT);
+        if (prc == 0)
+        {
+          // The web server stopped reading, the event loop drops the
+          // connection when it sees it shut down
+          ::shutdown(p_fd,SHUT_RDWR);
+          errno = ETIMEDOUT;
+          return false;
+        }
+        continue;
+      }
+      return false;
+    }
+    size_t n = rc;
+    while (cnt > 0 && n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0)
+    {
+      iov->iov_base = static_cast<char *>(iov->iov_base)+n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+// Queues what the event loop could not write. Unless a worker is writing,
+// which sends it when done, the loop watches the socket until it drains.
+// Called by the event loop with p_outMutex held.
+bool FCGIConnection::queue_output(const struct iovec *iov,int cnt)
+{
+  for (int i = 0; i < cnt; i++)
+    p_outbuf.append(static_cast<const char *>(iov[i].iov_base),iov[i].iov_len);
+  if (p_outbuf.size() > NATIVE_QUEUE_MAX)
+  {
+    ::shutdown(p_fd,SHUT_RDWR);
+    errno = ENOBUFS;
+    return false;
+  }
+  if (!p_writing)
+    watch_output(true);
+  return true;
+}
+
+// Adds or removes EPOLLOUT on the socket, only called by the event loop
+void FCGIConnection::watch_output(bool on)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if (p_watchingOut == on || p_limits.poller < 0)
+    return;
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | (on ? (uint32_t)EPOLLOUT : 0);
+  ev.data.fd = p_fd;
+  if (::epoll_ctl(p_limits.poller,EPOLL_CTL_MOD,p_fd,&ev) == 0)
+    p_watchingOut = on;
+#else
+  (void)on;
+#endif
+}
+
+// Shuts the connection down, once the output queued on it is sent
+void FCGIConnection::shutdown_when_flushed()
+{
+  std::lock_guard<std::mutex> l(p_outMutex);
+  if (!p_writing && p_outbuf.empty())
+    ::shutdown(p_fd,SHUT_RDWR);
+  else
+    p_shutdownPending = true;
+}
+
+/**
+ * @brief FCGIConnection::write_end_request writes an END_REQUEST record
+ * @param id the request id
+ * @param appStatus the application exit status
+ * @param protocolStatus one of the FCGIProto protocol status values
+ * @return true if written, false if the connection failed
+ */
+bool FCGIConnection::write_end_request(int id,int appStatus,int protocolStatus)
+{
+  unsigned char rec[FCGIProto::HEADER_LEN*2];
+  memset(rec,0,sizeof(rec));
+  FCGI::putRecordHeader(rec,FCGIProto::END_REQUEST,id,8);
+  rec[8] = (appStatus >> 24) & 0xff;
+  rec[9] = (appStatus >> 16) & 0xff;
+  rec[10] = (appStatus >> 8) & 0xff;
+  rec[11] = appStatus & 0xff;
+  rec[12] = protocolStatus;
+  struct iovec iov = { rec, sizeof(rec) };
+  return write_all(&iov,1);
+}
+
+/**
+ * @brief FCGIConnection::request_ending is called right before the end of a
+ * request is written. It frees the request id and the multiplexing slot, so a
+ * request the web server starts once it read the END_REQUEST is taken.
+ * @param id the request id
+ * @param keepConn the FCGI_KEEP_CONN flag of the request
+ */
+void FCGIConnection::request_ending(int id,bool keepConn)
+{
+  std::lock_guard<std::mutex> l(p_stateMutex);
+  p_active.erase(id);
+  p_pending--;
+  p_ending++;
+  if (!keepConn)
+    p_closeWhenIdle = true;
+}
+
+/**
+ * @brief FCGIConnection::request_done is called once the end of a request was
+ * written. If the web server did not set FCGI_KEEP_CONN the connection is
+ * shut down once no other request is multiplexed over it, and the event loop
+ * drops it when it sees the hang up.
+ */
+void FCGIConnection::request_done()
+{
+  bool close = false;
+  {
+    std::lock_guard<std::mutex> l(p_stateMutex);
+    p_ending--;
+    close = (p_closeWhenIdle && p_pending <= 0 && p_ending <= 0);
+  }
+  if (close)
+    shutdown_when_flushed();
+}
+
+/**
+ * @brief FCGIConnection::close_when_idle closes the connection once the
+ * requests started on it are answered, or right away if there are none
+ */
+void FCGIConnection::close_when_idle()
+{
+  bool close = false;
+  {
+    std::lock_guard<std::mutex> l(p_stateMutex);
+    p_closeWhenIdle = true;
+    close = (p_pending <= 0 && p_ending <= 0);
+  }
+  if (close)
+    shutdown_when_flushed();
+}
+
+/**
+ * @brief FCGIConnection::close_requests is called when the web server went
+ * away. Requests still being received are dropped, and requests handed out
+ * are marked aborted so their output is not written.
+ */
+void FCGIConnection::close_requests()
+{
+  for (auto &r: p_receiving)
+  {
+    disarm(*r.second);
+    r.second->finished = true;
+  }
+  p_receiving.clear();
+  std::vector<std::shared_ptr<FCGINativeRequest>> active;
+  {
+    std::lock_guard<std::mutex> l(p_stateMutex);
+    for (auto &r: p_active)
+    {
+      std::shared_ptr<FCGINativeRequest> sp = r.second.lock();
+      if (sp)
+        active.push_back(sp);
+    }
+  }
+  for (std::shared_ptr<FCGINativeRequest> &r: active)
+    r->aborted = true;
+}
@@ -0,0 +1,238 @@
+#ifndef FCGI_NATIVE_HXX
+#define FCGI_NATIVE_HXX
+
+#include <fcgi_request_cpp.hxx>
+#include <sys/uio.h>
+#include <atomic>
+
+/*
+ * Internal to the library: the built in FastCGI protocol engine used by the
+ * event loop mode of FCGIListener. Requests it assembles embed an FCGX_Request
+ * whose streams are backed by its own buffers, so FCGIRequest and FCGIResponse
+ * work on them through the regular FCGX_GetStr / FCGX_PutStr calls.
+ */
+
+// Record layout and constants from the FastCGI 1.0 specification
+namespace FCGIProto
+{
+enum
+{
+  HEADER_LEN = 8,
+  VERSION_1 = 1,
+  MAX_CONTENT = 65535,
+
+  BEGIN_REQUEST = 1,
+  ABORT_REQUEST = 2,
+  END_REQUEST = 3,
+  PARAMS = 4,
+  STDIN = 5,
+  STDOUT = 6,
+  STDERR = 7,
+  DATA = 8,
+  GET_VALUES = 9,
+  GET_VALUES_RESULT = 10,
+  UNKNOWN_TYPE = 11,
+
+  KEEP_CONN = 1,
+  RESPONDER = 1,
+
+  REQUEST_COMPLETE = 0,
+  CANT_MPX_CONN = 1,
+  OVERLOADED = 2,
+  UNKNOWN_ROLE = 3
+};
+}
+
+class FCGIConnection;
+
+// Marks an FCGX_Request given to libfcgi as the first member of an
+// FCGIAcceptedRequest, libfcgi leaves flags it does not know alone
+#define FCGI_TRACKED_REQUEST 0x40000000
+
+/**
+ * @brief The FCGIRequestRecord struct is what the library keeps on a request
+ * besides the FCGX_Request, reachable from the handle a response gets
+ */
+struct FCGIRequestRecord
+{
+  FCGIRequestTimes times;
+  std::shared_ptr<FCGIStats> stats;
+  // Only filled in when there is an access log
+  std::shared_ptr<FCGIAccessLog> log;
+  std::string method;
+  std::string uri;
+  // When it has to be answered by, unset without a total deadline
+  FCGIRequestTimes::Time deadline;
+};
+
+/**
+ * @brief The FCGIAcceptedRequest struct is a request accepted through libfcgi
+ */
+struct FCGIAcceptedRequest
+{
+  FCGX_Request request;
+  FCGIRequestRecord record;
+};
+
+/**
+ * @brief The FCGINativeLimits struct holds what the engine advertises in
+ * reply to FCGI_GET_VALUES and enforces on each connection
+ */
+struct FCGINativeLimits
+{
+  bool multiplex;
+  int maxConns;
+  int maxReqs;
+  // What requests may send, nullptr for no limits
+  std::shared_ptr<const FCGILimits> requests;
+  // Checked once the PARAMS are in, nullptr for none
+  std::shared_ptr<FCGIRateLimiter> rate;
+  // The header and body deadlines are kept on the wheel of the event loop,
+  // in milliseconds, nullptr if there are none
+  FCGITimerWheel *wheel;
+  FCGIListener::Deadlines deadlines;
+  // The epoll of the event loop, which watches the sockets it could not
+  // write to without waiting until they drain
+  int poller;
+};
+
+/**
+ * @brief The FCGINativeRequest struct is one request assembled from records
+ * read off a connection. It is handed to FCGIRequest through an aliasing
+ * shared pointer to the embedded FCGX_Request.
+ */
+struct FCGINativeRequest
+{
+  FCGINativeRequest(std::shared_ptr<FCGIConnection>,int id,bool keepConn);
+  ~FCGINativeRequest();
+  void add_params(const char *,size_t);
+  void params_complete();
+  const char *env(const char *name,size_t len,size_t &valLen) const;
+  void stdin_complete();
+  bool flush(FCGX_Stream *,bool close);
+  bool write_stdout(const struct iovec *,int);
+  void park();
+  bool finish();
+
+  FCGX_Request request;
+  FCGX_Stream in;
+  FCGX_Stream out;
+  FCGX_Stream err;
+  std::shared_ptr<FCGIConnection> conn;
+  // A name-value pair split across PARAMS records, kept until the rest arrives
+  std::string params;
+  // Decoded NAME=VALUE entries, each 0 terminated, envp points into it
+  std::string envArena;
+  std::vector<size_t> envOffsets;
+  std::string stdinData;
+  // Bytes of the decoded names and values, and the most body taken
+  size_t paramBytes;
+  uint64_t maxBody;
+  // The status it is answered with by the listener when over its limits,
+  // and the Retry-After of a 429
+  int rejected;
+  uint32_t retryAfter;
+  // Its header or body deadline, and the tick of the wheel it began at
+  FCGITimerWheel::Timer timer;
+  uint64_t began;
+  std::vector<char *> envp;
+  std::vector<char> outBuf;
+  std::vector<char> errBuf;
+  FCGIRequestRecord record;
+  std::atomic<bool> aborted;
+  bool paramsDone;
+  bool finished;
+};
+
+/**
+ * @brief The FCGIConnection class is one connection from the web server. The
+ * event loop feeds it whatever it reads, and it hands back the requests which
+ * are fully received. Several requests may be multiplexed over it, and it is
+ * kept open between them when the web server asks for FCGI_KEEP_CONN. Writes
+ * may come from any thread and are serialized. The event loop never waits on
+ * a write, what the socket does not take is queued and sent once it drains.
+ */
+class FCGIConnection : public std::enable_shared_from_this<FCGIConnection>
+{
+public:
+  FCGIConnection(int fd,const FCGINativeLimits &);
+  ~FCGIConnection();
+  int fd() { return p_fd; }
+  bool consume(const char *,size_t,std::vector<std::shared_ptr<FCGINativeRequest>> &);
+  bool write_all(struct iovec *,int);
+  bool flush_output();
+  bool write_end_request(int id,int appStatus,int protocolStatus);
+  void request_ending(int id,bool keepConn);
+  void request_done();
+  void close_when_idle();
+  void close_requests();
+  void time_out(int id,std::vector<std::shared_ptr<FCGINativeRequest>> &);
+  void disarm(FCGINativeRequest &);
+
+private:
+  bool handle_record(int type,int id,const char *,size_t,std::vector<std::shared_ptr<FCGINativeRequest>> &);
+  void hand_out(int id,std::vector<std::shared_ptr<FCGINativeRequest>> &);
+  int check_limits(FCGINativeRequest &);
+  void arm(FCGINativeRequest &,std::chrono::milliseconds);
+  bool write_values(const char *,size_t);
+  bool send_all(struct iovec *&,int &,bool wait);
+  bool send_pending(std::string &);
+  bool queue_output(const struct iovec *,int);
+  void watch_output(bool);
+  void shutdown_when_flushed();
+
+  int p_fd;
+  FCGINativeLimits p_limits;
+  std::string p_inbuf;
+  // Requests still being received, only touched by the event loop
+  std::map<int,std::shared_ptr<FCGINativeRequest>> p_receiving;
+  // Requests handed out, guarded by p_stateMutex along with the counters
+  std::map<int,std::weak_ptr<FCGINativeRequest>> p_active;
+  int p_pending;
+  // Requests released but still writing their END_REQUEST
+  int p_ending;
+  bool p_closeWhenIdle;
+  std::mutex p_stateMutex;
+  // Whether a thread is writing to the socket, the output the event loop
+  // queued meanwhile or because the socket was full, and whether it is to
+  // be shut down once that is sent. Guarded by p_outMutex, which is never
+  // held while writing so the event loop only ever waits for it briefly.
+  // Workers wait on p_writable for their turn.
+  std::mutex p_outMutex;
+  std::condition_variable p_writable;
+  bool p_writing;
+  std::string p_outbuf;
+  bool p_shutdownPending;
+  // Only changed by the event loop
+  bool p_watchingOut;
+  std::thread::id p_loop;
+};
+
+namespace FCGI
+{
+void putRecordHeader(unsigned char *,int type,int id,size_t len);
+bool isNativeRequest(const FCGX_Request *);
+bool requestAborted(const FCGX_Request *);
+// FCGX_Finish_r / FCGX_Free for either libfcgi or native requests
+void finishRequest(const FCGX_Request *);
+void freeRequest(const FCGX_Request *);
+// Writes a gather list to the STDOUT stream, without copying it first on
+// native requests
+bool putGather(const FCGX_Request *,const struct iovec *,int cnt);
+// Writes out what is buffered on the STDOUT stream
+bool flushStdout(const FCGX_Request *);
+// Frees what a request answered later no longer needs, its input and
+// the output buffer of a native request
+void parkRequest(const FCGX_Request *);
+// The record of a request from FCGIListener, nullptr for others
+FCGIRequestRecord *requestRecord(const FCGX_Request *);
+// CONTENT_LENGTH, digits only, false if it is anything else or overflows
+bool parseLength(const char *,size_t,uint64_t &);
+// Appends the status line of a code, ie "HTTP/1.1 200 OK\r\n", without
+// rendering it again
+void appendHeaderLine(std::string &,int httpcode);
+// Stamps the end of a response and hands the timings to the statistics
+void responseFinished(const FCGX_Request *,FCGIRequestTimes::Time responded,int status,size_t bytes);
+}
+
+#endif // FCGI_NATIVE_HXX
@@ -0,0 +1,325 @@
+#include <config.h>
+#ifdef HAVE_IOSTREAM
+#include <iostream>
+#endif
+#ifdef HAVE_THREAD
+#include <thread>
+#endif
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+#include <fcgi_request_cpp.hxx>
+
+/**
+ * @brief FCGIPrefork::FCGIPrefork sets up a supervisor for a listener which
+ * has its listener paths and options set, but is not started
+ * @param l the listener the workers share, opened by run() if need be
+ * @param workers the number of worker processes
+ */
+FCGIPrefork::FCGIPrefork(FCGIListener &l,int workers)
+  :p_listener(l)
+{
+  p_workers = workers;
+  p_generation = 0;
+  p_restarts = 0;
+  p_shutdown = false;
+  p_drainTimeout = std::chrono::seconds(30);
+  p_restartDelay = std::chrono::milliseconds(1000);
+}
+
+// The signals the master waits for, workers keep them blocked as well
+static void supervisor_signals(sigset_t *set)
+{
+  sigemptyset(set);
+  sigaddset(set,SIGCHLD);
+  sigaddset(set,SIGHUP);
+  sigaddset(set,SIGTERM);
+  sigaddset(set,SIGINT);
+  sigaddset(set,SIGALRM);
+}
+
+/**
+ * @brief FCGIPrefork::spawn forks a worker of the current generation and
+ * waits until it started its listener. The worker never returns from here,
+ * it exits with the return value of the worker function.
+ * @param main the worker function
+ * @return the pid of the worker, or -1 if it could not be started
+ */
+pid_t FCGIPrefork::spawn(WorkerMain &main)
+{
+  int ready[2];
+  if (::pipe(ready) != 0)
+  {
+    p_errorString = "pipe: ";
+    p_errorString.append(strerror(errno));
+    return -1;
+  }
+  pid_t pid = ::fork();
+  if (pid < 0)
+  {
+    p_errorString = "fork: ";
+    p_errorString.append(strerror(errno));
+    ::close(ready[0]);
+    ::close(ready[1]);
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    ::close(ready[0]);
+    // Only SIGTERM and SIGINT mean something to a worker, they are picked
+    // up by a thread of its own so the handling does not need to be signal
+    // safe. The mask is inherited by the listener threads.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set,SIGHUP);
+    sigaddset(&set,SIGTERM);
+    sigaddset(&set,SIGINT);
+    pthread_sigmask(SIG_SETMASK,&set,nullptr);
+    if (!p_listener.start())
+    {
+      std::cerr << "worker " << getpid() << ": " << p_listener.error_string() << std::endl;
+      ::_exit(1);
+    }
+    std::thread t1([this]() {
+      FCGI::SetThreadName("FCGI Drain");
+      sigset_t s;
+      sigemptyset(&s);
+      sigaddset(&s,SIGTERM);
+      sigaddset(&s,SIGINT);
+      int sig = 0;
+      while (sigwait(&s,&sig) != 0)
+        ;
+      if (p_drainTimeout.count() > 0)
+        p_listener.drain(p_drainTimeout);
+      else
+        p_listener.stop();
+    });
+    t1.detach();
+    char c = 1;
+    if (::write(ready[1],&c,1) < 0)
+      ::_exit(1);
+    ::close(ready[1]);
+    int rc = main(p_listener);
+    // _exit() so the worker does not run destructors of objects it shares
+    // with the master, such as a listener unlinking its unix sockets
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(nullptr);
+    ::_exit(rc);
+  }
+
+  ::close(ready[1]);
+  Worker w;
+  w.generation = p_generation;
+  w.started = std::chrono::steady_clock::now();
+  w.draining = false;
+  p_children[pid] = w;
+
+  // EOF without the ready byte means the worker died on the way up
+  char c = 0;
+  ssize_t rc;
+  do
+  {
+    rc = ::read(ready[0],&c,1);
+  } while (rc < 0 && errno == EINTR);
+  ::close(ready[0]);
+  if (rc != 1)
+  {
+    p_errorString = "worker failed to start";
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * @brief FCGIPrefork::drain asks a worker to stop accepting, answer what it
+ * queued and exit. The worker answers what is left 503 at the drain timeout,
+ * and gets killed if it is not gone a second after.
+ * @param pid the worker
+ */
+void FCGIPrefork::drain(pid_t pid)
+{
+  auto it = p_children.find(pid);
+  if (it == p_children.end() || it->second.draining)
+    return;
+  it->second.draining = true;
+  it->second.drainDeadline = std::chrono::steady_clock::now() + p_drainTimeout + std::chrono::seconds(1);
+  ::kill(pid,SIGTERM);
+}
+
+/**
+ * @brief FCGIPrefork::reap collects the workers which exited. Ones of the
+ * current generation which were not asked to go count as restarts.
+ */
+void FCGIPrefork::reap()
+{
+  int status = 0;
+  pid_t pid;
+  while ((pid = ::waitpid(-1,&status,WNOHANG)) > 0)
+  {
+    auto it = p_children.find(pid);
+    if (it == p_children.end())
+      continue;
+    if (!it->second.draining && !p_shutdown)
+    {
+      p_errorString = "worker " + std::to_string(pid);
+      if (WIFSIGNALED(status))
+        p_errorString.append(" killed by signal " + std::to_string(WTERMSIG(status)));
+      else
+        p_errorString.append(" exited with status " + std::to_string(WEXITSTATUS(status)));
+      if (std::chrono::steady_clock::now() - it->second.started < std::chrono::seconds(1))
+        p_lastEarlyExit = true;
+    }
+    p_children.erase(it);
+  }
+}
+
+/**
+ * @brief FCGIPrefork::run opens the listener if it is not yet, starts the
+ * workers and supervises them until SIGTERM or SIGINT. Call it from the main
+ * thread before any other threads are started, it blocks SIGCHLD, SIGHUP,
+ * SIGTERM, SIGINT and SIGALRM to wait for them.
+ * @param main the function each worker runs
+ * @return 0 once all workers drained after a SIGTERM or SIGINT, 1 if the
+ * listener could not be opened or no worker could be started
+ */
+int FCGIPrefork::run(WorkerMain main)
+{
+  p_errorString.clear();
+  if (p_listener.state() != FCGIListener::ATTACHED && !p_listener.open())
+  {
+    p_errorString = p_listener.error_string();
+    return 1;
+  }
+  p_listener.set_shared_sockets(true);
+
+  sigset_t set, old;
+  supervisor_signals(&set);
+  pthread_sigmask(SIG_BLOCK,&set,&old);
+  p_shutdown = false;
+  p_lastEarlyExit = false;
+
+  int started = 0;
+  for (int i = 0; i < p_workers; i++)
+  {
+    if (spawn(main) > 0)
+      started++;
+  }
+  if (started == 0)
+  {
+    for (auto &c: p_children)
+      ::kill(c.first,SIGKILL);
+    while (!p_children.empty() && ::waitpid(-1,nullptr,0) > 0)
+      reap();
+    pthread_sigmask(SIG_SETMASK,&old,nullptr);
+    return 1;
+  }
+  ::alarm(1);
+
+  while (!p_shutdown || !p_children.empty())
+  {
+    int sig = 0;
+    if (sigwait(&set,&sig) != 0)
+      continue;
+    switch (sig)
+    {
+    case SIGCHLD:
+      reap();
+      break;
+    case SIGHUP:
+    {
+      if (p_shutdown)
+        break;
+      // Bring up the new generation before the old one stops accepting,
+      // so there is always somebody on the sockets
+      std::vector<pid_t> previous, fresh;
+      for (auto &c: p_children)
+      {
+        if (!c.second.draining)
+          previous.push_back(c.first);
+      }
+      p_generation++;
+      bool ok = true;
+      for (int i = 0; i < p_workers; i++)
+      {
+        pid_t pid = spawn(main);
+        if (pid > 0)
+          fresh.push_back(pid);
+        else
+          ok = false;
+      }
+      // A new generation which does not come up whole is dropped, the
+      // old one stays on
+      std::vector<pid_t> &leaving = ok ? previous : fresh;
+      if (!ok)
+      {
+        for (pid_t pid: previous)
+          p_children[pid].generation = p_generation;
+      }
+      for (pid_t pid: leaving)
+        drain(pid);
+      break;
+    }
+    case SIGTERM:
+    case SIGINT:
+      p_shutdown = true;
+      for (auto &c: p_children)
+        drain(c.first);
+      break;
+    case SIGALRM:
+    {
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      for (auto &c: p_children)
+      {
+        if (c.second.draining && p_drainTimeout.count() > 0 && c.second.drainDeadline <= now)
+          ::kill(c.first,SIGKILL);
+      }
+      ::alarm(1);
+      break;
+    }
+    default:
+      break;
+    }
+
+    if (p_shutdown)
+      continue;
+    int running = 0;
+    for (auto &c: p_children)
+    {
+      if (!c.second.draining && c.second.generation == p_generation)
+        running++;
+    }
+    for (; running < p_workers; running++)
+    {
+      if (p_lastEarlyExit)
+      {
+        std::this_thread::sleep_for(p_restartDelay);
+        p_lastEarlyExit = false;
+      }
+      p_restarts++;
+      spawn(main);
+    }
+  }
+
+  ::alarm(0);
+  pthread_sigmask(SIG_SETMASK,&old,nullptr);
+  p_listener.stop();
+  return 0;
+}
@@ -0,0 +1,217 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_CCTYPE
+#include <cctype>
+#endif
+#include <algorithm>
+#include <cmath>
+
+#include <fcgi_request_cpp.hxx>
+
+namespace
+{
+// Four slots of 16 bytes, a client is looked for in one group only
+const size_t GROUP = 4;
+const int TOKEN_BITS = 24;
+const uint64_t TOKEN_MASK = ((uint64_t)1 << TOKEN_BITS) - 1;
+// A token in the fixed point the buckets count in
+const uint64_t ONE = 256;
+
+// FNV-1a, spread again so both halves are usable
+uint64_t key_hash(const char *key,size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  return h;
+}
+}
+
+FCGIRateLimiter::FCGIRateLimiter(double rate,double burst,size_t slots)
+{
+  size_t n = GROUP;
+  while (n < slots)
+    n <<= 1;
+  p_slots.reset(new Slot[n]);
+  for (size_t i = 0; i < n; i++)
+  {
+    p_slots[i].tag.store(0,std::memory_order_relaxed);
+    p_slots[i].state.store(0,std::memory_order_relaxed);
+  }
+  p_groupMask = n / GROUP - 1;
+  p_rate = std::max(rate,1e-6);
+  p_burst = (uint64_t)(std::min(std::max(burst,1.0),65535.0) * ONE);
+  p_perMs = p_rate * ONE / 1000;
+  p_var = "REMOTE_ADDR=";
+  p_started = std::chrono::steady_clock::now();
+  p_allowed = 0;
+  p_limited = 0;
+  p_untracked = 0;
+}
+
+void FCGIRateLimiter::set_key(Key k,std::string name)
+{
+  p_cookie.clear();
+  switch (k)
+  {
+  case REMOTE_ADDR:
+    p_var = "REMOTE_ADDR=";
+    break;
+  case HEADER:
+    // As the web server passes it, HTTP_ and upper case with underscores
+    p_var = (name.compare(0,5,"HTTP_") == 0) ? std::string() : std::string("HTTP_");
+    for (char c: name)
+      p_var.push_back((c == '-') ? '_' : (char)toupper((unsigned char)c));
+    p_var.push_back('=');
+    break;
+  case COOKIE:
+    p_var = "HTTP_COOKIE=";
+    p_cookie = name + "=";
+    break;
+  }
+}
+
+uint64_t FCGIRateLimiter::now_ms() const
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - p_started).count();
+}
+
+/**
+ * @brief FCGIRateLimiter::admit takes a token from the bucket of a client.
+ * Safe to call from any thread, it takes no locks.
+ * @param key what tells the client apart
+ * @param len the length of the key
+ * @param retryAfter set to the seconds until the client has a token again
+ * when it is out of them
+ * @return true to let the request through, false if the client is over
+ * its rate. A request without a key is let through.
+ */
+bool FCGIRateLimiter::admit(const char *key,size_t len,uint32_t &retryAfter)
+{
+  retryAfter = 0;
+  if (len == 0)
+    return true;
+  const uint64_t h = key_hash(key,len);
+  const uint64_t tag = h | 1;
+  Slot *group = &p_slots[((h >> 17) & p_groupMask) * GROUP];
+  const uint64_t now = now_ms();
+  const uint64_t fresh = (now << TOKEN_BITS) | p_burst;
+  // The tokens of a bucket once refilled up to now
+  auto refill = [this,now](uint64_t state) {
+    const uint64_t then = state >> TOKEN_BITS;
+    uint64_t tokens = state & TOKEN_MASK;
+    if (now > then)
+      tokens = std::min<uint64_t>(p_burst,tokens + (uint64_t)((now - then) * p_perMs));
+    return tokens;
+  };
+
+  Slot *slot = nullptr;
+  for (size_t i = 0; i < GROUP && !slot; i++)
+  {
+    if (group[i].tag.load(std::memory_order_acquire) == tag)
+      slot = &group[i];
+  }
+  for (size_t i = 0; i < GROUP && !slot; i++)
+  {
+    uint64_t t = 0;
+    if (group[i].tag.compare_exchange_strong(t,tag,std::memory_order_acq_rel))
+    {
+      group[i].state.store(fresh,std::memory_order_release);
+      slot = &group[i];
+    } else if (t == tag) {
+      slot = &group[i];
+    }
+  }
+  for (size_t i = 0; i < GROUP && !slot; i++)
+  {
+    // A full bucket is the same as none, its client may have it back later
+    uint64_t t = group[i].tag.load(std::memory_order_acquire);
+    if (refill(group[i].state.load(std::memory_order_acquire)) >= p_burst &&
+        group[i].tag.compare_exchange_strong(t,tag,std::memory_order_acq_rel))
+    {
+      group[i].state.store(fresh,std::memory_order_release);
+      slot = &group[i];
+    }
+  }
+  if (!slot)
+  {
+    p_untracked.fetch_add(1,std::memory_order_relaxed);
+    return true;
+  }
+
+  uint64_t state = slot->state.load(std::memory_order_acquire);
+  for (;;)
+  {
+    const uint64_t tokens = refill(state);
+    if (tokens < ONE)
+    {
+      // Left as it is, the refill is worked out from the same time again
+      const double secs = std::ceil((ONE - tokens) / (p_rate * ONE));
+      retryAfter = (uint32_t)std::min(std::max(secs,1.0),86400.0);
+      p_limited.fetch_add(1,std::memory_order_relaxed);
+      return false;
+    }
+    const uint64_t then = std::max<uint64_t>(now,state >> TOKEN_BITS);
+    if (slot->state.compare_exchange_weak(state,(then << TOKEN_BITS) | (tokens - ONE),std::memory_order_acq_rel))
+      break;
+  }
+  p_allowed.fetch_add(1,std::memory_order_relaxed);
+  return true;
+}
+
+/**
+ * @brief FCGIRateLimiter::admit takes a token from the bucket of the client a
+ * request came from, by its CGI variables
+ * @param envp the NAME=VALUE variables, nullptr terminated
+ * @param retryAfter set to the seconds until the client has a token again
+ * @return true to let the request through, false if the client is over
+ * its rate
+ */
+bool FCGIRateLimiter::admit(const char *const *envp,uint32_t &retryAfter)
+{
+  retryAfter = 0;
+  const char *val = nullptr;
+  for (; envp && *envp; envp++)
+  {
+    if (strncmp(*envp,p_var.data(),p_var.size()) == 0)
+    {
+      val = *envp + p_var.size();
+      break;
+    }
+  }
+  if (!val)
+    return true;
+  if (p_cookie.empty())
+    return admit(val,strlen(val),retryAfter);
+  // name=value pairs separated by ";" and spaces
+  const char *p = val;
+  while (*p)
+  {
+    while (*p == ' ' || *p == ';')
+      p++;
+    const char *end = strchr(p,';');
+    if (!end)
+      end = p + strlen(p);
+    if ((size_t)(end - p) >= p_cookie.size() && memcmp(p,p_cookie.data(),p_cookie.size()) == 0)
+      return admit(p + p_cookie.size(),end - p - p_cookie.size(),retryAfter);
+    p = end;
+  }
+  return true;
+}
+
+FCGIRateLimiter::Stats FCGIRateLimiter::stats() const
+{
+  Stats rv;
+  rv.allowed = p_allowed.load(std::memory_order_relaxed);
+  rv.limited = p_limited.load(std::memory_order_relaxed);
+  rv.untracked = p_untracked.load(std::memory_order_relaxed);
+  return rv;
+}
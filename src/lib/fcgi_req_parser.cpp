@@ -5,56 +5,259 @@
 #ifdef HAVE_IOSTREAM
 #include <iostream>
 #endif
+#include <limits.h>
+#include <tuple>
+#include <algorithm>
 #include <fcgi_request_cpp.hxx>
+#include "fcgi_native.hxx"
 
-static std::string safe_get_map_value(std::string key,std::map<std::string,std::string> *map)
+namespace
 {
-    std::map<std::string,std::string>::iterator it = map->find(key);
-    if (it == map->end())
-        return std::string();
-    return it->second;
+// In the order of FCGIRequest::Var
+constexpr const char *var_names[FCGIRequest::VAR_COUNT] = {
+  "SCRIPT_NAME", "PATH_INFO", "QUERY_STRING", "REQUEST_METHOD", "REQUEST_URI",
+  "CONTENT_LENGTH", "CONTENT_TYPE", "SERVER_PROTOCOL", "REMOTE_ADDR", "REMOTE_PORT",
+  "REMOTE_USER", "SERVER_NAME", "SERVER_PORT", "SERVER_ADDR", "SERVER_SOFTWARE",
+  "GATEWAY_INTERFACE", "DOCUMENT_ROOT", "DOCUMENT_URI", "SCRIPT_FILENAME",
+  "PATH_TRANSLATED", "REQUEST_SCHEME", "HTTPS", "AUTH_TYPE", "HTTP_HOST", "HTTP_COOKIE",
+  "HTTP_USER_AGENT", "HTTP_ACCEPT", "HTTP_ACCEPT_ENCODING", "HTTP_ACCEPT_LANGUAGE",
+  "HTTP_AUTHORIZATION", "HTTP_CONNECTION", "HTTP_CACHE_CONTROL", "HTTP_REFERER",
+  "HTTP_ORIGIN", "HTTP_IF_NONE_MATCH", "HTTP_IF_MODIFIED_SINCE",
+  "HTTP_X_FORWARDED_FOR", "HTTP_X_FORWARDED_PROTO", "HTTP_X_REAL_IP",
+  "HTTP_X_REQUEST_ID", "HTTP_CONTENT_TYPE", "HTTP_CONTENT_LENGTH", "HTTP_UPGRADE",
+  "HTTP_RANGE"
+};
+
+// The shortest name, the hash looks at its last two characters
+const size_t VAR_MIN_LENGTH = 5;
+const size_t VAR_TABLE_SIZE = 128;
+
+constexpr size_t const_length(const char *s)
+{
+  size_t n = 0;
+  while (s[n])
+    n++;
+  return n;
+}
+
+// The length, the last two characters and the one after a HTTP_ prefix
+// tell the names apart, the constants were searched for to make it so
+constexpr size_t var_hash(const char *s,size_t len)
+{
+  return (len * 2 + (uint8_t)s[len - 1] * 60 + (uint8_t)s[len - 2] + (uint8_t)s[(len > 5) ? 5 : 0] * 22) & (VAR_TABLE_SIZE - 1);
+}
+
+// The hash table of the names, built and checked by the compiler
+struct VarTable
+{
+  // The slot plus one, 0 for an empty entry
+  uint8_t slot[VAR_TABLE_SIZE];
+  uint8_t length[FCGIRequest::VAR_COUNT];
+  bool perfect;
+
+  constexpr VarTable(): slot(), length(), perfect(true)
+  {
+    for (size_t i = 0; i < FCGIRequest::VAR_COUNT; i++)
+    {
+      const size_t len = const_length(var_names[i]);
+      const size_t h = var_hash(var_names[i],len);
+      if (slot[h] || len < VAR_MIN_LENGTH)
+        perfect = false;
+      slot[h] = (uint8_t)(i + 1);
+      length[i] = (uint8_t)len;
+    }
+  }
+};
+
+constexpr VarTable var_table;
+static_assert(var_table.perfect,"FCGIRequest::Var names collide in var_hash(), search for other constants");
 }
 
-bool FCGIRequest::parse()
+/**
+ * @brief FCGIRequest::var_from finds the slot of a variable, hashing the
+ * name and comparing it with the one name it can be
+ * @param name the name
+ * @param len its length
+ * @return the slot, VAR_COUNT if the name has none
+ */
+FCGIRequest::Var FCGIRequest::var_from(const char *name,size_t len)
+{
+  if (len < VAR_MIN_LENGTH)
+    return VAR_COUNT;
+  const uint8_t s = var_table.slot[var_hash(name,len)];
+  if (s == 0 || var_table.length[s - 1] != len || memcmp(var_names[s - 1],name,len) != 0)
+    return VAR_COUNT;
+  return (Var)(s - 1);
+}
+
+const char *FCGIRequest::var_name(Var v)
+{
+  return ((unsigned)v < VAR_COUNT) ? var_names[v] : "";
+}
+
+// Adds a CGI variable, the well known ones get their slot, the first time
+// they are passed
+void FCGIRequest::add_param(const char *key,size_t keyLen,const char *val,size_t valLen)
+{
+  p_params.emplace_back(std::piecewise_construct,std::forward_as_tuple(key,keyLen),std::forward_as_tuple(val,valLen));
+  Var v = var_from(key,keyLen);
+  if (v != VAR_COUNT && p_varIndex[v] == 0)
+    p_varIndex[v] = p_params.size();
+  p_indexed = false;
+}
+
+// Builds the maps of the variables and headers, for looking up the others
+// by name
+void FCGIRequest::index_params()
+{
+  if (p_indexed)
+    return;
+  p_envp.clear();
+  p_headers.clear();
+  for (const std::pair<std::string,std::string> &p: p_params)
+  {
+    p_envp.insert(p);
+    if (p.first.compare(0,5,"HTTP_") == 0)
+      p_headers.insert({p.first.substr(5),p.second});
+  }
+  p_indexed = true;
+}
+
+namespace FCGI
+{
+bool parseLength(const char *s,size_t len,uint64_t &rv)
+{
+  rv = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    if (s[i] < '0' || s[i] > '9' || rv > (UINT64_MAX - 9) / 10)
+      return false;
+    rv = rv * 10 + (s[i] - '0');
+  }
+  return true;
+}
+}
+
+// A body is read into a buffer growing by at least this much, so memory
+// follows what arrives rather than what CONTENT_LENGTH claims
+static const size_t body_chunk = 64 * 1024;
+
+bool FCGIRequest::parse(const FCGILimits *limits)
 {
     char **envp = p_fcgiHandle->envp;
-    while (*envp)
+    size_t count = 0;
+    while (envp[count])
+        count++;
+    p_params.reserve(count);
+    size_t paramBytes = 0;
+    for (; *envp; envp++)
     {
-        std::string envs(*envp);
-        size_t idx = envs.find_first_of('=');
-        if (idx == std::string::npos)
-        {
+        const char *eq = strchr(*envp,'=');
+        if (!eq)
             break;
-        }
-        std::string key = envs.substr(0,idx);
-        std::string val = envs.substr(idx+1);
-        p_envp.insert({key,val});
-        if (key.substr(0,5) == "HTTP_")
+        const size_t valLen = strlen(eq + 1);
+        add_param(*envp,eq - *envp,eq + 1,valLen);
+        paramBytes += (eq - *envp) + valLen;
+    }
+    const std::string &length = var(CONTENT_LENGTH);
+    if (!FCGI::parseLength(length.data(),length.size(),p_contentLength))
+    {
+        p_rejected = 400;
+        return false;
+    }
+    const FCGILimits::Limits *lim = nullptr;
+    if (limits)
+    {
+        const std::string &script = var(SCRIPT_NAME);
+        const std::string &info = var(PATH_INFO);
+        lim = &limits->lookup(script.data(),script.size(),info.data(),info.size());
+        p_rejected = FCGILimits::check_params(*lim,p_params.size(),paramBytes);
+        if (!p_rejected && lim->maxBody && p_contentLength > lim->maxBody)
+            p_rejected = 413;
+        if (p_rejected)
+            return false;
+    }
+    const uint64_t clen = p_contentLength;
+    uint64_t got = 0;
+    while (got < clen)
+    {
+        // FCGX_GetStr() takes an int, so a read is never more than INT_MAX
+        const int want = (int)std::min<uint64_t>(std::min<uint64_t>(clen - got,std::max<uint64_t>(got,body_chunk)),INT_MAX);
+        if (!p_postdata.resizeTo(got + want))
         {
-            p_headers.insert({key.substr(5),val});
+            p_postdata.resizeTo(got);
+            p_rejected = 413;
+            return false;
         }
-        envp++;
+        int n = FCGX_GetStr(p_postdata.get_for_modify() + got,want,p_fcgiHandle->in);
+        if (n <= 0)
+            break;
+        got += n;
+        if (n < want)
+            break;
+    }
+    p_postdata.resizeTo(got);
+    FCGIRequestRecord *rec = FCGI::requestRecord(p_fcgiHandle.get());
+    if (rec && rec->times.received == FCGIRequestTimes::Time())
+    {
+        // libfcgi requests are only read in full here
+        rec->times.received = std::chrono::steady_clock::now();
+        rec->times.bytesIn = got;
     }
-    p_uri = safe_get_map_value("SCRIPT_NAME",&p_envp);
-    p_query_string = safe_get_map_value("QUERY_STRING",&p_envp);
-    std::string len= safe_get_map_value("CONTENT_LENGTH",&p_envp);
-    size_t clen = 0;
-    if (!len.empty())
+    // The web server gave up on the body before CONTENT_LENGTH was reached,
+    // keep what did arrive so a capture of it fails to replay the same way
+    if (got != clen)
+        return false;
+    decode(lim);
+    return (p_rejected == 0);
+}
+
+/**
+ * @brief FCGIRequest::parse parses a request from its CGI variables and body
+ * instead of a FastCGI connection, such as one recorded by FCGICapture
+ * @param params the CGI variables
+ * @param body the request body
+ * @return true if parsed, false if the body is shorter than CONTENT_LENGTH
+ * or CONTENT_LENGTH is not a number
+ */
+bool FCGIRequest::parse(const std::map<std::string,std::string> &params,FCGIData body)
+{
+    p_params.reserve(params.size());
+    for (const std::pair<const std::string,std::string> &p: params)
+        add_param(p.first.data(),p.first.size(),p.second.data(),p.second.size());
+    const std::string &length = var(CONTENT_LENGTH);
+    if (!FCGI::parseLength(length.data(),length.size(),p_contentLength))
     {
-        clen = strtoul(len.c_str(),nullptr,10);
+        p_rejected = 400;
+        return false;
     }
-    p_postdata.resizeTo(clen);
-    char *pdata = p_postdata.get_for_modify();
-    memset(pdata,0,clen);
-    FCGX_GetStr(pdata,clen,p_fcgiHandle->in);
+    if (body.size() < p_contentLength)
+        return false;
+    body.resizeTo(p_contentLength);
+    p_postdata = std::move(body);
+    decode();
+    return true;
+}
+
+// Decodes the query string, cookies and body once they are all in
+void FCGIRequest::decode(const FCGILimits::Limits *limits)
+{
+    p_uri = var(SCRIPT_NAME);
+    p_path = p_uri + var(PATH_INFO);
+    p_method = var(REQUEST_METHOD);
+    p_methodId = FCGIRouter::method_from(p_method);
+    p_query_string = var(QUERY_STRING);
     p_queryfields = FCGI::query_string_parse(p_query_string);
-    std::string cookiestr = safe_get_map_value("HTTP_COOKIE",&p_envp);
+    const std::string &cookiestr = var(HTTP_COOKIE);
     if (cookiestr.length())
         p_cookies = FCGI::cookie_parse(cookiestr);
 
     if (!p_postdata.empty())
     {
-        std::string contentType = safe_get_map_value("CONTENT_TYPE",&p_headers);
+        // Web servers pass it as CONTENT_TYPE, not as a header
+        std::string contentType = var(CONTENT_TYPE);
+        if (contentType.empty())
+            contentType = var(HTTP_CONTENT_TYPE);
         std::string boundary;
         if (contentType.find("multipart/") != std::string::npos)
         {
@@ -74,8 +277,8 @@ bool FCGIRequest::parse()
             }
             if (!boundary.empty())
             {
-                std::vector<FCGIMultipartItem> items = parseMultipart(boundary,p_postdata);
-                for (FCGIMultipartItem itm: items)
+                std::vector<FCGIMultipartItem> items = parseMultipart(boundary,p_postdata,limits);
+                for (FCGIMultipartItem &itm: items)
                 {
                   auto nmit = itm.attributes.find("name");
                   if (nmit == itm.attributes.end())
@@ -88,15 +291,14 @@ bool FCGIRequest::parse()
                     // no filename, so it must be a field value
                     p_postfields[nmit->second] = itm.data.toStdString();
                   } else {
-                    std::string fname = fnit->second;
-                    p_files[nmit->second] = { itm };
+                    p_files[nmit->second] = std::move(itm);
                   }
                 }
             }
-        } else {
+        } else if (!isJson()) {
+            // JSON is left for json() to parse when it is asked for
             std::string pdata = std::string(p_postdata.get(),p_postdata.size());
             p_postfields = FCGI::query_string_parse(pdata);
         }
     }
-    return true;
 }
@@ -2,30 +2,90 @@
 #ifdef HAVE_IOSTREAM
 #include <iostream>
 #endif
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_CCTYPE
+#include <cctype>
+#endif
 
 #include <fcgi_request_cpp.hxx>
+#include "fcgi_native.hxx"
 
 FCGIRequest::FCGIRequest(std::shared_ptr<FCGX_Request> r)
 {
   p_fcgiHandle = r;
+  memset(p_varIndex,0,sizeof(p_varIndex));
+  p_indexed = true;
+  p_methodId = FCGIRouter::METHOD_COUNT;
+  p_contentLength = 0;
+  p_rejected = 0;
+  p_deferred = false;
 }
 
 FCGIRequest::~FCGIRequest()
 {
   if (p_fcgiHandle.use_count() < 2)
   {
-    FCGX_Free(p_fcgiHandle.get(),1);
+    FCGI::freeRequest(p_fcgiHandle.get());
   }
 }
 
+FCGIRequestTimes FCGIRequest::times()
+{
+  FCGIRequestRecord *r = FCGI::requestRecord(p_fcgiHandle.get());
+  if (!r)
+    return FCGIRequestTimes();
+  return r->times;
+}
+
+FCGIRequestTimes::Time FCGIRequest::deadline()
+{
+  FCGIRequestRecord *r = FCGI::requestRecord(p_fcgiHandle.get());
+  if (!r)
+    return FCGIRequestTimes::Time();
+  return r->deadline;
+}
+
+bool FCGIRequest::aborted()
+{
+  return FCGI::requestAborted(p_fcgiHandle.get());
+}
+
+const std::string &FCGIRequest::var(Var v) const
+{
+  static const std::string empty;
+  if ((unsigned)v >= VAR_COUNT || p_varIndex[v] == 0)
+    return empty;
+  return p_params[p_varIndex[v] - 1].second;
+}
+
+// The slot of a header, by its name without the HTTP_ prefix
+static FCGIRequest::Var header_var(const std::string &key)
+{
+  char name[64] = "HTTP_";
+  if (key.size() > sizeof(name) - 6)
+    return FCGIRequest::VAR_COUNT;
+  memcpy(name + 5,key.data(),key.size());
+  return FCGIRequest::var_from(name,key.size() + 5);
+}
+
 bool FCGIRequest::hasHeader(std::string key)
 {
+  Var v = header_var(key);
+  if (v != VAR_COUNT)
+    return hasVar(v);
+  index_params();
   std::map<std::string,std::string>::iterator it = p_headers.find(key);
   return (it != p_headers.end());
 }
 
 std::string FCGIRequest::header(std::string key)
 {
+  Var v = header_var(key);
+  if (v != VAR_COUNT)
+    return var(v);
+  index_params();
   std::map<std::string,std::string>::iterator it = p_headers.find(key);
   if (it == p_headers.end())
     return std::string();
@@ -34,6 +94,7 @@ std::string FCGIRequest::header(std::string key)
 
 const std::map<std::string,std::string> *FCGIRequest::allHeaders()
 {
+  index_params();
   return &p_headers;
 }
 
@@ -83,6 +144,7 @@ void FCGIRequest::debug_dump()
   }
   std::cout << "'" << std::endl;
 
+  index_params();
   dump_map("Environment",&p_envp);
   dump_map("Headers",&p_headers);
   dump_map("Query Fields",&p_queryfields);
@@ -93,12 +155,20 @@ void FCGIRequest::debug_dump()
 
 bool FCGIRequest::hasEnv(std::string key)
 {
+  Var v = var_from(key.data(),key.size());
+  if (v != VAR_COUNT)
+    return hasVar(v);
+  index_params();
   std::map<std::string,std::string>::iterator it = p_envp.find(key);
   return (it != p_envp.end());
 }
 
 std::string FCGIRequest::getenv(std::string key)
 {
+  Var v = var_from(key.data(),key.size());
+  if (v != VAR_COUNT)
+    return var(v);
+  index_params();
   std::map<std::string,std::string>::iterator it = p_envp.find(key);
   if (it == p_envp.end())
     return std::string();
@@ -107,6 +177,7 @@ std::string FCGIRequest::getenv(std::string key)
 
 const std::map<std::string,std::string> *FCGIRequest::allEnviron()
 {
+  index_params();
   return &p_envp;
 }
 
@@ -191,3 +262,36 @@ FCGIData *FCGIRequest::postData()
 {
   return &p_postdata;
 }
+
+bool FCGIRequest::isJson()
+{
+  const std::string &contentType = var(CONTENT_TYPE);
+  if (contentType.empty())
+    return false;
+  // The media type without its parameters, ie charset
+  std::string type = FCGI::string_trim(contentType.substr(0,contentType.find(';')));
+  for (char &c: type)
+    c = tolower((unsigned char)c);
+  return (type == "application/json" || (type.size() > 5 && type.compare(type.size() - 5,5,"+json") == 0));
+}
+
+/**
+ * @brief FCGIRequest::json parses the body as JSON on first use. The
+ * document points into the body, so a copy of the request made before or
+ * after parses its own body again.
+ * @return the document, with an error if the body is not valid JSON or
+ * not JSON by its CONTENT_TYPE
+ */
+const FCGIJson &FCGIRequest::json()
+{
+  if (p_json && p_json->text() == p_postdata.get())
+    return *p_json;
+  p_json = std::make_shared<FCGIJson>();
+  if (!isJson())
+  {
+    p_json->p_text = p_postdata.get();
+    p_json->p_errorString = "not a JSON request";
+  } else
+    p_json->parse(p_postdata.get(),p_postdata.size());
+  return *p_json;
+}
@@ -8,7 +8,11 @@
 #ifdef HAVE_STDIO_H
 #include <stdio.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #include <fcgi_request_cpp.hxx>
+#include "fcgi_native.hxx"
 
 /**
  * @brief FCGIResponse::FCGIResponse is responsible for sending the response
@@ -23,6 +27,7 @@ FCGIResponse::FCGIResponse(const FCGX_Request *p)
   p_headers.clear();
   p_cookies.clear();
   p_httpCode = 200;
+  p_template = nullptr;
 }
 
 /**
@@ -51,6 +56,75 @@ void FCGIResponse::set_header(std::string name,std::string value)
   p_headers[name] = value;
 }
 
+/**
+ * @brief FCGIResponse::header_block renders the status line, the server name or
+ * the template, the headers, the cookies and the Content-Length header,
+ * followed by the blank line which seperates them from the data
+ * @param out the string to append the header block to
+ * @param length false to leave out the Content-Length, for a streamed body
+ */
+void FCGIResponse::header_block(std::string &out,bool length)
+{
+  FCGI::appendHeaderLine(out,p_httpCode);
+  if (p_template)
+  {
+    p_template->append_to(out,p_headers);
+  } else {
+    const std::string &svrname = FCGI::serverName();
+    if (!svrname.empty())
+    {
+      out.append("Server: ",8);
+      out.append(svrname);
+      out.append("\r\n",2);
+    }
+  }
+  for (const std::pair<const std::string,std::string> &h: p_headers)
+  {
+    out.append(h.first);
+    out.append(": ",2);
+    out.append(h.second);
+    out.append("\r\n",2);
+  }
+  for (const std::pair<const std::string,std::string> &h: p_cookies)
+  {
+    out.append("Set-Cookie: ",12);
+    out.append(h.first);
+    out.append(1,'=');
+    out.append(h.second);
+    out.append("\r\n",2);
+  }
+  if (!length)
+  {
+    out.append("\r\n",2);
+    return;
+  }
+  char buf[64];
+  int n = snprintf(buf,sizeof(buf),"Content-Length: %lu\r\n\r\n",(unsigned long)body_size());
+  out.append(buf,n);
+}
+
+// Headers are rendered into a buffer each thread keeps, so once it grew to
+// the size of a header block a response allocates nothing for its headers
+static std::string &header_buffer()
+{
+  static thread_local std::string buf;
+  buf.clear();
+  return buf;
+}
+
+// The data, blob and rope are sent one after the other
+size_t FCGIResponse::body_size()
+{
+  return p_data.size()+(p_blob ? p_blob->size() : 0)+p_rope.size();
+}
+
+void FCGIResponse::clear_body()
+{
+  p_data.clear();
+  p_blob.reset();
+  p_rope.clear();
+}
+
 /**
  * @brief FCGIResponse::send sends the message to the browser. At this point
  * the object should be considered invalid and only read operations should be
@@ -62,49 +136,101 @@ bool FCGIResponse::send()
   FCGX_Stream *strm = p_fcgiHandle->out;
   if (!strm)
     return false;
-  std::string header = FCGI::headerLine(p_httpCode);
-  if (FCGX_PutS(header.c_str(),strm) == -1)
+  FCGIRequestTimes::Time responded = std::chrono::steady_clock::now();
+  std::string &header = header_buffer();
+  header_block(header);
+  if (!put_body(header))
   {
     return false;
   }
-  std::string svrname = FCGI::serverName();
-  if (!svrname.empty())
-  {
-    svrname.append("\r\n");
-    svrname = "Server: "+svrname;
-    if (FCGX_PutS(svrname.c_str(),strm) == -1)
-    {
-      return false;
-    }
-  }
-  for (std::pair<std::string,std::string> h: p_headers)
-  {
-    std::string hl = h.first + ": " + h.second + "\r\n";
-    if (FCGX_PutS(hl.c_str(),strm) == -1)
-    {
-      return false;
-    }
-  }
-  for (std::pair<std::string,std::string> h: p_cookies)
+  FCGI::finishRequest(p_fcgiHandle);
+  FCGI::responseFinished(p_fcgiHandle,responded,p_httpCode,header.size()+body_size());
+  return true;
+}
+
+/**
+ * @brief FCGIResponse::send_head writes the header block, with no
+ * Content-Length, and whatever body there is so far, then flushes the
+ * stream and leaves the request open for more
+ * @return true if written, otherwise false
+ */
+bool FCGIResponse::send_head()
+{
+  if (!p_fcgiHandle->out)
+    return false;
+  std::string &header = header_buffer();
+  header_block(header,false);
+  return (put_body(header) && FCGI::flushStdout(p_fcgiHandle));
+}
+
+// Writes the header and the body
+bool FCGIResponse::put_body(const std::string &header)
+{
+  // The header, the data, the blob and the rope segments as one gather
+  // list, which only needs the heap for a rope
+  struct iovec fixed[3];
+  std::vector<struct iovec> list;
+  struct iovec *iov = fixed;
+  int cnt = 0;
+  if (!p_rope.empty())
   {
-    std::string hl = "Set-Cookie: " + h.first + "=" + h.second + "\r\n";
-    if (FCGX_PutS(hl.c_str(),strm) == -1)
-    {
-      return false;
-    }
+    list.resize(3+p_rope.segments().size());
+    iov = list.data();
   }
-  char buf[256];
-  memset(buf,0,sizeof(buf));
-  snprintf(buf,sizeof(buf)-1,"Content-Length: %lu\r\n\r\n",p_data.size());
-  if (FCGX_PutS(buf,strm) == -1)
-  {
+  iov[cnt++] = { const_cast<char *>(header.data()), header.size() };
+  if (!p_data.empty())
+    iov[cnt++] = { p_data.get_for_modify(), p_data.size() };
+  if (p_blob && !p_blob->empty())
+    iov[cnt++] = { const_cast<char *>(p_blob->get()), p_blob->size() };
+  for (const FCGIRope::Segment &seg: p_rope.segments())
+    iov[cnt++] = { const_cast<char *>(seg.data), seg.len };
+  return FCGI::putGather(p_fcgiHandle,iov,cnt);
+}
+
+/**
+ * @brief FCGIResponse::serialize renders the whole response, exactly as send()
+ * would write it, into a buffer instead of the stream. This allows the same
+ * response to be written to several requests with send_serialized()
+ * @param out the buffer to append the rendered response to
+ */
+void FCGIResponse::serialize(FCGIData &out)
+{
+  std::string &header = header_buffer();
+  header_block(header);
+  out.reserve(out.size()+header.size()+body_size());
+  out.append(header);
+  out.append(p_data);
+  if (p_blob)
+    out.append(*p_blob);
+  p_rope.copy_to(out);
+}
+
+/**
+ * @brief FCGIResponse::send_serialized writes a response rendered by serialize()
+ * to the request and finishes it, the same way send() does
+ * @param handle The raw pointer retrieved from FCGIRequest::FCGXHandle()
+ * @param data The rendered response
+ * @return true if sent successfully, otherwise false
+ */
+bool FCGIResponse::send_serialized(const FCGX_Request *handle,FCGIData &data)
+{
+  FCGX_Stream *strm = handle->out;
+  if (!strm)
     return false;
-  }
-  if (-1 == FCGX_PutStr(p_data.get(),p_data.size(),strm))
+  FCGIRequestTimes::Time responded = std::chrono::steady_clock::now();
+  // Cached responses are large as often as not, they are written from
+  // where they are
+  struct iovec iov = { data.get_for_modify(), data.size() };
+  if (!FCGI::putGather(handle,&iov,1))
   {
     return false;
   }
-  FCGX_Finish_r(const_cast<FCGX_Request *>(p_fcgiHandle));
+  FCGI::finishRequest(handle);
+  // The status code is the one in the "HTTP/1.1 200 OK" line up front
+  int status = 0;
+  if (data.size() > 12)
+    status = strtol(data.get()+9,nullptr,10);
+  FCGI::responseFinished(handle,responded,status,data.size());
   return true;
 }
 
@@ -115,7 +241,7 @@ bool FCGIResponse::send()
  */
 void FCGIResponse::set_c_string(const char *s)
 {
-  p_data.clear();
+  clear_body();
   p_data.append(s);
 }
 
@@ -126,10 +252,21 @@ void FCGIResponse::set_c_string(const char *s)
  */
 void FCGIResponse::set_string(std::string &src)
 {
-  p_data.clear();
+  clear_body();
   p_data.append(src);
 }
 
+/**
+ * @brief FCGIResponse::set_string sets the response data to a string which is
+ * moved in, and sent from where it is rather than copied
+ * @param src the string to take over
+ */
+void FCGIResponse::set_string(std::string &&src)
+{
+  clear_body();
+  p_rope.append(std::move(src));
+}
+
 /**
  * @brief FCGIResponse::set_data sets the raw data pointed to by src for the length
  * of sz as the response data. This is intended to send binary data from an in memory
@@ -139,7 +276,20 @@ void FCGIResponse::set_string(std::string &src)
  */
 void FCGIResponse::set_data(void *src,size_t sz)
 {
-  p_data = FCGIData((const char *)src,sz);
+  clear_body();
+  p_data.append((const char *)src,sz);
+}
+
+/**
+ * @brief FCGIResponse::set_data sets the response data to an immutable shared
+ * blob, ie a payload loaded once at startup. Only its reference count changes,
+ * its bytes are written to the connection from where they are.
+ * @param blob the blob to send
+ */
+void FCGIResponse::set_data(FCGIBlob blob)
+{
+  clear_body();
+  p_blob = std::move(blob);
 }
 
 /**
@@ -163,11 +313,12 @@ void FCGIResponse::read_local_file(std::string filename)
     return;
   }
   size_t sz = s.st_size;
+  clear_body();
   p_data.resizeTo(sz);
-  if (fread(p_data.get_for_modify(),sz,1,f) != sz)
+  if (fread(p_data.get_for_modify(),1,sz,f) != sz)
   {
     perror(filename.c_str());
-    return;
+    p_data.clear();
   }
   fclose(f);
 }
@@ -0,0 +1,162 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+
+#include <fcgi_request_cpp.hxx>
+
+// Anything shorter is copied into a chunk, a segment of its own costs
+// more than the copy by the time it is written
+static const size_t ROPE_COPY_MAX = 256;
+
+FCGIRope::FCGIRope()
+{
+  p_tail = std::string::npos;
+  p_size = 0;
+}
+
+/**
+ * @brief FCGIRope::FCGIRope copies a rope. Owned bytes are copied, borrowed
+ * and shared ones are referenced by both.
+ */
+FCGIRope::FCGIRope(const FCGIRope &o)
+  :FCGIRope()
+{
+  *this = o;
+}
+
+FCGIRope::FCGIRope(FCGIRope &&o) noexcept
+  :FCGIRope()
+{
+  *this = std::move(o);
+}
+
+FCGIRope &FCGIRope::operator=(const FCGIRope &o)
+{
+  if (this == &o)
+    return *this;
+  clear();
+  p_blobs = o.p_blobs;
+  for (const Segment &seg: o.p_segments)
+  {
+    if (seg.kind == OWNED)
+      append(seg.data,seg.len);
+    else
+      add_segment(seg.data,seg.len,seg.kind);
+  }
+  return *this;
+}
+
+// The deques hand over their blocks, so the segments stay valid
+FCGIRope &FCGIRope::operator=(FCGIRope &&o) noexcept
+{
+  if (this == &o)
+    return *this;
+  p_segments = std::move(o.p_segments);
+  p_chunks = std::move(o.p_chunks);
+  p_strings = std::move(o.p_strings);
+  p_blobs = std::move(o.p_blobs);
+  p_tail = o.p_tail;
+  p_size = o.p_size;
+  o.clear();
+  return *this;
+}
+
+void FCGIRope::clear()
+{
+  p_segments.clear();
+  p_chunks.clear();
+  p_strings.clear();
+  p_blobs.clear();
+  p_tail = std::string::npos;
+  p_size = 0;
+}
+
+// Adds a segment, or extends the last one if the bytes follow on from it
+void FCGIRope::add_segment(const char *data,size_t len,Kind kind)
+{
+  if (len == 0)
+    return;
+  p_size += len;
+  if (!p_segments.empty())
+  {
+    Segment &last = p_segments.back();
+    if (last.kind == kind && last.data + last.len == data)
+    {
+      last.len += len;
+      return;
+    }
+  }
+  p_segments.push_back({ data, len, kind });
+}
+
+/**
+ * @brief FCGIRope::append copies the bytes to the end of the current chunk,
+ * or to a chunk of their own if they would fill most of one
+ * @param data the bytes to copy
+ * @param len the number of bytes
+ */
+void FCGIRope::append(const char *data,size_t len)
+{
+  if (len == 0)
+    return;
+  if (len > CHUNK_SIZE / 2)
+  {
+    p_chunks.emplace_back(data,len);
+    add_segment(p_chunks.back().get(),len,OWNED);
+    return;
+  }
+  if (p_tail == std::string::npos || p_chunks[p_tail].capacity() - p_chunks[p_tail].size() < len)
+  {
+    p_chunks.emplace_back();
+    p_chunks.back().reserve(CHUNK_SIZE);
+    p_tail = p_chunks.size() - 1;
+  }
+  // Within the capacity, so the chunk is not reallocated
+  FCGIData &tail = p_chunks[p_tail];
+  const char *dest = tail.get() + tail.size();
+  tail.append(data,len);
+  add_segment(dest,len,OWNED);
+}
+
+void FCGIRope::append(std::string &&s)
+{
+  if (s.size() <= ROPE_COPY_MAX)
+  {
+    append(s.data(),s.size());
+    return;
+  }
+  p_strings.push_back(std::move(s));
+  add_segment(p_strings.back().data(),p_strings.back().size(),OWNED);
+}
+
+void FCGIRope::append(FCGIData &&d)
+{
+  if (d.size() <= ROPE_COPY_MAX)
+  {
+    append(d.get(),d.size());
+    return;
+  }
+  p_chunks.push_back(std::move(d));
+  add_segment(p_chunks.back().get(),p_chunks.back().size(),OWNED);
+}
+
+void FCGIRope::append(FCGIBlob blob)
+{
+  if (!blob || blob->empty())
+    return;
+  add_segment(blob->get(),blob->size(),SHARED);
+  p_blobs.push_back(std::move(blob));
+}
+
+void FCGIRope::append_static(const char *data,size_t len)
+{
+  add_segment(data,len,BORROWED);
+}
+
+void FCGIRope::copy_to(FCGIData &out) const
+{
+  out.reserve(out.size() + p_size);
+  for (const Segment &seg: p_segments)
+    out.append(seg.data,seg.len);
+}
@@ -0,0 +1,304 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+
+#include <fcgi_request_cpp.hxx>
+
+/**
+ * @brief The FCGIRouter::Node struct is a node of the radix tree. Its
+ * static children are told apart by the first byte of their prefix, which
+ * is kept in indices. A capture of a segment and a capture of the rest of
+ * the path are children of their own.
+ */
+struct FCGIRouter::Node
+{
+  std::string prefix;
+  std::string indices;
+  std::vector<std::unique_ptr<Node>> children;
+  std::unique_ptr<Node> param;
+  std::unique_ptr<Node> wildcard;
+  // Name of the capture, for param and wildcard nodes
+  std::string name;
+  // Indexed by Method, empty if no route ends here
+  std::vector<Handler> handlers;
+  unsigned methods = 0;
+};
+
+FCGIRouter::FCGIRouter()
+{
+  p_root.reset(new Node());
+  p_routes = 0;
+}
+
+FCGIRouter::~FCGIRouter()
+{
+}
+
+std::string FCGIRouter::Match::param(const std::string &name) const
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    if (params[i].nameLen == name.size() && memcmp(params[i].name,name.data(),name.size()) == 0)
+      return std::string(params[i].value,params[i].len);
+  }
+  return std::string();
+}
+
+#if __cplusplus >= 201703L
+std::string_view FCGIRouter::Match::view(std::string_view name) const
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    if (name == std::string_view(params[i].name,params[i].nameLen))
+      return std::string_view(params[i].value,params[i].len);
+  }
+  return std::string_view();
+}
+#endif
+
+/**
+ * @brief FCGIRouter::add walks the route down the tree, splitting a static
+ * prefix where the route parts from it, and sets the handler at its end
+ * @param method the method, ANY for all without a handler of their own
+ * @param route the route, ie "/users/:id"
+ * @param h the handler
+ * @return true if added, false and sets the error string if not
+ */
+bool FCGIRouter::add(Method method,const std::string &route,Handler h)
+{
+  p_errorString.clear();
+  if ((unsigned)method >= METHOD_COUNT)
+  {
+    p_errorString = route + ": unknown method";
+    return false;
+  }
+  if (route.empty() || route[0] != '/')
+  {
+    p_errorString = route + ": routes start with /";
+    return false;
+  }
+  Node *n = p_root.get();
+  size_t pos = 0, captures = 0;
+  while (pos < route.size())
+  {
+    const char c = route[pos];
+    if (c == ':' || c == '*')
+    {
+      size_t end = route.find('/',pos);
+      if (end == std::string::npos)
+        end = route.size();
+      std::string name = route.substr(pos+1,end-pos-1);
+      if (route[pos-1] != '/' || name.empty() || name.find_first_of(":*") != std::string::npos)
+      {
+        p_errorString = route + ": a capture must be a whole segment with a name";
+        return false;
+      }
+      if (c == '*' && end != route.size())
+      {
+        p_errorString = route + ": *" + name + " must be the end of the route";
+        return false;
+      }
+      if (++captures > MAX_PARAMS)
+      {
+        p_errorString = route + ": more than " + std::to_string(MAX_PARAMS) + " captures";
+        return false;
+      }
+      std::unique_ptr<Node> &child = (c == ':') ? n->param : n->wildcard;
+      if (!child)
+      {
+        child.reset(new Node());
+        child->name = name;
+      } else if (child->name != name) {
+        p_errorString = route + ": " + c + name + " clashes with " + c + child->name + " of an existing route";
+        return false;
+      }
+      n = child.get();
+      pos = end;
+      continue;
+    }
+
+    // Static text up to the next capture
+    size_t end = route.find_first_of(":*",pos);
+    if (end == std::string::npos)
+      end = route.size();
+    size_t idx = n->indices.find(c);
+    if (idx == std::string::npos)
+    {
+      std::unique_ptr<Node> child(new Node());
+      child->prefix = route.substr(pos,end-pos);
+      n->indices.push_back(c);
+      n->children.push_back(std::move(child));
+      n = n->children.back().get();
+      pos = end;
+      continue;
+    }
+    Node *child = n->children[idx].get();
+    size_t common = 0;
+    while (common < child->prefix.size() && pos+common < end && child->prefix[common] == route[pos+common])
+      common++;
+    if (common < child->prefix.size())
+    {
+      // The route parts from the prefix, which is split in two
+      std::unique_ptr<Node> mid(new Node());
+      mid->prefix = child->prefix.substr(0,common);
+      std::unique_ptr<Node> rest = std::move(n->children[idx]);
+      rest->prefix.erase(0,common);
+      mid->indices.push_back(rest->prefix[0]);
+      mid->children.push_back(std::move(rest));
+      n->children[idx] = std::move(mid);
+      child = n->children[idx].get();
+    }
+    n = child;
+    pos += common;
+  }
+
+  if (n->handlers.empty())
+    n->handlers.resize(METHOD_COUNT);
+  if (!n->handlers[method])
+    p_routes++;
+  n->handlers[method] = h;
+  n->methods |= (1u << method);
+  return true;
+}
+
+const FCGIRouter::Handler *FCGIRouter::match(Method method,const char *path,size_t len,Match &m) const
+{
+  m.count = 0;
+  m.allowed = 0;
+  return match_node(p_root.get(),path,path+len,method,m);
+}
+
+// The handler of a node for a method, HEAD falls back to GET and any method
+// to ANY
+const FCGIRouter::Handler *FCGIRouter::pick(const Node *n,Method method)
+{
+  if (n->methods & (1u << method))
+    return &n->handlers[method];
+  if (method == HEAD && (n->methods & (1u << GET)))
+    return &n->handlers[GET];
+  if (n->methods & (1u << ANY))
+    return &n->handlers[ANY];
+  return nullptr;
+}
+
+// Matches the rest of the path below a node: static children first, then a
+// segment capture, then a capture of the rest, backing out of dead ends
+const FCGIRouter::Handler *FCGIRouter::match_node(const Node *n,const char *p,const char *ep,Method method,Match &m)
+{
+  const size_t plen = n->prefix.size();
+  if ((size_t)(ep-p) < plen || memcmp(p,n->prefix.data(),plen) != 0)
+    return nullptr;
+  p += plen;
+  if (p == ep)
+  {
+    const Handler *h = pick(n,method);
+    if (h)
+      return h;
+    m.allowed |= n->methods;
+    // A capture of the rest may still take an empty rest
+  } else {
+    const char *idx = static_cast<const char *>(memchr(n->indices.data(),*p,n->indices.size()));
+    if (idx)
+    {
+      const Handler *h = match_node(n->children[idx-n->indices.data()].get(),p,ep,method,m);
+      if (h)
+        return h;
+    }
+    if (n->param && m.count < MAX_PARAMS)
+    {
+      const char *seg = static_cast<const char *>(memchr(p,'/',ep-p));
+      if (!seg)
+        seg = ep;
+      if (seg > p)
+      {
+        m.params[m.count++] = { n->param->name.data(), n->param->name.size(), p, (size_t)(seg-p) };
+        const Handler *h = match_node(n->param.get(),seg,ep,method,m);
+        if (h)
+          return h;
+        m.count--;
+      }
+    }
+  }
+  if (n->wildcard && m.count < MAX_PARAMS)
+  {
+    const Node *w = n->wildcard.get();
+    const Handler *h = pick(w,method);
+    if (h)
+    {
+      m.params[m.count++] = { w->name.data(), w->name.size(), p, (size_t)(ep-p) };
+      return h;
+    }
+    m.allowed |= w->methods;
+  }
+  return nullptr;
+}
+
+/**
+ * @brief FCGIRouter::dispatch matches the method and path of a request and
+ * runs the handler
+ * @param req the request
+ * @return true if a route matched, false if the request got the not found
+ * handler or an error response
+ */
+bool FCGIRouter::dispatch(FCGIRequest &req) const
+{
+  Match m;
+  const std::string &path = req.path();
+  const Handler *h = match(req.method_id(),path.data(),path.size(),m);
+  if (h)
+  {
+    (*h)(req,m);
+    return true;
+  }
+  if (p_notFound)
+  {
+    p_notFound(req,m);
+    return false;
+  }
+  FCGIResponse resp(req.FCGXHandle());
+  resp.set_header("Content-Type","text/plain");
+  if (m.allowed)
+  {
+    unsigned allowed = m.allowed;
+    if (allowed & (1u << GET))
+      allowed |= (1u << HEAD);
+    std::string allow;
+    for (int i = 0; i < ANY; i++)
+    {
+      if (allowed & (1u << i))
+        allow += std::string(allow.empty() ? "" : ", ") + method_name((Method)i);
+    }
+    resp.set_header("Allow",allow);
+    resp.set_status_code(405);
+    resp.set_c_string("Method Not Allowed\r\n");
+  } else {
+    resp.set_status_code(404);
+    resp.set_c_string("Not Found\r\n");
+  }
+  resp.send();
+  return false;
+}
+
+static const char *const method_names[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS" };
+
+/**
+ * @brief FCGIRouter::method_from
+ * @param s a REQUEST_METHOD value
+ * @return the method, METHOD_COUNT for one the router does not know, which
+ * only ANY handlers serve
+ */
+FCGIRouter::Method FCGIRouter::method_from(const std::string &s)
+{
+  for (int i = 0; i < ANY; i++)
+  {
+    if (s == method_names[i])
+      return (Method)i;
+  }
+  return METHOD_COUNT;
+}
+
+const char *FCGIRouter::method_name(Method m)
+{
+  return ((unsigned)m < ANY) ? method_names[m] : "";
+}
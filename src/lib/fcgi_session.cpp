@@ -0,0 +1,500 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <algorithm>
+#include <random>
+#include <tuple>
+
+#include <fcgi_request_cpp.hxx>
+
+namespace
+{
+// What an entry costs besides its id and value, the entry and its map node
+const size_t ENTRY_OVERHEAD = 128;
+
+const char snapshot_magic[8] = { 'F', 'C', 'G', 'I', 'S', 'E', 'S', '1' };
+}
+
+/**
+ * @brief The FCGISessionStore::Entry struct is a session, on the LRU list of
+ * its shard, an intrusive doubly linked list, and in its wheel
+ */
+struct FCGISessionStore::Entry
+{
+  const std::string *id = nullptr;
+  FCGIBlob value;
+  // Its expiry in seconds, data points back at the entry
+  FCGITimerWheel::Timer timer;
+  uint32_t ttl = 0;
+  size_t bytes = 0;
+  Entry *lruPrev = nullptr;
+  Entry *lruNext = nullptr;
+};
+
+/**
+ * @brief The FCGISessionStore::Shard struct is one lock's worth of sessions.
+ * Entries live in the map, whose nodes do not move, the lists link them.
+ */
+struct FCGISessionStore::Shard
+{
+  std::mutex mutex;
+  std::unordered_map<std::string,Entry> entries;
+  // Most recently used first
+  Entry *lruHead = nullptr;
+  Entry *lruTail = nullptr;
+  // Turned to the second of the store whenever the shard is used
+  FCGITimerWheel wheel;
+  std::vector<FCGITimerWheel::Timer *> fired;
+  size_t bytes = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t expired = 0;
+  uint64_t evicted = 0;
+
+  void lru_unlink(Entry *e);
+  void lru_push(Entry *e);
+  void remove(Entry *e,std::vector<FCGIBlob> &dropped);
+  void advance(uint64_t to,std::vector<FCGIBlob> &dropped);
+};
+
+void FCGISessionStore::Shard::lru_unlink(Entry *e)
+{
+  (e->lruPrev ? e->lruPrev->lruNext : lruHead) = e->lruNext;
+  (e->lruNext ? e->lruNext->lruPrev : lruTail) = e->lruPrev;
+  e->lruPrev = e->lruNext = nullptr;
+}
+
+void FCGISessionStore::Shard::lru_push(Entry *e)
+{
+  e->lruPrev = nullptr;
+  e->lruNext = lruHead;
+  if (lruHead)
+    lruHead->lruPrev = e;
+  lruHead = e;
+  if (!lruTail)
+    lruTail = e;
+}
+
+// Takes an entry out of the shard, its value is only let go of by the
+// caller once the lock is released
+void FCGISessionStore::Shard::remove(Entry *e,std::vector<FCGIBlob> &dropped)
+{
+  wheel.cancel(&e->timer);
+  lru_unlink(e);
+  bytes -= e->bytes;
+  dropped.push_back(std::move(e->value));
+  entries.erase(entries.find(*e->id));
+}
+
+// Turns the wheel up to the given second, dropping the entries which
+// expired on the way
+void FCGISessionStore::Shard::advance(uint64_t to,std::vector<FCGIBlob> &dropped)
+{
+  wheel.advance(to,fired);
+  for (FCGITimerWheel::Timer *t: fired)
+  {
+    remove(static_cast<Entry *>(t->data),dropped);
+    expired++;
+  }
+  fired.clear();
+}
+
+FCGISessionStore::FCGISessionStore(std::string cookieName,size_t shards)
+{
+  p_cookieName = cookieName;
+  p_shardBits = 0;
+  while (((size_t)1 << p_shardBits) < shards)
+    p_shardBits++;
+  for (size_t i = 0; i < ((size_t)1 << p_shardBits); i++)
+    p_shards.emplace_back(new Shard());
+  p_ttl = std::chrono::minutes(30);
+  p_sliding = true;
+  p_maxBytes = 0;
+  p_started = std::chrono::steady_clock::now();
+}
+
+FCGISessionStore::~FCGISessionStore()
+{
+  if (!p_snapshotPath.empty())
+    save(p_snapshotPath);
+}
+
+uint64_t FCGISessionStore::tick()
+{
+  return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - p_started).count();
+}
+
+FCGISessionStore::Shard &FCGISessionStore::shard_of(const std::string &id)
+{
+  if (p_shardBits == 0)
+    return *p_shards[0];
+  // The high bits of a multiplicative mix, the map takes the low ones
+  const uint64_t h = (uint64_t)std::hash<std::string>()(id) * 0x9e3779b97f4a7c15ULL;
+  return *p_shards[h >> (64 - p_shardBits)];
+}
+
+/**
+ * @brief FCGISessionStore::session_id
+ * @param req the request
+ * @return the value of the session cookie of the request, empty if it has none
+ */
+std::string FCGISessionStore::session_id(FCGIRequest &req)
+{
+  return req.hasCookie(p_cookieName) ? req.cookie(p_cookieName) : std::string();
+}
+
+/**
+ * @brief FCGISessionStore::get looks up a session, marking it used and, if
+ * sliding, pushing its expiry out
+ * @param id the session id
+ * @return the value, nullptr if there is no such session or it expired
+ */
+FCGIBlob FCGISessionStore::get(const std::string &id)
+{
+  if (id.empty())
+    return FCGIBlob();
+  Shard &s = shard_of(id);
+  const uint64_t now = tick();
+  std::vector<FCGIBlob> dropped;
+  std::lock_guard<std::mutex> l(s.mutex);
+  s.advance(now,dropped);
+  auto it = s.entries.find(id);
+  if (it == s.entries.end())
+  {
+    s.misses++;
+    return FCGIBlob();
+  }
+  Entry *e = &it->second;
+  s.hits++;
+  if (s.lruHead != e)
+  {
+    s.lru_unlink(e);
+    s.lru_push(e);
+  }
+  if (p_sliding && e->timer.expires != now + e->ttl)
+    s.wheel.schedule(&e->timer,now + e->ttl);
+  return e->value;
+}
+
+/**
+ * @brief FCGISessionStore::put stores a session with the default time to live
+ * @param id the session id, ie from new_id()
+ * @param value the value, replacing the one stored before
+ * @return true if stored, false if the id is empty or the session alone is
+ * larger than what a shard may hold
+ */
+bool FCGISessionStore::put(const std::string &id,FCGIBlob value)
+{
+  return put(id,value,p_ttl);
+}
+
+/**
+ * @brief FCGISessionStore::put stores a session
+ * @param id the session id
+ * @param value the value, replacing the one stored before
+ * @param ttl how long it lives, at least a second
+ * @return true if stored, false if the id is empty or the session alone is
+ * larger than what a shard may hold
+ */
+bool FCGISessionStore::put(const std::string &id,FCGIBlob value,std::chrono::seconds ttl)
+{
+  if (id.empty())
+    return false;
+  const size_t bytes = id.size() + (value ? value->size() : 0) + ENTRY_OVERHEAD;
+  const size_t cap = p_maxBytes >> p_shardBits;
+  if (p_maxBytes && bytes > cap)
+    return false;
+  const uint64_t secs = std::max<int64_t>(1,std::min<int64_t>(ttl.count(),UINT32_MAX));
+  Shard &s = shard_of(id);
+  const uint64_t now = tick();
+  std::vector<FCGIBlob> dropped;
+  std::lock_guard<std::mutex> l(s.mutex);
+  s.advance(now,dropped);
+  auto r = s.entries.emplace(std::piecewise_construct,std::forward_as_tuple(id),std::forward_as_tuple());
+  Entry *e = &r.first->second;
+  if (r.second)
+  {
+    e->id = &r.first->first;
+    e->timer.data = e;
+  } else {
+    s.lru_unlink(e);
+    s.bytes -= e->bytes;
+    dropped.push_back(std::move(e->value));
+  }
+  e->value = std::move(value);
+  e->ttl = (uint32_t)secs;
+  e->bytes = bytes;
+  s.bytes += bytes;
+  s.lru_push(e);
+  s.wheel.schedule(&e->timer,now + secs);
+  while (p_maxBytes && s.bytes > cap && s.lruTail != e)
+  {
+    s.remove(s.lruTail,dropped);
+    s.evicted++;
+  }
+  return true;
+}
+
+/**
+ * @brief FCGISessionStore::erase drops a session, ie on logout
+ * @param id the session id
+ * @return true if there was such a session
+ */
+bool FCGISessionStore::erase(const std::string &id)
+{
+  Shard &s = shard_of(id);
+  const uint64_t now = tick();
+  std::vector<FCGIBlob> dropped;
+  std::lock_guard<std::mutex> l(s.mutex);
+  s.advance(now,dropped);
+  auto it = s.entries.find(id);
+  if (it == s.entries.end())
+    return false;
+  s.remove(&it->second,dropped);
+  return true;
+}
+
+void FCGISessionStore::clear()
+{
+  for (std::unique_ptr<Shard> &s: p_shards)
+  {
+    std::unordered_map<std::string,Entry> entries;
+    std::lock_guard<std::mutex> l(s->mutex);
+    entries.swap(s->entries);
+    s->lruHead = s->lruTail = nullptr;
+    s->wheel.clear();
+    s->bytes = 0;
+  }
+}
+
+/**
+ * @brief FCGISessionStore::expire turns the wheels of all shards to now.
+ * They are turned as they are used anyway, this frees the memory of expired
+ * sessions in shards which are not.
+ * @return the number of sessions which expired
+ */
+size_t FCGISessionStore::expire()
+{
+  const uint64_t now = tick();
+  size_t rv = 0;
+  for (std::unique_ptr<Shard> &s: p_shards)
+  {
+    std::vector<FCGIBlob> dropped;
+    std::lock_guard<std::mutex> l(s->mutex);
+    const uint64_t before = s->expired;
+    s->advance(now,dropped);
+    rv += s->expired - before;
+  }
+  return rv;
+}
+
+FCGISessionStore::Stats FCGISessionStore::stats()
+{
+  Stats rv;
+  memset(&rv,0,sizeof(rv));
+  for (std::unique_ptr<Shard> &s: p_shards)
+  {
+    std::lock_guard<std::mutex> l(s->mutex);
+    rv.sessions += s->entries.size();
+    rv.bytes += s->bytes;
+    rv.hits += s->hits;
+    rv.misses += s->misses;
+    rv.expired += s->expired;
+    rv.evicted += s->evicted;
+  }
+  return rv;
+}
+
+/**
+ * @brief FCGISessionStore::new_id makes a session id from 128 random bits
+ * @return 32 hex digits
+ */
+std::string FCGISessionStore::new_id()
+{
+  thread_local std::random_device rd;
+  static const char hex[] = "0123456789abcdef";
+  std::string rv;
+  rv.reserve(32);
+  for (int i = 0; i < 4; i++)
+  {
+    uint32_t r = rd();
+    for (int j = 0; j < 8; j++, r >>= 4)
+      rv.push_back(hex[r & 15]);
+  }
+  return rv;
+}
+
+static void put_u32(std::string &out,uint32_t v)
+{
+  for (int i = 24; i >= 0; i -= 8)
+    out.push_back((char)(v >> i));
+}
+
+static void put_u64(std::string &out,uint64_t v)
+{
+  put_u32(out,(uint32_t)(v >> 32));
+  put_u32(out,(uint32_t)v);
+}
+
+static uint64_t get_be(const unsigned char *p,int n)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < n; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+/**
+ * @brief FCGISessionStore::save writes the sessions to a snapshot file, each
+ * with its expiry in wall clock time. It is written next to the file first
+ * and renamed over it, so a crash never leaves half a snapshot.
+ * @param path the snapshot file
+ * @return true if written, false and sets the error string if not
+ */
+bool FCGISessionStore::save(const std::string &path)
+{
+  std::lock_guard<std::mutex> fl(p_fileMutex);
+  p_errorString.clear();
+  std::string out(snapshot_magic,sizeof(snapshot_magic));
+  const int64_t wall = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  const uint64_t now = tick();
+  for (std::unique_ptr<Shard> &s: p_shards)
+  {
+    std::lock_guard<std::mutex> l(s->mutex);
+    for (const std::pair<const std::string,Entry> &p: s->entries)
+    {
+      const Entry &e = p.second;
+      if (e.timer.expires <= now)
+        continue;
+      const size_t vlen = e.value ? e.value->size() : 0;
+      put_u32(out,p.first.size());
+      put_u32(out,vlen);
+      put_u64(out,wall + (e.timer.expires - now));
+      put_u32(out,e.ttl);
+      out.append(p.first);
+      if (vlen)
+        out.append(e.value->get(),vlen);
+    }
+  }
+  const std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(),O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0600);
+  if (fd < 0)
+  {
+    p_errorString = tmp + ": " + strerror(errno);
+    return false;
+  }
+  size_t off = 0;
+  while (off < out.size())
+  {
+    ssize_t rc = ::write(fd,out.data() + off,out.size() - off);
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      p_errorString = tmp + ": " + strerror(errno);
+      ::close(fd);
+      ::unlink(tmp.c_str());
+      return false;
+    }
+    off += rc;
+  }
+  if (::fsync(fd) != 0 || ::close(fd) != 0 || ::rename(tmp.c_str(),path.c_str()) != 0)
+  {
+    p_errorString = path + ": " + strerror(errno);
+    ::unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief FCGISessionStore::load reads back a snapshot file written by save(),
+ * the sessions which expired since are left out. Every length is checked
+ * against the file, so a damaged one is refused rather than trusted.
+ * @param path the snapshot file
+ * @return true if read, false and sets the error string if it could not be
+ * read or is malformed. The sessions before a malformed one are kept.
+ */
+bool FCGISessionStore::load(const std::string &path)
+{
+  std::lock_guard<std::mutex> fl(p_fileMutex);
+  p_errorString.clear();
+  int fd = ::open(path.c_str(),O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    p_errorString = path + ": " + strerror(errno);
+    return false;
+  }
+  std::string data;
+  char buf[65536];
+  ssize_t rc;
+  while ((rc = ::read(fd,buf,sizeof(buf))) != 0)
+  {
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      p_errorString = path + ": " + strerror(errno);
+      ::close(fd);
+      return false;
+    }
+    data.append(buf,rc);
+  }
+  ::close(fd);
+
+  if (data.size() < sizeof(snapshot_magic) || memcmp(data.data(),snapshot_magic,sizeof(snapshot_magic)) != 0)
+  {
+    p_errorString = path + ": not a session snapshot";
+    return false;
+  }
+  const int64_t wall = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(data.data());
+  size_t off = sizeof(snapshot_magic);
+  while (off < data.size())
+  {
+    if (data.size() - off < 20)
+      break;
+    const size_t idLen = get_be(p + off,4);
+    const size_t vlen = get_be(p + off + 4,4);
+    const int64_t expires = (int64_t)get_be(p + off + 8,8);
+    const uint32_t ttl = get_be(p + off + 16,4);
+    off += 20;
+    if (idLen > data.size() - off || vlen > data.size() - off - idLen)
+    {
+      p_errorString = path + ": malformed session at offset " + std::to_string(off - 20);
+      return false;
+    }
+    std::string id = data.substr(off,idLen);
+    off += idLen;
+    if (expires > wall)
+    {
+      std::shared_ptr<FCGIData> value = std::make_shared<FCGIData>();
+      value->append(data.data() + off,vlen);
+      // Stored with what is left of its time, sliding from then on with
+      // its own again
+      put(id,value,std::chrono::seconds(expires - wall));
+      Shard &s = shard_of(id);
+      std::lock_guard<std::mutex> l(s.mutex);
+      auto it = s.entries.find(id);
+      if (it != s.entries.end() && ttl)
+        it->second.ttl = ttl;
+    }
+    off += vlen;
+  }
+  if (off != data.size())
+  {
+    p_errorString = path + ": truncated session at the end";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,233 @@
+#include <config.h>
+#include <algorithm>
+#include <fcgi_request_cpp.hxx>
+
+/**
+ * @brief FCGIHistogram::FCGIHistogram starts with all buckets empty
+ */
+FCGIHistogram::FCGIHistogram()
+{
+  for (std::atomic<uint64_t> &c: p_counts)
+    c.store(0,std::memory_order_relaxed);
+}
+
+/**
+ * @brief FCGIHistogram::bucket finds the bucket of a value. Values below
+ * eight get a bucket each, above that every power of two is split in eight.
+ * @param usec the value
+ * @return the bucket index
+ */
+size_t FCGIHistogram::bucket(uint64_t usec)
+{
+  if (usec < SUB_BUCKETS)
+    return usec;
+  int e = 63 - __builtin_clzll(usec);
+  size_t sub = (usec >> (e-3)) & (SUB_BUCKETS-1);
+  return SUB_BUCKETS + (e-3) * SUB_BUCKETS + sub;
+}
+
+/**
+ * @brief FCGIHistogram::bucket_value
+ * @param idx the bucket index
+ * @return the highest value counted in the bucket
+ */
+uint64_t FCGIHistogram::bucket_value(size_t idx)
+{
+  if (idx < SUB_BUCKETS)
+    return idx;
+  int e = (idx - SUB_BUCKETS) / SUB_BUCKETS + 3;
+  uint64_t sub = (idx - SUB_BUCKETS) % SUB_BUCKETS;
+  uint64_t lower = (SUB_BUCKETS + sub) << (e-3);
+  return lower + (uint64_t(1) << (e-3)) - 1;
+}
+
+/**
+ * @brief FCGIHistogram::record counts a value, only ever called by the
+ * thread owning the histogram
+ * @param usec the latency in microseconds
+ */
+void FCGIHistogram::record(uint64_t usec)
+{
+  p_counts[bucket(usec)].fetch_add(1,std::memory_order_relaxed);
+}
+
+/**
+ * @brief FCGIHistogram::add_to merges the counts into a bucket array
+ * @param counts array of BUCKETS counts to add to
+ */
+void FCGIHistogram::add_to(std::vector<uint64_t> &counts) const
+{
+  counts.resize(BUCKETS,0);
+  for (size_t i = 0; i < BUCKETS; i++)
+    counts[i] += p_counts[i].load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief FCGIHistogram::percentile
+ * @param counts merged bucket counts, see add_to()
+ * @param pct the percentile, ie 99.9
+ * @return the value at or below which pct percent of the values are
+ */
+uint64_t FCGIHistogram::percentile(const std::vector<uint64_t> &counts,double pct)
+{
+  uint64_t total = 0;
+  for (uint64_t c: counts)
+    total += c;
+  if (total == 0)
+    return 0;
+  uint64_t target = (uint64_t)(pct / 100.0 * total + 0.5);
+  if (target < 1)
+    target = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts.size(); i++)
+  {
+    seen += counts[i];
+    if (seen >= target)
+      return bucket_value(i);
+  }
+  return bucket_value(counts.size()-1);
+}
+
+/**
+ * @brief FCGIStats::FCGIStats starts the clock for the throughput
+ */
+FCGIStats::FCGIStats()
+{
+  static std::atomic<uint64_t> ids(0);
+  p_id = ++ids;
+  p_started = std::chrono::steady_clock::now();
+}
+
+/**
+ * @brief FCGIStats::stage_name
+ * @param s the stage
+ * @return a short lower case name for the stage
+ */
+const char *FCGIStats::stage_name(Stage s)
+{
+  static const char *names[STAGES] = { "receive", "parse", "queue", "handler", "send", "total" };
+  return (s < STAGES) ? names[s] : "";
+}
+
+// The shard of the calling thread, created on its first request
+FCGIStats::Shard *FCGIStats::local()
+{
+  // Keyed by id rather than address, a new object may reuse the address
+  thread_local std::vector<std::pair<uint64_t,Shard *>> shards;
+  for (std::pair<uint64_t,Shard *> &s: shards)
+  {
+    if (s.first == p_id)
+      return s.second;
+  }
+  std::unique_ptr<Shard> sh(new Shard());
+  Shard *rv = sh.get();
+  {
+    std::lock_guard<std::mutex> l(p_mutex);
+    p_shards.push_back(std::move(sh));
+  }
+  shards.push_back(std::make_pair(p_id,rv));
+  return rv;
+}
+
+/**
+ * @brief FCGIStats::stage_usec works out how long a request spent in a stage
+ * @param t the timestamps of the request
+ * @param s the stage
+ * @param usec receives the latency in microseconds
+ * @return false if the request did not get through the stage
+ */
+bool FCGIStats::stage_usec(const FCGIRequestTimes &t,Stage s,uint64_t &usec)
+{
+  const FCGIRequestTimes::Time *from[STAGES] = { &t.begin, &t.received, &t.parsed, &t.dequeued, &t.responded, &t.begin };
+  const FCGIRequestTimes::Time *to[STAGES] = { &t.received, &t.parsed, &t.dequeued, &t.responded, &t.finished, &t.finished };
+  if (s >= STAGES)
+    return false;
+  if (*from[s] == FCGIRequestTimes::Time() || *to[s] == FCGIRequestTimes::Time() || *to[s] < *from[s])
+    return false;
+  usec = std::chrono::duration_cast<std::chrono::microseconds>(*to[s] - *from[s]).count();
+  return true;
+}
+
+/**
+ * @brief FCGIStats::record adds the stages of a finished request to the
+ * histograms of the calling thread
+ * @param t the timestamps of the request
+ */
+void FCGIStats::record(const FCGIRequestTimes &t)
+{
+  Shard *sh = local();
+  for (int i = 0; i < STAGES; i++)
+  {
+    uint64_t usec;
+    if (!stage_usec(t,(Stage)i,usec))
+      continue;
+    sh->hist[i].record(usec);
+    sh->sum[i].fetch_add(usec,std::memory_order_relaxed);
+    if (usec > sh->max[i].load(std::memory_order_relaxed))
+      sh->max[i].store(usec,std::memory_order_relaxed);
+  }
+  if (t.status >= 100 && t.status < 600)
+    sh->statuses[t.status].fetch_add(1,std::memory_order_relaxed);
+  sh->requests.fetch_add(1,std::memory_order_relaxed);
+  sh->bytesIn.fetch_add(t.bytesIn,std::memory_order_relaxed);
+  sh->bytesOut.fetch_add(t.bytesOut,std::memory_order_relaxed);
+}
+
+/**
+ * @brief FCGIStats::record_parse_error counts a request which could not be
+ * parsed and was dropped
+ */
+void FCGIStats::record_parse_error()
+{
+  local()->parseErrors.fetch_add(1,std::memory_order_relaxed);
+}
+
+/**
+ * @brief FCGIStats::snapshot merges the shards of all threads
+ * @return the counters and the percentiles of each stage
+ */
+FCGIStats::Snapshot FCGIStats::snapshot()
+{
+  Snapshot rv;
+  rv.requests = rv.bytesIn = rv.bytesOut = rv.parseErrors = 0;
+  uint64_t sums[STAGES] = { 0 };
+  for (int i = 0; i < STAGES; i++)
+    rv.stages[i].max = 0;
+  {
+    std::lock_guard<std::mutex> l(p_mutex);
+    for (std::unique_ptr<Shard> &sh: p_shards)
+    {
+      for (int i = 0; i < STAGES; i++)
+      {
+        sh->hist[i].add_to(rv.stages[i].buckets);
+        sums[i] += sh->sum[i].load(std::memory_order_relaxed);
+        rv.stages[i].max = std::max(rv.stages[i].max,sh->max[i].load(std::memory_order_relaxed));
+      }
+      rv.requests += sh->requests.load(std::memory_order_relaxed);
+      rv.bytesIn += sh->bytesIn.load(std::memory_order_relaxed);
+      rv.bytesOut += sh->bytesOut.load(std::memory_order_relaxed);
+      rv.parseErrors += sh->parseErrors.load(std::memory_order_relaxed);
+      for (int code = 100; code < 600; code++)
+      {
+        uint64_t n = sh->statuses[code].load(std::memory_order_relaxed);
+        if (n)
+          rv.statuses[code] += n;
+      }
+    }
+  }
+  for (int i = 0; i < STAGES; i++)
+  {
+    StageSnapshot &s = rv.stages[i];
+    s.buckets.resize(FCGIHistogram::BUCKETS,0);
+    s.count = 0;
+    for (uint64_t c: s.buckets)
+      s.count += c;
+    s.p50 = FCGIHistogram::percentile(s.buckets,50.0);
+    s.p99 = FCGIHistogram::percentile(s.buckets,99.0);
+    s.p999 = FCGIHistogram::percentile(s.buckets,99.9);
+    s.mean = s.count ? (double)sums[i] / s.count : 0.0;
+  }
+  rv.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - p_started).count();
+  rv.throughput = (rv.seconds > 0) ? rv.requests / rv.seconds : 0.0;
+  return rv;
+}
@@ -0,0 +1,198 @@
+#include <config.h>
+#ifdef HAVE_CSTRING
+#include <cstring>
+#endif
+
+#include <algorithm>
+
+#include <fcgi_request_cpp.hxx>
+
+namespace
+{
+// Four levels of 64 slots reach 2^24 ticks, later timers are put as far out
+// as that and cascaded down again
+const uint64_t WHEEL_SPAN = (uint64_t)1 << (FCGITimerWheel::SLOT_BITS * FCGITimerWheel::LEVELS);
+
+inline uint64_t level_mask(int level)
+{
+  return ((uint64_t)1 << (FCGITimerWheel::SLOT_BITS * level)) - 1;
+}
+}
+
+/**
+ * @brief FCGITimerWheel::FCGITimerWheel
+ * @param now the tick to start at
+ */
+FCGITimerWheel::FCGITimerWheel(uint64_t now)
+{
+  memset(p_slots,0,sizeof(p_slots));
+  memset(p_levelCount,0,sizeof(p_levelCount));
+  p_size = 0;
+  p_now = now;
+}
+
+// Puts a timer in the lowest level whose span reaches the tick, in the slot
+// of that level the tick falls in
+void FCGITimerWheel::link(Timer *t,uint64_t when)
+{
+  if (when - p_now >= WHEEL_SPAN)
+    when = p_now + WHEEL_SPAN - 1;
+  const uint64_t delta = when - p_now;
+  int level = 0;
+  while (level < LEVELS - 1 && delta > level_mask(level + 1))
+    level++;
+  Timer **slot = &p_slots[level][(when >> (SLOT_BITS * level)) & (SLOTS - 1)];
+  t->slot = slot;
+  t->level = level;
+  t->prev = nullptr;
+  t->next = *slot;
+  if (*slot)
+    (*slot)->prev = t;
+  *slot = t;
+  p_levelCount[level]++;
+}
+
+/**
+ * @brief FCGITimerWheel::schedule sets a timer to fire, moving it if it was
+ * scheduled already
+ * @param t the timer
+ * @param expires the tick it fires at, one already passed fires on the next
+ */
+void FCGITimerWheel::schedule(Timer *t,uint64_t expires)
+{
+  if (t->slot)
+    cancel(t);
+  t->expires = expires;
+  // The slot of this tick was already done with
+  link(t,std::max(expires,p_now + 1));
+  p_size++;
+}
+
+/**
+ * @brief FCGITimerWheel::cancel takes a timer out of the wheel, nothing
+ * happens if it is not in it
+ * @param t the timer
+ */
+void FCGITimerWheel::cancel(Timer *t)
+{
+  if (!t->slot)
+    return;
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    *t->slot = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  t->prev = t->next = nullptr;
+  t->slot = nullptr;
+  p_levelCount[t->level]--;
+  p_size--;
+}
+
+// Moves the timers of a slot of an upper level down to where they belong now
+void FCGITimerWheel::cascade(int level,size_t idx)
+{
+  Timer *t = p_slots[level][idx];
+  p_slots[level][idx] = nullptr;
+  while (t)
+  {
+    Timer *next = t->next;
+    p_levelCount[level]--;
+    // Those due right now go to the slot advance() is about to fire
+    link(t,std::max(t->expires,p_now));
+    t = next;
+  }
+}
+
+/**
+ * @brief FCGITimerWheel::advance turns the wheel up to a tick, skipping
+ * ahead over levels with nothing in them
+ * @param to the tick, ie the current time
+ * @param expired receives the timers which fired on the way, they are out of
+ * the wheel and may be scheduled again or destroyed
+ */
+void FCGITimerWheel::advance(uint64_t to,std::vector<Timer *> &expired)
+{
+  while (p_now < to)
+  {
+    if (p_size == 0)
+    {
+      p_now = to;
+      break;
+    }
+    int level = 0;
+    while (p_levelCount[level] == 0)
+      level++;
+    if (level > 0)
+    {
+      // Nothing below this level, straight on to its next cascade
+      const uint64_t last = p_now | level_mask(level);
+      if (last >= to)
+      {
+        p_now = to;
+        break;
+      }
+      p_now = last;
+    }
+    p_now++;
+    for (level = 1; level < LEVELS; level++)
+    {
+      if (p_now & level_mask(level))
+        break;
+      cascade(level,(p_now >> (SLOT_BITS * level)) & (SLOTS - 1));
+    }
+    Timer *t = p_slots[0][p_now & (SLOTS - 1)];
+    while (t)
+    {
+      Timer *next = t->next;
+      cancel(t);
+      if (t->expires <= p_now)
+        expired.push_back(t);
+      else
+      {
+        // Cut short by the span of the wheel
+        link(t,t->expires);
+        p_size++;
+      }
+      t = next;
+    }
+  }
+}
+
+/**
+ * @brief FCGITimerWheel::next_wakeup tells how far the owner may wait before
+ * it calls advance(). Timers further out may need cascading first, so it can
+ * be earlier than the first of them.
+ * @return the tick, UINT64_MAX if the wheel is empty
+ */
+uint64_t FCGITimerWheel::next_wakeup() const
+{
+  if (p_size == 0)
+    return UINT64_MAX;
+  uint64_t rv = UINT64_MAX;
+  int level = 1;
+  while (level < LEVELS && p_levelCount[level] == 0)
+    level++;
+  if (level < LEVELS)
+    rv = (p_now | level_mask(level)) + 1;
+  if (p_levelCount[0] != 0)
+  {
+    for (uint64_t t = p_now + 1; t < rv && t < p_now + SLOTS; t++)
+    {
+      if (p_slots[0][t & (SLOTS - 1)])
+        return t;
+    }
+  }
+  return rv;
+}
+
+/**
+ * @brief FCGITimerWheel::clear empties the wheel, without touching the timers
+ * which were in it
+ */
+void FCGITimerWheel::clear()
+{
+  memset(p_slots,0,sizeof(p_slots));
+  memset(p_levelCount,0,sizeof(p_levelCount));
+  p_size = 0;
+}
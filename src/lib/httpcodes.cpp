@@ -3,7 +3,9 @@
 #include <map>
 #include <string>
 
-static std::map<unsigned short,std::string> httpResponseCodes = {
+#include "fcgi_native.hxx"
+
+static const std::map<unsigned short,std::string> httpResponseCodes = {
 {100 ,"Continue"},
 {101 ,"Switching Protocols"},
 {200 ,"OK"},
@@ -38,6 +40,8 @@ static std::map<unsigned short,std::string> httpResponseCodes = {
 {415 ,"Unsupported Media Type"},
 {416 ,"Requested range not satisfiable"},
 {417 ,"Expectation Failed"},
+{429 ,"Too Many Requests"},
+{431 ,"Request Header Fields Too Large"},
 {500 ,"Internal Server Error"},
 {501 ,"Not Implemented"},
 {502 ,"Bad Gateway"},
@@ -46,13 +50,50 @@ static std::map<unsigned short,std::string> httpResponseCodes = {
 {505 ,"HTTP Version not supported"}
 };
 
+namespace
+{
+std::string render_line(unsigned short httpcode)
+{
+  char buf[256];
+  memset(buf,0,sizeof(buf));
+  std::map<unsigned short,std::string>::const_iterator it = httpResponseCodes.find(httpcode);
+  snprintf(buf,sizeof(buf)-1,"HTTP/1.1 %d %s\r\n",httpcode,it != httpResponseCodes.end() ? it->second.c_str() : "");
+  return std::string(buf);
+}
+
+// The status lines of the codes from 100 to 599, rendered once and only
+// read from then on, so any thread may use them
+struct StatusLines
+{
+  StatusLines()
+  {
+    for (unsigned short c = 100; c < 600; c++)
+      lines[c - 100] = render_line(c);
+  }
+  std::string lines[500];
+};
+
+const StatusLines &status_lines()
+{
+  static const StatusLines rv;
+  return rv;
+}
+}
+
 namespace FCGI
 {
   std::string headerLine(unsigned short httpcode)
   {
-    char buf[256];
-    memset(buf,0,sizeof(buf));
-    snprintf(buf,sizeof(buf)-1,"HTTP/1.1 %d %s\r\n",httpcode,httpResponseCodes[httpcode].c_str());
-    return std::string(buf);
+    if (httpcode >= 100 && httpcode < 600)
+      return status_lines().lines[httpcode - 100];
+    return render_line(httpcode);
+  }
+
+  void appendHeaderLine(std::string &out,int httpcode)
+  {
+    if (httpcode >= 100 && httpcode < 600)
+      out.append(status_lines().lines[httpcode - 100]);
+    else
+      out.append(render_line((unsigned short)httpcode));
   }
 }
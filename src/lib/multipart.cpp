@@ -6,13 +6,20 @@
 
 #include <fcgi_request_cpp.hxx>
 
-std::vector<struct FCGIMultipartItem> FCGIRequest::parseMultipart(std::string boundary, FCGIData data)
+/**
+ * @brief FCGIRequest::parseMultipart splits a multipart body into its parts
+ * @param boundary the boundary from the CONTENT_TYPE
+ * @param data the body
+ * @param limits the part count and file size limits, or nullptr for none.
+ * Going over one stops the parsing and marks the request rejected 413.
+ * @return the parts
+ */
+std::vector<struct FCGIMultipartItem> FCGIRequest::parseMultipart(std::string boundary, const FCGIData &data, const FCGILimits::Limits *limits)
 {
   std::vector<struct FCGIMultipartItem> rv;
 
   std::string dataStr;
-  dataStr.resize(data.size());
-  std::memcpy(const_cast<char *>(dataStr.data()),data.get_for_modify(),data.size());
+  dataStr.assign(data.get(),data.size());
   std::string::size_type idx = dataStr.find(boundary,0);
   const std::string::size_type bndLen = boundary.length();
 
@@ -24,6 +31,15 @@ std::vector<struct FCGIMultipartItem> FCGIRequest::parseMultipart(std::string bo
     if (idx == std::string::npos)
       continue; // weve hit the end
     std::string::size_type dataStart = dataStr.find("\r\n\r\n",start);
+    // A part is its headers, a blank line, the data and CRLF-- before the
+    // next boundary, one too short to hold that is skipped
+    if (dataStart == std::string::npos || dataStart+8 > idx)
+      continue;
+    if (limits && limits->maxParts && rv.size() >= limits->maxParts)
+    {
+      p_rejected = 413;
+      break;
+    }
     std::string nvpairs = dataStr.substr(start,dataStart-start);
     std::string::size_type rpos = nvpairs.find("\r\n");
     std::string::size_type lrpos = 0;
@@ -34,7 +50,7 @@ std::vector<struct FCGIMultipartItem> FCGIRequest::parseMultipart(std::string bo
     } else {
     while (rpos != std::string::npos)
     {
-      nvtmp.append(nvpairs.substr(lrpos,rpos));
+      nvtmp.append(nvpairs.substr(lrpos,rpos-lrpos));
       lrpos = rpos+2;
       if (lrpos > nvpairs.size()) break;
       rpos = nvpairs.find("\r\n",lrpos);
@@ -47,8 +63,7 @@ std::vector<struct FCGIMultipartItem> FCGIRequest::parseMultipart(std::string bo
     }
     nvpairs = nvtmp;
     FCGIMultipartItem itm;
-    itm.data.resizeTo(idx-dataStart-8);
-    std::memcpy(itm.data.get_for_modify(),&data.get()[dataStart+4],itm.data.size());
+    itm.data.append(&data.get()[dataStart+4],idx-dataStart-8);
     std::vector<std::string::size_type> commas;
     std::string::size_type i = 0;
     while (i != std::string::npos)
@@ -84,7 +99,7 @@ std::vector<struct FCGIMultipartItem> FCGIRequest::parseMultipart(std::string bo
 
         key = FCGI::string_trim(nv[0]);
         val = FCGI::string_trim(nv[1]);
-        if (val.front() == '"')
+        if (val.size() >= 2 && val.front() == '"')
         {
           val = val.substr(1,val.size()-2);
         }
@@ -97,13 +112,18 @@ std::vector<struct FCGIMultipartItem> FCGIRequest::parseMultipart(std::string bo
             {
               std::string base64 = itm.data.toStdString();
               FCGIData d = FCGI::base64Decode(base64);
-              itm.data = d;
+              itm.data = std::move(d);
             }
           }
         }
       }
     }
-    rv.push_back(itm);
+    if (limits && limits->maxFileSize && itm.data.size() > limits->maxFileSize && itm.attributes.count("filename"))
+    {
+      p_rejected = 413;
+      break;
+    }
+    rv.push_back(std::move(itm));
   }
   return rv;
 }
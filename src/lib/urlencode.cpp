@@ -2,6 +2,9 @@
 #ifdef HAVE_STRING
 #include <string>
 #endif
+#ifdef HAVE_CCTYPE
+#include <cctype>
+#endif
 
 namespace FCGI
 {
@@ -15,9 +18,9 @@ namespace FCGI
 std::string urldecode(std::string s)
 {
     std::string rv;
-    char *p = const_cast<char *>(s.data());
-    const char *ep = &s.data()[s.length()];
-    while (*p && p <= ep)
+    const char *p = s.data();
+    const char *ep = p + s.length();
+    while (p < ep && *p)
     {
         switch (*p)
         {
@@ -26,13 +29,17 @@ std::string urldecode(std::string s)
             break;
         }
         case '%': {
-            p++;
-            char hexv[3] = {0,};
-            hexv[0] = *p;
-            p++;
-            hexv[1] = *p;
+            // A % without two hex digits after it is kept as it is, rather
+            // than reading past the end of the string
+            if (ep - p < 3 || !isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2]))
+            {
+                rv.append({*p});
+                break;
+            }
+            char hexv[3] = { p[1], p[2], 0 };
             char c = std::strtol(hexv,nullptr,16) & 0xff;
             rv.append({c});
+            p += 2;
             break;
         }
         default:
@@ -21,7 +21,7 @@ static std::string _serverName;
 namespace FCGI
 {
 
-std::string serverName() { return _serverName; }
+const std::string &serverName() { return _serverName; }
 void setServerName(std::string s) { _serverName = s; }
 
 void SetThreadName(const char* threadName)